@@ -48,6 +48,12 @@ check_cxx_symbol_exists(MSG_NOSIGNAL "sys/types.h;sys/socket.h" HAVE_NOSIGNAL)
 check_cxx_symbol_exists(GetLogicalProcessorInformation "windows.h" HAVE_PROCESSORINFORMATION)
 check_cxx_symbol_exists(SCHED_IDLE "pthread.h" HAVE_SCHEDIDLE)
 check_cxx_symbol_exists(SHM_DEST "sys/types.h;sys/ipc.h;sys/shm.h" HAVE_SHMDEST)
+check_cxx_symbol_exists(eventfd "sys/eventfd.h" HAVE_EVENTFD)
+check_cxx_symbol_exists(sendfile "sys/sendfile.h" HAVE_SENDFILE)
+check_cxx_symbol_exists(recvmmsg "sys/socket.h" HAVE_RECVMMSG)
+check_cxx_symbol_exists(sendmmsg "sys/socket.h" HAVE_SENDMMSG)
+check_cxx_symbol_exists(accept4 "sys/socket.h" HAVE_ACCEPT4)
+check_cxx_symbol_exists(SO_EE_ORIGIN_ZEROCOPY "sys/socket.h;linux/errqueue.h" HAVE_ZEROCOPY)
 
 if (CYGWIN)
   message("-- Using win32 FileSystemWatcher")
@@ -130,24 +136,31 @@ list(APPEND RCT_INCLUDE_DIRS ${CMAKE_CURRENT_LIST_DIR} ${RCT_INCLUDE_DIR})
 set(RCT_SOURCES
   ${RCT_SOURCES}
   ${CMAKE_CURRENT_LIST_DIR}/rct/Buffer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ByteQueue.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Config.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Connection.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/ConnectionPool.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/CpuUsage.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Date.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/DnsResolver.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/EventLoop.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/FileSystemWatcher.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/LazyMessage.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Log.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MemoryMonitor.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Message.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/MessageQueue.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Path.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Plugin.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/RateLimiter.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Rct.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ReadWriteLock.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Semaphore.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemory.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SharedMemoryRing.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketClient.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/SocketServer.cpp
+  ${CMAKE_CURRENT_LIST_DIR}/rct/SocketStats.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/String.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/Thread.cpp
   ${CMAKE_CURRENT_LIST_DIR}/rct/ThreadPool.cpp
@@ -343,10 +356,14 @@ if (NOT RCT_NO_INSTALL)
     rct/AES256CBC.h
     rct/Apply.h
     rct/Buffer.h
+    rct/ByteQueue.h
     rct/Config.h
     rct/Connection.h
+    rct/ConnectionPool.h
+    rct/DnsResolver.h
     rct/EventLoop.h
     rct/FileSystemWatcher.h
+    rct/LazyMessage.h
     rct/List.h
     rct/Log.h
     rct/Map.h
@@ -357,6 +374,7 @@ if (NOT RCT_NO_INSTALL)
     rct/Plugin.h
     rct/Point.h
     rct/Process.h
+    rct/RateLimiter.h
     rct/Rct.h
     rct/ReadLocker.h
     rct/ReadWriteLock.h
@@ -367,11 +385,15 @@ if (NOT RCT_NO_INSTALL)
     rct/Serializer.h
     rct/Set.h
     rct/SharedMemory.h
+    rct/SharedMemoryMessage.h
+    rct/SharedMemoryRing.h
     rct/SignalSlot.h
     rct/Size.h
     rct/SocketClient.h
     rct/SocketServer.h
+    rct/SocketStats.h
     rct/StopWatch.h
+    rct/StreamMessage.h
     rct/String.h
     rct/StringTokenizer.h
     rct/Thread.h
@@ -380,6 +402,7 @@ if (NOT RCT_NO_INSTALL)
     rct/Timer.h
     rct/Value.h
     rct/WriteLocker.h
+    rct/ZeroCopyCompletions.h
     DESTINATION include/rct)
 
   install(EXPORT "rct" DESTINATION lib/cmake)
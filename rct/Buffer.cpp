@@ -2,8 +2,111 @@
 
 #include <stdio.h>
 
+#include <algorithm>
+#include <mutex>
+
+#include "rct/List.h"
 #include "rct/String.h"
 
+namespace {
+struct BufferPoolData
+{
+    BufferPoolData()
+        : limit(8 * 1024 * 1024), cached(0)
+    {}
+
+    std::mutex mutex;
+    size_t limit, cached;
+    // indexed by log2(size / MinBlockSize)
+    List<unsigned char *> blocks[7];
+};
+}
+
+static_assert(BufferPool::MaxBlockSize == BufferPool::MinBlockSize << 6, "BufferPoolData::blocks has the wrong size");
+
+static BufferPoolData &bufferPool()
+{
+    // never destroyed since buffers might be released during exit
+    static BufferPoolData *data = new BufferPoolData;
+    return *data;
+}
+
+static inline int blockIndex(size_t size)
+{
+    int idx = 0;
+    size_t blockSize = BufferPool::MinBlockSize;
+    while (blockSize < size) {
+        blockSize <<= 1;
+        ++idx;
+    }
+    return idx;
+}
+
+unsigned char *BufferPool::take(size_t size, size_t *capacity)
+{
+    unsigned char *ret = nullptr;
+    if (size <= MaxBlockSize) {
+        const int idx = blockIndex(size);
+        size = static_cast<size_t>(MinBlockSize) << idx;
+        BufferPoolData &pool = bufferPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (!pool.blocks[idx].isEmpty()) {
+            ret = pool.blocks[idx].takeLast();
+            pool.cached -= size;
+        }
+    }
+    if (!ret) {
+        ret = static_cast<unsigned char *>(malloc(size));
+        if (!ret)
+            abort();
+    }
+    *capacity = size;
+    return ret;
+}
+
+void BufferPool::release(unsigned char *data, size_t capacity)
+{
+    if (capacity >= MinBlockSize && capacity <= MaxBlockSize && !(capacity & (capacity - 1))) {
+        BufferPoolData &pool = bufferPool();
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        if (pool.cached + capacity <= pool.limit) {
+            pool.blocks[blockIndex(capacity)].append(data);
+            pool.cached += capacity;
+            return;
+        }
+    }
+    free(data);
+}
+
+void BufferPool::setLimit(size_t bytes)
+{
+    BufferPoolData &pool = bufferPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    pool.limit = bytes;
+    // drop the largest blocks first
+    for (int idx = 6; idx >= 0 && pool.cached > pool.limit; --idx) {
+        const size_t size = static_cast<size_t>(MinBlockSize) << idx;
+        while (pool.cached > pool.limit && !pool.blocks[idx].isEmpty()) {
+            free(pool.blocks[idx].takeLast());
+            pool.cached -= size;
+        }
+    }
+}
+
+size_t BufferPool::limit()
+{
+    BufferPoolData &pool = bufferPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return pool.limit;
+}
+
+size_t BufferPool::cachedBytes()
+{
+    BufferPoolData &pool = bufferPool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    return pool.cached;
+}
+
 bool Buffer::load(const String& filename)
 {
     clear();
@@ -33,3 +136,77 @@ bool Buffer::load(const String& filename)
     fclose(f);
     return true;
 }
+
+BufferRef::BufferRef(Buffer &&buffer)
+    : mData(nullptr), mSize(buffer.size())
+{
+    if (mSize) {
+        std::shared_ptr<Buffer> owner = std::make_shared<Buffer>(std::move(buffer));
+        mData = owner->data();
+        mOwner = std::move(owner);
+    }
+}
+
+BufferRef::BufferRef(String &&string)
+    : mData(nullptr), mSize(string.size())
+{
+    if (mSize) {
+        std::shared_ptr<String> owner = std::make_shared<String>(std::move(string));
+        mData = reinterpret_cast<const unsigned char *>(owner->constData());
+        mOwner = std::move(owner);
+    }
+}
+
+BufferRef::BufferRef(const std::shared_ptr<const String> &string)
+    : mOwner(string), mData(nullptr), mSize(string ? string->size() : 0)
+{
+    if (mSize)
+        mData = reinterpret_cast<const unsigned char *>(string->constData());
+}
+
+BufferRef BufferRef::copy(const void *data, size_t size)
+{
+    Buffer buffer;
+    if (size) {
+        buffer.reserve(size);
+        memcpy(buffer.data(), data, size);
+        buffer.resize(size);
+    }
+    return BufferRef(std::move(buffer));
+}
+
+BufferRef BufferRef::slice(size_t offset, size_t size) const
+{
+    BufferRef ret;
+    offset = std::min(offset, mSize);
+    size = std::min(size, mSize - offset);
+    if (size) {
+        ret.mOwner = mOwner;
+        ret.mData = mData + offset;
+        ret.mSize = size;
+    }
+    return ret;
+}
+
+BufferRef Buffers::take(size_t size)
+{
+    size = std::min(size, mSize);
+    if (!size)
+        return BufferRef();
+    const BufferRef &front = mBuffers.front();
+    if (front.size() - mBufferOffset >= size) {
+        BufferRef ret = front.slice(mBufferOffset, size);
+        mBufferOffset += size;
+        mSize -= size;
+        if (mBufferOffset == front.size()) {
+            mBufferOffset = 0;
+            mBuffers.pop_front();
+        }
+        return ret;
+    }
+    Buffer buffer;
+    buffer.reserve(size);
+    read(buffer.data(), size);
+    buffer.resize(size);
+    return BufferRef(std::move(buffer));
+}
@@ -5,9 +5,34 @@
 #include <assert.h>
 #include <rct/LinkedList.h>
 #include <rct/String.h>
+#include <stdint.h>
 #include <string.h>
+#include <memory>
 #include <utility>
 
+/**
+ * Keeps the memory of released buffers around for reuse so sockets don't
+ * go back to the allocator for every read. Blocks are powers of two from
+ * MinBlockSize to MaxBlockSize, larger ones aren't kept. Up to limit()
+ * bytes are cached, shared between all threads.
+ */
+class BufferPool
+{
+public:
+    enum { MinBlockSize = 4 * 1024, MaxBlockSize = 256 * 1024 };
+
+    /**
+     * Returns at least size bytes, *capacity is set to the actual size of
+     * the block.
+     */
+    static unsigned char *take(size_t size, size_t *capacity);
+    static void release(unsigned char *data, size_t capacity);
+
+    static void setLimit(size_t bytes);
+    static size_t limit();
+    static size_t cachedBytes();
+};
+
 class Buffer
 {
 public:
@@ -27,11 +52,13 @@ public:
     ~Buffer()
     {
         if (bufferData)
-            free(bufferData);
+            BufferPool::release(bufferData, bufferReserved);
     }
 
     Buffer& operator=(Buffer&& other)
     {
+        if (bufferData)
+            BufferPool::release(bufferData, bufferReserved);
         bufferData = other.bufferData;
         bufferSize = other.bufferSize;
         bufferReserved = other.bufferReserved;
@@ -48,17 +75,30 @@ public:
     {
         enum { ClearThreshold = 1024 * 512 };
         if (bufferSize >= ClearThreshold) {
-            free(bufferData);
+            reset();
+        } else {
+            bufferSize = 0;
+        }
+    }
+
+    // gives the memory back to BufferPool
+    void reset()
+    {
+        if (bufferData) {
+            BufferPool::release(bufferData, bufferReserved);
             bufferData = nullptr;
-            bufferReserved = 0;
         }
-        bufferSize = 0;
+        bufferSize = bufferReserved = 0;
     }
 
     void reserve(size_t sz)
     {
         if (sz <= bufferReserved)
             return;
+        if (!bufferData) {
+            bufferData = BufferPool::take(sz, &bufferReserved);
+            return;
+        }
         bufferData = static_cast<unsigned char*>(realloc(bufferData, sz));
         if (!bufferData)
             abort();
@@ -88,6 +128,19 @@ public:
     unsigned char* end() { return bufferData + bufferSize; }
     const unsigned char* data() const { return bufferData; }
 
+    /**
+     * Hands the memory over to the caller, who gives it back with
+     * BufferPool::release(), and leaves the buffer empty.
+     */
+    unsigned char *release(size_t *capacity)
+    {
+        unsigned char *ret = bufferData;
+        *capacity = bufferReserved;
+        bufferData = nullptr;
+        bufferSize = bufferReserved = 0;
+        return ret;
+    }
+
     bool load(const String& filename);
 
 private:
@@ -99,23 +152,70 @@ private:
     Buffer& operator=(const Buffer& other) = delete;
 };
 
+/**
+ * Immutable, reference counted view of bytes. Copies and slices share the
+ * memory, which goes away with the last of them, so parts of a received
+ * buffer can be handed to several consumers or outlive the rest of it
+ * without being copied. Buffers and Strings are taken over as they are.
+ */
+class BufferRef
+{
+public:
+    BufferRef()
+        : mData(nullptr), mSize(0)
+    {}
+    BufferRef(Buffer &&buffer);
+    BufferRef(String &&string);
+    // shares string, e.g. a frame kept by a LazyMessage
+    BufferRef(const std::shared_ptr<const String> &string);
+    static BufferRef copy(const void *data, size_t size);
+
+    const unsigned char *data() const { return mData; }
+    size_t size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+    bool empty() const { return !mSize; }
+
+    // shares the memory, offset and size are cut to what's there
+    BufferRef slice(size_t offset, size_t size = SIZE_MAX) const;
+    String toString() const { return String(reinterpret_cast<const char *>(mData), mSize); }
+    // how many BufferRefs share the memory
+    long useCount() const { return mOwner.use_count(); }
+
+private:
+    std::shared_ptr<const void> mOwner;
+    const unsigned char *mData;
+    size_t mSize;
+};
+
+/**
+ * Queue of buffers that are read from as one. ByteQueue is the better fit
+ * for lots of small pieces and can peek, Buffers can hand out what's
+ * queued without copying it.
+ */
 class Buffers
 {
 public:
     Buffers()
-        : mBufferOffset(0)
+        : mBufferOffset(0), mSize(0)
     {}
     void push(Buffer &&buf)
     {
-        mBuffers.append(std::forward<Buffer>(buf));
+        if (!buf.isEmpty())
+            push(BufferRef(std::move(buf)));
     }
-    size_t size() const
+    void push(const BufferRef &buf)
     {
-        size_t ret = 0;
-        for (const auto &buf : mBuffers)
-            ret += buf.size();
-        return ret - mBufferOffset;
+        if (buf.isEmpty())
+            return;
+        mSize += buf.size();
+        mBuffers.append(buf);
     }
+    size_t size() const { return mSize; }
+    /**
+     * Takes up to size bytes off the front. They're shared with what was
+     * pushed if they come from a single buffer, otherwise copied together.
+     */
+    BufferRef take(size_t size);
     size_t read(void *outPtr, size_t size)
     {
         if (!size)
@@ -136,10 +236,12 @@ public:
                     mBufferOffset = remaining + mBufferOffset;
                 }
                 read += remaining;
+                mSize -= remaining;
                 break;
             }
             memcpy(out + read, buf.data() + mBufferOffset, bufferSize);
             read += bufferSize;
+            mSize -= bufferSize;
             mBufferOffset = 0;
             remaining -= bufferSize;
             assert(!mBuffers.empty());
@@ -151,8 +253,8 @@ private:
     Buffers(const Buffers &) = delete;
     Buffers &operator=(const Buffers &) = delete;
 
-    LinkedList<Buffer> mBuffers;
-    size_t mBufferOffset;
+    LinkedList<BufferRef> mBuffers;
+    size_t mBufferOffset, mSize;
 };
 
 #endif
@@ -0,0 +1,167 @@
+#include "ByteQueue.h"
+
+#include <assert.h>
+#include <string.h>
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+#include <algorithm>
+
+ByteQueue::Chunk ByteQueue::allocate(size_t size)
+{
+    Chunk chunk;
+    chunk.data = BufferPool::take(std::max<size_t>(size, ChunkSize), &chunk.capacity);
+    chunk.begin = chunk.end = 0;
+    return chunk;
+}
+
+void ByteQueue::clear()
+{
+    for (const Chunk &chunk : mChunks)
+        BufferPool::release(chunk.data, chunk.capacity);
+    mChunks.clear();
+    mTail = mSize = 0;
+}
+
+void ByteQueue::append(const void *data, size_t size)
+{
+    const unsigned char *in = static_cast<const unsigned char *>(data);
+    while (size) {
+        if (mTail == mChunks.size())
+            mChunks.push_back(allocate(ChunkSize));
+        Chunk &chunk = mChunks[mTail];
+        const size_t count = std::min(size, chunk.capacity - chunk.end);
+        memcpy(chunk.data + chunk.end, in, count);
+        chunk.end += count;
+        in += count;
+        size -= count;
+        mSize += count;
+        if (chunk.end == chunk.capacity)
+            ++mTail;
+    }
+}
+
+void ByteQueue::append(Buffer &&buffer)
+{
+    const size_t size = buffer.size();
+    if (!size)
+        return;
+    const bool open = mTail < mChunks.size();
+    if (size < AdoptSize || (open && mChunks[mTail].capacity - mChunks[mTail].end >= size)) {
+        append(buffer.data(), size);
+        buffer.clear();
+        return;
+    }
+
+    Chunk chunk;
+    chunk.data = buffer.release(&chunk.capacity);
+    chunk.begin = 0;
+    chunk.end = size;
+    // goes after the tail, which is closed now, unless nothing has been
+    // appended to that yet
+    if (open && mChunks[mTail].end)
+        ++mTail;
+    mChunks.insert(mChunks.begin() + mTail, chunk);
+    mSize += size;
+    if (chunk.end == chunk.capacity)
+        ++mTail;
+}
+
+size_t ByteQueue::peek(void *outPtr, size_t size, size_t offset) const
+{
+    if (offset >= mSize)
+        return 0;
+    size = std::min(size, mSize - offset);
+    unsigned char *out = static_cast<unsigned char *>(outPtr);
+    size_t copied = 0;
+    for (const Chunk &chunk : mChunks) {
+        if (copied == size)
+            break;
+        size_t available = chunk.end - chunk.begin;
+        if (offset >= available) {
+            offset -= available;
+            continue;
+        }
+        available = std::min(available - offset, size - copied);
+        memcpy(out + copied, chunk.data + chunk.begin + offset, available);
+        copied += available;
+        offset = 0;
+    }
+    assert(copied == size);
+    return copied;
+}
+
+size_t ByteQueue::discard(size_t size)
+{
+    size = std::min(size, mSize);
+    mSize -= size;
+    if (!mSize) {
+        clear();
+        return size;
+    }
+    size_t remaining = size;
+    while (remaining) {
+        Chunk &chunk = mChunks.front();
+        const size_t count = std::min(remaining, chunk.end - chunk.begin);
+        chunk.begin += count;
+        remaining -= count;
+        if (chunk.begin == chunk.end) {
+            // there's more data, so this one can't be the tail
+            assert(mTail);
+            BufferPool::release(chunk.data, chunk.capacity);
+            mChunks.pop_front();
+            --mTail;
+        }
+    }
+    return size;
+}
+
+const unsigned char *ByteQueue::contiguousView(size_t size)
+{
+    assert(size <= mSize);
+    if (mChunks.empty())
+        return nullptr;
+    const Chunk &front = mChunks.front();
+    if (front.end - front.begin >= size)
+        return front.data + front.begin;
+
+    Chunk merged = allocate(size);
+    merged.end = peek(merged.data, size);
+    discard(size);
+    mChunks.push_front(merged);
+    // closed, or appends would go in front of what's queued after it
+    ++mTail;
+    mSize += size;
+    return merged.data;
+}
+
+#ifndef _WIN32
+int ByteQueue::reserve(iovec *vecs, int count, size_t size)
+{
+    int used = 0;
+    size_t room = 0;
+    for (size_t idx = mTail; used < count && (room < size || idx < mChunks.size()); ++idx) {
+        if (idx == mChunks.size())
+            mChunks.push_back(allocate(ChunkSize));
+        Chunk &chunk = mChunks[idx];
+        vecs[used].iov_base = chunk.data + chunk.end;
+        vecs[used].iov_len = chunk.capacity - chunk.end;
+        room += vecs[used++].iov_len;
+    }
+    return used;
+}
+
+void ByteQueue::commit(size_t size)
+{
+    mSize += size;
+    while (size) {
+        assert(mTail < mChunks.size());
+        Chunk &chunk = mChunks[mTail];
+        const size_t count = std::min(size, chunk.capacity - chunk.end);
+        chunk.end += count;
+        size -= count;
+        if (chunk.end == chunk.capacity)
+            ++mTail;
+    }
+}
+#endif
@@ -0,0 +1,92 @@
+#ifndef ByteQueue_h
+#define ByteQueue_h
+
+#include <stddef.h>
+#include <deque>
+
+#include <rct/Buffer.h>
+
+struct iovec;
+
+/**
+ * FIFO of bytes, e.g. what has been read from a socket but not parsed yet.
+ * The bytes are kept in fixed size chunks from BufferPool so appending
+ * never moves what's already queued and consuming gives chunks back as
+ * they empty. size() is kept up to date rather than counted. An empty
+ * queue doesn't hold on to any memory.
+ */
+class ByteQueue
+{
+public:
+    enum {
+        ChunkSize = 16 * 1024,
+        // buffers smaller than this are copied by append(Buffer &&)
+        AdoptSize = 2 * 1024
+    };
+
+    ByteQueue()
+        : mTail(0), mSize(0)
+    {}
+    ~ByteQueue() { clear(); }
+
+    size_t size() const { return mSize; }
+    bool isEmpty() const { return !mSize; }
+    void clear();
+
+    void append(const void *data, size_t size);
+    /**
+     * Takes over the memory of buffer as a chunk of its own rather than
+     * copying it, e.g. for what SocketClient has just read. Small buffers
+     * are still copied into the last chunk if there's room.
+     */
+    void append(Buffer &&buffer);
+
+    // copies up to size bytes, starting offset bytes in, without consuming them
+    size_t peek(void *out, size_t size, size_t offset = 0) const;
+    // drops up to size bytes from the front
+    size_t discard(size_t size);
+    size_t read(void *out, size_t size)
+    {
+        const size_t ret = peek(out, size);
+        discard(ret);
+        return ret;
+    }
+
+    /**
+     * The first size bytes in one piece, valid until the queue is changed.
+     * That's free when they're in the first chunk, otherwise they're copied
+     * together into a block of their own.
+     */
+    const unsigned char *contiguousView(size_t size);
+
+#ifndef _WIN32
+    /**
+     * For reading straight into the queue, e.g. with readv(2). Fills in up
+     * to count iovecs with free space at the end of the queue, adding
+     * chunks until there's room for at least size bytes if count allows,
+     * and returns how many were used. Follow up with commit() for what was
+     * actually read before doing anything else with the queue.
+     */
+    int reserve(iovec *vecs, int count, size_t size);
+    void commit(size_t size);
+#endif
+
+private:
+    ByteQueue(const ByteQueue &) = delete;
+    ByteQueue &operator=(const ByteQueue &) = delete;
+
+    struct Chunk
+    {
+        unsigned char *data;
+        size_t capacity, begin, end;
+    };
+    static Chunk allocate(size_t size);
+
+    // the chunks before mTail are closed, appends go into mTail and the
+    // ones after it are empty
+    std::deque<Chunk> mChunks;
+    size_t mTail;
+    size_t mSize;
+};
+
+#endif
@@ -1,21 +1,128 @@
 #include "Connection.h"
 
 #include <assert.h>
+#include <fcntl.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <utility>
+#ifdef HAVE_EVENTFD
+#  include <sys/eventfd.h>
+#endif
 
 #include "EventLoop.h"
+#include "LazyMessage.h"
 #include "Message.h"
 #include "Serializer.h"
-#include "StackBuffer.h"
+#include "MemoryMappedFile.h"
+#include "StreamMessage.h"
+#include "ThreadPool.h"
 #include "Timer.h"
 #include "rct/FinishMessage.h"
 #include "rct/SocketClient.h"
 #include "rct/String.h"
+#ifndef _WIN32
+#  include <sys/ipc.h>
+#  include "SharedMemory.h"
+#  include "SharedMemoryMessage.h"
+#  include "SharedMemoryRing.h"
+
+struct Connection::SharedMemoryState
+{
+    SharedMemoryState()
+        : doorbell(-1), doorbellWriter(-1), peerDoorbell(-1),
+          reading(false), writing(false), pendingOffset(0)
+    {}
+    ~SharedMemoryState()
+    {
+        if (doorbell != -1) {
+            if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+                loop->unregisterSocket(doorbell);
+            ::close(doorbell);
+        }
+        if (doorbellWriter != -1 && doorbellWriter != doorbell)
+            ::close(doorbellWriter);
+        if (peerDoorbell != -1)
+            ::close(peerDoorbell);
+    }
+
+    // eventfd where available, otherwise a pipe and doorbellWriter is the
+    // end that gets sent to the peer
+    bool createDoorbell()
+    {
+#ifdef HAVE_EVENTFD
+        doorbell = doorbellWriter = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        return doorbell != -1;
+#else
+        int fds[2];
+        if (::pipe(fds) == -1)
+            return false;
+        doorbell = fds[0];
+        doorbellWriter = fds[1];
+        for (int i = 0; i < 2; ++i) {
+            SocketClient::setFlags(fds[i], O_NONBLOCK, F_GETFL, F_SETFL);
+#ifdef HAVE_CLOEXEC
+            SocketClient::setFlags(fds[i], FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+        }
+        return true;
+#endif
+    }
+
+    void wakePeer()
+    {
+        int e;
+#ifdef HAVE_EVENTFD
+        const uint64_t one = 1;
+        eintrwrap(e, ::write(peerDoorbell, &one, sizeof(one)));
+#else
+        // a full pipe means there's a wakeup pending already
+        const char one = 1;
+        eintrwrap(e, ::write(peerDoorbell, &one, sizeof(one)));
+#endif
+        (void)e;
+    }
+
+    void drainDoorbell()
+    {
+        int e;
+#ifdef HAVE_EVENTFD
+        uint64_t count;
+        eintrwrap(e, ::read(doorbell, &count, sizeof(count)));
+#else
+        char buf[64];
+        do {
+            eintrwrap(e, ::read(doorbell, buf, sizeof(buf)));
+        } while (e > 0);
+#endif
+        (void)e;
+    }
+
+    std::unique_ptr<SharedMemory> segment;
+    SharedMemoryRing readRing, writeRing;
+    int doorbell, doorbellWriter, peerDoorbell;
+    // reading starts once we've seen the last message the peer sent over
+    // the socket, writing once the peer knows to read from the ring
+    bool reading, writing;
+    // bytes that didn't fit in the ring yet
+    String pending;
+    size_t pendingOffset;
+};
+#endif
 
 Connection::Connection(int version)
-    : mPendingRead(0), mPendingWrite(0), mTimeoutTimer(0), mCheckTimer(0), mFinishStatus(0),
-      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false)
+    :
+#ifndef _WIN32
+      mSharedMemoryAllowed(true),
+#endif
+      mRequestTimerDeadline(0), mRequestTimer(0), mNextCorrelationId(0),
+      mStreamWindow(1024 * 1024), mStreamChunkSize(64 * 1024), mNextStreamId(0), mPumpingStreams(false),
+      mPendingRead(0), mPendingWrite(0), mTimeoutTimer(0), mCheckTimer(0), mFinishStatus(0),
+      mVersion(version), mSilent(false), mIsConnected(false), mWarned(false),
+      mCorkThreshold(64 * 1024), mCorked(false), mFlushPending(false),
+      mHighWatermark(0), mLowWatermark(0), mWriteBlocked(false), mPauseReads(false), mWriteProgressPending(false),
+      mDecodePool(nullptr), mDecodeThreshold(64 * 1024), mLazyMessages(false)
 {
 }
 
@@ -26,6 +133,8 @@ Connection::~Connection()
             eventLoop->unregisterTimer(mTimeoutTimer);
         if (mCheckTimer)
             eventLoop->unregisterTimer(mCheckTimer);
+        if (mRequestTimer)
+            eventLoop->unregisterTimer(mRequestTimer);
     }
     disconnect();
 }
@@ -117,14 +226,13 @@ int Connection::pendingWrite() const
     return mPendingWrite;
 }
 
-void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &client, Buffer&& buf)
+void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &, Buffer&& buf)
 {
     auto that = shared_from_this();
+    // takes the socket's read buffer over rather than copying out of it
+    mReadQueue.append(std::move(buf));
     while (true) {
-        if (!buf.empty())
-            mBuffers.push(std::forward<Buffer>(buf));
-
-        unsigned int available = mBuffers.size();
+        unsigned int available = mReadQueue.size();
         if (!available)
             break;
         if (!mPendingRead) {
@@ -134,7 +242,7 @@ void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &client, Bu
                 unsigned char b[sizeof(uint32_t)];
                 int pending;
             };
-            const int read = mBuffers.read(b, 4);
+            const int read = mReadQueue.read(b, 4);
             assert(read == 4);
             mPendingRead = pending;
             assert(mPendingRead > 0);
@@ -144,29 +252,111 @@ void Connection::onDataAvailable(const std::shared_ptr<SocketClient> &client, Bu
         if (available < static_cast<unsigned int>(mPendingRead))
             break;
 
-        StackBuffer<1024 * 16> buffer(mPendingRead);
-        const int read = mBuffers.read(buffer.buffer(), mPendingRead);
-        assert(read == mPendingRead);
+        if (mDecodePool && !mLazyMessages && mPendingRead >= mDecodeThreshold) {
+            std::shared_ptr<PendingDecode> pending = std::make_shared<PendingDecode>();
+            pending->size = mPendingRead;
+            pending->data.resize(mPendingRead);
+            const int read = mReadQueue.read(pending->data.data(), mPendingRead);
+            assert(read == mPendingRead);
+            (void)read;
+            mPendingRead = 0;
+            mPendingDecodes.push_back(pending);
+
+            const int version = mVersion;
+            std::weak_ptr<Connection> weak = that;
+            std::weak_ptr<EventLoop> loop = EventLoop::eventLoop();
+            mDecodePool->start([pending, version, weak, loop]() {
+                    pending->message = Message::create(version, pending->data.constData(), pending->size, &pending->error);
+                    pending->data.clear();
+                    pending->done.store(true, std::memory_order_release);
+                    if (std::shared_ptr<EventLoop> eventLoop = loop.lock()) {
+                        eventLoop->callLater([weak]() {
+                                if (std::shared_ptr<Connection> conn = weak.lock())
+                                    conn->processDecoded();
+                            });
+                    }
+                });
+            continue;
+        }
+
+        const int read = mPendingRead;
         mPendingRead = 0;
         Message::MessageError error;
-        std::shared_ptr<Message> message = Message::create(mVersion, buffer, read, &error);
-        if (message) {
-            if (message->messageId() == FinishMessage::MessageId) {
-                mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
-                mFinished(that, mFinishStatus);
-            } else {
-                newMessage()(message, that);
-            }
-        } else if (mErrorHandler) {
-            mErrorHandler(client, std::move(error));
+        std::shared_ptr<Message> message;
+        if (mLazyMessages) {
+            // the message keeps the frame
+            Buffer frame;
+            frame.reserve(read);
+            const int r = mReadQueue.read(frame.data(), read);
+            assert(r == read);
+            (void)r;
+            frame.resize(read);
+            message = Message::createLazy(mVersion, BufferRef(std::move(frame)), &error);
         } else {
-            ::error() << "Unable to create message from data" << error.type << error.text << read;
+            // only copied if the frame spans chunks
+            const unsigned char *frame = mReadQueue.contiguousView(read);
+            message = Message::create(mVersion, reinterpret_cast<const char *>(frame), read, &error);
+            mReadQueue.discard(read);
+        }
+        if (!mPendingDecodes.empty()) {
+            // an earlier frame is still being decoded, queue behind it
+            std::shared_ptr<PendingDecode> pending = std::make_shared<PendingDecode>();
+            pending->size = read;
+            pending->message = std::move(message);
+            pending->error = std::move(error);
+            pending->done.store(true, std::memory_order_relaxed);
+            mPendingDecodes.push_back(pending);
+            continue;
         }
-        if (!message)
-            client->close();
+        processMessage(message, std::move(error), read);
     }
 }
 
+void Connection::processDecoded()
+{
+    auto that = shared_from_this();
+    while (!mPendingDecodes.empty() && mPendingDecodes.front()->done.load(std::memory_order_acquire)) {
+        std::shared_ptr<PendingDecode> pending = mPendingDecodes.front();
+        mPendingDecodes.pop_front();
+        processMessage(pending->message, std::move(pending->error), pending->size);
+    }
+}
+
+void Connection::processMessage(const std::shared_ptr<Message> &message, Message::MessageError &&error, int size)
+{
+    auto that = shared_from_this();
+    if (message) {
+        if (message->messageId() == StreamMessage::MessageId) {
+            onStreamMessage(message);
+            return;
+        }
+#ifndef _WIN32
+        if (message->messageId() == SharedMemoryMessage::MessageId) {
+            onSharedMemoryMessage(message);
+            return;
+        }
+#endif
+        if (message->isReply()) {
+            // unknown ids belong to requests that timed out or were cancelled
+            if (const RequestCallback callback = takeRequest(message->correlationId()))
+                callback(message, RequestSuccess);
+        } else if (message->messageId() == FinishMessage::MessageId) {
+            mFinishStatus = std::static_pointer_cast<FinishMessage>(message)->status();
+            mFinished(that, mFinishStatus);
+        } else {
+            newMessage()(message, that);
+        }
+        return;
+    }
+    if (mErrorHandler) {
+        mErrorHandler(mSocketClient, std::move(error));
+    } else {
+        ::error() << "Unable to create message from data" << error.type << error.text << size;
+    }
+    if (mSocketClient)
+        mSocketClient->close();
+}
+
 void Connection::onDataWritten(const std::shared_ptr<SocketClient>&, int bytes)
 {
     assert(mPendingWrite >= bytes);
@@ -175,34 +365,172 @@ void Connection::onDataWritten(const std::shared_ptr<SocketClient>&, int bytes)
     if (!mPendingWrite) {
         mSendFinished(shared_from_this());
     }
+    // this is called from inside SocketClient::write() so neither the
+    // writable callbacks nor the streams can send from here
+    if ((mWriteBlocked || !mOutgoingStreams.empty()) && !mWriteProgressPending) {
+        mWriteProgressPending = true;
+        std::weak_ptr<Connection> weak = shared_from_this();
+        EventLoop::eventLoop()->callLater([weak]() {
+                if (std::shared_ptr<Connection> conn = weak.lock())
+                    conn->onWriteProgress();
+            });
+    }
 }
 
-class SocketClientBuffer : public Serializer::Buffer
+void Connection::onWriteProgress()
 {
-public:
-    SocketClientBuffer(const std::shared_ptr<SocketClient> &client)
-        : mClient(client), mWritten(0)
-    {}
+    mWriteProgressPending = false;
+    checkWatermarks();
+    pumpStreams();
+}
 
-    virtual bool write(const void *data, int len) override
-    {
-        if (mClient->write(data, len)) {
-            mWritten += len;
-            return true;
+void Connection::setWriteWatermarks(int high, int low, bool pauseReads)
+{
+    assert(!high || low < high);
+    mHighWatermark = high;
+    mLowWatermark = low;
+    if (mPauseReads && !pauseReads && mSocketClient)
+        mSocketClient->setReadPaused(false);
+    mPauseReads = pauseReads;
+    if (mPauseReads && mWriteBlocked && mSocketClient)
+        mSocketClient->setReadPaused(true);
+    checkWatermarks();
+}
+
+void Connection::whenWritable(WritableCallback &&callback)
+{
+    if (!mWriteBlocked && mWritableCallbacks.empty()) {
+        callback(shared_from_this());
+    } else {
+        mWritableCallbacks.push_back(std::move(callback));
+    }
+}
+
+void Connection::checkWatermarks()
+{
+    if (!mWriteBlocked) {
+        if (mHighWatermark && mPendingWrite >= mHighWatermark) {
+            mWriteBlocked = true;
+            if (mPauseReads && mSocketClient)
+                mSocketClient->setReadPaused(true);
+            mWriteBlockedSignal(shared_from_this());
         }
-        return false;
+        return;
     }
+    if (mHighWatermark && mPendingWrite > mLowWatermark)
+        return;
 
-    virtual int pos() const override
-    {
-        return mWritten;
+    auto that = shared_from_this();
+    mWriteBlocked = false;
+    if (mPauseReads) {
+        if (mSocketClient)
+            mSocketClient->setReadPaused(false);
+#ifndef _WIN32
+        if (mSharedMemory && mSharedMemory->reading) {
+            std::weak_ptr<Connection> weak = that;
+            EventLoop::eventLoop()->callLater([weak]() {
+                    if (std::shared_ptr<Connection> conn = weak.lock()) {
+                        if (conn->mSharedMemory)
+                            conn->onSharedMemoryReadable();
+                    }
+                });
+        }
+#endif
     }
-private:
-    std::shared_ptr<SocketClient> mClient;
-    int mWritten;
-};
+    mWriteDrainedSignal(that);
+    while (!mWriteBlocked && !mWritableCallbacks.empty()) {
+        WritableCallback callback = std::move(mWritableCallbacks.front());
+        mWritableCallbacks.pop_front();
+        callback(that);
+    }
+}
+
+bool Connection::writeRaw(const void *data, int len)
+{
+#ifndef _WIN32
+    if (mSharedMemory && mSharedMemory->writing) {
+        // whatever was corked before we switched has to go first
+        if (!mCorkBuffer.empty())
+            flush();
+        return writeSharedMemory(static_cast<const char *>(data), len);
+    }
+#endif
+    if (mCorked) {
+        mCorkBuffer.append(static_cast<const char *>(data), len);
+        if (static_cast<int>(mCorkBuffer.size()) >= mCorkThreshold)
+            return flush();
+        if (!mFlushPending) {
+            mFlushPending = true;
+            std::weak_ptr<Connection> weak = shared_from_this();
+            EventLoop::eventLoop()->callLater([weak]() {
+                    if (std::shared_ptr<Connection> conn = weak.lock()) {
+                        conn->mFlushPending = false;
+                        conn->flush();
+                    }
+                });
+        }
+        return true;
+    }
+    return mSocketClient->write(data, len);
+}
+
+bool Connection::writeRaw(const BufferRef &data)
+{
+#ifndef _WIN32
+    if (mSharedMemory && mSharedMemory->writing)
+        return writeRaw(data.data(), data.size());
+#endif
+    if (mCorked)
+        return writeRaw(data.data(), data.size());
+    return mSocketClient->write(data);
+}
+
+bool Connection::writeRaw(String &&data)
+{
+#ifndef _WIN32
+    if (mSharedMemory && mSharedMemory->writing)
+        return writeRaw(data.constData(), data.size());
+#endif
+    if (mCorked)
+        return writeRaw(data.constData(), data.size());
+    return mSocketClient->write(std::move(data));
+}
+
+void Connection::setCorked(bool corked, int threshold)
+{
+    mCorked = corked;
+    mCorkThreshold = threshold;
+    if (!mCorked)
+        flush();
+}
+
+bool Connection::flush()
+{
+    if (mCorkBuffer.empty())
+        return true;
+    String data;
+    std::swap(data, mCorkBuffer);
+    return mSocketClient && mSocketClient->write(std::move(data));
+}
+
+void Connection::close()
+{
+    assert(mSocketClient);
+    flush();
+#ifndef _WIN32
+    // nothing more is read, the peer keeps what it hasn't read from our ring
+    mSharedMemory.reset();
+#endif
+    mSocketClient->close();
+}
 
 bool Connection::send(const Message &message)
+{
+    // whatever correlation id message was received with stays behind
+    return sendCorrelated(message, 0, 0);
+}
+
+bool Connection::sendCorrelated(const Message &message, uint8_t flags, uint32_t correlationId)
 {
     // ::error() << getpid() << "sending message" << static_cast<int>(message.messageId());
     if (!mSocketClient || !mSocketClient->isConnected()) {
@@ -215,23 +543,667 @@ bool Connection::send(const Message &message)
 
     mAboutToSend(shared_from_this(), &message);
 
+    auto that = shared_from_this();
+    bool ret;
+    if (message.mFlags & (Message::MessageCache|Message::Compressed) && !message.mLazy) {
+        String header, value;
+        message.prepare(mVersion, header, value, flags, correlationId);
+        mPendingWrite += header.size() + value.size();
+        ret = (writeRaw(header.constData(), header.size()) && (value.empty() || writeRaw(value.constData(), value.size())));
+    } else if (message.mLazy) {
+        // the payload goes out as it was received
+        const LazyMessage &lazy = static_cast<const LazyMessage &>(message);
+        String header;
+        {
+            Serializer serializer(header);
+            message.encodeHeader(serializer, lazy.payloadSize(), mVersion, flags, correlationId);
+        }
+        mPendingWrite += header.size() + lazy.payloadSize();
+        ret = (writeRaw(header.constData(), header.size())
+               && (!lazy.payloadSize() || writeRaw(lazy.payloadRef())));
+    } else {
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
-    const size_t size = String::npos;
+        const size_t size = message.countEncodedSize();
 #else
-    const size_t size = message.encodedSize();
+        // encodedSize() is the size with FixedEncoding
+        const size_t size = (message.mFlags & Message::Compact
+                             ? message.countEncodedSize(Serializer::CompactEncoding)
+                             : message.encodedSize());
+#endif
+        const size_t frameSize = sizeof(uint32_t) + Message::headerExtra(flags) + size;
+        auto encode = [&](Serializer &serializer) {
+            message.encodeHeader(serializer, size, mVersion, flags, correlationId);
+            if (message.mFlags & Message::Compact)
+                serializer.setEncoding(Serializer::CompactEncoding);
+            message.encode(serializer);
+        };
+#ifndef _WIN32
+        // with nothing queued ahead of it and room for all of it before the
+        // end of the ring the frame is serialized in place
+        char *ring = nullptr;
+        if (mSharedMemory && mSharedMemory->writing && mSharedMemory->pending.empty() && mCorkBuffer.empty())
+            ring = mSharedMemory->writeRing.reserve(frameSize);
+        if (ring) {
+            {
+                Serializer serializer(std::unique_ptr<Serializer::Buffer>(new Serializer::MemoryBuffer(ring, frameSize)));
+                encode(serializer);
+                assert(!serializer.hasError() && static_cast<size_t>(serializer.pos()) == frameSize);
+            }
+            mPendingWrite += frameSize;
+            bool wake;
+            mSharedMemory->writeRing.commit(frameSize, &wake);
+            if (wake)
+                mSharedMemory->wakePeer();
+            onDataWritten(mSocketClient, frameSize);
+            ret = true;
+        } else
 #endif
+        {
+            String frame;
+            frame.reserve(frameSize);
+            {
+                Serializer serializer(frame);
+                encode(serializer);
+            }
+            assert(frame.size() == frameSize);
+            mPendingWrite += frame.size();
+            ret = writeRaw(std::move(frame));
+        }
+    }
+    checkWatermarks();
+    return ret;
+}
 
-    if (size == String::npos || message.mFlags & Message::MessageCache) {
-        String header, value;
-        message.prepare(mVersion, header, value);
-        mPendingWrite += header.size() + value.size();
-        assert(size == String::npos || size == (header.size() + value.size() - 4));
-        return (mSocketClient->write(header) && (value.empty() || mSocketClient->write(value)));
-    } else {
-        mPendingWrite += (size + Message::HeaderExtra) + sizeof(int);
-        Serializer serializer(std::unique_ptr<SocketClientBuffer>(new SocketClientBuffer(mSocketClient)));
-        message.encodeHeader(serializer, size, mVersion);
-        message.encode(serializer);
-        return !serializer.hasError();
+uint32_t Connection::request(const Message &message, RequestCallback &&callback, int timeout)
+{
+    assert(callback);
+    do {
+        ++mNextCorrelationId;
+    } while (!mNextCorrelationId || mPendingRequests.contains(mNextCorrelationId));
+    const uint32_t id = mNextCorrelationId;
+    if (!sendCorrelated(message, Message::Request, id))
+        return 0;
+
+    PendingRequest &pending = mPendingRequests[id];
+    pending.callback = std::move(callback);
+    pending.deadline = 0;
+    if (timeout > 0) {
+        pending.deadline = Rct::monoMs() + timeout;
+        mRequestDeadlines.insert(std::make_pair(pending.deadline, id));
+        if (!mRequestTimer || pending.deadline < mRequestTimerDeadline)
+            startRequestTimer();
+    }
+    return id;
+}
+
+bool Connection::reply(uint32_t correlationId, const Message &response)
+{
+    assert(correlationId);
+    return sendCorrelated(response, Message::Reply, correlationId);
+}
+
+bool Connection::cancelRequest(uint32_t correlationId)
+{
+    const RequestCallback callback = takeRequest(correlationId);
+    if (!callback)
+        return false;
+    callback(std::shared_ptr<Message>(), RequestCancelled);
+    return true;
+}
+
+Connection::RequestCallback Connection::takeRequest(uint32_t correlationId)
+{
+    auto it = mPendingRequests.find(correlationId);
+    if (it == mPendingRequests.end())
+        return RequestCallback();
+    RequestCallback callback = std::move(it->second.callback);
+    if (it->second.deadline) {
+        auto range = mRequestDeadlines.equal_range(it->second.deadline);
+        while (range.first != range.second) {
+            if (range.first->second == correlationId) {
+                mRequestDeadlines.erase(range.first);
+                break;
+            }
+            ++range.first;
+        }
+    }
+    mPendingRequests.erase(it);
+    return callback;
+}
+
+void Connection::failRequests(RequestStatus status)
+{
+    if (mPendingRequests.empty())
+        return;
+    Hash<uint32_t, PendingRequest> requests;
+    std::swap(requests, mPendingRequests);
+    mRequestDeadlines.clear();
+    if (mRequestTimer) {
+        if (std::shared_ptr<EventLoop> eventLoop = EventLoop::eventLoop())
+            eventLoop->unregisterTimer(mRequestTimer);
+        mRequestTimer = 0;
+    }
+    for (const auto &request : requests)
+        request.second.callback(std::shared_ptr<Message>(), status);
+}
+
+void Connection::startRequestTimer()
+{
+    std::shared_ptr<EventLoop> eventLoop = EventLoop::eventLoop();
+    if (!eventLoop)
+        return;
+    if (mRequestTimer) {
+        eventLoop->unregisterTimer(mRequestTimer);
+        mRequestTimer = 0;
     }
+    if (mRequestDeadlines.empty())
+        return;
+    mRequestTimerDeadline = mRequestDeadlines.begin()->first;
+    const uint64_t now = Rct::monoMs();
+    const int timeout = mRequestTimerDeadline > now ? static_cast<int>(mRequestTimerDeadline - now) : 0;
+    std::weak_ptr<Connection> weak = shared_from_this();
+    mRequestTimer = eventLoop->registerTimer([weak](int) {
+            if (std::shared_ptr<Connection> conn = weak.lock()) {
+                conn->mRequestTimer = 0;
+                conn->onRequestTimeout();
+            }
+        }, timeout, Timer::SingleShot);
+}
+
+void Connection::onRequestTimeout()
+{
+    auto that = shared_from_this();
+    const uint64_t now = Rct::monoMs();
+    while (!mRequestDeadlines.empty() && mRequestDeadlines.begin()->first <= now) {
+        const RequestCallback callback = takeRequest(mRequestDeadlines.begin()->second);
+        assert(callback);
+        callback(std::shared_ptr<Message>(), RequestTimeout);
+    }
+    if (!mRequestTimer)
+        startRequestTimer();
+}
+
+uint32_t Connection::sendStream(StreamGenerator &&generator, int64_t size, const String &header, StreamCallback &&callback)
+{
+    return startStream({ 0, std::move(generator), size, 0, std::move(callback), std::shared_ptr<FILE>(), 0 }, header);
 }
+
+uint32_t Connection::sendFile(const Path &path, int64_t offset, int64_t length, const String &header, StreamCallback &&callback)
+{
+    FILE *f = fopen(path.constData(), "r");
+    if (!f)
+        return 0;
+    std::shared_ptr<FILE> file(f, fclose);
+    struct stat st;
+    if (fstat(fileno(f), &st) || offset < 0 || offset > st.st_size)
+        return 0;
+    if (length < 0 || length > st.st_size - offset)
+        length = st.st_size - offset;
+    return startStream({ 0, StreamGenerator(), length, 0, std::move(callback), file, offset }, header);
+}
+
+uint32_t Connection::startStream(OutgoingStream &&stream, const String &header)
+{
+    if (!isConnected())
+        return 0;
+    if (!++mNextStreamId)
+        ++mNextStreamId;
+    stream.id = mNextStreamId;
+    if (!send(StreamMessage(StreamMessage::Begin, stream.id, stream.size, String(header))))
+        return 0;
+    mOutgoingStreams.push_back(std::move(stream));
+    pumpStreams();
+    return mNextStreamId;
+}
+
+int Connection::writeFileChunk(OutgoingStream &stream, int size)
+{
+    const int fd = fileno(stream.file.get());
+    const StreamMessage message(StreamMessage::Data, stream.id);
+    // without data of its own the message's size is what
+    // encodeDataHeader() writes, counted like in send() with type bytes
+#ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+    const size_t dataHeaderSize = message.countEncodedSize();
+#else
+    const size_t dataHeaderSize = message.encodedSize();
+#endif
+    String header;
+    {
+        Serializer serializer(header);
+        message.encodeHeader(serializer, dataHeaderSize + size, mVersion);
+        message.encodeDataHeader(serializer, size);
+    }
+    assert(header.size() == sizeof(uint32_t) + Message::headerExtra() + dataHeaderSize);
+
+    int sent = 0;
+#if defined(HAVE_SENDFILE) && !defined(_WIN32)
+    if (!mSharedMemory || !mSharedMemory->writing) {
+        // the frame header has to go out first, wait until the socket has
+        // written everything it has buffered
+        if (!flush())
+            return -1;
+        if (mSocketClient->pendingWrite())
+            return 0;
+        mPendingWrite += header.size() + size;
+        if (!mSocketClient->write(header))
+            return -1;
+        // the socket takes care of the write limiter and its statistics,
+        // onDataWritten() is called through bytesWritten()
+        sent = mSocketClient->sendFile(fd, stream.offset, size);
+        if (sent == -1)
+            return -1;
+        if (sent == size) {
+            stream.offset += size;
+            return size;
+        }
+        // the socket is full or the write limiter ran out, the rest of the
+        // frame has to be buffered so nothing else gets written in the
+        // middle of it
+    } else
+#endif
+    {
+        mPendingWrite += header.size() + size;
+        if (!writeRaw(header.constData(), header.size()))
+            return -1;
+    }
+
+    String data(size - sent, '\0');
+    ssize_t e;
+    eintrwrap(e, ::pread(fd, data.data(), data.size(), stream.offset + sent));
+    if (e != static_cast<ssize_t>(data.size())) {
+        // the file shrunk, we've promised the peer more bytes than we have
+        // and there's no way to recover the framing
+        close();
+        return -1;
+    }
+    if (!writeRaw(data.constData(), data.size()))
+        return -1;
+    stream.offset += size;
+    return size;
+}
+
+uint32_t Connection::sendStream(const Path &path, const String &header, StreamCallback &&callback)
+{
+    FILE *f = fopen(path.constData(), "r");
+    if (!f)
+        return 0;
+    std::shared_ptr<FILE> file(f, fclose);
+    struct stat st;
+    if (fstat(fileno(f), &st))
+        return 0;
+    return sendStream([file](char *data, int max) -> int {
+            const size_t read = fread(data, 1, max, file.get());
+            if (!read && ferror(file.get()))
+                return -1;
+            return read;
+        }, st.st_size, header, std::move(callback));
+}
+
+uint32_t Connection::sendStream(const std::shared_ptr<MemoryMappedFile> &file, const String &header, StreamCallback &&callback)
+{
+    if (!file->isOpen())
+        return 0;
+    size_t offset = 0;
+    return sendStream([file, offset](char *data, int max) mutable -> int {
+            const size_t count = std::min<size_t>(max, file->size() - offset);
+            if (count) {
+                memcpy(data, file->filePtr<char>() + offset, count);
+                offset += count;
+            }
+            return count;
+        }, file->size(), header, std::move(callback));
+}
+
+bool Connection::cancelStream(uint32_t streamId)
+{
+    for (auto it = mOutgoingStreams.begin(); it != mOutgoingStreams.end(); ++it) {
+        if (it->id == streamId) {
+            StreamCallback callback = std::move(it->callback);
+            mOutgoingStreams.erase(it);
+            finishStream(streamId, false, std::move(callback));
+            return true;
+        }
+    }
+    return false;
+}
+
+void Connection::finishStream(uint32_t streamId, bool success, StreamCallback &&callback)
+{
+    send(StreamMessage(success ? StreamMessage::End : StreamMessage::Abort, streamId));
+    if (callback)
+        callback(shared_from_this(), streamId, success);
+}
+
+void Connection::pumpStreams()
+{
+    // sending can get us back here through the writable callbacks
+    if (mPumpingStreams)
+        return;
+    auto that = shared_from_this();
+    mPumpingStreams = true;
+    while (!mOutgoingStreams.empty() && isConnected() && !mWriteBlocked && mPendingWrite < mStreamWindow) {
+        OutgoingStream stream = std::move(mOutgoingStreams.front());
+        mOutgoingStreams.pop_front();
+        int max = mStreamChunkSize;
+        if (stream.size >= 0)
+            max = static_cast<int>(std::min<int64_t>(max, stream.size - stream.sent));
+        int read = 0;
+        if (stream.file) {
+            read = max > 0 ? writeFileChunk(stream, max) : 0;
+            if (!read && max > 0) {
+                // the socket is busy, try again once it has written
+                mOutgoingStreams.push_front(std::move(stream));
+                break;
+            }
+            if (read > 0)
+                stream.sent += read;
+        } else if (max > 0) {
+            String chunk(max, '\0');
+            read = stream.generator(chunk.data(), max);
+            if (read > 0) {
+                assert(read <= max);
+                chunk.resize(read);
+                stream.sent += read;
+                if (!send(StreamMessage(StreamMessage::Data, stream.id, -1, std::move(chunk))))
+                    read = -1;
+            }
+        }
+        if (read > 0) {
+            if (stream.size < 0 || stream.sent < stream.size) {
+                mOutgoingStreams.push_back(std::move(stream));
+                continue;
+            }
+        }
+        // a generator that ends early or fails aborts the stream
+        finishStream(stream.id, read >= 0 && (stream.size < 0 || stream.sent == stream.size), std::move(stream.callback));
+    }
+    mPumpingStreams = false;
+}
+
+void Connection::onStreamMessage(const std::shared_ptr<Message> &msg)
+{
+    const StreamMessage *message = static_cast<const StreamMessage *>(msg.get());
+    const uint32_t id = message->streamId();
+    auto that = shared_from_this();
+    if (message->type() == StreamMessage::Begin) {
+        mIncomingStreams[id] = { message->size(), 0 };
+        mStreamChunk(that, StreamChunk { id, StreamBegin, message->size(), 0, message->data() });
+        return;
+    }
+    auto it = mIncomingStreams.find(id);
+    if (it == mIncomingStreams.end())
+        return;
+    const IncomingStream stream = it->second;
+    switch (message->type()) {
+    case StreamMessage::Data:
+        it->second.offset += message->data().size();
+        mStreamChunk(that, StreamChunk { id, StreamData, stream.size, stream.offset, message->data() });
+        break;
+    case StreamMessage::End:
+    case StreamMessage::Abort:
+        mIncomingStreams.erase(it);
+        mStreamChunk(that, StreamChunk { id, message->type() == StreamMessage::End ? StreamEnd : StreamAborted,
+                             stream.size, stream.offset, message->data() });
+        break;
+    case StreamMessage::Begin:
+    case StreamMessage::Invalid:
+        break;
+    }
+}
+
+void Connection::abortStreams()
+{
+    auto that = shared_from_this();
+    std::deque<OutgoingStream> outgoing;
+    std::swap(outgoing, mOutgoingStreams);
+    for (auto &stream : outgoing) {
+        if (stream.callback)
+            stream.callback(that, stream.id, false);
+    }
+    Hash<uint32_t, IncomingStream> incoming;
+    std::swap(incoming, mIncomingStreams);
+    const String empty;
+    for (const auto &stream : incoming)
+        mStreamChunk(that, StreamChunk { stream.first, StreamAborted, stream.second.size, stream.second.offset, empty });
+}
+
+#ifndef _WIN32
+bool Connection::enableSharedMemory(int capacity)
+{
+    if (!mSocketClient || !mSocketClient->isConnected() || !(mSocketClient->mode() & SocketClient::Unix) || mSharedMemory)
+        return false;
+    std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+    if (!loop)
+        return false;
+
+    size_t size = 4096;
+    while (size < static_cast<size_t>(capacity))
+        size <<= 1;
+    const size_t segmentSize = SharedMemoryRing::segmentSize(size);
+
+    std::unique_ptr<SharedMemoryState> state(new SharedMemoryState);
+    // SharedMemory needs a key that the peer can look the segment up by
+    key_t key = static_cast<key_t>((getpid() << 12) ^ Rct::monoMs());
+    for (int i = 0; i < 16; ++i, ++key) {
+        if (key == -1 || key == IPC_PRIVATE)
+            continue;
+        state->segment.reset(new SharedMemory(key, segmentSize * 2, SharedMemory::Create));
+        if (state->segment->isValid())
+            break;
+    }
+    char *base = state->segment->isValid() ? static_cast<char *>(state->segment->attach(SharedMemory::ReadWrite)) : nullptr;
+    if (!base || !state->createDoorbell())
+        return false;
+
+    // the first ring carries data from the side that asked for shared memory
+    state->writeRing.attach(base, size, true);
+    state->readRing.attach(base + segmentSize, size, true);
+
+    std::weak_ptr<Connection> weak = shared_from_this();
+    loop->registerSocket(state->doorbell, EventLoop::SocketRead, [weak](int, unsigned int) {
+            if (std::shared_ptr<Connection> conn = weak.lock())
+                conn->onSharedMemoryReadable();
+        });
+    const int doorbell = state->doorbellWriter;
+    mSharedMemory = std::move(state);
+    if (!sendWithFileDescriptor(SharedMemoryMessage(SharedMemoryMessage::Setup, key, size), doorbell)) {
+        mSharedMemory.reset();
+        return false;
+    }
+    return true;
+}
+
+bool Connection::isUsingSharedMemory() const
+{
+    return mSharedMemory && mSharedMemory->reading && mSharedMemory->writing;
+}
+
+void Connection::closeSharedMemory()
+{
+    if (!mSharedMemory)
+        return;
+    // the peer may have written to the ring right before it went away
+    if (mSharedMemory->reading)
+        onSharedMemoryReadable();
+    mSharedMemory.reset();
+}
+
+bool Connection::sendWithFileDescriptor(const Message &message, int fd)
+{
+    String header, value;
+    message.prepare(mVersion, header, value);
+    header += value;
+    mPendingWrite += header.size();
+    flush();
+    const bool ret = mSocketClient->writeFileDescriptors(header.constData(), header.size(), &fd, 1);
+    if (!ret)
+        mPendingWrite -= header.size();
+    checkWatermarks();
+    return ret;
+}
+
+void Connection::onSharedMemoryMessage(const std::shared_ptr<Message> &msg)
+{
+    const SharedMemoryMessage *message = static_cast<const SharedMemoryMessage *>(msg.get());
+    List<int> fds = mSocketClient ? mSocketClient->takeFileDescriptors() : List<int>();
+    auto closeFds = [&fds]() {
+        for (int fd : fds)
+            ::close(fd);
+        fds.clear();
+    };
+    switch (message->type()) {
+    case SharedMemoryMessage::Setup: {
+        std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+        const size_t capacity = message->capacity();
+        if (!mSharedMemoryAllowed || mSharedMemory || fds.size() != 1 || !loop
+            || capacity < 4096 || (capacity & (capacity - 1))) {
+            closeFds();
+            send(SharedMemoryMessage(SharedMemoryMessage::Reject));
+            break;
+        }
+        const size_t segmentSize = SharedMemoryRing::segmentSize(capacity);
+        std::unique_ptr<SharedMemoryState> state(new SharedMemoryState);
+        state->peerDoorbell = fds.first();
+        fds.clear();
+        state->segment.reset(new SharedMemory(message->key(), segmentSize * 2));
+        char *base = state->segment->isValid() ? static_cast<char *>(state->segment->attach(SharedMemory::ReadWrite)) : nullptr;
+        if (!base || !state->createDoorbell()) {
+            send(SharedMemoryMessage(SharedMemoryMessage::Reject));
+            break;
+        }
+        state->readRing.attach(base, capacity, false);
+        state->writeRing.attach(base + segmentSize, capacity, false);
+        std::weak_ptr<Connection> weak = shared_from_this();
+        loop->registerSocket(state->doorbell, EventLoop::SocketRead, [weak](int, unsigned int) {
+                if (std::shared_ptr<Connection> conn = weak.lock())
+                    conn->onSharedMemoryReadable();
+            });
+        const int doorbell = state->doorbellWriter;
+        mSharedMemory = std::move(state);
+        if (!sendWithFileDescriptor(SharedMemoryMessage(SharedMemoryMessage::Accept), doorbell)) {
+            mSharedMemory.reset();
+            send(SharedMemoryMessage(SharedMemoryMessage::Reject));
+            break;
+        }
+        // Accept is the last thing we send over the socket
+        mSharedMemory->writing = true;
+        break; }
+    case SharedMemoryMessage::Accept:
+        if (!mSharedMemory || mSharedMemory->writing || fds.size() != 1) {
+            closeFds();
+            break;
+        }
+        mSharedMemory->peerDoorbell = fds.first();
+        fds.clear();
+        // the peer starts reading the ring once it has seen Switched and
+        // we've seen everything it sent over the socket
+        send(SharedMemoryMessage(SharedMemoryMessage::Switched));
+        mSharedMemory->writing = true;
+        mSharedMemory->reading = true;
+        onSharedMemoryReadable();
+        break;
+    case SharedMemoryMessage::Reject:
+        closeFds();
+        if (mSharedMemory && !mSharedMemory->writing)
+            mSharedMemory.reset();
+        break;
+    case SharedMemoryMessage::Switched:
+        closeFds();
+        if (mSharedMemory && mSharedMemory->writing && !mSharedMemory->reading) {
+            mSharedMemory->reading = true;
+            onSharedMemoryReadable();
+        }
+        break;
+    case SharedMemoryMessage::Invalid:
+        closeFds();
+        break;
+    }
+}
+
+bool Connection::writeSharedMemory(const char *data, int len)
+{
+    SharedMemoryState *state = mSharedMemory.get();
+    if (state->pending.empty()) {
+        bool wake;
+        const size_t written = state->writeRing.write(data, len, &wake);
+        if (wake)
+            state->wakePeer();
+        if (written)
+            onDataWritten(mSocketClient, written);
+        if (written == static_cast<size_t>(len))
+            return true;
+        data += written;
+        len -= written;
+        state->pending.append(data, len);
+        // the ring is full, the peer wakes us up when it has made room
+        if (state->writeRing.waitForSpace())
+            flushSharedMemory();
+        return true;
+    }
+    state->pending.append(data, len);
+    return true;
+}
+
+void Connection::flushSharedMemory()
+{
+    SharedMemoryState *state = mSharedMemory.get();
+    while (state->pendingOffset < state->pending.size()) {
+        bool wake;
+        const size_t written = state->writeRing.write(state->pending.constData() + state->pendingOffset,
+                                                      state->pending.size() - state->pendingOffset, &wake);
+        if (wake)
+            state->wakePeer();
+        if (!written) {
+            if (!state->writeRing.waitForSpace())
+                return;
+            continue;
+        }
+        state->pendingOffset += written;
+        onDataWritten(mSocketClient, written);
+    }
+    state->pending.clear();
+    state->pendingOffset = 0;
+}
+
+void Connection::onSharedMemoryReadable()
+{
+    auto that = shared_from_this();
+    mSharedMemory->drainDoorbell();
+    if (mSharedMemory->writing && !mSharedMemory->pending.empty())
+        flushSharedMemory();
+    while (mSharedMemory && mSharedMemory->reading && !(mPauseReads && mWriteBlocked)) {
+        SharedMemoryRing &ring = mSharedMemory->readRing;
+        const char *data;
+        const size_t available = ring.readable(&data);
+        if (!available)
+            break;
+        // decode straight out of the ring when a whole frame is contiguous
+        if (!mPendingRead && mPendingDecodes.empty() && mReadQueue.isEmpty() && available >= sizeof(uint32_t)) {
+            uint32_t frame;
+            memcpy(&frame, data, sizeof(frame));
+            if (available >= sizeof(frame) + frame && (!mDecodePool || frame < static_cast<uint32_t>(mDecodeThreshold))) {
+                Message::MessageError error;
+                std::shared_ptr<Message> message;
+                if (mLazyMessages) {
+                    // the ring gets reused, the message needs a copy of its frame
+                    message = Message::createLazy(mVersion, BufferRef::copy(data + sizeof(frame), frame), &error);
+                } else {
+                    message = Message::create(mVersion, data + sizeof(frame), frame, &error);
+                }
+                if (ring.consume(sizeof(frame) + frame))
+                    mSharedMemory->wakePeer();
+                processMessage(message, std::move(error), frame);
+                continue;
+            }
+        }
+        mReadQueue.append(data, available);
+        if (ring.consume(available))
+            mSharedMemory->wakePeer();
+        onDataAvailable(mSocketClient, Buffer());
+    }
+}
+#else
+void Connection::closeSharedMemory()
+{
+}
+#endif
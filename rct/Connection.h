@@ -2,6 +2,7 @@
 #define CONNECTION_H
 
 #include <rct/Buffer.h>
+#include <rct/ByteQueue.h>
 #include <rct/ResponseMessage.h>
 #include <rct/SignalSlot.h>
 #include <rct/SocketClient.h>
@@ -10,12 +11,15 @@
 #include <errno.h>
 #include <stdarg.h>
 #include <stdint.h>
+#include <atomic>
+#include <deque>
 #include <functional>
 #include <map>
 #include <memory>
 
 #include "FinishMessage.h"
 #include "rct/Buffer.h"
+#include "rct/Hash.h"
 #include "rct/Log.h"
 #include "rct/Message.h"
 #include "rct/Path.h"
@@ -23,8 +27,10 @@
 
 class ConnectionPrivate;
 class Event;
+class MemoryMappedFile;
 class Message;
 class SocketClient;
+class ThreadPool;
 
 class Connection : public std::enable_shared_from_this<Connection>
 {
@@ -50,6 +56,25 @@ public:
     void setSilent(bool on) { mSilent = on; }
     bool isSilent() const { return mSilent; }
 
+    /**
+     * Frames of at least threshold bytes are uncompressed and decoded on
+     * pool instead of on the event loop thread. Messages are still
+     * delivered on the event loop thread, in the order they were
+     * received. Pass nullptr to decode everything synchronously again.
+     */
+    void setDecodeThreadPool(ThreadPool *pool, int threshold = 64 * 1024) { mDecodePool = pool; mDecodeThreshold = threshold; }
+    ThreadPool *decodeThreadPool() const { return mDecodePool; }
+    int decodeThreshold() const { return mDecodeThreshold; }
+
+    /**
+     * Delivers received messages as LazyMessage, which decodes on first
+     * access and is sent on byte for byte, instead of decoding every
+     * frame up front. Useful for routers and proxies that only look at
+     * messageId(). Finish messages and replies are still decoded.
+     */
+    void setLazyMessages(bool lazy) { mLazyMessages = lazy; }
+    bool lazyMessages() const { return mLazyMessages; }
+
 #ifndef _WIN32
     bool connectUnix(const Path &socketFile, int timeout = 0);
 #endif
@@ -57,9 +82,148 @@ public:
 
     int pendingWrite() const;
 
+    /**
+     * While corked, messages are collected and written to the socket in one
+     * go once the event loop has processed everything that is pending or
+     * when more than threshold bytes have been collected, whichever comes
+     * first. flush() writes them out right away.
+     */
+    void setCorked(bool corked, int threshold = 64 * 1024);
+    bool isCorked() const { return mCorked; }
+    int corkThreshold() const { return mCorkThreshold; }
+    bool flush();
+
+    /**
+     * writeBlocked() is emitted when pendingWrite() reaches high and
+     * writeDrained() once it has gone back down to low. This covers data
+     * queued for the socket as well as for the shared memory ring. Pass 0
+     * for high to turn it off.
+     *
+     * With pauseReads set the connection stops reading from its peer while
+     * it is blocked.
+     */
+    void setWriteWatermarks(int high, int low, bool pauseReads = false);
+    int highWatermark() const { return mHighWatermark; }
+    int lowWatermark() const { return mLowWatermark; }
+    bool isWriteBlocked() const { return mWriteBlocked; }
+
+    typedef std::function<void(const std::shared_ptr<Connection> &)> WritableCallback;
+    /**
+     * Calls callback right away if the connection isn't blocked, otherwise
+     * once it has drained. Callbacks run in the order they were added and
+     * the ones that haven't run yet are dropped if the connection goes
+     * away.
+     */
+    void whenWritable(WritableCallback &&callback);
+
     bool send(const Message &message);
     bool send(Message &&message){ return send(message); }
 
+    enum RequestStatus {
+        RequestSuccess,
+        RequestTimeout,
+        RequestCancelled,
+        RequestDisconnected
+    };
+    typedef std::function<void(const std::shared_ptr<Message> &, RequestStatus)> RequestCallback;
+
+    /**
+     * Sends message tagged with a new correlation id. The peer sees it
+     * through newMessage() with Message::isRequest() set and answers with
+     * reply(). callback is called exactly once, either with the reply or
+     * with a null message if the request timed out, was cancelled or the
+     * connection went away. Any number of requests can be outstanding.
+     *
+     * @param timeout timeout in ms, 0 for no timeout
+     * @return the correlation id of the request or 0 if it couldn't be sent
+     */
+    uint32_t request(const Message &message, RequestCallback &&callback, int timeout = 0);
+    bool cancelRequest(uint32_t correlationId);
+    size_t pendingRequests() const { return mPendingRequests.size(); }
+
+    bool reply(const Message &request, const Message &response) { return reply(request.correlationId(), response); }
+    bool reply(uint32_t correlationId, const Message &response);
+
+    /**
+     * Fills data with up to max bytes of the stream and returns the number
+     * of bytes written, 0 at the end of the stream and -1 on error.
+     */
+    typedef std::function<int(char *data, int max)> StreamGenerator;
+    typedef std::function<void(const std::shared_ptr<Connection> &, uint32_t streamId, bool success)> StreamCallback;
+
+    /**
+     * Sends a stream of any size as a series of chunks. Chunks are only
+     * produced while pendingWrite() is below streamWindow() so only that
+     * much of the stream is held in memory at a time, the peer sees the
+     * chunks as they arrive through streamChunk(). Several streams can be in
+     * flight at once and regular messages can be sent in between.
+     *
+     * @param size total size of the stream or -1 if not known up front
+     * @param header passed on to the peer with the StreamBegin chunk
+     * @param callback called once the stream has been queued up completely
+     *                 or has failed
+     * @return the id of the stream or 0 if it couldn't be started
+     */
+    uint32_t sendStream(StreamGenerator &&generator, int64_t size = -1, const String &header = String(),
+                        StreamCallback &&callback = StreamCallback());
+    uint32_t sendStream(const Path &file, const String &header = String(), StreamCallback &&callback = StreamCallback());
+    uint32_t sendStream(const std::shared_ptr<MemoryMappedFile> &file, const String &header = String(),
+                        StreamCallback &&callback = StreamCallback());
+    /**
+     * Sends length bytes of path starting at offset as a stream, the whole
+     * rest of the file if length is -1. Where sendfile(2) is available the
+     * payload goes from the page cache to the socket without being copied
+     * through userspace, still within the socket's write limiter.
+     */
+    uint32_t sendFile(const Path &path, int64_t offset = 0, int64_t length = -1, const String &header = String(),
+                      StreamCallback &&callback = StreamCallback());
+    bool cancelStream(uint32_t streamId);
+    size_t pendingStreams() const { return mOutgoingStreams.size(); }
+
+    void setStreamWindow(int bytes) { mStreamWindow = bytes; }
+    int streamWindow() const { return mStreamWindow; }
+    void setStreamChunkSize(int bytes) { mStreamChunkSize = bytes; }
+    int streamChunkSize() const { return mStreamChunkSize; }
+
+    enum StreamEvent {
+        StreamBegin,
+        StreamData,
+        StreamEnd,
+        StreamAborted
+    };
+    struct StreamChunk
+    {
+        uint32_t streamId;
+        StreamEvent event;
+        // total size of the stream or -1 if the sender didn't know
+        int64_t size;
+        // offset of data in the stream
+        int64_t offset;
+        // the header for StreamBegin, the payload for StreamData
+        const String &data;
+    };
+
+#ifndef _WIN32
+    /**
+     * Asks the peer, which has to be a Connection on the same host connected
+     * through a Unix socket, to move the connection to a shared memory ring
+     * buffer per direction. Once both sides have switched messages go
+     * through the rings, the peer is woken up through an eventfd (a pipe
+     * where eventfd isn't available) registered with its EventLoop and the
+     * socket is only used for control. Frames that fit before the end of
+     * the ring while nothing else is queued are serialized straight into
+     * it, others are serialized first and copied in as there's room.
+     *
+     * Messages sent before and during the negotiation keep their order.
+     * @param capacity size in bytes of each ring, rounded up to a power of two
+     */
+    bool enableSharedMemory(int capacity = 4 * 1024 * 1024);
+    bool isUsingSharedMemory() const;
+    // whether requests from the peer to use shared memory are accepted
+    void setSharedMemoryAllowed(bool on) { mSharedMemoryAllowed = on; }
+    bool isSharedMemoryAllowed() const { return mSharedMemoryAllowed; }
+#endif
+
     template <int StaticBufSize>
     bool write(const char *format, ...) RCT_PRINTF_WARNING(2, 3);
     bool write(const String &out, ResponseMessage::Type type = ResponseMessage::Stdout)
@@ -81,17 +245,20 @@ public:
 
     int finishStatus() const { return mFinishStatus; }
 
-    void close() { assert(mSocketClient); mSocketClient->close(); }
+    void close();
 
     bool isConnected() const { return mSocketClient && mSocketClient->isConnected(); }
 
     Signal<std::function<void(std::shared_ptr<Connection>)>> &sendFinished() { return mSendFinished; }
+    Signal<std::function<void(std::shared_ptr<Connection>)>> &writeBlocked() { return mWriteBlockedSignal; }
+    Signal<std::function<void(std::shared_ptr<Connection>)>> &writeDrained() { return mWriteDrainedSignal; }
     Signal<std::function<void(std::shared_ptr<Connection>)>> &connected() { return mConnected; }
     Signal<std::function<void(std::shared_ptr<Connection>)>> &disconnected() { return mDisconnected; }
     Signal<std::function<void(std::shared_ptr<Connection>)>> &error() { return mError; }
     Signal<std::function<void(std::shared_ptr<Connection>, int)>> &finished() { return mFinished; }
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)>> &aboutToSend() { return mAboutToSend; }
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)>> &newMessage() { return mNewMessage; }
+    Signal<std::function<void(std::shared_ptr<Connection>, const StreamChunk &)>> &streamChunk() { return mStreamChunk; }
     std::shared_ptr<SocketClient> client() const { return mSocketClient; }
 
 private:
@@ -99,29 +266,134 @@ private:
     void disconnect();
     void connect(const std::shared_ptr<SocketClient> &client);
     void onClientConnected(const std::shared_ptr<SocketClient>&) { mIsConnected = true; mConnected(shared_from_this()); }
-    void onClientDisconnected(const std::shared_ptr<SocketClient>&) { mIsConnected = false; mDisconnected(shared_from_this()); }
+    void onClientDisconnected(const std::shared_ptr<SocketClient>&)
+    {
+        mIsConnected = false;
+        closeSharedMemory();
+        failRequests(RequestDisconnected);
+        mWritableCallbacks.clear();
+        abortStreams();
+        mDisconnected(shared_from_this());
+    }
     void onDataAvailable(const std::shared_ptr<SocketClient>&, Buffer&& buffer);
     void onDataWritten(const std::shared_ptr<SocketClient>&, int);
     void onSocketError(const std::shared_ptr<SocketClient>&, SocketClient::Error error)
     {
         ::warning() << "Socket error" << error << errno << Rct::strerror();
         mError(shared_from_this());
+        closeSharedMemory();
+        failRequests(RequestDisconnected);
+        mWritableCallbacks.clear();
+        abortStreams();
         mDisconnected(shared_from_this());
     }
     void checkData();
+    void processMessage(const std::shared_ptr<Message> &message, Message::MessageError &&error, int size);
+    void processDecoded();
+    bool writeRaw(const void *data, int len);
+    // lets the socket send large frames zero-copy
+    bool writeRaw(String &&data);
+    // shared with whatever else sends it
+    bool writeRaw(const BufferRef &data);
+    void checkWatermarks();
+    void onWriteProgress();
+    void pumpStreams();
+    void finishStream(uint32_t streamId, bool success, StreamCallback &&callback);
+    void onStreamMessage(const std::shared_ptr<Message> &message);
+    void abortStreams();
+    bool sendCorrelated(const Message &message, uint8_t flags, uint32_t correlationId);
+    RequestCallback takeRequest(uint32_t correlationId);
+    void failRequests(RequestStatus status);
+    void onRequestTimeout();
+    void startRequestTimer();
+    // delivers what's left in the ring and releases the segment and doorbells
+    void closeSharedMemory();
+#ifndef _WIN32
+    void onSharedMemoryMessage(const std::shared_ptr<Message> &message);
+    bool sendWithFileDescriptor(const Message &message, int fd);
+    bool writeSharedMemory(const char *data, int len);
+    void flushSharedMemory();
+    void onSharedMemoryReadable();
+
+    struct SharedMemoryState;
+    std::unique_ptr<SharedMemoryState> mSharedMemory;
+    bool mSharedMemoryAllowed;
+#endif
+
+    struct PendingRequest
+    {
+        RequestCallback callback;
+        uint64_t deadline;
+    };
+    Hash<uint32_t, PendingRequest> mPendingRequests;
+    // all requests with a timeout share one event loop timer which is
+    // always armed for the earliest deadline
+    std::multimap<uint64_t, uint32_t> mRequestDeadlines;
+    uint64_t mRequestTimerDeadline;
+    int mRequestTimer;
+    uint32_t mNextCorrelationId;
+
+    struct OutgoingStream
+    {
+        uint32_t id;
+        StreamGenerator generator;
+        int64_t size, sent;
+        StreamCallback callback;
+        // for sendFile(), instead of generator
+        std::shared_ptr<FILE> file;
+        int64_t offset;
+    };
+    uint32_t startStream(OutgoingStream &&stream, const String &header);
+    int writeFileChunk(OutgoingStream &stream, int size);
+    // round robin, one chunk each
+    std::deque<OutgoingStream> mOutgoingStreams;
+    struct IncomingStream
+    {
+        int64_t size, offset;
+    };
+    Hash<uint32_t, IncomingStream> mIncomingStreams;
+    int mStreamWindow, mStreamChunkSize;
+    uint32_t mNextStreamId;
+    bool mPumpingStreams;
+
+    struct PendingDecode
+    {
+        PendingDecode() : size(0), done(false) {}
+
+        String data;
+        int size;
+        std::shared_ptr<Message> message;
+        Message::MessageError error;
+        std::atomic<bool> done;
+    };
 
     std::shared_ptr<SocketClient> mSocketClient;
-    Buffers mBuffers;
+    ByteQueue mReadQueue;
     int mPendingRead, mPendingWrite, mTimeoutTimer, mCheckTimer, mFinishStatus, mVersion;
 
     bool mSilent, mIsConnected, mWarned;
 
+    String mCorkBuffer;
+    int mCorkThreshold;
+    bool mCorked, mFlushPending;
+
+    int mHighWatermark, mLowWatermark;
+    bool mWriteBlocked, mPauseReads, mWriteProgressPending;
+    std::deque<WritableCallback> mWritableCallbacks;
+
+    ThreadPool *mDecodePool;
+    int mDecodeThreshold;
+    std::deque<std::shared_ptr<PendingDecode>> mPendingDecodes;
+    bool mLazyMessages;
+
     std::function<void(const std::shared_ptr<SocketClient> &, Message::MessageError &&)> mErrorHandler;
 
     Signal<std::function<void(std::shared_ptr<Message>, std::shared_ptr<Connection>)>> mNewMessage;
     Signal<std::function<void(std::shared_ptr<Connection>)>> mConnected, mDisconnected, mError, mSendFinished;
+    Signal<std::function<void(std::shared_ptr<Connection>)>> mWriteBlockedSignal, mWriteDrainedSignal;
     Signal<std::function<void(std::shared_ptr<Connection>, int)>> mFinished;
     Signal<std::function<void(std::shared_ptr<Connection>, const Message *)>> mAboutToSend;
+    Signal<std::function<void(std::shared_ptr<Connection>, const StreamChunk &)>> mStreamChunk;
 };
 
 template <int StaticBufSize>
@@ -0,0 +1,444 @@
+#include "ConnectionPool.h"
+
+#include <assert.h>
+#include <algorithm>
+
+#include "Connection.h"
+#include "EventLoop.h"
+#include "Rct.h"
+#include "SocketClient.h"
+#include "Timer.h"
+
+struct ConnectionPool::Endpoint
+{
+    String key, host;
+    uint16_t port { 0 };
+    Path path;
+
+    struct Idle
+    {
+        std::shared_ptr<Connection> connection;
+        uint64_t since, checked;
+    };
+    // most recently released last, that's the one handed out next so that
+    // the others can time out when there's less traffic
+    List<Idle> idle;
+
+    struct Waiter
+    {
+        Callback callback;
+        uint64_t deadline;
+    };
+    std::deque<Waiter> waiters;
+
+    // all connections, whatever their state
+    int open { 0 };
+    int connecting { 0 };
+    bool dispatching { false }, again { false };
+};
+
+static inline bool isUsable(const std::shared_ptr<Connection> &connection)
+{
+    const std::shared_ptr<SocketClient> client = connection->client();
+    return client && client->state() == SocketClient::Connected;
+}
+
+ConnectionPool::ConnectionPool()
+    : mMaxConnections(8), mMaxIdle(8), mIdleTimeout(60000), mConnectTimeout(10000),
+      mAcquireTimeout(0), mHealthCheckInterval(0), mTimer(-1), mTimerDeadline(0)
+{
+}
+
+ConnectionPool::~ConnectionPool()
+{
+    clear();
+    for (const auto &member : mMembers) {
+        if (std::shared_ptr<Connection> connection = member.second.connection.lock()) {
+            connection->connected().disconnect(member.second.connectedKey);
+            connection->disconnected().disconnect(member.second.disconnectedKey);
+            connection->error().disconnect(member.second.errorKey);
+            if (member.second.state == Connecting && connection->client())
+                connection->close();
+        }
+    }
+    if (mTimer != -1) {
+        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+            loop->unregisterTimer(mTimer);
+    }
+}
+
+void ConnectionPool::acquire(const String &host, uint16_t port, Callback &&callback)
+{
+    acquire(String::format<128>("%s:%u", host.constData(), port), host, port, Path(), std::move(callback));
+}
+
+#ifndef _WIN32
+void ConnectionPool::acquire(const Path &socketFile, Callback &&callback)
+{
+    acquire("unix:" + socketFile, String(), 0, socketFile, std::move(callback));
+}
+#endif
+
+void ConnectionPool::acquire(const String &key, const String &host, uint16_t port, const Path &path, Callback &&callback)
+{
+    std::shared_ptr<Endpoint> &slot = mEndpoints[key];
+    if (!slot) {
+        slot.reset(new Endpoint);
+        slot->key = key;
+        slot->host = host;
+        slot->port = port;
+        slot->path = path;
+    }
+    const std::shared_ptr<Endpoint> endpoint = slot;
+
+    Endpoint::Waiter waiter;
+    waiter.callback = std::move(callback);
+    waiter.deadline = mAcquireTimeout > 0 ? Rct::monoMs() + mAcquireTimeout : 0;
+    endpoint->waiters.push_back(std::move(waiter));
+    if (mAcquireTimeout > 0)
+        schedule(endpoint->waiters.back().deadline);
+    dispatch(endpoint);
+}
+
+void ConnectionPool::release(const std::shared_ptr<Connection> &connection, bool reuse)
+{
+    auto it = mMembers.find(connection.get());
+    if (it == mMembers.end()) {
+        // dropped while it was out
+        return;
+    }
+    const std::shared_ptr<Endpoint> endpoint = it->second.endpoint.lock();
+    assert(it->second.state == Acquired);
+    if (!reuse || !endpoint || !isUsable(connection)
+        || (endpoint->waiters.empty() && endpoint->idle.size() >= static_cast<size_t>(mMaxIdle))) {
+        remove(connection, true);
+    } else {
+        it->second.state = Idle;
+        const uint64_t now = Rct::monoMs();
+        endpoint->idle.append(Endpoint::Idle { connection, now, now });
+        scheduleIdle(now, now);
+    }
+    if (endpoint)
+        dispatch(endpoint);
+}
+
+void ConnectionPool::setMaxConnections(int max)
+{
+    assert(max > 0);
+    if (mMaxIdle == mMaxConnections)
+        mMaxIdle = max;
+    mMaxConnections = max;
+}
+
+void ConnectionPool::setMaxIdle(int max)
+{
+    assert(max >= 0);
+    mMaxIdle = max;
+}
+
+void ConnectionPool::setIdleTimeout(int ms)
+{
+    mIdleTimeout = ms;
+    schedule(Rct::monoMs() + ms);
+}
+
+void ConnectionPool::setAcquireTimeout(int ms)
+{
+    mAcquireTimeout = ms;
+}
+
+void ConnectionPool::setHealthCheck(HealthCheck &&check, int interval)
+{
+    mHealthCheck = std::move(check);
+    mHealthCheckInterval = interval;
+    if (mHealthCheck)
+        schedule(Rct::monoMs() + interval);
+}
+
+size_t ConnectionPool::connectionCount() const
+{
+    return mMembers.size();
+}
+
+size_t ConnectionPool::idleCount() const
+{
+    size_t ret = 0;
+    for (const auto &endpoint : mEndpoints)
+        ret += endpoint.second->idle.size();
+    return ret;
+}
+
+size_t ConnectionPool::pendingCount() const
+{
+    size_t ret = 0;
+    for (const auto &endpoint : mEndpoints)
+        ret += endpoint.second->waiters.size();
+    return ret;
+}
+
+void ConnectionPool::clear()
+{
+    List<Callback> failed;
+    List<std::shared_ptr<Endpoint> > endpoints;
+    for (const auto &endpoint : mEndpoints)
+        endpoints.append(endpoint.second);
+    for (const std::shared_ptr<Endpoint> &endpoint : endpoints) {
+        for (Endpoint::Waiter &waiter : endpoint->waiters)
+            failed.append(std::move(waiter.callback));
+        endpoint->waiters.clear();
+        while (!endpoint->idle.isEmpty()) {
+            const std::shared_ptr<Connection> connection = endpoint->idle.back().connection;
+            remove(connection, true);
+        }
+        if (!endpoint->open)
+            mEndpoints.remove(endpoint->key);
+    }
+    for (const Callback &callback : failed)
+        callback(std::shared_ptr<Connection>());
+}
+
+void ConnectionPool::dispatch(const std::shared_ptr<Endpoint> &endpoint)
+{
+    // connects and callbacks can call back into the pool
+    if (endpoint->dispatching) {
+        endpoint->again = true;
+        return;
+    }
+    endpoint->dispatching = true;
+    do {
+        endpoint->again = false;
+        while (!endpoint->waiters.empty() && !endpoint->idle.isEmpty()) {
+            const std::shared_ptr<Connection> connection = endpoint->idle.back().connection;
+            endpoint->idle.removeLast();
+            auto it = mMembers.find(connection.get());
+            assert(it != mMembers.end());
+            if (!isUsable(connection)) {
+                // it's off the idle list already
+                it->second.state = Acquired;
+                remove(connection, true);
+                continue;
+            }
+            it->second.state = Acquired;
+            const Callback callback = std::move(endpoint->waiters.front().callback);
+            endpoint->waiters.pop_front();
+            callback(connection);
+        }
+        // Unix sockets can connect right away, hand those out first
+        while (!endpoint->again && endpoint->waiters.size() > static_cast<size_t>(endpoint->connecting)
+               && endpoint->open < mMaxConnections) {
+            open(endpoint);
+        }
+    } while (endpoint->again);
+    endpoint->dispatching = false;
+
+    if (!endpoint->open && endpoint->waiters.empty())
+        mEndpoints.remove(endpoint->key);
+}
+
+void ConnectionPool::open(const std::shared_ptr<Endpoint> &endpoint)
+{
+    const std::shared_ptr<Connection> connection = Connection::create();
+    Member &member = mMembers[connection.get()];
+    member.endpoint = endpoint;
+    member.connection = connection;
+    member.owned = connection;
+    member.state = Connecting;
+    member.connectedKey = connection->connected().connect([this](std::shared_ptr<Connection> conn) { onConnected(conn); });
+    member.disconnectedKey = connection->disconnected().connect([this](std::shared_ptr<Connection> conn) { onGone(conn); });
+    member.errorKey = connection->error().connect([this](std::shared_ptr<Connection> conn) { onGone(conn); });
+    ++endpoint->open;
+    ++endpoint->connecting;
+
+    bool ok;
+#ifndef _WIN32
+    if (!endpoint->path.empty()) {
+        ok = connection->connectUnix(endpoint->path, mConnectTimeout);
+    } else
+#endif
+    {
+        ok = connection->connectTcp(endpoint->host, endpoint->port, mConnectTimeout);
+    }
+    if (!ok)
+        onGone(connection);
+}
+
+void ConnectionPool::onConnected(const std::shared_ptr<Connection> &connection)
+{
+    auto it = mMembers.find(connection.get());
+    if (it == mMembers.end() || it->second.state != Connecting)
+        return;
+    const std::shared_ptr<Endpoint> endpoint = it->second.endpoint.lock();
+    it->second.owned.reset();
+    it->second.state = Idle;
+    --endpoint->connecting;
+    const uint64_t now = Rct::monoMs();
+    endpoint->idle.append(Endpoint::Idle { connection, now, now });
+    scheduleIdle(now, now);
+    dispatch(endpoint);
+}
+
+void ConnectionPool::onGone(const std::shared_ptr<Connection> &connection)
+{
+    auto it = mMembers.find(connection.get());
+    if (it == mMembers.end())
+        return;
+    const std::shared_ptr<Endpoint> endpoint = it->second.endpoint.lock();
+    const State state = it->second.state;
+    if (it->second.owned) {
+        // we're in one of its signals, it can't go away just yet
+        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+            loop->callLater([connection]() {});
+    }
+    remove(connection, false);
+    if (!endpoint)
+        return;
+    if (state == Connecting && !endpoint->waiters.empty()) {
+        // one failed connect fails one acquire, the others get their own
+        // attempt
+        const Callback callback = std::move(endpoint->waiters.front().callback);
+        endpoint->waiters.pop_front();
+        callback(std::shared_ptr<Connection>());
+    }
+    dispatch(endpoint);
+}
+
+void ConnectionPool::remove(const std::shared_ptr<Connection> &connection, bool close)
+{
+    auto it = mMembers.find(connection.get());
+    if (it == mMembers.end())
+        return;
+    const Member member = it->second;
+    mMembers.erase(it);
+    connection->connected().disconnect(member.connectedKey);
+    connection->disconnected().disconnect(member.disconnectedKey);
+    connection->error().disconnect(member.errorKey);
+    if (std::shared_ptr<Endpoint> endpoint = member.endpoint.lock()) {
+        --endpoint->open;
+        if (member.state == Connecting) {
+            --endpoint->connecting;
+        } else if (member.state == Idle) {
+            takeIdle(endpoint.get(), connection.get());
+        }
+    }
+    if (close && connection->client())
+        connection->close();
+}
+
+void ConnectionPool::takeIdle(Endpoint *endpoint, const Connection *connection)
+{
+    for (size_t i = 0; i < endpoint->idle.size(); ++i) {
+        if (endpoint->idle[i].connection.get() == connection) {
+            endpoint->idle.removeAt(i);
+            break;
+        }
+    }
+}
+
+void ConnectionPool::check(const std::shared_ptr<Endpoint> &endpoint, const std::shared_ptr<Connection> &connection)
+{
+    uint64_t since = 0;
+    for (const Endpoint::Idle &idle : endpoint->idle) {
+        if (idle.connection == connection) {
+            since = idle.since;
+            break;
+        }
+    }
+    takeIdle(endpoint.get(), connection.get());
+    mMembers[connection.get()].state = Checking;
+
+    std::weak_ptr<Endpoint> weak = endpoint;
+    mHealthCheck(connection, [this, weak, connection, since](bool healthy) {
+            // the endpoint goes away with the pool
+            const std::shared_ptr<Endpoint> owner = weak.lock();
+            if (!owner)
+                return;
+            auto it = mMembers.find(connection.get());
+            if (it == mMembers.end() || it->second.state != Checking)
+                return;
+            if (!healthy || !isUsable(connection)) {
+                remove(connection, true);
+            } else {
+                it->second.state = Idle;
+                const uint64_t now = Rct::monoMs();
+                owner->idle.insert(owner->idle.begin(), Endpoint::Idle { connection, since, now });
+                scheduleIdle(since, now);
+            }
+            dispatch(owner);
+        });
+}
+
+void ConnectionPool::schedule(uint64_t deadline)
+{
+    if (mTimer != -1 && mTimerDeadline <= deadline)
+        return;
+    std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    if (mTimer != -1)
+        loop->unregisterTimer(mTimer);
+    const uint64_t now = Rct::monoMs();
+    mTimerDeadline = deadline;
+    mTimer = loop->registerTimer([this](int) {
+            mTimer = -1;
+            sweep();
+        }, deadline > now ? static_cast<int>(deadline - now) : 1, Timer::SingleShot);
+}
+
+void ConnectionPool::scheduleIdle(uint64_t since, uint64_t checked)
+{
+    uint64_t deadline = since + mIdleTimeout;
+    if (mHealthCheck)
+        deadline = std::min(deadline, checked + mHealthCheckInterval);
+    schedule(deadline);
+}
+
+void ConnectionPool::sweep()
+{
+    const uint64_t now = Rct::monoMs();
+    uint64_t next = 0;
+    auto earlier = [&next](uint64_t deadline) {
+        if (!next || deadline < next)
+            next = deadline;
+    };
+
+    List<std::shared_ptr<Endpoint> > endpoints;
+    for (const auto &endpoint : mEndpoints)
+        endpoints.append(endpoint.second);
+    for (const std::shared_ptr<Endpoint> &endpoint : endpoints) {
+        List<Callback> expired;
+        for (auto it = endpoint->waiters.begin(); it != endpoint->waiters.end(); ) {
+            if (it->deadline && it->deadline <= now) {
+                expired.append(std::move(it->callback));
+                it = endpoint->waiters.erase(it);
+            } else {
+                if (it->deadline)
+                    earlier(it->deadline);
+                ++it;
+            }
+        }
+
+        // a check that finishes right away puts the connection back at the
+        // front, looking at an entry twice does no harm
+        for (size_t i = 0; i < endpoint->idle.size(); ) {
+            const Endpoint::Idle &idle = endpoint->idle[i];
+            if (idle.since + mIdleTimeout <= now) {
+                const std::shared_ptr<Connection> connection = idle.connection;
+                remove(connection, true);
+            } else if (mHealthCheck && idle.checked + mHealthCheckInterval <= now) {
+                const std::shared_ptr<Connection> connection = idle.connection;
+                check(endpoint, connection);
+            } else {
+                earlier(idle.since + mIdleTimeout);
+                if (mHealthCheck)
+                    earlier(idle.checked + mHealthCheckInterval);
+                ++i;
+            }
+        }
+
+        for (const Callback &callback : expired)
+            callback(std::shared_ptr<Connection>());
+        dispatch(endpoint);
+    }
+    if (next)
+        schedule(next);
+}
@@ -0,0 +1,127 @@
+#ifndef ConnectionPool_h
+#define ConnectionPool_h
+
+#include <stdint.h>
+#include <deque>
+#include <functional>
+#include <memory>
+
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/SignalSlot.h>
+#include <rct/String.h>
+
+class Connection;
+
+/**
+ * Keeps client connections open between uses, per endpoint (host:port or
+ * Unix socket path), so that call sites don't pay for a connect each time.
+ *
+ * acquire() hands out an idle connection or opens a new one. Once an
+ * endpoint has maxConnections() open, further acquires queue up and get
+ * connections in the order they asked as others are released. Every
+ * acquired connection has to be given back with release(). Idle
+ * connections are closed after idleTimeout(), connections that drop while
+ * idle are noticed through their disconnected() signal. With a health
+ * check set, connections are checked while they sit idle. Timeouts and
+ * checks are driven by one timer for the whole pool.
+ *
+ * The pool and its connections belong to the event loop of the thread that
+ * uses them.
+ */
+class ConnectionPool
+{
+public:
+    ConnectionPool();
+    ~ConnectionPool();
+
+    /**
+     * Called with a connected connection or with nullptr if the endpoint
+     * couldn't be connected to or acquireTimeout() passed. Can be called
+     * before acquire() returns.
+     */
+    typedef std::function<void(const std::shared_ptr<Connection> &)> Callback;
+    void acquire(const String &host, uint16_t port, Callback &&callback);
+#ifndef _WIN32
+    void acquire(const Path &socketFile, Callback &&callback);
+#endif
+    /**
+     * Gives back an acquired connection. It's kept for the next acquire()
+     * if reuse is set and it's still connected, otherwise it's closed.
+     * Don't release a connection in the middle of a request and disconnect
+     * whatever you connected to its signals first, the next acquire() gets
+     * the same object.
+     */
+    void release(const std::shared_ptr<Connection> &connection, bool reuse = true);
+
+    // per endpoint, defaults to 8
+    void setMaxConnections(int max);
+    int maxConnections() const { return mMaxConnections; }
+    // per endpoint, defaults to maxConnections()
+    void setMaxIdle(int max);
+    int maxIdle() const { return mMaxIdle; }
+    // defaults to 60000ms
+    void setIdleTimeout(int ms);
+    int idleTimeout() const { return mIdleTimeout; }
+    // defaults to 10000ms
+    void setConnectTimeout(int ms) { mConnectTimeout = ms; }
+    int connectTimeout() const { return mConnectTimeout; }
+    // how long acquire() waits in the queue, 0 for no limit
+    void setAcquireTimeout(int ms);
+    int acquireTimeout() const { return mAcquireTimeout; }
+
+    /**
+     * Checks connection, e.g. by sending a ping request, and calls done
+     * with whether it's healthy. Runs on connections that have been idle
+     * for interval ms and again every interval ms while they stay idle.
+     * Unhealthy connections are closed.
+     */
+    typedef std::function<void(const std::shared_ptr<Connection> &connection,
+                               std::function<void(bool healthy)> &&done)> HealthCheck;
+    void setHealthCheck(HealthCheck &&check, int interval = 30000);
+
+    // connections that are handed out, idle, connecting or being checked
+    size_t connectionCount() const;
+    size_t idleCount() const;
+    // acquires waiting for a connection
+    size_t pendingCount() const;
+
+    // closes idle connections and fails pending acquires
+    void clear();
+
+private:
+    struct Endpoint;
+    enum State { Connecting, Idle, Checking, Acquired };
+    struct Member
+    {
+        std::weak_ptr<Endpoint> endpoint;
+        std::weak_ptr<Connection> connection;
+        // keeps connections alive while they're connecting
+        std::shared_ptr<Connection> owned;
+        State state;
+        Signal<std::function<void(std::shared_ptr<Connection>)>>::Key connectedKey, disconnectedKey, errorKey;
+    };
+
+    void acquire(const String &key, const String &host, uint16_t port, const Path &path, Callback &&callback);
+    void dispatch(const std::shared_ptr<Endpoint> &endpoint);
+    void open(const std::shared_ptr<Endpoint> &endpoint);
+    void onConnected(const std::shared_ptr<Connection> &connection);
+    void onGone(const std::shared_ptr<Connection> &connection);
+    void remove(const std::shared_ptr<Connection> &connection, bool close);
+    void takeIdle(Endpoint *endpoint, const Connection *connection);
+    void check(const std::shared_ptr<Endpoint> &endpoint, const std::shared_ptr<Connection> &connection);
+    void schedule(uint64_t deadline);
+    void scheduleIdle(uint64_t since, uint64_t checked);
+    void sweep();
+
+    Hash<String, std::shared_ptr<Endpoint> > mEndpoints;
+    Hash<const Connection *, Member> mMembers;
+    int mMaxConnections, mMaxIdle, mIdleTimeout, mConnectTimeout, mAcquireTimeout;
+    HealthCheck mHealthCheck;
+    int mHealthCheckInterval;
+    int mTimer;
+    uint64_t mTimerDeadline;
+};
+
+#endif
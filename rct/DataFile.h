@@ -9,8 +9,15 @@
 class DataFile
 {
 public:
-    DataFile(const Path &path, int version)
-        : mFile(nullptr), mSizeOffset(-1), mSerializer(nullptr), mDeserializer(nullptr), mPath(path), mVersion(version)
+    /**
+     * The header is always written with Serializer::FixedEncoding, the
+     * contents with encoding. Files written with CompactEncoding record it
+     * after the header but readers need to be created with the same
+     * encoding to find it, so changing it should come with a new version.
+     */
+    DataFile(const Path &path, int version, Serializer::Encoding encoding = Serializer::FixedEncoding)
+        : mFile(nullptr), mSizeOffset(-1), mSerializer(nullptr), mDeserializer(nullptr), mPath(path), mVersion(version),
+          mEncoding(encoding)
     {}
 
     ~DataFile()
@@ -26,10 +33,13 @@ public:
     {
         if (!mFile)
             return false;
+        mSerializer->flush();
         const int size = ftell(mFile);
         assert(mSizeOffset != -1);
         fseek(mFile, mSizeOffset, SEEK_SET);
+        mSerializer->setEncoding(Serializer::FixedEncoding);
         operator<<(size);
+        mSerializer->flush();
 
         fclose(mFile);
         mFile = nullptr;
@@ -68,8 +78,12 @@ public:
             }
             mSerializer = new Serializer(mFile);
             operator<<(mVersion);
-            mSizeOffset = ftell(mFile);
+            mSizeOffset = mSerializer->pos();
             operator<<(static_cast<int>(0));
+            if (mEncoding != Serializer::FixedEncoding) {
+                operator<<(static_cast<uint8_t>(mEncoding));
+                mSerializer->setEncoding(mEncoding);
+            }
             return true;
         } else {
             mContents = mPath.readAll();
@@ -93,6 +107,16 @@ public:
                                              mPath.c_str(), mContents.size(), fs);
                 return false;
             }
+            if (mEncoding != Serializer::FixedEncoding) {
+                uint8_t encoding;
+                (*mDeserializer) >> encoding;
+                if (encoding != mEncoding) {
+                    mError = String::format<128>("Wrong encoding. Expected %d, got %d for %s",
+                                                 mEncoding, encoding, mPath.c_str());
+                    return false;
+                }
+                mDeserializer->setEncoding(mEncoding);
+            }
             return true;
         }
     }
@@ -118,5 +142,6 @@ private:
     String mContents;
     String mError;
     const int mVersion;
+    const Serializer::Encoding mEncoding;
 };
 #endif
@@ -0,0 +1,673 @@
+#include "DnsResolver.h"
+
+#ifdef _WIN32
+#  include <Winsock2.h>
+#  include <Ws2tcpip.h>
+#else
+#  include <arpa/inet.h>
+#  include <netdb.h>
+#  include <netinet/in.h>
+#  include <poll.h>
+#  include <sys/socket.h>
+#  include <unistd.h>
+#endif
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <random>
+
+#include "EventLoop.h"
+#include "rct/rct-config.h"
+
+enum {
+    MaxThreads = 4,
+    DefaultTimeout = 2000,
+    DefaultTtl = 60 * 1000,
+    DefaultNegativeTtl = 5 * 1000,
+    DefaultMaxCacheSize = 1024
+};
+
+DnsResolver::DnsResolver()
+    : mIdleThreads(0), mStopped(false), mHostsFile("/etc/hosts"), mTimeout(DefaultTimeout),
+      mTtl(DefaultTtl), mNegativeTtl(DefaultNegativeTtl), mMaxCacheSize(DefaultMaxCacheSize)
+{
+}
+
+DnsResolver::~DnsResolver()
+{
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        mStopped = true;
+    }
+    mCondition.notify_all();
+    for (std::thread &thread : mThreads)
+        thread.join();
+}
+
+DnsResolver &DnsResolver::instance()
+{
+    // leaked on purpose, the worker threads may outlive static destruction
+    static DnsResolver *resolver = new DnsResolver;
+    return *resolver;
+}
+
+int DnsResolver::Address::family() const
+{
+    return length ? sockAddress()->sa_family : AF_UNSPEC;
+}
+
+void DnsResolver::Address::setPort(uint16_t port)
+{
+    if (family() == AF_INET) {
+        reinterpret_cast<sockaddr_in *>(data)->sin_port = htons(port);
+    } else if (family() == AF_INET6) {
+        reinterpret_cast<sockaddr_in6 *>(data)->sin6_port = htons(port);
+    }
+}
+
+String DnsResolver::Address::toString() const
+{
+    String ret(INET6_ADDRSTRLEN, '\0');
+    if (family() == AF_INET) {
+        inet_ntop(AF_INET, &reinterpret_cast<const sockaddr_in *>(data)->sin_addr, ret.data(), ret.size());
+    } else if (family() == AF_INET6) {
+        inet_ntop(AF_INET6, &reinterpret_cast<const sockaddr_in6 *>(data)->sin6_addr, ret.data(), ret.size());
+    } else {
+        return String();
+    }
+    ret.resize(strlen(ret.c_str()));
+    return ret;
+}
+
+static void setAddress(DnsResolver::Address *address, const void *addr, size_t length)
+{
+    assert(length <= sizeof(address->data));
+    memset(address->data, 0, sizeof(address->data));
+    memcpy(address->data, addr, length);
+    address->length = length;
+}
+
+bool DnsResolver::parseAddress(const String &host, Address *address)
+{
+    sockaddr_in addr4;
+    memset(&addr4, 0, sizeof(addr4));
+    if (inet_pton(AF_INET, host.c_str(), &addr4.sin_addr) == 1) {
+        addr4.sin_family = AF_INET;
+        setAddress(address, &addr4, sizeof(addr4));
+        return true;
+    }
+    sockaddr_in6 addr6;
+    memset(&addr6, 0, sizeof(addr6));
+    if (inet_pton(AF_INET6, host.c_str(), &addr6.sin6_addr) == 1) {
+        addr6.sin6_family = AF_INET6;
+        setAddress(address, &addr6, sizeof(addr6));
+        return true;
+    }
+    return false;
+}
+
+List<DnsResolver::Address> DnsResolver::filter(const List<Address> &addresses, Rct::LookupMode mode)
+{
+    if (mode == Rct::Auto)
+        return addresses;
+    const int family = mode == Rct::IPv6 ? AF_INET6 : AF_INET;
+    List<Address> ret;
+    for (const Address &address : addresses) {
+        if (address.family() == family)
+            ret.append(address);
+    }
+    return ret;
+}
+
+// drops duplicates and alternates between the families, starting with
+// the family of the first address (RFC 8305 section 4)
+static List<DnsResolver::Address> order(const List<DnsResolver::Address> &addresses)
+{
+    List<DnsResolver::Address> families[2];
+    for (const DnsResolver::Address &address : addresses) {
+        List<DnsResolver::Address> &list = families[address.family() == addresses.first().family() ? 0 : 1];
+        bool found = false;
+        for (const DnsResolver::Address &other : list) {
+            if (other.length == address.length && !memcmp(other.data, address.data, address.length)) {
+                found = true;
+                break;
+            }
+        }
+        if (!found)
+            list.append(address);
+    }
+    List<DnsResolver::Address> ret;
+    ret.reserve(families[0].size() + families[1].size());
+    for (size_t i = 0; i < families[0].size() || i < families[1].size(); ++i) {
+        if (i < families[0].size())
+            ret.append(families[0].at(i));
+        if (i < families[1].size())
+            ret.append(families[1].at(i));
+    }
+    return ret;
+}
+
+List<DnsResolver::Address> DnsResolver::lookup(const String &host, Rct::LookupMode mode)
+{
+    List<Address> ret;
+    if (cached(host, mode, &ret))
+        return ret;
+    Entry entry = resolve(host);
+    ret = filter(entry.addresses, mode);
+    insert(host.toLower(), std::move(entry));
+    return ret;
+}
+
+void DnsResolver::lookup(const String &host, Rct::LookupMode mode, Callback &&callback)
+{
+    std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+    if (!loop) {
+        callback(host, lookup(host, mode));
+        return;
+    }
+
+    List<Address> addresses;
+    if (cached(host, mode, &addresses)) {
+        loop->callLater([callback, host, addresses]() { callback(host, addresses); });
+        return;
+    }
+
+    const String key = host.toLower();
+    std::lock_guard<std::mutex> lock(mMutex);
+    List<Waiter> &waiters = mPending[key];
+    waiters.append(Waiter { host, mode, loop, std::move(callback) });
+    if (waiters.size() > 1)
+        return;
+    mQueue.push_back(key);
+    if (!mIdleThreads && mThreads.size() < MaxThreads) {
+        mThreads.emplace_back(&DnsResolver::run, this);
+    } else {
+        mCondition.notify_one();
+    }
+}
+
+bool DnsResolver::cached(const String &host, Rct::LookupMode mode, List<Address> *addresses) const
+{
+    Address address;
+    if (parseAddress(host, &address)) {
+        addresses->clear();
+        if ((mode == Rct::Auto) || (mode == Rct::IPv6) == (address.family() == AF_INET6))
+            addresses->append(address);
+        return true;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    auto it = mCache.find(host.toLower());
+    if (it == mCache.end() || it->second.expires <= Rct::monoMs())
+        return false;
+    *addresses = filter(it->second.addresses, mode);
+    return true;
+}
+
+String DnsResolver::reverseLookup(const String &address, Rct::LookupMode mode)
+{
+    Address addr;
+    if (!parseAddress(address, &addr)
+        || (mode != Rct::Auto && (mode == Rct::IPv6) != (addr.family() == AF_INET6))) {
+        return String();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        auto it = mReverseCache.find(address);
+        if (it != mReverseCache.end() && it->second.expires > Rct::monoMs())
+            return it->second.name;
+    }
+
+    Entry entry;
+    String name(NI_MAXHOST, '\0');
+    if (getnameinfo(addr.sockAddress(), addr.length, name.data(), NI_MAXHOST, nullptr, 0, 0) == 0) {
+        name.resize(strlen(name.c_str()));
+        entry.name = name;
+    }
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    entry.expires = Rct::monoMs() + (entry.name.isEmpty() ? mNegativeTtl : mTtl);
+    if (mReverseCache.size() >= mMaxCacheSize)
+        mReverseCache.clear();
+    mReverseCache[address] = entry;
+    return entry.name;
+}
+
+void DnsResolver::insert(const String &key, Entry &&entry)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (mCache.size() >= mMaxCacheSize && !mCache.contains(key)) {
+        // drop what has expired, then whatever expires first
+        const uint64_t now = Rct::monoMs();
+        auto soonest = mCache.end();
+        for (auto it = mCache.begin(); it != mCache.end(); ) {
+            if (it->second.expires <= now) {
+                it = mCache.erase(it);
+            } else {
+                if (soonest == mCache.end() || it->second.expires < soonest->second.expires)
+                    soonest = it;
+                ++it;
+            }
+        }
+        if (mCache.size() >= mMaxCacheSize && soonest != mCache.end())
+            mCache.erase(soonest);
+    }
+    mCache[key] = std::move(entry);
+}
+
+void DnsResolver::run()
+{
+    std::unique_lock<std::mutex> lock(mMutex);
+    while (true) {
+        while (mQueue.empty() && !mStopped) {
+            ++mIdleThreads;
+            mCondition.wait(lock);
+            --mIdleThreads;
+        }
+        if (mStopped)
+            return;
+        const String key = mQueue.front();
+        mQueue.pop_front();
+        lock.unlock();
+
+        Entry entry = resolve(key);
+        const List<Address> addresses = entry.addresses;
+        insert(key, std::move(entry));
+
+        lock.lock();
+        List<Waiter> waiters = mPending.take(key);
+        lock.unlock();
+        for (Waiter &waiter : waiters) {
+            if (std::shared_ptr<EventLoop> loop = waiter.loop.lock()) {
+                loop->callLater([callback = std::move(waiter.callback), host = waiter.host,
+                                 addresses = filter(addresses, waiter.mode)]() {
+                    callback(host, addresses);
+                });
+            }
+        }
+        lock.lock();
+    }
+}
+
+DnsResolver::Entry DnsResolver::resolve(const String &host) const
+{
+    List<String> servers;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        servers = mNameServers;
+    }
+    return servers.isEmpty() ? resolveSystem(host) : resolveNameServers(host, servers);
+}
+
+DnsResolver::Entry DnsResolver::resolveSystem(const String &host) const
+{
+    Entry entry;
+    addrinfo hints, *res;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) == 0) {
+        for (addrinfo *p = res; p; p = p->ai_next) {
+            if (p->ai_family == AF_INET || p->ai_family == AF_INET6) {
+                Address address;
+                setAddress(&address, p->ai_addr, p->ai_addrlen);
+                entry.addresses.append(address);
+            }
+        }
+        freeaddrinfo(res);
+    }
+    entry.addresses = order(entry.addresses);
+
+    std::lock_guard<std::mutex> lock(mMutex);
+    entry.expires = Rct::monoMs() + (entry.addresses.isEmpty() ? mNegativeTtl : mTtl);
+    return entry;
+}
+
+static List<DnsResolver::Address> readHostsFile(const Path &path, const String &host)
+{
+    List<DnsResolver::Address> ret;
+    String contents = path.readAll();
+    if (contents.isEmpty())
+        return ret;
+    contents.replace('\t', ' ');
+    for (const String &line : contents.split('\n')) {
+        const size_t comment = line.indexOf('#');
+        const List<String> fields = (comment == String::npos ? line : line.left(comment)).split(' ', String::SkipEmpty);
+        for (size_t i = 1; i < fields.size(); ++i) {
+            if (!strcasecmp(fields.at(i).c_str(), host.c_str())) {
+                DnsResolver::Address address;
+                if (DnsResolver::parseAddress(fields.first(), &address))
+                    ret.append(address);
+                break;
+            }
+        }
+    }
+    return ret;
+}
+
+enum { DnsHeaderSize = 12, DnsTypeA = 1, DnsTypeAAAA = 28, DnsClassIN = 1 };
+
+static inline uint16_t read16(const unsigned char *data)
+{
+    return (data[0] << 8) | data[1];
+}
+
+static bool buildQuery(const String &host, uint16_t id, uint16_t type, String *query)
+{
+    const unsigned char header[DnsHeaderSize] = {
+        static_cast<unsigned char>(id >> 8), static_cast<unsigned char>(id),
+        0x01, 0x00, // recursion desired
+        0x00, 0x01, // one question
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+    };
+    query->assign(reinterpret_cast<const char *>(header), sizeof(header));
+    List<String> labels = host.split('.');
+    if (labels.size() > 1 && labels.last().isEmpty())
+        labels.removeLast(); // fully qualified
+    for (const String &label : labels) {
+        if (label.isEmpty() || label.size() > 63)
+            return false;
+        query->append(static_cast<char>(label.size()));
+        query->append(label);
+    }
+    query->append('\0');
+    if (query->size() - DnsHeaderSize > 255)
+        return false;
+    const char trailer[4] = { 0, static_cast<char>(type), 0, DnsClassIN };
+    query->append(trailer, sizeof(trailer));
+    return true;
+}
+
+static bool skipName(const unsigned char *data, size_t size, size_t *pos)
+{
+    while (*pos < size) {
+        const unsigned char len = data[*pos];
+        if (!len) {
+            ++*pos;
+            return true;
+        } else if ((len & 0xc0) == 0xc0) {
+            *pos += 2;
+            return *pos <= size;
+        } else if (len & 0xc0) {
+            return false;
+        }
+        *pos += len + 1;
+    }
+    return false;
+}
+
+/**
+ * Returns the response code or -1 if the response is malformed or doesn't
+ * match id. A and AAAA records are taken as they come, the name server is
+ * expected to have followed CNAMEs.
+ */
+static int parseResponse(const unsigned char *data, size_t size, uint16_t id,
+                         List<DnsResolver::Address> *addresses, uint32_t *ttl)
+{
+    if (size < DnsHeaderSize || read16(data) != id || !(data[2] & 0x80))
+        return -1;
+    const int rcode = data[3] & 0x0f;
+    const int questions = read16(data + 4);
+    const int answers = read16(data + 6);
+    size_t pos = DnsHeaderSize;
+    for (int i = 0; i < questions; ++i) {
+        if (!skipName(data, size, &pos))
+            return -1;
+        pos += 4;
+    }
+    for (int i = 0; i < answers; ++i) {
+        if (!skipName(data, size, &pos) || pos + 10 > size)
+            return -1;
+        const uint16_t type = read16(data + pos);
+        const uint16_t cls = read16(data + pos + 2);
+        const uint32_t recordTtl = (static_cast<uint32_t>(read16(data + pos + 4)) << 16) | read16(data + pos + 6);
+        const uint16_t length = read16(data + pos + 8);
+        pos += 10;
+        if (pos + length > size)
+            return -1;
+        if (cls == DnsClassIN && type == DnsTypeA && length == 4) {
+            sockaddr_in addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin_family = AF_INET;
+            memcpy(&addr.sin_addr, data + pos, 4);
+            DnsResolver::Address address;
+            setAddress(&address, &addr, sizeof(addr));
+            addresses->append(address);
+            *ttl = std::min(*ttl, recordTtl);
+        } else if (cls == DnsClassIN && type == DnsTypeAAAA && length == 16) {
+            sockaddr_in6 addr;
+            memset(&addr, 0, sizeof(addr));
+            addr.sin6_family = AF_INET6;
+            memcpy(&addr.sin6_addr, data + pos, 16);
+            DnsResolver::Address address;
+            setAddress(&address, &addr, sizeof(addr));
+            addresses->append(address);
+            *ttl = std::min(*ttl, recordTtl);
+        }
+        pos += length;
+    }
+    return rcode;
+}
+
+static bool parseNameServer(const String &server, DnsResolver::Address *address)
+{
+    String host = server;
+    uint16_t port = 53;
+    size_t colon = String::npos;
+    if (server.startsWith('[')) {
+        const size_t end = server.indexOf(']');
+        if (end == String::npos)
+            return false;
+        host = server.mid(1, end - 1);
+        if (end + 1 < server.size()) {
+            if (server.at(end + 1) != ':')
+                return false;
+            colon = end + 1;
+        }
+    } else if (server.indexOf(':') != String::npos && server.indexOf(':') == server.lastIndexOf(':')) {
+        colon = server.indexOf(':');
+        host = server.left(colon);
+    }
+    if (colon != String::npos) {
+        bool ok;
+        const unsigned long long p = server.mid(colon + 1).toULongLong(&ok);
+        if (!ok || !p || p > 0xffff)
+            return false;
+        port = static_cast<uint16_t>(p);
+    }
+    if (!DnsResolver::parseAddress(host, address))
+        return false;
+    address->setPort(port);
+    return true;
+}
+
+DnsResolver::Entry DnsResolver::resolveNameServers(const String &host, const List<String> &servers) const
+{
+    Path hostsFile;
+    int timeout, ttl, negativeTtl;
+    {
+        std::lock_guard<std::mutex> lock(mMutex);
+        hostsFile = mHostsFile;
+        timeout = mTimeout;
+        ttl = mTtl;
+        negativeTtl = mNegativeTtl;
+    }
+
+    Entry entry;
+    if (!hostsFile.isEmpty()) {
+        entry.addresses = order(readHostsFile(hostsFile, host));
+        if (!entry.addresses.isEmpty()) {
+            entry.expires = Rct::monoMs() + ttl;
+            return entry;
+        }
+    }
+
+    static thread_local std::mt19937 random(std::random_device {}());
+    const uint16_t types[2] = { DnsTypeAAAA, DnsTypeA };
+    String queries[2];
+    uint16_t ids[2];
+    for (int i = 0; i < 2; ++i) {
+        ids[i] = static_cast<uint16_t>(random());
+        if (!buildQuery(host, ids[i], types[i], &queries[i])) {
+            entry.expires = Rct::monoMs() + negativeTtl;
+            return entry;
+        }
+    }
+
+    uint32_t minTtl = ttl / 1000;
+    for (const String &server : servers) {
+        Address address;
+        if (!parseNameServer(server, &address))
+            continue;
+        const int fd = ::socket(address.family(), SOCK_DGRAM, 0);
+        if (fd == -1)
+            continue;
+        int e;
+        eintrwrap(e, ::connect(fd, address.sockAddress(), address.length));
+        if (e == -1) {
+            ::close(fd);
+            continue;
+        }
+
+        List<Address> found[2];
+        bool answered[2] = { false, false };
+        int sent = 0;
+        for (int i = 0; i < 2; ++i) {
+            eintrwrap(e, ::send(fd, queries[i].constData(), queries[i].size(), 0));
+            if (e == static_cast<int>(queries[i].size()))
+                ++sent;
+        }
+        const uint64_t deadline = Rct::monoMs() + timeout;
+        bool failed = sent < 2;
+        while (!failed && !(answered[0] && answered[1])) {
+            const uint64_t now = Rct::monoMs();
+            if (now >= deadline) {
+                failed = true;
+                break;
+            }
+            pollfd pfd = { fd, POLLIN, 0 };
+            eintrwrap(e, ::poll(&pfd, 1, static_cast<int>(deadline - now)));
+            if (e <= 0)
+                continue;
+            unsigned char response[4096];
+            eintrwrap(e, ::recv(fd, response, sizeof(response), 0));
+            if (e <= 0) {
+                failed = true;
+                break;
+            }
+            for (int i = 0; i < 2; ++i) {
+                if (answered[i])
+                    continue;
+                List<Address> addresses;
+                const int rcode = parseResponse(response, e, ids[i], &addresses, &minTtl);
+                if (rcode == -1)
+                    continue;
+                if (rcode != 0 && rcode != 3) { // anything but NXDOMAIN means try the next server
+                    failed = true;
+                } else {
+                    answered[i] = true;
+                    found[i] = std::move(addresses);
+                }
+                break;
+            }
+        }
+        ::close(fd);
+        if (failed)
+            continue;
+
+        entry.addresses = found[0];
+        entry.addresses.append(found[1]);
+        entry.addresses = order(entry.addresses);
+        entry.expires = Rct::monoMs() + (entry.addresses.isEmpty() ? negativeTtl : std::min<uint64_t>(ttl, minTtl * 1000ull));
+        return entry;
+    }
+
+    entry.expires = Rct::monoMs() + negativeTtl;
+    return entry;
+}
+
+void DnsResolver::setNameServers(const List<String> &servers)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mNameServers = servers;
+}
+
+List<String> DnsResolver::nameServers() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mNameServers;
+}
+
+void DnsResolver::setHostsFile(const Path &path)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mHostsFile = path;
+}
+
+Path DnsResolver::hostsFile() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mHostsFile;
+}
+
+void DnsResolver::setTimeout(int ms)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTimeout = ms;
+}
+
+int DnsResolver::timeout() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTimeout;
+}
+
+void DnsResolver::setTtl(int ms)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mTtl = ms;
+}
+
+int DnsResolver::ttl() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mTtl;
+}
+
+void DnsResolver::setNegativeTtl(int ms)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mNegativeTtl = ms;
+}
+
+int DnsResolver::negativeTtl() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mNegativeTtl;
+}
+
+void DnsResolver::setMaxCacheSize(size_t entries)
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mMaxCacheSize = std::max<size_t>(entries, 1);
+}
+
+size_t DnsResolver::maxCacheSize() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mMaxCacheSize;
+}
+
+void DnsResolver::clearCache()
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    mCache.clear();
+    mReverseCache.clear();
+}
+
+size_t DnsResolver::cacheSize() const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    return mCache.size();
+}
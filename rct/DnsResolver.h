@@ -0,0 +1,156 @@
+#ifndef DnsResolver_h
+#define DnsResolver_h
+
+#include <stdint.h>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include <rct/Hash.h>
+#include <rct/List.h>
+#include <rct/Path.h>
+#include <rct/Rct.h>
+#include <rct/String.h>
+
+class EventLoop;
+struct sockaddr;
+
+/**
+ * Host name resolution off the event loop thread, with a cache.
+ *
+ * Lookups run on a few background threads. By default they use the
+ * system resolver (getaddrinfo), which honours /etc/hosts and
+ * nsswitch.conf but doesn't report TTLs, so answers are cached for ttl().
+ * With setNameServers() the resolver instead reads the hosts file itself
+ * and sends A and AAAA queries to the given servers over UDP, caching the
+ * answers for their TTL (but no longer than ttl()). Failed lookups are
+ * cached for negativeTtl().
+ *
+ * Addresses come back ordered for happy eyeballs (RFC 8305), alternating
+ * between IPv6 and IPv4 starting with the family the system prefers.
+ *
+ * instance() is shared by SocketClient and Rct::nameLookup()/addrLookup().
+ */
+class DnsResolver
+{
+public:
+    DnsResolver();
+    ~DnsResolver();
+
+    static DnsResolver &instance();
+
+    struct Address
+    {
+        Address()
+            : length(0)
+        {}
+
+        const sockaddr *sockAddress() const { return reinterpret_cast<const sockaddr *>(data); }
+        // AF_INET or AF_INET6
+        int family() const;
+        void setPort(uint16_t port);
+        String toString() const;
+
+        // big enough for a sockaddr_in6
+        alignas(8) unsigned char data[28];
+        uint32_t length;
+    };
+
+    // numeric IPv4 or IPv6 addresses only
+    static bool parseAddress(const String &ip, Address *address);
+
+    /**
+     * Resolves host, numeric addresses are parsed without a lookup. Blocks
+     * on a cache miss. Returns an empty list if host can't be resolved.
+     */
+    List<Address> lookup(const String &host, Rct::LookupMode mode = Rct::Auto);
+
+    /**
+     * Resolves host on a background thread and calls callback from the
+     * calling thread's event loop. Concurrent lookups of the same host
+     * share one query. Without an event loop the lookup is done right away.
+     */
+    typedef std::function<void(const String &host, const List<Address> &addresses)> Callback;
+    void lookup(const String &host, Rct::LookupMode mode, Callback &&callback);
+
+    /**
+     * Returns true if host is numeric or its answer, positive or negative,
+     * is in the cache.
+     */
+    bool cached(const String &host, Rct::LookupMode mode, List<Address> *addresses) const;
+
+    /**
+     * Reverse lookup of a numeric address through the system resolver,
+     * cached like forward lookups. Returns an empty string on failure.
+     */
+    String reverseLookup(const String &address, Rct::LookupMode mode = Rct::Auto);
+
+    /**
+     * Name servers as "ip", "ip:port" or "[ipv6]:port". Pass an empty list
+     * to go back to the system resolver.
+     */
+    void setNameServers(const List<String> &servers);
+    List<String> nameServers() const;
+    // consulted before the name servers, defaults to /etc/hosts
+    void setHostsFile(const Path &path);
+    Path hostsFile() const;
+    // per query and name server
+    void setTimeout(int ms);
+    int timeout() const;
+
+    void setTtl(int ms);
+    int ttl() const;
+    void setNegativeTtl(int ms);
+    int negativeTtl() const;
+    void setMaxCacheSize(size_t entries);
+    size_t maxCacheSize() const;
+    void clearCache();
+    size_t cacheSize() const;
+
+private:
+    struct Entry
+    {
+        Entry()
+            : expires(0)
+        {}
+
+        List<Address> addresses;
+        String name; // reverse lookups
+        uint64_t expires;
+    };
+    struct Waiter
+    {
+        String host;
+        Rct::LookupMode mode;
+        std::weak_ptr<EventLoop> loop;
+        Callback callback;
+    };
+
+    Entry resolve(const String &host) const;
+    Entry resolveSystem(const String &host) const;
+    Entry resolveNameServers(const String &host, const List<String> &servers) const;
+    void insert(const String &host, Entry &&entry);
+    static List<Address> filter(const List<Address> &addresses, Rct::LookupMode mode);
+    void run();
+
+    mutable std::mutex mMutex;
+    std::condition_variable mCondition;
+    Hash<String, Entry> mCache;
+    Hash<String, Entry> mReverseCache;
+    Hash<String, List<Waiter> > mPending;
+    std::deque<String> mQueue;
+    std::vector<std::thread> mThreads;
+    int mIdleThreads;
+    bool mStopped;
+
+    List<String> mNameServers;
+    Path mHostsFile;
+    int mTimeout, mTtl, mNegativeTtl;
+    size_t mMaxCacheSize;
+};
+
+#endif
@@ -110,7 +110,8 @@ EventLoop::EventLoop()
 #if defined(HAVE_EPOLL) || defined(HAVE_KQUEUE)
     mPollFd(-1),
 #endif
-    mNextTimerId(0), mStop(false), mTimeout(false), mFlags(0), mInactivityTimeout(0)
+    mNextTimerId(0), mStop(false), mTimeout(false), mFlags(0), mInactivityTimeout(0),
+    mSocketStats(std::make_shared<SocketStatsGroup>())
 {
     std::call_once(sMainOnce, [](){
             atexit(&EventLoop::cleanupLocalEventLoop);
@@ -754,8 +755,22 @@ unsigned int EventLoop::processSocketEvents(NativeEvent* events, int eventCount)
     for (int i = 0; i < eventCount; ++i) {
         unsigned int mode = 0;
 #if defined(HAVE_EPOLL)
-        const uint32_t ev = events[i].events;
+        uint32_t ev = events[i].events;
         const int fd = events[i].data.fd;
+        if ((ev & (EPOLLERR|EPOLLHUP)) == EPOLLERR) {
+            bool errorQueue;
+            {
+                std::lock_guard<std::mutex> locker(mMutex);
+                const auto socket = mSockets.find(fd);
+                errorQueue = socket != mSockets.end() && socket->second.first & SocketErrorQueue;
+            }
+            int err;
+            socklen_t size = sizeof(err);
+            if (errorQueue && !::getsockopt(fd, SOL_SOCKET, SO_ERROR, &err, &size) && !err) {
+                mode |= SocketErrorQueue;
+                ev &= ~EPOLLERR;
+            }
+        }
         if (ev & (EPOLLERR|EPOLLHUP) && !(ev & EPOLLRDHUP)) {
             // bad, take the fd out
             epoll_ctl(mPollFd, EPOLL_CTL_DEL, fd, &events[i]);
@@ -29,6 +29,8 @@
 #  endif
 #endif
 
+class SocketStatsGroup;
+
 class Event
 {
 public:
@@ -139,7 +141,11 @@ public:
         SocketWrite = 0x2,
         SocketOneShot = 0x4,
         SocketError = 0x8,
-        SocketLevelTriggered = 0x10
+        SocketLevelTriggered = 0x10,
+        // the socket has notifications on its error queue, e.g.
+        // MSG_ZEROCOPY completions (epoll). Sockets registered with it
+        // aren't taken out when an error is reported but SO_ERROR is 0.
+        SocketErrorQueue = 0x20
     };
     bool registerSocket(int fd, unsigned int mode, std::function<void(int, unsigned int)>&& func);
     bool updateSocket(int fd, unsigned int mode);
@@ -177,6 +183,9 @@ public:
     static std::shared_ptr<EventLoop> eventLoop();
     static void cleanupLocalEventLoop();
 
+    // every SocketClient created on this loop's thread
+    std::shared_ptr<SocketStatsGroup> socketStats() const { return mSocketStats; }
+
     static bool isMainThread() { return EventLoop::mainEventLoop() && std::this_thread::get_id() == EventLoop::mainEventLoop()->threadId; }
 private:
 #if defined(HAVE_EPOLL)
@@ -276,6 +285,7 @@ private:
     unsigned int mFlags;
 
     int mInactivityTimeout;
+    std::shared_ptr<SocketStatsGroup> mSocketStats;
 private:
     EventLoop(const EventLoop&) = delete;
     EventLoop& operator=(const EventLoop&) = delete;
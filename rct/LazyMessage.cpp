@@ -0,0 +1,28 @@
+#include "LazyMessage.h"
+
+std::shared_ptr<Message> LazyMessage::message(MessageError *error) const
+{
+    std::lock_guard<std::mutex> lock(mMutex);
+    if (!mDecoded.load(std::memory_order_relaxed)) {
+        mMessage = decodePayload(mMessageId, mFlags, payload(), payloadSize(), &mError);
+        if (mMessage) {
+            mMessage->mCorrelationFlags = mCorrelationFlags;
+            mMessage->mCorrelationId = mCorrelationId;
+        }
+        mDecoded.store(true, std::memory_order_release);
+    }
+    if (error && !mMessage)
+        *error = mError;
+    return mMessage;
+}
+
+void LazyMessage::decode(Deserializer &deserializer)
+{
+    const int size = deserializer.length() - deserializer.pos();
+    BufferRef payload = deserializer.readRef(std::max(size, 0));
+    std::lock_guard<std::mutex> lock(mMutex);
+    mPayload = std::move(payload);
+    mMessage.reset();
+    mError = MessageError();
+    mDecoded.store(false, std::memory_order_release);
+}
@@ -0,0 +1,71 @@
+#ifndef LazyMessage_h
+#define LazyMessage_h
+
+#include <memory>
+#include <mutex>
+
+#include <rct/Buffer.h>
+#include <rct/Message.h>
+
+/**
+ * A received message that hasn't been decoded yet, see
+ * Connection::setLazyMessages(). messageId() and flags() are those of the
+ * frame, the payload is decoded into the registered message type on the
+ * first call to message().
+ *
+ * Sending a LazyMessage writes the payload it was received with byte for
+ * byte, still compressed or compact encoded if it was, which makes
+ * forwarding cheap. Changes to the decoded message are not sent.
+ */
+class LazyMessage : public Message
+{
+public:
+    LazyMessage(uint8_t id, uint8_t flags, const BufferRef &payload)
+        : Message(id, flags), mPayload(payload)
+    {
+        mLazy = true;
+    }
+
+    /**
+     * The payload as it was received, Deserializer(payload(), payloadSize())
+     * can be used to peek at leading fields of uncompressed messages.
+     */
+    const char *payload() const { return reinterpret_cast<const char *>(mPayload.data()); }
+    int payloadSize() const { return mPayload.size(); }
+    // shares the payload, sending the message to many connections doesn't copy it
+    const BufferRef &payloadRef() const { return mPayload; }
+
+    bool isDecoded() const { return mDecoded.load(std::memory_order_acquire); }
+
+    /**
+     * Decodes the payload the first time it's called, returns null if
+     * the message id isn't registered or the payload can't be decoded.
+     */
+    std::shared_ptr<Message> message(MessageError *error = nullptr) const;
+    template <typename T> std::shared_ptr<T> message(MessageError *error = nullptr) const
+    {
+        std::shared_ptr<Message> ret = message(error);
+        if (!ret || ret->messageId() != T::MessageId)
+            return std::shared_ptr<T>();
+        return std::static_pointer_cast<T>(ret);
+    }
+
+    virtual size_t encodedSize() const override { return mPayload.size(); }
+    virtual void encode(Serializer &serializer) const override
+    {
+        if (!mPayload.isEmpty())
+            serializer.write(payload(), mPayload.size());
+    }
+    // takes the rest of the deserializer as the payload
+    virtual void decode(Deserializer &deserializer) override;
+
+private:
+    BufferRef mPayload;
+
+    mutable std::mutex mMutex;
+    mutable std::atomic<bool> mDecoded { false };
+    mutable std::shared_ptr<Message> mMessage;
+    mutable MessageError mError;
+};
+
+#endif
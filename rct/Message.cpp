@@ -6,22 +6,36 @@
 #include <functional>
 #include <map>
 #include <memory>
-#include <mutex>
 #include <utility>
 
 #include "FinishMessage.h"
+#include "LazyMessage.h"
 #include "QuitMessage.h"
 #include "ResponseMessage.h"
 #include "Serializer.h"
+#include "SharedMemoryMessage.h"
+#include "StreamMessage.h"
 #include "rct/Log.h"
-#include "rct/Map.h"
 #include "rct/Message.h"
 #include "rct/String.h"
 
-std::mutex Message::sMutex;
-Map<uint8_t, Message::MessageCreatorBase *> Message::sFactory;
+std::atomic<Message::MessageCreatorBase *> Message::sFactory[256];
 
-void Message::prepare(int version, String &header, String &value) const
+const bool Message::sBuiltinMessages = Message::registerBuiltinMessages();
+
+bool Message::registerBuiltinMessages()
+{
+    addCreator<ResponseMessage>();
+    addCreator<FinishMessage>();
+    addCreator<QuitMessage>();
+    // registerMessage() doesn't take the reserved ids
+    addCreator<SharedMemoryMessage>();
+    addCreator<StreamMessage>();
+    atexit(Message::cleanup);
+    return true;
+}
+
+void Message::prepare(int version, String &header, String &value, uint8_t correlationFlags, uint32_t correlationId) const
 {
     if (mHeader.empty() || version != mVersion) {
         if (version != mVersion) {
@@ -30,33 +44,54 @@ void Message::prepare(int version, String &header, String &value) const
         }
         {
             Serializer s(mValue);
+            if (mFlags & Compact)
+                s.setEncoding(Serializer::CompactEncoding);
             encode(s);
         }
-        if (mFlags & Compressed) {
+        if (mFlags & Compressed && !mLazy) {
             mValue = mValue.compress();
         }
+        // the cached header never contains a correlation id since that
+        // changes from send to send
         Serializer s(mHeader);
         encodeHeader(s, mValue.size(), version);
         mVersion = version;
     }
     value = mValue;
-    header = mHeader;
+    if (correlationFlags) {
+        header.clear();
+        Serializer s(header);
+        encodeHeader(s, mValue.size(), version, correlationFlags, correlationId);
+    } else {
+        header = mHeader;
+    }
 }
 
-std::shared_ptr<Message> Message::create(int version, const char *data, int size, MessageError *errorPtr)
+size_t Message::countEncodedSize(Serializer::Encoding encoding) const
+{
+    Serializer serializer(std::unique_ptr<Serializer::Buffer>(new Serializer::CountingBuffer));
+    serializer.setEncoding(encoding);
+    encode(serializer);
+    return serializer.pos();
+}
+
+static void reportError(Message::MessageError *errorPtr, Message::MessageErrorType type, const String &text)
+{
+    if (errorPtr) {
+        errorPtr->text = text;
+        errorPtr->type = type;
+    } else {
+        logDirect(LogLevel::Error, text);
+    }
+}
+
+bool Message::parseHeader(int version, const char *data, int size, FrameHeader *header, MessageError *errorPtr)
 {
-    auto sendError = [errorPtr](MessageErrorType type, const String &text) {
-        if (errorPtr) {
-            errorPtr->text = text;
-            errorPtr->type = type;
-        } else {
-            logDirect(LogLevel::Error, text);
-        }
-    };
     if (!size || !data) {
-        sendError(Message_LengthError, "Can't create message from empty data");
-        return std::shared_ptr<Message>();
+        reportError(errorPtr, Message_LengthError, "Can't create message from empty data");
+        return false;
     }
+    const char *const start = data;
     Deserializer ds(data, Serializer::sizeOf<int>() + Serializer::sizeOf<uint8_t>() + Serializer::sizeOf<uint8_t>());
     int ver;
     ds >> ver;
@@ -72,49 +107,88 @@ std::shared_ptr<Message> Message::create(int version, const char *data, int size
             text = String::format<1024>("Invalid message version. Got %d, expected %d", ver, version);
             text += String::toHex(data, std::min(size, 1024));
         }
-        sendError(Message_VersionError, text);
-        return std::shared_ptr<Message>();
+        reportError(errorPtr, Message_VersionError, text);
+        return false;
     }
     size -= Serializer::sizeOf(version);
     data += Serializer::sizeOf(version);
-    uint8_t id;
-    ds >> id;
-    size -= Serializer::sizeOf(id);
-    data += Serializer::sizeOf(id);
-    uint8_t flags;
-    ds >> flags;
-    data += Serializer::sizeOf(flags);
-    size -= Serializer::sizeOf(flags);
+    ds >> header->id;
+    size -= Serializer::sizeOf(header->id);
+    data += Serializer::sizeOf(header->id);
+    ds >> header->flags;
+    data += Serializer::sizeOf(header->flags);
+    size -= Serializer::sizeOf(header->flags);
+    header->correlationId = 0;
+    if (header->flags & (Request|Reply)) {
+        if (size < static_cast<int>(Serializer::sizeOf(header->correlationId))) {
+            reportError(errorPtr, Message_LengthError,
+                        String::format<128>("Missing correlation id for message id %d", header->id));
+            return false;
+        }
+        Deserializer cds(data, Serializer::sizeOf(header->correlationId));
+        cds >> header->correlationId;
+        data += Serializer::sizeOf(header->correlationId);
+        size -= Serializer::sizeOf(header->correlationId);
+    }
+    header->offset = data - start;
+    header->size = size;
+    return true;
+}
+
+std::shared_ptr<Message> Message::decodePayload(uint8_t id, uint8_t flags, const char *data, int size, MessageError *errorPtr)
+{
     String uncompressed;
     if (flags & Compressed) {
         uncompressed = String::uncompress(data, size);
         data = uncompressed.c_str();
         size = uncompressed.size();
     }
-    std::lock_guard<std::mutex> lock(sMutex);
-    if (!sFactory.contains(ResponseMessage::MessageId)) {
-        atexit(Message::cleanup);
-        sFactory[ResponseMessage::MessageId] = new MessageCreator<ResponseMessage>();
-        sFactory[FinishMessage::MessageId] = new MessageCreator<FinishMessage>();
-        sFactory[QuitMessage::MessageId] = new MessageCreator<QuitMessage>();
+    MessageCreatorBase *base = sFactory[id].load(std::memory_order_acquire);
+    if (!base) {
+        reportError(errorPtr, Message_IdError, String::format<128>("Invalid message id %d, data: %d bytes", id, size));
+        return std::shared_ptr<Message>();
     }
+    std::shared_ptr<Message> message = base->create(data, size, flags & Compact ? Serializer::CompactEncoding : Serializer::FixedEncoding);
+    if (!message)
+        reportError(errorPtr, Message_CreateError, String::format<128>("Can't create message from data id: %d, data: %d bytes", id, size));
+    return message;
+}
 
-    MessageCreatorBase *base = sFactory.value(id);
-    if (!base) {
-        sendError(Message_IdError, String::format<128>("Invalid message id %d, data: %d bytes", id, size));
+std::shared_ptr<Message> Message::create(int version, const char *data, int size, MessageError *errorPtr)
+{
+    FrameHeader header;
+    if (!parseHeader(version, data, size, &header, errorPtr))
+        return std::shared_ptr<Message>();
+    std::shared_ptr<Message> message = decodePayload(header.id, header.flags, data + header.offset, header.size, errorPtr);
+    if (message) {
+        message->mCorrelationFlags = header.flags & (Request|Reply);
+        message->mCorrelationId = header.correlationId;
+    }
+    return message;
+}
+
+std::shared_ptr<Message> Message::createLazy(int version, const BufferRef &frame, MessageError *errorPtr)
+{
+    const char *data = reinterpret_cast<const char *>(frame.data());
+    FrameHeader header;
+    if (!parseHeader(version, data, frame.size(), &header, errorPtr))
         return std::shared_ptr<Message>();
+    std::shared_ptr<Message> message;
+    if (header.id == FinishMessageId || header.id >= FirstReservedId || header.flags & Reply) {
+        // Connection needs to look into these itself
+        message = decodePayload(header.id, header.flags, data + header.offset, header.size, errorPtr);
+    } else {
+        message = std::make_shared<LazyMessage>(header.id, header.flags & ~(Request|Reply), frame.slice(header.offset, header.size));
     }
-    std::shared_ptr<Message> message(base->create(data, size));
-    if (!message) {
-        sendError(Message_CreateError, String::format<128>("Can't create message from data id: %d, data: %d bytes", id, size));
+    if (message) {
+        message->mCorrelationFlags = header.flags & (Request|Reply);
+        message->mCorrelationId = header.correlationId;
     }
     return message;
 }
 
 void Message::cleanup()
 {
-    std::lock_guard<std::mutex> lock(sMutex);
-    for (Map<uint8_t, MessageCreatorBase *>::const_iterator it = sFactory.begin(); it != sFactory.end(); ++it)
-        delete it->second;
-    sFactory.clear();
+    for (auto &slot : sFactory)
+        delete slot.exchange(nullptr, std::memory_order_acq_rel);
 }
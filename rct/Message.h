@@ -2,8 +2,9 @@
 #define MESSAGE_H
 
 #include <rct/Serializer.h>
-#include <mutex>
+#include <atomic>
 #include <memory>
+#include <mutex>
 
 class Message
 {
@@ -11,11 +12,15 @@ public:
     enum {
         ResponseId = 1,
         FinishMessageId = 2,
-        QuitMessageId = 3
+        QuitMessageId = 3,
+        // ids from here on are reserved for Connection's own control messages
+        FirstReservedId = 240,
+        StreamMessageId = 254,
+        SharedMemoryMessageId = 255
     };
 
     Message(uint8_t id, uint8_t f = None)
-        : mMessageId(id), mFlags(f), mVersion(0)
+        : mMessageId(id), mFlags(f), mLazy(false), mCorrelationFlags(0), mCorrelationId(0), mVersion(0)
     {}
     virtual ~Message()
     {}
@@ -27,19 +32,53 @@ public:
         mVersion = 0;
     }
 
+    /**
+     * Called when a pooled message (see setPoolSize()) goes back to its pool.
+     * Subclasses can clear members that decode() doesn't overwrite
+     * completely, preferably without giving up their capacity.
+     */
+    virtual void recycle()
+    {
+        clearCache();
+        mCorrelationFlags = 0;
+        mCorrelationId = 0;
+    }
+
     enum Flag {
         None = 0x0,
         Compressed = 0x1,
-        MessageCache = 0x2
+        MessageCache = 0x2,
+        // set in the frame by Connection::request()/reply(), followed by a
+        // uint32_t correlation id
+        Request = 0x4,
+        Reply = 0x8,
+        // the payload is written with Serializer::CompactEncoding
+        Compact = 0x10
     };
 
     uint8_t flags() const { return mFlags; }
     uint8_t messageId() const { return mMessageId; }
 
+    /**
+     * Lazy messages are LazyMessage instances holding the raw payload, see
+     * Connection::setLazyMessages().
+     */
+    bool isLazy() const { return mLazy; }
+
+    bool isRequest() const { return mCorrelationFlags & Request; }
+    bool isReply() const { return mCorrelationFlags & Reply; }
+    uint32_t correlationId() const { return mCorrelationId; }
+
     virtual void encode(Serializer &/* serializer */) const = 0;
     virtual void decode(Deserializer &/* deserializer */) = 0;
 
-    virtual size_t encodedSize() const { return String::npos; }
+    /**
+     * The size of the payload with Serializer::FixedEncoding. The default
+     * runs encode() against a Serializer that only counts, subclasses can
+     * override it with something cheaper.
+     */
+    virtual size_t encodedSize() const { return countEncodedSize(); }
+    size_t countEncodedSize(Serializer::Encoding encoding = Serializer::FixedEncoding) const;
     enum MessageErrorType {
         Message_Success,
         Message_VersionError,
@@ -52,56 +91,242 @@ public:
         String text;
     };
     static std::shared_ptr<Message> create(int version, const char *data, int size, MessageError *error = nullptr);
+    /**
+     * Like create() but returns a LazyMessage that shares frame and
+     * decodes it on first access. Finish messages, replies and
+     * Connection's own control messages are still decoded right away.
+     */
+    static std::shared_ptr<Message> createLazy(int version, const BufferRef &frame, MessageError *error = nullptr);
     template<typename T> static void registerMessage()
     {
-        const uint8_t id = T::MessageId;
-        std::lock_guard<std::mutex> lock(sMutex);
-        MessageCreatorBase *&base = sFactory[id];
-        if (!base) {
-            base = new MessageCreator<T>();
-        }
+        static_assert(static_cast<int>(T::MessageId) < FirstReservedId, "Message ids from FirstReservedId on are reserved");
+        addCreator<T>();
+    }
+    /**
+     * Keeps up to size messages of type T per thread that have been
+     * released by everyone around for create() to decode into again,
+     * including the shared_ptr control blocks. 0, the default, allocates
+     * every message with std::make_shared.
+     */
+    template<typename T> static void setPoolSize(size_t size)
+    {
+        registerMessage<T>();
+        MessagePool<T>::setSize(size);
     }
     static void cleanup();
 private:
+    template<typename T> static void addCreator()
+    {
+        const uint8_t id = T::MessageId;
+        if (sFactory[id].load(std::memory_order_acquire))
+            return;
+        MessageCreatorBase *creator = new MessageCreator<T>();
+        MessageCreatorBase *expected = nullptr;
+        if (!sFactory[id].compare_exchange_strong(expected, creator, std::memory_order_acq_rel))
+            delete creator;
+    }
+    static bool registerBuiltinMessages();
+
     class MessageCreatorBase
     {
     public:
         virtual ~MessageCreatorBase() {}
-        virtual Message *create(const char *data, int size) = 0;
+        virtual std::shared_ptr<Message> create(const char *data, int size, Serializer::Encoding encoding) = 0;
+    };
+
+    /**
+     * Freelists of messages and of the shared_ptr control blocks for them.
+     * Every thread has its own so taking from and giving back to the pool
+     * never locks, a message goes back to the freelist of the thread that
+     * releases it. Each freelist keeps up to size() of both. There's one
+     * pool per type and it's never destroyed so the deleter and allocator
+     * don't have to keep it alive.
+     */
+    template <typename T>
+    class MessagePool
+    {
+    public:
+        static void setSize(size_t size)
+        {
+            sSize.store(size, std::memory_order_relaxed);
+            // the other threads trim theirs as they release
+            if (FreeList *list = freeList())
+                list->trim(size);
+        }
+        static size_t size() { return sSize.load(std::memory_order_relaxed); }
+
+        static T *takeMessage()
+        {
+            FreeList *list = freeList();
+            if (list && !list->messages.isEmpty())
+                return list->messages.takeLast();
+            return new T;
+        }
+        static void releaseMessage(T *t)
+        {
+            t->recycle();
+            FreeList *list = freeList();
+            if (list && list->messages.size() < size()) {
+                list->messages.append(t);
+                return;
+            }
+            delete t;
+        }
+
+        // control blocks, they all have the same size
+        static void *takeBlock(size_t size)
+        {
+            FreeList *list = freeList();
+            if (list && size == list->blockSize && !list->blocks.isEmpty())
+                return list->blocks.takeLast();
+            return ::operator new(size);
+        }
+        static void releaseBlock(void *block, size_t size)
+        {
+            FreeList *list = freeList();
+            if (list && list->blocks.size() < MessagePool::size() && (!list->blockSize || size == list->blockSize)) {
+                list->blockSize = size;
+                list->blocks.append(block);
+                return;
+            }
+            ::operator delete(block);
+        }
+    private:
+        struct FreeList
+        {
+            FreeList() : blockSize(0) {}
+            ~FreeList() { trim(0); }
+
+            void trim(size_t size)
+            {
+                while (messages.size() > size) {
+                    delete messages.back();
+                    messages.removeLast();
+                }
+                while (blocks.size() > size) {
+                    ::operator delete(blocks.back());
+                    blocks.removeLast();
+                }
+            }
+
+            List<T *> messages;
+            List<void *> blocks;
+            size_t blockSize;
+        };
+
+        // the calling thread's, null once it has started to exit
+        static FreeList *freeList()
+        {
+            static thread_local FreeList *list = nullptr;
+            static thread_local bool exiting = false;
+            struct Owner
+            {
+                ~Owner()
+                {
+                    // messages deleted here can release more of them
+                    FreeList *dead = list;
+                    list = nullptr;
+                    exiting = true;
+                    delete dead;
+                }
+            };
+            if (!list && !exiting) {
+                static thread_local Owner owner;
+                (void)owner;
+                list = new FreeList;
+            }
+            return list;
+        }
+
+        static std::atomic<size_t> sSize;
+    };
+
+    template <typename T>
+    struct PoolDeleter
+    {
+        void operator()(T *t) const { MessagePool<T>::releaseMessage(t); }
+    };
+
+    template <typename T, typename U>
+    struct PoolAllocator
+    {
+        typedef U value_type;
+        template <typename V> struct rebind { typedef PoolAllocator<T, V> other; };
+        PoolAllocator() {}
+        template <typename V> PoolAllocator(const PoolAllocator<T, V> &) {}
+        U *allocate(size_t count) { return static_cast<U *>(MessagePool<T>::takeBlock(count * sizeof(U))); }
+        void deallocate(U *u, size_t count) { MessagePool<T>::releaseBlock(u, count * sizeof(U)); }
+        template <typename V> bool operator==(const PoolAllocator<T, V> &) const { return true; }
+        template <typename V> bool operator!=(const PoolAllocator<T, V> &) const { return false; }
     };
 
     template <typename T>
     class MessageCreator : public MessageCreatorBase
     {
     public:
-        virtual Message *create(const char *data, int size) override
+        virtual std::shared_ptr<Message> create(const char *data, int size, Serializer::Encoding encoding) override
         {
-            T *t = new T;
+            std::shared_ptr<T> t;
+            if (MessagePool<T>::size()) {
+                t = std::shared_ptr<T>(MessagePool<T>::takeMessage(), PoolDeleter<T>(), PoolAllocator<T, T>());
+            } else {
+                t = std::make_shared<T>();
+            }
             Deserializer deserializer(data, size);
+            deserializer.setEncoding(encoding);
             t->decode(deserializer);
             return t;
         }
     };
 
-    void prepare(int version, String &header, String &value) const;
+    struct FrameHeader
+    {
+        uint8_t id, flags;
+        uint32_t correlationId;
+        // of the payload within the frame
+        int offset, size;
+    };
+    static bool parseHeader(int version, const char *data, int size, FrameHeader *header, MessageError *error);
+    static std::shared_ptr<Message> decodePayload(uint8_t id, uint8_t flags, const char *data, int size, MessageError *error);
+
+    // correlationFlags/correlationId are what goes out with this send, the
+    // ones a message was received with are never sent again
+    void prepare(int version, String &header, String &value, uint8_t correlationFlags = 0, uint32_t correlationId = 0) const;
     enum { HeaderExtra = Serializer::sizeOf<int>() + Serializer::sizeOf<uint8_t>() + Serializer::sizeOf<uint8_t>() };
-    inline void encodeHeader(Serializer &serializer, uint32_t size, int version) const
+    static size_t headerExtra(uint8_t correlationFlags = 0) { return HeaderExtra + (correlationFlags ? Serializer::sizeOf<uint32_t>() : 0); }
+    inline void encodeHeader(Serializer &serializer, uint32_t size, int version,
+                             uint8_t correlationFlags = 0, uint32_t correlationId = 0) const
     {
+        const uint8_t flags = (mFlags & ~(Request|Reply)) | correlationFlags;
         size += HeaderExtra;
+        if (flags & (Request|Reply))
+            size += Serializer::sizeOf<uint32_t>();
         serializer.write(&size, sizeof(size));
-        serializer << version << static_cast<uint8_t>(mMessageId) << mFlags;
+        serializer << version << static_cast<uint8_t>(mMessageId) << flags;
+        if (flags & (Request|Reply))
+            serializer << correlationId;
     }
     friend class Connection;
+    friend class LazyMessage;
 
     uint8_t mMessageId;
     uint8_t mFlags;
+    bool mLazy;
+    // what the message was received with
+    uint8_t mCorrelationFlags;
+    uint32_t mCorrelationId;
     mutable int mVersion;
     mutable String mHeader;
     mutable String mValue;
 
-    static Map<uint8_t, MessageCreatorBase *> sFactory;
-    static std::mutex sMutex;
+    // indexed by message id, written once in registerMessage() and only
+    // read afterwards so lookups in create() don't need a lock
+    static std::atomic<MessageCreatorBase *> sFactory[256];
+    static const bool sBuiltinMessages;
 
 };
 
+template <typename T>
+std::atomic<size_t> Message::MessagePool<T>::sSize(0);
+
 #endif // MESSAGE_H
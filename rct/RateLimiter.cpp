@@ -0,0 +1,72 @@
+#include "RateLimiter.h"
+
+#include <math.h>
+#include <algorithm>
+
+#include "Rct.h"
+
+RateLimiter::RateLimiter(uint64_t bytesPerSecond, uint64_t burst)
+    : mRate(0), mBurst(0), mTokens(0), mLast(0)
+{
+    setRate(bytesPerSecond, burst);
+}
+
+void RateLimiter::setRate(uint64_t bytesPerSecond, uint64_t burst)
+{
+    enum { MinBurst = 4096 };
+    std::lock_guard<std::mutex> locker(mMutex);
+    mRate = bytesPerSecond;
+    mBurst = burst ? burst : std::max<uint64_t>(bytesPerSecond / 10, MinBurst);
+    mTokens = static_cast<double>(mBurst);
+    mLast = Rct::monoMs();
+}
+
+uint64_t RateLimiter::rate() const
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    return mRate;
+}
+
+uint64_t RateLimiter::burst() const
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    return mBurst;
+}
+
+void RateLimiter::refill(uint64_t now)
+{
+    if (now > mLast) {
+        mTokens = std::min(mTokens + static_cast<double>(now - mLast) * mRate / 1000.0, static_cast<double>(mBurst));
+        mLast = now;
+    }
+}
+
+uint64_t RateLimiter::available()
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (!mRate)
+        return UINT64_MAX;
+    refill(Rct::monoMs());
+    return mTokens > 0 ? static_cast<uint64_t>(mTokens) : 0;
+}
+
+void RateLimiter::consume(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (!mRate)
+        return;
+    refill(Rct::monoMs());
+    mTokens -= static_cast<double>(bytes);
+}
+
+int RateLimiter::delay(uint64_t bytes)
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (!mRate)
+        return 0;
+    refill(Rct::monoMs());
+    const double missing = static_cast<double>(std::min(bytes, mBurst)) - mTokens;
+    if (missing <= 0)
+        return 0;
+    return static_cast<int>(ceil(missing * 1000.0 / mRate));
+}
@@ -0,0 +1,50 @@
+#ifndef RateLimiter_h
+#define RateLimiter_h
+
+#include <stdint.h>
+#include <mutex>
+
+/**
+ * Token bucket for capping bandwidth. It fills up with rate() bytes per
+ * second and holds at most burst() bytes, anything that goes through takes
+ * its size out of it.
+ *
+ * SocketClient::setReadLimiter() and setWriteLimiter() take one. Give the
+ * same limiter to several sockets, e.g. all connections of a tenant, to
+ * cap them together. The sockets may belong to different threads.
+ */
+class RateLimiter
+{
+public:
+    /**
+     * A rate of 0 doesn't limit anything. The burst defaults to a tenth
+     * of a second's worth but at least 4K.
+     */
+    RateLimiter(uint64_t bytesPerSecond = 0, uint64_t burst = 0);
+
+    // starts out full again
+    void setRate(uint64_t bytesPerSecond, uint64_t burst = 0);
+    uint64_t rate() const;
+    uint64_t burst() const;
+
+    // bytes that may go through right away
+    uint64_t available();
+    /**
+     * Takes bytes out of the bucket. It can go below empty, e.g. for a
+     * datagram that can't be split up, then nothing goes through until the
+     * debt is made up for.
+     */
+    void consume(uint64_t bytes);
+    // ms until bytes, or burst() if that's less, are available
+    int delay(uint64_t bytes);
+
+private:
+    void refill(uint64_t now);
+
+    mutable std::mutex mMutex;
+    uint64_t mRate, mBurst;
+    double mTokens;
+    uint64_t mLast;
+};
+
+#endif
@@ -40,6 +40,7 @@
 #include <mach/mach_time.h>
 #endif
 
+#include "DnsResolver.h"
 #include "Log.h"
 
 struct timeval;
@@ -486,92 +487,18 @@ bool isIP(const String& addr, LookupMode mode)
 
 String addrLookup(const String &address, LookupMode mode, bool *ok)
 {
-    union {
-        sockaddr_storage sockaddrStorage;
-        sockaddr_in6 sockaddr6;
-        sockaddr_in sockaddr4;
-        sockaddr addr;
-    };
-    memset(&sockaddrStorage, 0, sizeof(sockaddr_storage));
-    size_t sz;
-    if (mode == Auto)
-        mode = address.contains(':') ? IPv6 : IPv4;
-    if (mode == IPv6) {
-        if (inet_pton(AF_INET6, address.c_str(), &sockaddr6.sin6_addr) != 1) {
-            if (ok)
-                *ok = false;
-            return address;
-        }
-        sockaddrStorage.ss_family = AF_INET6;
-        sz = sizeof(sockaddr_in6);
-    } else {
-        if (inet_pton(AF_INET, address.c_str(), &sockaddr4.sin_addr) != 1) {
-            if (ok)
-                *ok = false;
-            return address;
-        }
-        sockaddrStorage.ss_family = AF_INET;
-        sz = sizeof(sockaddr_in);
-    }
-    String out(NI_MAXHOST, '\0');
-    if (getnameinfo(&addr, sz, out.data(), NI_MAXHOST, nullptr, 0, 0) != 0) {
-        if (ok)
-            *ok = false;
-        // bad
-        return address;
-    }
-    out.resize(strlen(out.c_str()));
+    const String name = DnsResolver::instance().reverseLookup(address, mode);
     if (ok)
-        *ok = true;
-
-    return out;
+        *ok = !name.isEmpty();
+    return name.isEmpty() ? address : name;
 }
 
 String nameLookup(const String& name, LookupMode mode, bool *ok)
 {
-    assert(mode == Auto);
-    String out(INET6_ADDRSTRLEN, '\0');
-    addrinfo hints, *p, *res;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = (mode == IPv6) ? AF_INET6 : AF_INET;
-    hints.ai_socktype = SOCK_STREAM;
-
-    if (getaddrinfo(name.c_str(), nullptr, &hints, &res) != 0) {
-        if (ok)
-            *ok = false;
-        // bad
-        return name;
-    }
-
-    bool found = false;
-    for (p = res; p; p = p->ai_next) {
-        if (mode == IPv4 && p->ai_family == AF_INET) {
-            sockaddr_in* addr = reinterpret_cast<sockaddr_in*>(p->ai_addr);
-            inet_ntop(AF_INET, &addr->sin_addr, out.data(), out.size());
-            out.resize(strlen(out.c_str()));
-            found = true;
-            break;
-        } else if (mode == IPv6 && p->ai_family == AF_INET6) {
-            sockaddr_in6* addr = reinterpret_cast<sockaddr_in6*>(p->ai_addr);
-            inet_ntop(AF_INET6, &addr->sin6_addr, out.data(), out.size());
-            out.resize(strlen(out.c_str()));
-            found = true;
-            break;
-        }
-    }
-
-    freeaddrinfo(res);
-
-    if (!found) {
-        if (ok)
-            *ok = false;
-        return name;
-    }
+    const List<DnsResolver::Address> addresses = DnsResolver::instance().lookup(name, mode);
     if (ok)
-        *ok = true;
-
-    return out;
+        *ok = !addresses.isEmpty();
+    return addresses.isEmpty() ? name : addresses.first().toString();
 }
 
 String strerror(int error)
@@ -3,16 +3,24 @@
 
 // #define RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
 #include <assert.h>
+#include <fcntl.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <string.h>
 
+#include <algorithm>
+#include <memory>
 #include <utility>
 #include <string>
+#include <string_view>
+#include <type_traits>
 
+#include <rct/Buffer.h>
 #include <rct/Hash.h>
 #include <rct/List.h>
 #include <rct/Log.h>
 #include <rct/Map.h>
+#include <rct/MemoryMappedFile.h>
 #include <rct/Path.h>
 #include <rct/Rct.h>
 #include <rct/Set.h>
@@ -27,26 +35,106 @@ public:
         virtual ~Buffer() {}
         virtual bool write(const void *data, int len) = 0;
         virtual int pos() const = 0;
+        virtual bool flush() { return true; }
+    };
+
+    /**
+     * Size of the block that file backed serializers and deserializers
+     * buffer in user space. They only hand whole blocks to stdio so a
+     * large file costs a few thousand calls rather than one per field.
+     */
+    enum { FileBufferSize = 256 * 1024 };
+
+    /**
+     * Doesn't store anything, pos() is the number of bytes that would have
+     * been written.
+     */
+    class CountingBuffer : public Buffer
+    {
+    public:
+        CountingBuffer()
+            : mSize(0)
+        {}
+
+        virtual bool write(const void *, int len) override
+        {
+            mSize += len;
+            return true;
+        }
+        virtual int pos() const override { return mSize; }
+    private:
+        int mSize;
+    };
+
+    /**
+     * Writes into memory that's already there, e.g. a frame reserved in a
+     * SharedMemoryRing. Writing past size fails.
+     */
+    class MemoryBuffer : public Buffer
+    {
+    public:
+        MemoryBuffer(char *data, int size)
+            : mData(data), mSize(size), mPos(0)
+        {}
+
+        virtual bool write(const void *data, int len) override
+        {
+            if (len > mSize - mPos)
+                return false;
+            memcpy(mData + mPos, data, len);
+            mPos += len;
+            return true;
+        }
+        virtual int pos() const override { return mPos; }
+    private:
+        char *mData;
+        int mSize, mPos;
+    };
+
+    /**
+     * FixedEncoding writes integers and container sizes with their native
+     * width, CompactEncoding as LEB128 varints (zigzag encoded for signed
+     * types). Both sides have to agree, the values double as format
+     * versions so they can be stored alongside the data.
+     */
+    enum Encoding {
+        FixedEncoding = 0,
+        CompactEncoding = 1
     };
 
     Serializer(std::unique_ptr<Buffer> &&buffer)
-        : mError(false), mBuffer(std::move(buffer))
+        : mError(false), mEncoding(FixedEncoding), mBuffer(std::move(buffer))
     {}
 
     Serializer(std::string &out)
-        : mError(false), mBuffer(new StringBuffer(out))
+        : mError(false), mEncoding(FixedEncoding), mBuffer(new StringBuffer(out))
     {}
 
     Serializer(String &out)
-        : mError(false), mBuffer(new StringBuffer(out))
+        : mError(false), mEncoding(FixedEncoding), mBuffer(new StringBuffer(out))
     {}
 
     Serializer(FILE *f)
-        : mError(false), mBuffer(new FileBuffer(f))
+        : mError(false), mEncoding(FixedEncoding), mBuffer(new FileBuffer(f))
     {
         assert(f);
     }
 
+    void setEncoding(Encoding encoding) { mEncoding = encoding; }
+    Encoding encoding() const { return mEncoding; }
+
+    bool writeVarInt(uint64_t value)
+    {
+        unsigned char buf[10];
+        int len = 0;
+        while (value >= 0x80) {
+            buf[len++] = static_cast<unsigned char>(value) | 0x80;
+            value >>= 7;
+        }
+        buf[len++] = static_cast<unsigned char>(value);
+        return write(buf, len);
+    }
+
     bool write(const String &string)
     {
         return write(string.c_str(), string.size());
@@ -69,6 +157,22 @@ public:
         return mBuffer->pos();
     }
 
+    /**
+     * Writes out anything that is buffered. Serializers created with a
+     * FILE need to be flushed (or destroyed) before the FILE is used
+     * directly.
+     */
+    bool flush()
+    {
+        if (mError)
+            return false;
+        if (!mBuffer->flush()) {
+            mError = true;
+            return false;
+        }
+        return true;
+    }
+
     bool hasError() const { return mError; }
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     template <typename T>
@@ -106,46 +210,171 @@ private:
     {
     public:
         FileBuffer(FILE *f)
-            : mFile(f)
+            : mFile(f), mUsed(0)
         {
             assert(f);
         }
 
+        virtual ~FileBuffer()
+        {
+            flush();
+        }
+
         virtual bool write(const void *data, int len) override
         {
             assert(mFile);
-            const size_t ret = fwrite(data, sizeof(char), len, mFile);
-            return (ret == static_cast<size_t>(len));
+            if (mUsed + len > FileBufferSize) {
+                if (!flush())
+                    return false;
+                if (len >= FileBufferSize)
+                    return fwrite(data, sizeof(char), len, mFile) == static_cast<size_t>(len);
+            }
+            if (!mBuffer)
+                mBuffer.reset(new char[FileBufferSize]);
+            memcpy(mBuffer.get() + mUsed, data, len);
+            mUsed += len;
+            return true;
         }
 
         virtual int pos() const override
         {
-            return static_cast<int>(ftell(mFile));
+            return static_cast<int>(ftell(mFile)) + mUsed;
+        }
+
+        virtual bool flush() override
+        {
+            if (!mUsed)
+                return true;
+            const size_t ret = fwrite(mBuffer.get(), sizeof(char), mUsed, mFile);
+            const bool ok = ret == static_cast<size_t>(mUsed);
+            mUsed = 0;
+            return ok;
         }
     private:
         FILE *mFile;
+        std::unique_ptr<char[]> mBuffer;
+        int mUsed;
     };
 
     bool mError;
+    Encoding mEncoding;
     std::unique_ptr<Buffer> mBuffer;
 };
 
 class Deserializer
 {
 public:
+    /**
+     * Reads straight from data without copying it, data has to outlive
+     * the Deserializer and anything decoded with view().
+     */
     Deserializer(const char *data, int len, const char *key = "")
-        : mData(data), mLength(len), mPos(0), mFile(nullptr), mKey(key)
+        : mData(data), mLength(len), mPos(0), mFile(nullptr), mKey(key), mEncoding(Serializer::FixedEncoding),
+          mFileBufferPos(0), mFileBufferLength(0), mFileBufferCapacity(0)
     {}
 
+    /**
+     * Takes a copy of string, use the const char * constructor to read a
+     * string that is known to outlive the Deserializer.
+     */
     Deserializer(const String &string, const char *key = "")
         : mString(string), mData(mString.c_str()), mLength(mString.size()),
-          mPos(0), mFile(nullptr), mKey(key)
+          mPos(0), mFile(nullptr), mKey(key), mEncoding(Serializer::FixedEncoding),
+          mFileBufferPos(0), mFileBufferLength(0), mFileBufferCapacity(0)
+    {}
+
+    Deserializer(String &&string, const char *key = "")
+        : mString(std::move(string)), mData(mString.c_str()), mLength(mString.size()),
+          mPos(0), mFile(nullptr), mKey(key), mEncoding(Serializer::FixedEncoding),
+          mFileBufferPos(0), mFileBufferLength(0), mFileBufferCapacity(0)
+    {}
+
+    /**
+     * Shares buffer, readRef() and BufferRefs that are decoded hand out
+     * slices of it instead of copies.
+     */
+    Deserializer(const BufferRef &buffer, const char *key = "")
+        : mRef(buffer), mData(mRef.isEmpty() ? "" : reinterpret_cast<const char *>(mRef.data())),
+          mLength(mRef.size()), mPos(0), mFile(nullptr), mKey(key), mEncoding(Serializer::FixedEncoding),
+          mFileBufferPos(0), mFileBufferLength(0), mFileBufferCapacity(0)
     {}
 
+    /**
+     * Reads from the mapping without copying it, file has to stay open
+     * for as long as the Deserializer and anything decoded with view() is
+     * used.
+     */
+    Deserializer(const MemoryMappedFile &file, const char *key = "")
+        : mData(file.filePtr<char>()), mLength(file.size()), mPos(0), mFile(nullptr), mKey(key),
+          mEncoding(Serializer::FixedEncoding), mFileBufferPos(0), mFileBufferLength(0), mFileBufferCapacity(0)
+    {
+        assert(file.isOpen());
+    }
+
+    /**
+     * Reads ahead in blocks of Serializer::FileBufferSize. The FILE is
+     * positioned after the last value that was read when the Deserializer
+     * is destroyed.
+     */
     Deserializer(FILE *file, const char *key = "")
-        : mData(nullptr), mLength(0), mFile(file), mKey(key)
+        : mData(nullptr), mLength(0), mPos(0), mFile(file), mKey(key), mEncoding(Serializer::FixedEncoding),
+          mFileBufferPos(0), mFileBufferLength(0), mFileBufferCapacity(0)
     {
         assert(file);
+        mPos = std::max<long>(ftell(file), 0);
+#ifdef POSIX_FADV_SEQUENTIAL
+        posix_fadvise(fileno(file), 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    }
+
+    ~Deserializer()
+    {
+        if (mFile && mFileBufferPos < mFileBufferLength)
+            fseek(mFile, mFileBufferPos - mFileBufferLength, SEEK_CUR);
+    }
+
+    void setEncoding(Serializer::Encoding encoding) { mEncoding = encoding; }
+    Serializer::Encoding encoding() const { return mEncoding; }
+
+    bool readVarInt(uint64_t &value)
+    {
+        if (mData) {
+            const unsigned char *data = reinterpret_cast<const unsigned char *>(mData) + mPos;
+            const int available = std::min(mLength - mPos, 10);
+            // most values are small
+            if (available > 0 && *data < 0x80) {
+                value = *data;
+                ++mPos;
+                return true;
+            }
+            uint64_t result = 0;
+            for (int i = 0; i < available; ++i) {
+                result |= static_cast<uint64_t>(data[i] & 0x7f) << (i * 7);
+                if (!(data[i] & 0x80)) {
+                    mPos += i + 1;
+                    value = result;
+                    return true;
+                }
+            }
+            error() << "Invalid varint at" << mPos << mLength << mKey;
+            mPos = mLength;
+        } else {
+            assert(mFile);
+            uint64_t result = 0;
+            for (int i = 0; i < 10; ++i) {
+                unsigned char byte;
+                if (!read(&byte, 1))
+                    break;
+                result |= static_cast<uint64_t>(byte & 0x7f) << (i * 7);
+                if (!(byte & 0x80)) {
+                    value = result;
+                    return true;
+                }
+            }
+            error() << "Invalid varint" << mKey;
+        }
+        value = 0;
+        return false;
     }
 
     int peek(char *target, int len)
@@ -157,14 +386,80 @@ public:
                 return len;
             } else {
                 assert(mFile);
-                const int r = fread(target, sizeof(char), len, mFile);
-                fseek(mFile, -r, SEEK_CUR);
+                const int r = std::min(fillFileBuffer(len), len);
+                memcpy(target, mFileBuffer.get() + mFileBufferPos, r);
                 return r;
             }
         }
         return 0;
     }
 
+    /**
+     * Returns a pointer to the next len bytes and moves past them. Only
+     * Deserializers that read from memory can do this, for files it
+     * returns nullptr.
+     */
+    const char *view(int len)
+    {
+        if (!mData || mPos + len > mLength) {
+            if (mData)
+                error() << "Can't view" << len << "bytes at" << mPos << mLength << mKey;
+            return nullptr;
+        }
+        const char *ret = mData + mPos;
+        mPos += len;
+        return ret;
+    }
+
+    /**
+     * Reads the next len bytes as a BufferRef, a slice of the buffer the
+     * Deserializer was made with or a copy otherwise.
+     */
+    BufferRef readRef(int len)
+    {
+        if (!mRef.isEmpty()) {
+            const int pos = mPos;
+            if (!view(len))
+                return BufferRef();
+            return mRef.slice(pos, len);
+        }
+        ::Buffer buffer;
+        if (len > 0) {
+            buffer.reserve(len);
+            buffer.resize(read(buffer.data(), len));
+        }
+        return BufferRef(std::move(buffer));
+    }
+
+    /**
+     * Moves past len bytes without reading them. Use skip<T>() to skip a
+     * serialized value.
+     */
+    bool skip(int len)
+    {
+        if (mData) {
+            if (mPos + len > mLength) {
+                error() << "Can't skip" << len << "bytes at" << mPos << mLength << mKey;
+                mPos = mLength;
+                return false;
+            }
+            mPos += len;
+            return true;
+        }
+        assert(mFile);
+        const int buffered = std::min(mFileBufferLength - mFileBufferPos, len);
+        mFileBufferPos += buffered;
+        mPos += buffered;
+        if (buffered < len) {
+            if (fseek(mFile, len - buffered, SEEK_CUR))
+                return false;
+            mPos += len - buffered;
+        }
+        return true;
+    }
+
+    template <typename T> bool skip();
+
     int read(void *target, int len)
     {
         static const bool dump = getenv("RCT_SERIALIZER_DUMP");
@@ -183,15 +478,32 @@ public:
                 return len;
             } else {
                 assert(mFile);
-                return fread(target, sizeof(char), len, mFile);
+                char *out = static_cast<char *>(target);
+                int r = std::min(mFileBufferLength - mFileBufferPos, len);
+                if (r) {
+                    memcpy(out, mFileBuffer.get() + mFileBufferPos, r);
+                    mFileBufferPos += r;
+                }
+                if (r < len) {
+                    if (len - r >= Serializer::FileBufferSize) {
+                        r += fread(out + r, sizeof(char), len - r, mFile);
+                    } else {
+                        const int count = std::min(fillFileBuffer(len - r), len - r);
+                        memcpy(out + r, mFileBuffer.get(), count);
+                        mFileBufferPos += count;
+                        r += count;
+                    }
+                }
+                mPos += r;
+                return r;
             }
         }
         return 0;
     }
 
-    bool atEnd() const { return mPos == mLength; }
+    bool atEnd() const { return mFile ? mPos >= length() : mPos == mLength; }
 
-    int pos() const { return mFile ? ftell(mFile) : mPos; }
+    int pos() const { return mPos; }
     int length() const { return mFile ? Rct::fileSize(mFile) : mLength; }
 #ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
     template <typename T>
@@ -210,12 +522,39 @@ public:
     template <typename T> bool decodeType() { return true; }
 #endif
 private:
+    // makes at least len bytes available in mFileBuffer unless the file
+    // ends first, returns the number of bytes available
+    int fillFileBuffer(int len)
+    {
+        int available = mFileBufferLength - mFileBufferPos;
+        if (available >= len)
+            return available;
+        const int capacity = std::max<int>(len, Serializer::FileBufferSize);
+        if (!mFileBuffer || capacity > mFileBufferCapacity) {
+            char *buffer = new char[capacity];
+            if (available)
+                memcpy(buffer, mFileBuffer.get() + mFileBufferPos, available);
+            mFileBuffer.reset(buffer);
+            mFileBufferCapacity = capacity;
+        } else if (available && mFileBufferPos) {
+            memmove(mFileBuffer.get(), mFileBuffer.get() + mFileBufferPos, available);
+        }
+        mFileBufferPos = 0;
+        mFileBufferLength = available;
+        mFileBufferLength += fread(mFileBuffer.get() + available, sizeof(char), mFileBufferCapacity - available, mFile);
+        return mFileBufferLength;
+    }
+
     String mString;
+    BufferRef mRef;
     const char *mData;
     const int mLength;
     int mPos;
     FILE *mFile;
     const char *mKey;
+    Serializer::Encoding mEncoding;
+    std::unique_ptr<char[]> mFileBuffer;
+    int mFileBufferPos, mFileBufferLength, mFileBufferCapacity;
 };
 
 template <typename T>
@@ -237,6 +576,41 @@ struct FixedSize
 {
     static constexpr size_t value = 0;
 };
+
+// integers wider than a byte are written as varints with CompactEncoding
+template <typename T, bool = std::is_integral<T>::value && (sizeof(T) > 1)>
+struct VarInt
+{
+    static bool encode(Serializer &, const T &) { return false; }
+    static bool decode(Deserializer &, T &) { return false; }
+};
+
+template <typename T>
+struct VarInt<T, true>
+{
+    static bool encode(Serializer &s, const T &t)
+    {
+        if (std::is_signed<T>::value) {
+            const int64_t value = t;
+            s.writeVarInt((static_cast<uint64_t>(value) << 1) ^ static_cast<uint64_t>(value >> 63));
+        } else {
+            s.writeVarInt(t);
+        }
+        return true;
+    }
+    static bool decode(Deserializer &s, T &t)
+    {
+        uint64_t value;
+        s.readVarInt(value);
+        if (std::is_signed<T>::value) {
+            t = static_cast<T>(static_cast<int64_t>((value >> 1) ^ (~(value & 1) + 1)));
+        } else {
+            t = static_cast<T>(value);
+        }
+        return true;
+    }
+};
+
 #define DECLARE_NATIVE_TYPE(T)                                      \
     template <> struct FixedSize<T>                                 \
     {                                                               \
@@ -245,6 +619,10 @@ struct FixedSize
     template <> inline Serializer &operator<<(Serializer &s,        \
                                               const T &t)           \
     {                                                               \
+        if (s.encoding() == Serializer::CompactEncoding             \
+            && VarInt<T>::encode(s, t)) {                           \
+            return s;                                               \
+        }                                                           \
         s.encodeType<T>();                                          \
         union {                                                     \
             T orig;                                                 \
@@ -257,6 +635,10 @@ struct FixedSize
     template <> inline Deserializer &operator>>(Deserializer &s,    \
                                                 T &t)               \
     {                                                               \
+        if (s.encoding() == Serializer::CompactEncoding             \
+            && VarInt<T>::decode(s, t)) {                           \
+            return s;                                               \
+        }                                                           \
         if (s.decodeType<T>()) {                                    \
             union {                                                 \
                 T value;                                            \
@@ -294,6 +676,17 @@ inline Serializer &operator<<(Serializer &s, const String &string)
     return s;
 }
 
+// same encoding as a String
+template <>
+inline Serializer &operator<<(Serializer &s, const BufferRef &buffer)
+{
+    const uint32_t size = buffer.size();
+    s << size;
+    if (size)
+        s.write(buffer.data(), size);
+    return s;
+}
+
 template <>
 inline Serializer &operator<<(Serializer &s, const Path &path)
 {
@@ -311,14 +704,228 @@ inline Serializer &operator<<(Serializer &s, const LogLevel &level)
     return s;
 }
 
+/**
+ * Types that are serialized as their in-memory representation, see
+ * DECLARE_NATIVE_TYPE (which can also be used for POD structs). Containers
+ * of these are written and read in blocks instead of element by element.
+ * Native types are always written in host byte order so this produces the
+ * same bytes.
+ */
 template <typename T>
-Serializer &operator<<(Serializer &s, const List<T> &list)
+struct BlockSerializable
+{
+#ifdef RCT_SERIALIZER_VERIFY_PRIMITIVE_SIZE
+    static constexpr bool value = false;
+#else
+    static constexpr bool value = (FixedSize<T>::value == sizeof(T) && std::is_trivially_copyable<T>::value
+                                   && !std::is_same<T, bool>::value);
+#endif
+    // integers are varints with CompactEncoding
+    static bool canUse(Serializer::Encoding encoding)
+    {
+        return value && (encoding == Serializer::FixedEncoding || !(std::is_integral<T>::value && sizeof(T) > 1));
+    }
+};
+
+namespace SerializerBlock {
+enum { MaxChunk = 1024 * 1024 * 1024, BatchBytes = 16 * 1024 };
+
+// how many elements of stride bytes go in a batch, sets and hashes of
+// elements that are too big for one go element by element
+constexpr size_t batchCount(size_t stride) { return BatchBytes / stride; }
+
+inline void write(Serializer &s, const void *data, size_t bytes)
+{
+    const char *ch = static_cast<const char *>(data);
+    while (bytes) {
+        const int chunk = static_cast<int>(std::min<size_t>(bytes, MaxChunk));
+        s.write(ch, chunk);
+        ch += chunk;
+        bytes -= chunk;
+    }
+}
+
+inline void read(Deserializer &s, void *data, size_t bytes)
+{
+    char *ch = static_cast<char *>(data);
+    while (bytes) {
+        const int chunk = static_cast<int>(std::min<size_t>(bytes, MaxChunk));
+        s.read(ch, chunk);
+        ch += chunk;
+        bytes -= chunk;
+    }
+}
+
+template <typename T>
+inline void serialize(Serializer &s, const List<T> &list, std::false_type)
 {
     const uint32_t size = list.size();
-    s << size;
     for (uint32_t i=0; i<size; ++i) {
         s << list.at(i);
     }
+}
+
+template <typename T>
+inline void serialize(Serializer &s, const List<T> &list, std::true_type)
+{
+    if (BlockSerializable<T>::canUse(s.encoding())) {
+        write(s, list.data(), list.size() * sizeof(T));
+    } else {
+        serialize(s, list, std::false_type());
+    }
+}
+
+template <typename T>
+inline void deserialize(Deserializer &s, List<T> &list, std::false_type)
+{
+    const uint32_t size = list.size();
+    for (uint32_t i=0; i<size; ++i) {
+        s >> list[i];
+    }
+}
+
+template <typename T>
+inline void deserialize(Deserializer &s, List<T> &list, std::true_type)
+{
+    if (BlockSerializable<T>::canUse(s.encoding())) {
+        read(s, list.data(), list.size() * sizeof(T));
+    } else {
+        deserialize(s, list, std::false_type());
+    }
+}
+
+// sets and hashes aren't contiguous, they go through a buffer on the stack
+// in batches of up to BatchBytes
+template <typename T>
+inline void serialize(Serializer &s, const Set<T> &set, std::false_type)
+{
+    for (typename Set<T>::const_iterator it = set.begin(); it != set.end(); ++it) {
+        s << *it;
+    }
+}
+
+template <typename T>
+inline void serialize(Serializer &s, const Set<T> &set, std::true_type)
+{
+    enum { Batch = batchCount(sizeof(T)) };
+    if (!BlockSerializable<T>::canUse(s.encoding())) {
+        serialize(s, set, std::false_type());
+        return;
+    }
+    alignas(T) char buffer[Batch * sizeof(T)];
+    size_t count = 0;
+    for (const T &t : set) {
+        memcpy(buffer + count * sizeof(T), &t, sizeof(T));
+        if (++count == Batch) {
+            write(s, buffer, sizeof(buffer));
+            count = 0;
+        }
+    }
+    if (count)
+        write(s, buffer, count * sizeof(T));
+}
+
+template <typename T>
+inline void deserialize(Deserializer &s, Set<T> &set, uint32_t size, std::false_type)
+{
+    T t;
+    for (uint32_t i=0; i<size; ++i) {
+        s >> t;
+        set.insert(t);
+    }
+}
+
+template <typename T>
+inline void deserialize(Deserializer &s, Set<T> &set, uint32_t size, std::true_type)
+{
+    enum { Batch = batchCount(sizeof(T)) };
+    if (!BlockSerializable<T>::canUse(s.encoding())) {
+        deserialize(s, set, size, std::false_type());
+        return;
+    }
+    alignas(T) char buffer[Batch * sizeof(T)];
+    while (size) {
+        const uint32_t count = std::min<uint32_t>(size, Batch);
+        read(s, buffer, count * sizeof(T));
+        // written in order so hinting at the end makes this amortized O(1)
+        for (uint32_t i=0; i<count; ++i)
+            set.std::set<T>::insert(set.end(), *reinterpret_cast<const T *>(buffer + i * sizeof(T)));
+        size -= count;
+    }
+}
+
+template <typename Key, typename Value>
+inline void serialize(Serializer &s, const Hash<Key, Value> &hash, std::false_type)
+{
+    for (typename Hash<Key, Value>::const_iterator it = hash.begin(); it != hash.end(); ++it) {
+        s << it->first << it->second;
+    }
+}
+
+template <typename Key, typename Value>
+inline void serialize(Serializer &s, const Hash<Key, Value> &hash, std::true_type)
+{
+    enum { Stride = sizeof(Key) + sizeof(Value), Batch = batchCount(Stride) };
+    if (!BlockSerializable<Key>::canUse(s.encoding()) || !BlockSerializable<Value>::canUse(s.encoding())) {
+        serialize(s, hash, std::false_type());
+        return;
+    }
+    char buffer[Batch * Stride];
+    char *pos = buffer;
+    for (const auto &it : hash) {
+        memcpy(pos, &it.first, sizeof(Key));
+        memcpy(pos + sizeof(Key), &it.second, sizeof(Value));
+        pos += Stride;
+        if (pos == buffer + sizeof(buffer)) {
+            write(s, buffer, sizeof(buffer));
+            pos = buffer;
+        }
+    }
+    if (pos != buffer)
+        write(s, buffer, pos - buffer);
+}
+
+template <typename Key, typename Value>
+inline void deserialize(Deserializer &s, Hash<Key, Value> &hash, uint32_t size, std::false_type)
+{
+    Key key;
+    Value value;
+    for (uint32_t i=0; i<size; ++i) {
+        s >> key >> value;
+        hash[key] = value;
+    }
+}
+
+template <typename Key, typename Value>
+inline void deserialize(Deserializer &s, Hash<Key, Value> &hash, uint32_t size, std::true_type)
+{
+    enum { Stride = sizeof(Key) + sizeof(Value), Batch = batchCount(Stride) };
+    if (!BlockSerializable<Key>::canUse(s.encoding()) || !BlockSerializable<Value>::canUse(s.encoding())) {
+        deserialize(s, hash, size, std::false_type());
+        return;
+    }
+    char buffer[Batch * Stride];
+    Key key;
+    Value value;
+    while (size) {
+        const uint32_t count = std::min<uint32_t>(size, Batch);
+        read(s, buffer, count * Stride);
+        for (const char *pos = buffer; pos != buffer + count * Stride; pos += Stride) {
+            memcpy(&key, pos, sizeof(Key));
+            memcpy(&value, pos + sizeof(Key), sizeof(Value));
+            hash[key] = value;
+        }
+        size -= count;
+    }
+}
+}
+
+template <typename T>
+Serializer &operator<<(Serializer &s, const List<T> &list)
+{
+    const uint32_t size = list.size();
+    s << size;
+    SerializerBlock::serialize(s, list, std::integral_constant<bool, BlockSerializable<T>::value>());
     return s;
 }
 
@@ -349,9 +956,8 @@ Serializer &operator<<(Serializer &s, const Hash<Key, Value> &map)
 {
     const uint32_t size = map.size();
     s << size;
-    for (typename Hash<Key, Value>::const_iterator it = map.begin(); it != map.end(); ++it) {
-        s << it->first << it->second;
-    }
+    SerializerBlock::serialize(s, map, std::integral_constant<bool, BlockSerializable<Key>::value && BlockSerializable<Value>::value
+                                                          && SerializerBlock::batchCount(sizeof(Key) + sizeof(Value))>());
     return s;
 }
 
@@ -378,9 +984,7 @@ Serializer &operator<<(Serializer &s, const Set<T> &set)
 {
     const uint32_t size = set.size();
     s << size;
-    for (typename Set<T>::const_iterator it = set.begin(); it != set.end(); ++it) {
-        s << *it;
-    }
+    SerializerBlock::serialize(s, set, std::integral_constant<bool, BlockSerializable<T>::value && SerializerBlock::batchCount(sizeof(T))>());
     return s;
 }
 
@@ -424,12 +1028,9 @@ Deserializer &operator>>(Deserializer &s, Hash<Key, Value> &map)
     s >> size;
     map.clear();
     if (size) {
-        Key key;
-        Value value;
-        for (uint32_t i=0; i<size; ++i) {
-            s >> key >> value;
-            map[key] = value;
-        }
+        map.reserve(size);
+        SerializerBlock::deserialize(s, map, size, std::integral_constant<bool, BlockSerializable<Key>::value && BlockSerializable<Value>::value
+                                                                  && SerializerBlock::batchCount(sizeof(Key) + sizeof(Value))>());
     }
     return s;
 }
@@ -442,7 +1043,8 @@ Deserializer &operator>>(Deserializer &s, Flags<T> &flags)
         s >> value;
         flags = Flags<T>::construct(value);
     } else {
-        int value;
+        // what operator<< writes, compact encoding zigzags signed values
+        uint32_t value;
         s >> value;
         flags = Flags<T>::construct(value);
     }
@@ -454,12 +1056,10 @@ Deserializer &operator>>(Deserializer &s, List<T> &list)
 {
     uint32_t size;
     s >> size;
-    if (size) {
-        list.resize(size);
-        for (uint32_t i=0; i<size; ++i) {
-            s >> list[i];
-        }
-    }
+    // an empty list has to clear whatever list held before
+    list.resize(size);
+    if (size)
+        SerializerBlock::deserialize(s, list, std::integral_constant<bool, BlockSerializable<T>::value>());
     return s;
 }
 
@@ -469,13 +1069,8 @@ Deserializer &operator>>(Deserializer &s, Set<T> &set)
     set.clear();
     uint32_t size;
     s >> size;
-    if (size) {
-        T t;
-        for (uint32_t i=0; i<size; ++i) {
-            s >> t;
-            set.insert(t);
-        }
-    }
+    if (size)
+        SerializerBlock::deserialize(s, set, size, std::integral_constant<bool, BlockSerializable<T>::value && SerializerBlock::batchCount(sizeof(T))>());
     return s;
 }
 
@@ -491,6 +1086,15 @@ inline Deserializer &operator>>(Deserializer &s, String &string)
     return s;
 }
 
+template <>
+inline Deserializer &operator>>(Deserializer &s, BufferRef &buffer)
+{
+    uint32_t size;
+    s >> size;
+    buffer = s.readRef(size);
+    return s;
+}
+
 template <typename First, typename Second>
 Deserializer &operator>>(Deserializer &s, std::pair<First, Second> &pair)
 {
@@ -510,6 +1114,128 @@ inline Deserializer &operator>>(Deserializer &s, Path &path)
     return s;
 }
 
+/**
+ * Decodes a String or Path in place. This only works with Deserializers
+ * that read from memory, for files the view is left empty.
+ */
+inline Deserializer &operator>>(Deserializer &s, std::string_view &view)
+{
+    uint32_t size;
+    s >> size;
+    view = std::string_view();
+    if (size) {
+        if (const char *data = s.view(size))
+            view = std::string_view(data, size);
+    }
+    return s;
+}
+
+/**
+ * Skips a value of type T, reading only the sizes that are needed to find
+ * the end of it. Types without a specialization are decoded and thrown
+ * away.
+ */
+template <typename T>
+struct DeserializerSkip
+{
+    static bool skip(Deserializer &s)
+    {
+        return skip(s, std::integral_constant<bool, BlockSerializable<T>::value>());
+    }
+    static bool skip(Deserializer &s, std::true_type)
+    {
+        if (BlockSerializable<T>::canUse(s.encoding()))
+            return s.skip(sizeof(T));
+        return skip(s, std::false_type());
+    }
+    static bool skip(Deserializer &s, std::false_type)
+    {
+        T t;
+        s >> t;
+        return true;
+    }
+};
+
+struct DeserializerSkipString
+{
+    static bool skip(Deserializer &s)
+    {
+        uint32_t size;
+        s >> size;
+        return s.skip(size);
+    }
+};
+
+template <> struct DeserializerSkip<String> : public DeserializerSkipString {};
+template <> struct DeserializerSkip<Path> : public DeserializerSkipString {};
+template <> struct DeserializerSkip<BufferRef> : public DeserializerSkipString {};
+
+template <typename T>
+struct DeserializerSkip<List<T> >
+{
+    static bool skip(Deserializer &s)
+    {
+        uint32_t size;
+        s >> size;
+        if (BlockSerializable<T>::canUse(s.encoding()))
+            return s.skip(size * sizeof(T));
+        for (uint32_t i=0; i<size; ++i) {
+            if (!DeserializerSkip<T>::skip(s))
+                return false;
+        }
+        return true;
+    }
+};
+
+template <typename T>
+struct DeserializerSkip<Set<T> >
+{
+    static bool skip(Deserializer &s)
+    {
+        uint32_t size;
+        s >> size;
+        if (BlockSerializable<T>::canUse(s.encoding()))
+            return s.skip(size * sizeof(T));
+        for (uint32_t i=0; i<size; ++i) {
+            if (!DeserializerSkip<T>::skip(s))
+                return false;
+        }
+        return true;
+    }
+};
+
+template <typename Key, typename Value>
+struct DeserializerSkip<Hash<Key, Value> >
+{
+    static bool skip(Deserializer &s)
+    {
+        uint32_t size;
+        s >> size;
+        if (BlockSerializable<Key>::canUse(s.encoding()) && BlockSerializable<Value>::canUse(s.encoding()))
+            return s.skip(size * (sizeof(Key) + sizeof(Value)));
+        for (uint32_t i=0; i<size; ++i) {
+            if (!DeserializerSkip<Key>::skip(s) || !DeserializerSkip<Value>::skip(s))
+                return false;
+        }
+        return true;
+    }
+};
+
+template <typename First, typename Second>
+struct DeserializerSkip<std::pair<First, Second> >
+{
+    static bool skip(Deserializer &s)
+    {
+        return DeserializerSkip<First>::skip(s) && DeserializerSkip<Second>::skip(s);
+    }
+};
+
+template <typename T>
+inline bool Deserializer::skip()
+{
+    return DeserializerSkip<T>::skip(*this);
+}
+
 inline Deserializer &operator>>(Deserializer &s, LogLevel &level)
 {
     int l;
@@ -0,0 +1,35 @@
+#ifndef SharedMemoryMessage_h
+#define SharedMemoryMessage_h
+
+#include <rct/Message.h>
+
+// Used by Connection to negotiate its shared memory transport
+class SharedMemoryMessage : public Message
+{
+public:
+    enum { MessageId = SharedMemoryMessageId };
+    enum Type {
+        Invalid,
+        Setup,
+        Accept,
+        Reject,
+        Switched
+    };
+
+    SharedMemoryMessage(Type type = Invalid, int key = -1, int capacity = 0)
+        : Message(MessageId), mType(type), mKey(key), mCapacity(capacity)
+    {
+    }
+
+    Type type() const { return static_cast<Type>(mType); }
+    int key() const { return mKey; }
+    int capacity() const { return mCapacity; }
+
+    virtual size_t encodedSize() const override { return sizeof(int) * 3; }
+    virtual void encode(Serializer &s) const override { s << mType << mKey << mCapacity; }
+    virtual void decode(Deserializer &d) override { d >> mType >> mKey >> mCapacity; }
+private:
+    int mType, mKey, mCapacity;
+};
+
+#endif
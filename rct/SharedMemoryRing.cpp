@@ -0,0 +1,103 @@
+#include "SharedMemoryRing.h"
+
+#include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <new>
+
+void SharedMemoryRing::attach(void *memory, size_t capacity, bool initialize)
+{
+    assert(memory);
+    assert(capacity && !(capacity & (capacity - 1)));
+    mHeader = static_cast<Header *>(memory);
+    mData = static_cast<char *>(memory) + sizeof(Header);
+    mCapacity = capacity;
+    if (initialize) {
+        new (mHeader) Header;
+        mHeader->head.store(0, std::memory_order_relaxed);
+        mHeader->tail.store(0, std::memory_order_relaxed);
+        mHeader->writerWaiting.store(0, std::memory_order_seq_cst);
+    }
+}
+
+size_t SharedMemoryRing::write(const void *data, size_t len, bool *wakeReader)
+{
+    assert(mHeader);
+    *wakeReader = false;
+    const uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+    const uint64_t tail = mHeader->tail.load(std::memory_order_acquire);
+    assert(head - tail <= mCapacity);
+    const size_t count = std::min<size_t>(len, mCapacity - (head - tail));
+    if (!count)
+        return 0;
+
+    const size_t offset = head & (mCapacity - 1);
+    const size_t first = std::min(count, mCapacity - offset);
+    memcpy(mData + offset, data, first);
+    if (first < count)
+        memcpy(mData, static_cast<const char *>(data) + first, count - first);
+
+    // seq_cst on both sides so that either we see the reader's final tail
+    // or the reader sees our new head before it goes to sleep
+    mHeader->head.store(head + count, std::memory_order_seq_cst);
+    *wakeReader = mHeader->tail.load(std::memory_order_seq_cst) == head;
+    return count;
+}
+
+char *SharedMemoryRing::reserve(size_t len)
+{
+    assert(mHeader);
+    const uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+    const uint64_t tail = mHeader->tail.load(std::memory_order_acquire);
+    assert(head - tail <= mCapacity);
+    const size_t offset = head & (mCapacity - 1);
+    if (len > mCapacity - (head - tail) || len > mCapacity - offset)
+        return nullptr;
+    return mData + offset;
+}
+
+void SharedMemoryRing::commit(size_t len, bool *wakeReader)
+{
+    assert(mHeader);
+    const uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+    // like write()
+    mHeader->head.store(head + len, std::memory_order_seq_cst);
+    *wakeReader = mHeader->tail.load(std::memory_order_seq_cst) == head;
+}
+
+bool SharedMemoryRing::waitForSpace()
+{
+    assert(mHeader);
+    mHeader->writerWaiting.store(1, std::memory_order_seq_cst);
+    const uint64_t head = mHeader->head.load(std::memory_order_relaxed);
+    if (head - mHeader->tail.load(std::memory_order_seq_cst) < mCapacity) {
+        mHeader->writerWaiting.store(0, std::memory_order_relaxed);
+        return true;
+    }
+    return false;
+}
+
+size_t SharedMemoryRing::readable(const char **data) const
+{
+    assert(mHeader);
+    const uint64_t tail = mHeader->tail.load(std::memory_order_relaxed);
+    const uint64_t head = mHeader->head.load(std::memory_order_seq_cst);
+    const size_t offset = tail & (mCapacity - 1);
+    *data = mData + offset;
+    return std::min<size_t>(head - tail, mCapacity - offset);
+}
+
+bool SharedMemoryRing::consume(size_t len)
+{
+    assert(mHeader);
+    const uint64_t tail = mHeader->tail.load(std::memory_order_relaxed);
+    assert(mHeader->head.load(std::memory_order_acquire) - tail >= len);
+    mHeader->tail.store(tail + len, std::memory_order_seq_cst);
+    return mHeader->writerWaiting.exchange(0, std::memory_order_seq_cst);
+}
+
+bool SharedMemoryRing::isEmpty() const
+{
+    assert(mHeader);
+    return mHeader->head.load(std::memory_order_seq_cst) == mHeader->tail.load(std::memory_order_relaxed);
+}
@@ -0,0 +1,88 @@
+#ifndef SharedMemoryRing_h
+#define SharedMemoryRing_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <atomic>
+
+/**
+ * Single producer, single consumer byte ring living in memory that is
+ * shared between two processes (see SharedMemory). The ring itself does no
+ * blocking, write() and consume() report when the other side has to be
+ * woken up and the caller does that, typically through an eventfd
+ * registered with the peer's EventLoop.
+ */
+class SharedMemoryRing
+{
+public:
+    SharedMemoryRing()
+        : mHeader(nullptr), mData(nullptr), mCapacity(0)
+    {}
+
+    /**
+     * @param capacity must be a power of two
+     */
+    static size_t segmentSize(size_t capacity) { return sizeof(Header) + capacity; }
+
+    /**
+     * Sets up the ring in memory which must be at least
+     * segmentSize(capacity) bytes. Only one of the two sides should pass
+     * initialize.
+     */
+    void attach(void *memory, size_t capacity, bool initialize);
+    bool isValid() const { return mHeader; }
+    size_t capacity() const { return mCapacity; }
+
+    // producer
+    /**
+     * Writes as much of data as there is room for and returns the number
+     * of bytes written. wakeReader is set if the reader might be waiting
+     * for data and needs to be notified.
+     */
+    size_t write(const void *data, size_t len, bool *wakeReader);
+    /**
+     * For writing straight into the ring, e.g. serializing a message.
+     * Returns where len bytes can go in one piece or null if there isn't
+     * room for them before the end of the ring. Nothing is visible to the
+     * reader until commit(len).
+     */
+    char *reserve(size_t len);
+    void commit(size_t len, bool *wakeReader);
+    /**
+     * Called by the producer when the ring is full. Returns true if space
+     * became available in the meantime, otherwise the reader will report
+     * that the writer needs to be woken up from consume().
+     */
+    bool waitForSpace();
+
+    // consumer
+    /**
+     * Returns the number of contiguous bytes available for reading at
+     * *data.
+     */
+    size_t readable(const char **data) const;
+    /**
+     * Releases len bytes back to the producer. Returns true if the writer
+     * is waiting for space and needs to be notified.
+     */
+    bool consume(size_t len);
+    bool isEmpty() const;
+
+private:
+    struct Header
+    {
+        // each index on its own cache line
+        std::atomic<uint64_t> head;
+        char headPadding[64 - sizeof(uint64_t)];
+        std::atomic<uint64_t> tail;
+        char tailPadding[64 - sizeof(uint64_t)];
+        std::atomic<uint32_t> writerWaiting;
+        char waitingPadding[64 - sizeof(uint32_t)];
+    };
+
+    Header *mHeader;
+    char *mData;
+    size_t mCapacity;
+};
+
+#endif
@@ -7,6 +7,7 @@
 #  include <arpa/inet.h>
 #  include <netdb.h>
 #  include <netinet/in.h>
+#  include <netinet/udp.h>
 #  include <sys/socket.h>
 #  include <sys/un.h>
 #endif
@@ -17,15 +18,26 @@
 #include <unistd.h>
 #include <errno.h>
 #include <cstdint>
+#include <deque>
 #include <map>
+#include <vector>
 
 #include "EventLoop.h"
+#include "Timer.h"
 #include "rct/rct-config.h"
 #include "Rct.h"
 #include "rct/Log.h"
 #include "rct/Buffer.h"
 #include "rct/SignalSlot.h"
 #include "rct/String.h"
+#include "rct/ZeroCopyCompletions.h"
+
+#ifdef HAVE_ZEROCOPY
+#  include <linux/errqueue.h>
+#endif
+#ifdef HAVE_SENDFILE
+#  include <sys/sendfile.h>
+#endif
 
 #ifdef NDEBUG
 struct Null { template <typename T> Null operator<<(const T &) { return *this; } };
@@ -34,21 +46,70 @@ struct Null { template <typename T> Null operator<<(const T &) { return *this; }
 #define DEBUG() if (mLogsEnabled) debug()
 #endif
 
+struct SocketClient::ConnectAttempts
+{
+    List<DnsResolver::Address> addresses;
+    size_t next { 0 };
+    // descriptors of attempts still in progress
+    List<std::pair<int, bool> > pending;
+    int timer { -1 };
+};
+
+struct SocketClient::ZeroCopy
+{
+    struct Chunk
+    {
+        BufferRef data;
+        size_t offset { 0 };
+        // sent with MSG_ZEROCOPY, data has to stay around until the send
+        // numbered lastSend has completed
+        bool zeroCopy { false }, pinned { false };
+        uint32_t lastSend { 0 };
+    };
+
+    // releases the chunks at the front that the kernel is done with
+    void release()
+    {
+        while (next) {
+            const Chunk &chunk = chunks.front();
+            if (chunk.pinned && !completions.isComplete(chunk.lastSend))
+                break;
+            chunks.pop_front();
+            --next;
+        }
+    }
+
+    size_t threshold { 0 };
+    // what's written after a chunk has been queued goes here too
+    std::deque<Chunk> chunks;
+    // index of the first chunk that hasn't been sent completely
+    size_t next { 0 };
+    size_t unsent { 0 };
+    uint32_t sends { 0 };
+    ZeroCopyCompletions completions;
+    bool copied { false };
+};
+
 SocketClient::SocketClient(unsigned int mode)
     : mSocketMode(mode), mBlocking(mode & Blocking), mWriteOffset(0)
 {
+    if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+        addToStatsGroup(loop->socketStats());
 }
 
 SocketClient::SocketClient(int f, unsigned int mode)
-    : mFd(f), mSocketState(Connected), mSocketMode(mode), mWriteOffset(0)
+    : mFd(f), mSocketState(Connected), mSocketMode(mode & ~Prepared), mWriteOffset(0)
 {
     assert(mFd >= 0);
+    if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+        addToStatsGroup(loop->socketStats());
 #ifdef HAVE_NOSIGPIPE
     int flags = 1;
     ::setsockopt(mFd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
 #endif
 #ifdef HAVE_CLOEXEC
-    setFlags(mFd, FD_CLOEXEC, F_GETFD, F_SETFD);
+    if (!(mode & Prepared))
+        setFlags(mFd, FD_CLOEXEC, F_GETFD, F_SETFD);
 #endif
     mBlocking = (mode & Blocking);
 
@@ -57,7 +118,7 @@ SocketClient::SocketClient(int f, unsigned int mode)
             loop->registerSocket(mFd, EventLoop::SocketRead,
                                  std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
 #ifndef _WIN32
-            if (!setFlags(mFd, O_NONBLOCK, F_GETFL, F_SETFL)) {
+            if (!(mode & Prepared) && !setFlags(mFd, O_NONBLOCK, F_GETFL, F_SETFL)) {
                 mSignalError(shared_from_this(), InitializeError);
                 close();
                 return;
@@ -70,16 +131,60 @@ SocketClient::SocketClient(int f, unsigned int mode)
 SocketClient::~SocketClient()
 {
     close();
+    if (!mStatsGroups.isEmpty()) {
+        const SocketStats final = stats();
+        for (const std::shared_ptr<SocketStatsGroup> &group : mStatsGroups)
+            group->remove(this, final);
+    }
 }
 
 void SocketClient::close()
 {
+#ifndef _WIN32
+    for (int fd : mFileDescriptors)
+        ::close(fd);
+    mFileDescriptors.clear();
+#endif
+    if (mConnect) {
+        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+            for (const std::pair<int, bool> &attempt : mConnect->pending)
+                loop->unregisterSocket(attempt.first);
+            if (mConnect->timer != -1)
+                loop->unregisterTimer(mConnect->timer);
+        }
+        for (const std::pair<int, bool> &attempt : mConnect->pending)
+            ::close(attempt.first);
+        mConnect.reset();
+        mSocketState = Disconnected;
+        mWriteWait = false;
+        mSocketPort = 0;
+        mAddress.clear();
+    }
     if (mFd == -1)
         return;
     mSocketState = Disconnected;
     if (!mBlocking) {
-        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
             loop->unregisterSocket(mFd);
+            if (mReadTimer != -1)
+                loop->unregisterTimer(mReadTimer);
+            if (mWriteTimer != -1)
+                loop->unregisterTimer(mWriteTimer);
+        }
+        mReadTimer = mWriteTimer = -1;
+        mReadThrottled = false;
+    }
+    if (mZeroCopy) {
+        readZeroCopyCompletions();
+        std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+        if (mZeroCopy->next && loop) {
+            // the kernel may still be sending from these and there's no
+            // telling when it's done once the descriptor is gone
+            enum { ZeroCopyLinger = 30000 };
+            std::shared_ptr<ZeroCopy> inFlight(std::move(mZeroCopy));
+            loop->registerTimer([inFlight](int) {}, ZeroCopyLinger, Timer::SingleShot);
+        }
+        mZeroCopy.reset();
     }
     ::close(mFd);
     mSocketPort = 0;
@@ -87,153 +192,188 @@ void SocketClient::close()
     mFd = -1;
 }
 
-class Resolver
-{
-public:
-    Resolver();
-    Resolver(const String& host, uint16_t port, const std::shared_ptr<SocketClient>& socket);
-    ~Resolver();
-
-    void resolve(const String& host, uint16_t port, const std::shared_ptr<SocketClient>& socket);
-
-    addrinfo* res;
-    sockaddr* addr;
-    size_t size;
-};
-
-Resolver::Resolver()
-    : res(nullptr), addr(nullptr), size(0)
+bool SocketClient::connect(const String& host, uint16_t port)
 {
+    std::shared_ptr<SocketClient> tcpSocket = shared_from_this();
+    DnsResolver &resolver = DnsResolver::instance();
+    List<DnsResolver::Address> addresses;
+    std::shared_ptr<EventLoop> loop = mBlocking ? std::shared_ptr<EventLoop>() : EventLoop::eventLoop();
+    if (!loop) {
+        addresses = resolver.lookup(host);
+    } else if (!resolver.cached(host, Rct::Auto, &addresses)) {
+        // writes are buffered until we're connected
+        mConnect.reset(new ConnectAttempts);
+        mSocketState = Connecting;
+        mSocketMode = Tcp;
+        mWriteWait = true;
+        mSocketPort = port;
+        mAddress = host;
+        std::weak_ptr<SocketClient> weak = tcpSocket;
+        resolver.lookup(host, Rct::Auto, [weak, port](const String &name, const List<DnsResolver::Address> &result) {
+                std::shared_ptr<SocketClient> socket = weak.lock();
+                // unless closed or connecting somewhere else by now
+                if (socket && socket->mConnect && socket->mConnect->addresses.isEmpty()
+                    && socket->mAddress == name && socket->mSocketPort == port) {
+                    socket->connect(result, port);
+                }
+            });
+        return true;
+    }
+    mSocketPort = port;
+    mAddress = host;
+    return connect(addresses, port);
 }
 
-Resolver::Resolver(const String& host, uint16_t port, const std::shared_ptr<SocketClient>& socket)
-    : res(nullptr), addr(nullptr), size(0)
+bool SocketClient::connect(const List<DnsResolver::Address> &addresses, uint16_t port)
 {
-    resolve(host, port, socket);
-}
+    std::shared_ptr<SocketClient> tcpSocket = shared_from_this();
+    if (addresses.isEmpty()) {
+        mSignalError(tcpSocket, DnsError);
+        close();
+        return false;
+    }
 
-void Resolver::resolve(const String& host, uint16_t port, const std::shared_ptr<SocketClient>& socket)
-{
-    // first, see if this parses as an IP mAddress
-    {
-        struct in_addr inaddr4;
-        struct in6_addr inaddr6;
-        struct { int af; void* dst; } addrs[2] = {
-            { AF_INET, &inaddr4 },
-            { AF_INET6, &inaddr6 }
-        };
-        for (int i = 0; i < 2; ++i) {
-            if (inet_pton(addrs[i].af, host.c_str(), addrs[i].dst) == 1) {
-                // yes, use that
-                if (addrs[i].af == AF_INET) {
-                    sockaddr_in* newaddr = new sockaddr_in;
-                    memset(newaddr, '\0', sizeof(sockaddr_in));
-                    memcpy(&newaddr->sin_addr, &inaddr4, sizeof(struct in_addr));
-                    newaddr->sin_family = AF_INET;
-                    newaddr->sin_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in);
-                } else {
-                    assert(addrs[i].af == AF_INET6);
-                    sockaddr_in6* newaddr = new sockaddr_in6;
-                    memset(newaddr, '\0', sizeof(sockaddr_in6));
-                    memcpy(&newaddr->sin6_addr, &inaddr6, sizeof(struct in6_addr));
-                    newaddr->sin6_family = AF_INET6;
-                    newaddr->sin6_port = htons(port);
-                    addr = reinterpret_cast<sockaddr*>(newaddr);
-                    size = sizeof(sockaddr_in6);
-                }
-                return;
+    std::shared_ptr<EventLoop> loop = mBlocking ? std::shared_ptr<EventLoop>() : EventLoop::eventLoop();
+    if (!loop) {
+        // blocking, one address after the other
+        const String host = mAddress;
+        for (DnsResolver::Address address : addresses) {
+            if (!init(address.family() == AF_INET6 ? (Tcp|IPv6) : Tcp))
+                break;
+            address.setPort(port);
+            int e;
+            eintrwrap(e, ::connect(mFd, address.sockAddress(), address.length));
+            if (e == 0) {
+                mSocketPort = port;
+                mAddress = host;
+                mSocketState = Connected;
+                signalConnected(tcpSocket);
+                return true;
             }
+            close();
         }
+        mSignalError(tcpSocket, ConnectError);
+        close();
+        return false;
     }
 
-    // not an ip mAddress, try to resolve it
-    addrinfo hints, *p;
-
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC; // AF_INET or AF_INET6 to force version
-    hints.ai_socktype = SOCK_STREAM;
+    if (!mConnect)
+        mConnect.reset(new ConnectAttempts);
+    mConnect->addresses = addresses;
+    for (DnsResolver::Address &address : mConnect->addresses)
+        address.setPort(port);
+    mSocketState = Connecting;
+    mSocketMode = Tcp;
+    mWriteWait = true;
+    startConnectAttempt();
+    return mConnect || mFd != -1;
+}
 
-    if (getaddrinfo(host.c_str(), nullptr, &hints, &res) != 0) {
-        // bad
-        socket->mSignalError(socket, SocketClient::DnsError);
-        socket->close();
-        return;
+void SocketClient::startConnectAttempt()
+{
+    assert(mConnect);
+    std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+    if (mConnect->timer != -1) {
+        loop->unregisterTimer(mConnect->timer);
+        mConnect->timer = -1;
     }
+    while (mConnect->next < mConnect->addresses.size()) {
+        const DnsResolver::Address &address = mConnect->addresses.at(mConnect->next++);
+        const bool ipv6 = address.family() == AF_INET6;
+        const int fd = ::socket(address.family(), SOCK_STREAM, 0);
+        if (fd == -1)
+            continue;
+#ifdef HAVE_NOSIGPIPE
+        int flags = 1;
+        ::setsockopt(fd, SOL_SOCKET, SO_NOSIGPIPE, (void *)&flags, sizeof(int));
+#endif
+#ifdef HAVE_CLOEXEC
+        setFlags(fd, FD_CLOEXEC, F_GETFD, F_SETFD);
+#endif
+#ifndef _WIN32
+        if (!setFlags(fd, O_NONBLOCK, F_GETFL, F_SETFL)) {
+            ::close(fd);
+            continue;
+        }
+#endif
+        int e;
+        eintrwrap(e, ::connect(fd, address.sockAddress(), address.length));
+        if (e == 0) {
+            finishConnectAttempt(fd, ipv6);
+            return;
+        } else if (errno != EINPROGRESS) {
+            ::close(fd);
+            continue;
+        }
 
-    for (p = res; p; p = p->ai_next) {
-        if (p->ai_family == AF_INET) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in*>(addr)->sin_port = htons(port);
-            size = sizeof(sockaddr_in);
-            break;
-        } else if (p->ai_family == AF_INET6) {
-            addr = p->ai_addr;
-            reinterpret_cast<sockaddr_in6*>(addr)->sin6_port = htons(port);
-            size = sizeof(sockaddr_in6);
-            break;
+        mConnect->pending.append(std::make_pair(fd, ipv6));
+        std::weak_ptr<SocketClient> weak = shared_from_this();
+        loop->registerSocket(fd, EventLoop::SocketWrite|EventLoop::SocketOneShot, [weak, ipv6](int f, unsigned int) {
+                if (std::shared_ptr<SocketClient> socket = weak.lock())
+                    socket->connectAttemptReady(f, ipv6);
+            });
+        if (mConnect->next < mConnect->addresses.size()) {
+            // RFC 8305, give this one a head start before trying the next
+            enum { ConnectionAttemptDelay = 250 };
+            mConnect->timer = loop->registerTimer([weak](int) {
+                    if (std::shared_ptr<SocketClient> socket = weak.lock()) {
+                        if (socket->mConnect) {
+                            socket->mConnect->timer = -1;
+                            socket->startConnectAttempt();
+                        }
+                    }
+                }, ConnectionAttemptDelay, Timer::SingleShot);
         }
+        return;
     }
 
-    if (!addr) {
-        socket->mSignalError(socket, SocketClient::DnsError);
-        socket->close();
-        freeaddrinfo(res);
-        res = nullptr;
-        return;
+    if (mConnect->pending.isEmpty()) {
+        mSignalError(shared_from_this(), ConnectError);
+        close();
     }
 }
 
-Resolver::~Resolver()
+void SocketClient::connectAttemptReady(int fd, bool ipv6)
 {
-    if (res)
-        freeaddrinfo(res); // free the linked list
-    else if (addr) {
-        if (size == sizeof(sockaddr_in))
-            delete reinterpret_cast<sockaddr_in*>(addr);
-        else
-            delete reinterpret_cast<sockaddr_in6*>(addr);
+    if (!mConnect)
+        return;
+    int err = 0;
+    socklen_t size = sizeof(err);
+    if (::getsockopt(fd, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&err), &size) == -1)
+        err = errno;
+    if (!err) {
+        finishConnectAttempt(fd, ipv6);
+        return;
     }
+
+    EventLoop::eventLoop()->unregisterSocket(fd);
+    ::close(fd);
+    mConnect->pending.remove(std::make_pair(fd, ipv6));
+    // don't wait for the next attempt to be due
+    startConnectAttempt();
 }
 
-bool SocketClient::connect(const String& host, uint16_t port)
+void SocketClient::finishConnectAttempt(int fd, bool ipv6)
 {
-    std::shared_ptr<SocketClient> tcpSocket = shared_from_this();
-    Resolver resolver(host, port, tcpSocket);
-    if (!resolver.addr)
-        return false;
-
-    unsigned int mode = Tcp;
-    if (resolver.size == sizeof(sockaddr_in6))
-        mode |= IPv6;
-
-    if (!init(mode))
-        return false;
-
-    int e;
-    eintrwrap(e, ::connect(mFd, resolver.addr, resolver.size));
-    mSocketPort = port;
-    mAddress = host;
-    if (e == 0) { // we're done
-        mSocketState = Connected;
-
-        signalConnected(tcpSocket);
-    } else {
-        if (errno != EINPROGRESS) {
-            // bad
-            mSignalError(tcpSocket, ConnectError);
-            close();
-            return false;
-        }
-        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
-            loop->updateSocket(mFd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
-            mWriteWait = true;
-        }
-        mSocketState = Connecting;
+    assert(mConnect);
+    std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+    for (const std::pair<int, bool> &attempt : mConnect->pending) {
+        loop->unregisterSocket(attempt.first);
+        if (attempt.first != fd)
+            ::close(attempt.first);
     }
-
-    return true;
+    if (mConnect->timer != -1)
+        loop->unregisterTimer(mConnect->timer);
+    mConnect.reset();
+
+    // let socketCallback() finish the connect like for a single address,
+    // it flushes what has been written in the meantime
+    mFd = fd;
+    mSocketMode = ipv6 ? (Tcp|IPv6) : Tcp;
+    loop->registerSocket(mFd, EventLoop::SocketRead,
+                         std::bind(&SocketClient::socketCallback, this, std::placeholders::_1, std::placeholders::_2));
+    loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+    mWriteWait = true;
 }
 
 #ifndef _WIN32
@@ -269,7 +409,7 @@ bool SocketClient::connect(const String& path)
             return false;
         }
         if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
-            loop->updateSocket(mFd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+            loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
             mWriteWait = true;
         }
         mSocketState = Connecting;
@@ -415,18 +555,22 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
     const unsigned char *data = f_data;
 #endif
 
-#ifdef RCT_SOCKETCLIENT_TIMING_ENABLED
-    if (size) {
-        mWrites.append(size);
-    }
-#endif
-
     assert((!size) == (!data));
     std::shared_ptr<SocketClient> socketPtr = shared_from_this();
 
-    Resolver resolver;
-    if (port != 0)
-        resolver.resolve(host, port, socketPtr);
+    DnsResolver::Address to;
+    if (port != 0) {
+        if (!DnsResolver::parseAddress(host, &to)) {
+            const List<DnsResolver::Address> addresses = DnsResolver::instance().lookup(host, mSocketMode & IPv6 ? Rct::IPv6 : Rct::IPv4);
+            if (addresses.isEmpty()) {
+                mSignalError(socketPtr, DnsError);
+                close();
+                return false;
+            }
+            to = addresses.first();
+        }
+        to.setPort(port);
+    }
 
     int e;
     unsigned int total = 0;
@@ -437,25 +581,30 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
     const int sendFlags = 0;
 #endif
 
-    if (!mWriteWait) {
+    // while it's waiting for the write limiter everything is buffered
+    if (!mWriteWait && mWriteTimer == -1) {
+        size_t budget = writeBudget();
         if (!mWriteBuffer.empty()) {
             // assert(mWriteOffset < mWriteBuffer.size());
             const size_t writeBufferSize = mWriteBuffer.size() - mWriteOffset;
-            while (total < writeBufferSize) {
+            while (total < writeBufferSize && budget) {
                 assert(mWriteBuffer.size() > total);
-                if (resolver.addr) {
-                    eintrwrap(e, ::sendto(mFd, reinterpret_cast<const char*>(mWriteBuffer.data()) + total + mWriteOffset, writeBufferSize - total,
-                                          sendFlags, resolver.addr, resolver.size));
+                const size_t len = std::min<size_t>(writeBufferSize - total, budget);
+                if (to.length) {
+                    eintrwrap(e, ::sendto(mFd, reinterpret_cast<const char*>(mWriteBuffer.data()) + total + mWriteOffset, len,
+                                          sendFlags, to.sockAddress(), to.length));
                 } else {
-                    eintrwrap(e, ::write(mFd, mWriteBuffer.data() + total + mWriteOffset, writeBufferSize - total));
+                    eintrwrap(e, ::write(mFd, mWriteBuffer.data() + total + mWriteOffset, len));
                 }
-                DEBUG() << "SENT(1)" << (writeBufferSize - total) << "BYTES" << e << errno;
+                recordWrite(e);
+                DEBUG() << "SENT(1)" << len << "BYTES" << e << errno;
                 if (e == -1) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
                         assert(!mWriteWait);
                         if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(mFd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                            loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
                             mWriteWait = true;
+                            mWriteBlockedSince = Rct::monoMs();
                         }
                         break;
                     } else {
@@ -465,6 +614,7 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                         return false;
                     }
                 }
+                budget -= e;
                 mSignalBytesWritten(socketPtr, e);
                 total += e;
             }
@@ -474,34 +624,47 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                     mWriteOffset += total;
                 } else {
                     mWriteOffset = 0;
-                    mWriteBuffer.clear();
+                    mWriteBuffer.reset();
                 }
             }
         }
 
+        // chunks queued by write(String &&) go after the write buffer
+        if (mZeroCopy && mZeroCopy->unsent && mWriteBuffer.empty() && !mWriteWait && mFd != -1) {
+            if (!flushZeroCopy(socketPtr, budget))
+                return false;
+        }
+
         if (mFd == -1 || !data) {
-            return mFd != -1;
+            if (mFd == -1)
+                return false;
+            throttleWrite();
+            checkWatermarks();
+            return true;
         }
         total = 0;
 
         assert(data != nullptr && size > 0);
 
-        if (mWriteBuffer.empty()) {
-            for (;;) {
+        if (mWriteBuffer.empty() && (!mZeroCopy || !mZeroCopy->unsent)) {
+            while (budget) {
                 assert(size > total);
-                if (resolver.addr) {
-                    eintrwrap(e, ::sendto(mFd, data + total, size - total,
-                                          sendFlags, resolver.addr, resolver.size));
+                const size_t len = std::min<size_t>(size - total, budget);
+                if (to.length) {
+                    eintrwrap(e, ::sendto(mFd, data + total, len,
+                                          sendFlags, to.sockAddress(), to.length));
                 } else {
-                    eintrwrap(e, ::write(mFd, data + total, size - total));
+                    eintrwrap(e, ::write(mFd, data + total, len));
                 }
-                DEBUG() << "SENT(2)" << (size - total) << "BYTES" << e << errno;
+                recordWrite(e);
+                DEBUG() << "SENT(2)" << len << "BYTES" << e << errno;
                 if (e == -1) {
                     if (errno == EAGAIN || errno == EWOULDBLOCK) {
                         assert(!mWriteWait);
                         if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
-                            loop->updateSocket(mFd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                            loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
                             mWriteWait = true;
+                            mWriteBlockedSince = Rct::monoMs();
                         }
                         break;
                     } else {
@@ -511,11 +674,13 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
                         return false;
                     }
                 }
+                budget -= e;
                 mSignalBytesWritten(socketPtr, e);
                 total += e;
                 assert(total <= size);
                 if (total == size) {
                     // we're done
+                    checkWatermarks();
                     return true;
                 }
             }
@@ -525,22 +690,353 @@ bool SocketClient::writeTo(const String& host, uint16_t port, const unsigned cha
     if (total < size) {
         // store the rest
         const unsigned int rem = size - total;
-        if (mMaxWriteBufferSize && mWriteBuffer.size() + rem > mMaxWriteBufferSize) {
+        if (mMaxWriteBufferSize && pendingWrite() + rem > mMaxWriteBufferSize) {
             close();
             return false;
         }
+        if (mZeroCopy && mZeroCopy->unsent) {
+            mZeroCopy->chunks.emplace_back();
+            mZeroCopy->chunks.back().data = BufferRef::copy(data + total, rem);
+            mZeroCopy->unsent += rem;
+            throttleWrite();
+            checkWatermarks();
+            return true;
+        }
         mWriteBuffer.reserve(mWriteBuffer.size() + rem);
         memcpy(mWriteBuffer.end(), data + total, rem);
         mWriteBuffer.resize(mWriteBuffer.size() + rem);
     }
+    throttleWrite();
+    // not before data has been handled, the signal handlers may write more
+    checkWatermarks();
     return true;
 }
 
+void SocketClient::setWriteWatermarks(size_t high, size_t low)
+{
+    assert(!high || low < high);
+    mHighWatermark = high;
+    mLowWatermark = low;
+    checkWatermarks();
+}
+
+void SocketClient::checkWatermarks()
+{
+    mStats.peakWriteQueue = std::max<uint64_t>(mStats.peakWriteQueue, pendingWrite());
+    if (!mWriteBlocked) {
+        if (mHighWatermark && pendingWrite() >= mHighWatermark) {
+            mWriteBlocked = true;
+            mSignalWriteBlocked(shared_from_this());
+        }
+    } else if (!mHighWatermark || pendingWrite() <= mLowWatermark) {
+        mWriteBlocked = false;
+        mSignalWriteDrained(shared_from_this());
+    }
+}
+
+unsigned int SocketClient::readMode() const
+{
+    return (mReadPaused || mReadThrottled ? 0 : EventLoop::SocketRead) | (mZeroCopy ? EventLoop::SocketErrorQueue : 0);
+}
+
+size_t SocketClient::pendingWrite() const
+{
+    return mWriteBuffer.size() - mWriteOffset + (mZeroCopy ? mZeroCopy->unsent : 0);
+}
+
+void SocketClient::setReadPaused(bool paused)
+{
+    if (paused == mReadPaused)
+        return;
+    mReadPaused = paused;
+    if (mFd == -1 || mBlocking)
+        return;
+    // re-arming the socket reports data that arrived while we were paused
+    if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+        loop->updateSocket(mFd, readMode() | (mWriteWait ? EventLoop::SocketWrite|EventLoop::SocketOneShot : 0));
+}
+
 bool SocketClient::write(const void *data, unsigned int size)
 {
     return writeTo(String(), 0, reinterpret_cast<const unsigned char*>(data), size);
 }
 
+bool SocketClient::write(String &&data)
+{
+    if (!mZeroCopy || !mZeroCopy->threshold || mZeroCopy->copied || data.size() < mZeroCopy->threshold || mFd == -1)
+        return write(data.constData(), data.size());
+    return write(BufferRef(std::move(data)));
+}
+
+bool SocketClient::write(const BufferRef &data)
+{
+    if (!mZeroCopy || !mZeroCopy->threshold || mZeroCopy->copied || data.size() < mZeroCopy->threshold || mFd == -1)
+        return write(data.data(), data.size());
+
+    if (mMaxWriteBufferSize && pendingWrite() + data.size() > mMaxWriteBufferSize) {
+        close();
+        return false;
+    }
+    mZeroCopy->chunks.emplace_back();
+    ZeroCopy::Chunk &chunk = mZeroCopy->chunks.back();
+    chunk.data = data;
+    chunk.zeroCopy = true;
+    mZeroCopy->unsent += chunk.data.size();
+    if (mWriteWait || mWriteTimer != -1 || !mWriteBuffer.empty()) {
+        checkWatermarks();
+        return true;
+    }
+    return write(nullptr, 0);
+}
+
+bool SocketClient::flushZeroCopy(const std::shared_ptr<SocketClient> &socket, size_t &budget)
+{
+#ifdef HAVE_NOSIGNAL
+    int flags = MSG_NOSIGNAL;
+#else
+    int flags = 0;
+#endif
+    while (mZeroCopy->unsent && budget) {
+        ZeroCopy::Chunk &chunk = mZeroCopy->chunks[mZeroCopy->next];
+#ifdef HAVE_ZEROCOPY
+        if (chunk.zeroCopy) {
+            flags |= MSG_ZEROCOPY;
+        } else {
+            flags &= ~MSG_ZEROCOPY;
+        }
+#endif
+        const size_t rem = std::min(chunk.data.size() - chunk.offset, budget);
+        int e;
+        eintrwrap(e, ::send(mFd, chunk.data.data() + chunk.offset, rem, flags));
+        recordWrite(e);
+        DEBUG() << "SENT(4)" << rem << "BYTES" << e << errno << chunk.zeroCopy;
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+                    mWriteWait = true;
+                    mWriteBlockedSince = Rct::monoMs();
+                    loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                }
+                break;
+            } else if (errno == ENOBUFS && chunk.zeroCopy) {
+                // out of option memory for the completions, copy this one
+                chunk.zeroCopy = false;
+                continue;
+            }
+            mSignalError(socket, WriteError);
+            close();
+            return false;
+        }
+        if (chunk.zeroCopy) {
+            chunk.pinned = true;
+            chunk.lastSend = mZeroCopy->sends++;
+        }
+        chunk.offset += e;
+        mZeroCopy->unsent -= e;
+        budget -= e;
+        if (chunk.offset == chunk.data.size())
+            ++mZeroCopy->next;
+        mSignalBytesWritten(socket, e);
+        if (mFd == -1)
+            return false;
+    }
+    mZeroCopy->release();
+    return true;
+}
+
+void SocketClient::readZeroCopyCompletions()
+{
+#ifdef HAVE_ZEROCOPY
+    for (;;) {
+        union {
+            cmsghdr align;
+            char buf[CMSG_SPACE(sizeof(sock_extended_err) + sizeof(sockaddr_in6))];
+        } control;
+        msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control.buf;
+        msg.msg_controllen = sizeof(control.buf);
+        int e;
+        eintrwrap(e, ::recvmsg(mFd, &msg, MSG_ERRQUEUE));
+        if (e == -1)
+            break;
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                && !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            sock_extended_err err;
+            memcpy(&err, CMSG_DATA(cmsg), sizeof(err));
+            if (err.ee_errno || err.ee_origin != SO_EE_ORIGIN_ZEROCOPY)
+                continue;
+            if (err.ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                mZeroCopy->copied = true;
+            mZeroCopy->completions.complete(err.ee_info, err.ee_data);
+        }
+    }
+    mZeroCopy->release();
+#endif
+}
+
+bool SocketClient::setZeroCopyThreshold(size_t threshold)
+{
+#ifdef HAVE_ZEROCOPY
+    if (!threshold || mFd == -1 || mBlocking || !(mSocketMode & Tcp)) {
+        // chunks that are in flight stay until they've completed
+        if (mZeroCopy)
+            mZeroCopy->threshold = 0;
+        return !threshold;
+    }
+    if (!mZeroCopy) {
+        const int on = 1;
+        if (::setsockopt(mFd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)))
+            return false;
+        mZeroCopy.reset(new ZeroCopy);
+        // have the event loop report completions
+        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+            loop->updateSocket(mFd, readMode() | (mWriteWait ? EventLoop::SocketWrite|EventLoop::SocketOneShot : 0));
+    }
+    mZeroCopy->threshold = threshold;
+    mZeroCopy->copied = false;
+    return true;
+#else
+    return !threshold;
+#endif
+}
+
+size_t SocketClient::zeroCopyThreshold() const
+{
+    return mZeroCopy && !mZeroCopy->copied ? mZeroCopy->threshold : 0;
+}
+
+#ifndef _WIN32
+bool SocketClient::writeFileDescriptors(const void *data, unsigned int size, const int *fds, int count)
+{
+    assert(mSocketMode & Unix);
+    assert(size && count > 0);
+    if (mFd == -1 || mWriteWait || mWriteTimer != -1 || !mWriteBuffer.empty())
+        return false;
+
+    iovec iov;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = size;
+    List<char> control(CMSG_SPACE(sizeof(int) * count), '\0');
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.data();
+    msg.msg_controllen = control.size();
+    cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int) * count);
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * count);
+
+#ifdef HAVE_NOSIGNAL
+    const int sendFlags = MSG_NOSIGNAL;
+#else
+    const int sendFlags = 0;
+#endif
+    int e;
+    eintrwrap(e, ::sendmsg(mFd, &msg, sendFlags));
+    recordWrite(e);
+    DEBUG() << "SENT(3)" << size << "BYTES" << count << "FDS" << e << errno;
+    if (e == -1) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+            return false;
+        mSignalError(shared_from_this(), WriteError);
+        close();
+        return false;
+    }
+    mSignalBytesWritten(shared_from_this(), e);
+    if (static_cast<unsigned int>(e) < size)
+        return write(static_cast<const unsigned char *>(data) + e, size - e);
+    return true;
+}
+
+int SocketClient::sendFile(int fd, uint64_t offset, int size)
+{
+    assert(size >= 0);
+    int sent = 0;
+#ifdef HAVE_SENDFILE
+    if (mFd == -1 || mWriteWait || mWriteTimer != -1 || pendingWrite())
+        return 0;
+
+    std::shared_ptr<SocketClient> socketPtr = shared_from_this();
+    size_t budget = writeBudget();
+    off_t off = offset;
+    while (sent < size && budget) {
+        const size_t len = std::min<size_t>(size - sent, budget);
+        ssize_t e;
+        eintrwrap(e, ::sendfile(mFd, fd, &off, len));
+        recordWrite(e);
+        DEBUG() << "SENT(5)" << len << "BYTES" << e << errno;
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+                    loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                    mWriteWait = true;
+                    mWriteBlockedSince = Rct::monoMs();
+                }
+                break;
+            }
+            mSignalError(socketPtr, WriteError);
+            close();
+            return -1;
+        }
+        if (!e) // the file is shorter than expected
+            break;
+        budget -= e;
+        sent += e;
+        mSignalBytesWritten(socketPtr, e);
+        if (mFd == -1)
+            break;
+    }
+#else
+    (void)fd;
+    (void)offset;
+#endif
+    return sent;
+}
+
+int SocketClient::readUnix(void *data, unsigned int size)
+{
+    enum { MaxFileDescriptors = 8 };
+    iovec iov;
+    iov.iov_base = data;
+    iov.iov_len = size;
+    union {
+        cmsghdr align;
+        char buf[CMSG_SPACE(sizeof(int) * MaxFileDescriptors)];
+    } control;
+    msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+#ifdef MSG_CMSG_CLOEXEC
+    const int recvFlags = MSG_CMSG_CLOEXEC;
+#else
+    const int recvFlags = 0;
+#endif
+    int e;
+    eintrwrap(e, ::recvmsg(mFd, &msg, recvFlags));
+    if (e > 0 && msg.msg_controllen) {
+        for (cmsghdr *cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+            if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS) {
+                const int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+                const int *fds = reinterpret_cast<const int *>(CMSG_DATA(cmsg));
+                for (int i = 0; i < count; ++i)
+                    mFileDescriptors.append(fds[i]);
+            }
+        }
+    }
+    return e;
+}
+#endif
+
 static String addrToString(const sockaddr* addr, bool IPv6)
 {
     String ip(INET6_ADDRSTRLEN, '\0');
@@ -576,6 +1072,324 @@ static uint16_t addrToPort(const sockaddr* addr, bool IPv6)
     return ntohs(reinterpret_cast<const sockaddr_in*>(addr)->sin_port);
 }
 
+struct SocketClient::UdpBatch
+{
+    UdpBatch(int c, int size)
+        : count(c), datagramSize(size), data(static_cast<size_t>(c) * size), addresses(c)
+#ifdef HAVE_RECVMMSG
+        , headers(c), iovecs(c), control(static_cast<size_t>(c) * ControlSize)
+#endif
+    {
+#ifdef HAVE_RECVMMSG
+        for (int i = 0; i < count; ++i) {
+            iovecs[i].iov_base = &data[static_cast<size_t>(i) * datagramSize];
+            iovecs[i].iov_len = datagramSize;
+            memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_name = &addresses[i];
+            headers[i].msg_hdr.msg_iov = &iovecs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+#endif
+    }
+
+    // room for one int cmsg, the UDP_GRO segment size
+    enum { ControlSize = 64 };
+
+    const int count, datagramSize;
+    std::vector<unsigned char> data;
+    std::vector<sockaddr_storage> addresses;
+#ifdef HAVE_RECVMMSG
+    std::vector<mmsghdr> headers;
+    std::vector<iovec> iovecs;
+    std::vector<unsigned char> control;
+#endif
+    List<SocketClient::Datagram> datagrams;
+
+    // splits datagrams the kernel coalesced with UDP_GRO
+    void add(const sockaddr_storage &address, socklen_t addressLength, const unsigned char *buf, unsigned int size,
+             unsigned int segmentSize)
+    {
+        if (!segmentSize)
+            segmentSize = size;
+        do {
+            Datagram datagram;
+            datagram.setAddress(reinterpret_cast<const sockaddr *>(&address), addressLength);
+            datagram.data = buf;
+            datagram.size = std::min(size, segmentSize);
+            datagrams.append(datagram);
+            buf += datagram.size;
+            size -= datagram.size;
+        } while (size);
+    }
+};
+
+static_assert(sizeof(sockaddr_in6) <= sizeof(SocketClient::Datagram::addressData), "Datagram::addressData is too small");
+
+void SocketClient::Datagram::setAddress(const sockaddr *address, uint32_t length)
+{
+    addressLength = std::min<uint32_t>(length, sizeof(addressData));
+    memcpy(addressData, address, addressLength);
+}
+
+bool SocketClient::Datagram::setAddress(const String &ip, uint16_t port)
+{
+    memset(addressData, 0, sizeof(addressData));
+    sockaddr_in *addr4 = reinterpret_cast<sockaddr_in *>(addressData);
+    sockaddr_in6 *addr6 = reinterpret_cast<sockaddr_in6 *>(addressData);
+    if (inet_pton(AF_INET, ip.constData(), &addr4->sin_addr) == 1) {
+        addr4->sin_family = AF_INET;
+        addr4->sin_port = htons(port);
+        addressLength = sizeof(sockaddr_in);
+        return true;
+    }
+    if (inet_pton(AF_INET6, ip.constData(), &addr6->sin6_addr) == 1) {
+        addr6->sin6_family = AF_INET6;
+        addr6->sin6_port = htons(port);
+        addressLength = sizeof(sockaddr_in6);
+        return true;
+    }
+    addressLength = 0;
+    return false;
+}
+
+String SocketClient::Datagram::host(uint16_t *port) const
+{
+    if (addressLength < sizeof(sockaddr_in))
+        return String();
+    const bool isIPv6 = address()->sa_family == AF_INET6;
+    if (port)
+        *port = addrToPort(address(), isIPv6);
+    return addrToString(address(), isIPv6);
+}
+
+void SocketClient::setUdpBatchSize(int count, int datagramSize)
+{
+    assert(count >= 0 && datagramSize > 0);
+    if (!count) {
+        mUdpBatch.reset();
+    } else {
+        mUdpBatch.reset(new UdpBatch(count, datagramSize));
+    }
+}
+
+int SocketClient::udpBatchSize() const
+{
+    return mUdpBatch ? mUdpBatch->count : 0;
+}
+
+bool SocketClient::setUdpSegmentSize(int size)
+{
+#ifdef UDP_SEGMENT
+    return mFd != -1 && !::setsockopt(mFd, IPPROTO_UDP, UDP_SEGMENT, &size, sizeof(size));
+#else
+    (void)size;
+    return false;
+#endif
+}
+
+bool SocketClient::setUdpGro(bool on)
+{
+#if defined(UDP_GRO) && defined(HAVE_RECVMMSG)
+    const int val = on;
+    if (mFd == -1 || ::setsockopt(mFd, IPPROTO_UDP, UDP_GRO, &val, sizeof(val)))
+        return false;
+    mUdpGro = on;
+    return true;
+#else
+    (void)on;
+    return false;
+#endif
+}
+
+bool SocketClient::readBatch(const std::shared_ptr<SocketClient> &socketPtr)
+{
+    UdpBatch &batch = *mUdpBatch;
+    for (;;) {
+        batch.datagrams.clear();
+        int count = 0;
+#ifdef HAVE_RECVMMSG
+        for (int i = 0; i < batch.count; ++i) {
+            msghdr &header = batch.headers[i].msg_hdr;
+            header.msg_namelen = sizeof(sockaddr_storage);
+            if (mUdpGro) {
+                header.msg_control = &batch.control[static_cast<size_t>(i) * UdpBatch::ControlSize];
+                header.msg_controllen = UdpBatch::ControlSize;
+            } else {
+                header.msg_control = nullptr;
+                header.msg_controllen = 0;
+            }
+        }
+        eintrwrap(count, ::recvmmsg(mFd, &batch.headers[0], batch.count, MSG_DONTWAIT, nullptr));
+        if (count == -1) {
+            recordRead(count);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            mSignalError(socketPtr, ReadError);
+            close();
+            return false;
+        }
+        int bytes = 0;
+        for (int i = 0; i < count; ++i)
+            bytes += batch.headers[i].msg_len;
+        recordRead(bytes);
+        for (int i = 0; i < count; ++i) {
+            const msghdr &header = batch.headers[i].msg_hdr;
+            unsigned int size = batch.headers[i].msg_len;
+            unsigned int segmentSize = 0;
+#ifdef UDP_GRO
+            if (mUdpGro) {
+                for (cmsghdr *cmsg = CMSG_FIRSTHDR(&header); cmsg; cmsg = CMSG_NXTHDR(const_cast<msghdr *>(&header), cmsg)) {
+                    if (cmsg->cmsg_level == IPPROTO_UDP && cmsg->cmsg_type == UDP_GRO) {
+                        int segment;
+                        memcpy(&segment, CMSG_DATA(cmsg), sizeof(segment));
+                        segmentSize = segment;
+                    }
+                }
+            }
+#endif
+            if (header.msg_flags & MSG_TRUNC) {
+                ++mStats.datagramsTruncated;
+                // the segments of a coalesced read that made it in whole
+                // are fine, the cut off one and the rest are lost
+                if (!segmentSize || size < segmentSize)
+                    continue;
+                size -= size % segmentSize;
+            }
+            batch.add(batch.addresses[i], header.msg_namelen, static_cast<const unsigned char *>(batch.iovecs[i].iov_base),
+                      size, segmentSize);
+        }
+#else
+        while (count < batch.count) {
+            unsigned char *buf = &batch.data[static_cast<size_t>(count) * batch.datagramSize];
+            int e;
+            bool truncated;
+#ifdef _WIN32
+            int addressLength = sizeof(sockaddr_storage);
+            eintrwrap(e, ::recvfrom(mFd, reinterpret_cast<char *>(buf), batch.datagramSize, 0,
+                                    reinterpret_cast<sockaddr *>(&batch.addresses[count]), &addressLength));
+            truncated = e == -1 && WSAGetLastError() == WSAEMSGSIZE;
+            if (truncated)
+                e = batch.datagramSize;
+#else
+            // recvmsg() rather than recvfrom() to learn about truncation
+            iovec iov;
+            iov.iov_base = buf;
+            iov.iov_len = batch.datagramSize;
+            msghdr header;
+            memset(&header, 0, sizeof(header));
+            header.msg_name = &batch.addresses[count];
+            header.msg_namelen = sizeof(sockaddr_storage);
+            header.msg_iov = &iov;
+            header.msg_iovlen = 1;
+            eintrwrap(e, ::recvmsg(mFd, &header, 0));
+            truncated = e != -1 && header.msg_flags & MSG_TRUNC;
+            const socklen_t addressLength = header.msg_namelen;
+#endif
+            recordRead(e);
+            if (e == -1) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK)
+                    break;
+                mSignalError(socketPtr, ReadError);
+                close();
+                return false;
+            }
+            if (truncated) {
+                ++mStats.datagramsTruncated;
+                continue;
+            }
+            batch.add(batch.addresses[count], addressLength, buf, e, 0);
+            ++count;
+        }
+#endif
+        if (!count)
+            break;
+        mSignalReadyReadBatch(socketPtr, batch.datagrams);
+        // the handlers might have closed us or turned batching off
+        if (mFd == -1 || mUdpBatch.get() != &batch)
+            return mFd != -1;
+        if (mReadLimiter && !mReadLimiter->available()) {
+            throttleRead();
+            break;
+        }
+    }
+    return true;
+}
+
+int SocketClient::writeTo(const Datagram *datagrams, int count)
+{
+    assert(mSocketMode & Udp);
+    if (mFd == -1)
+        return -1;
+    std::shared_ptr<SocketClient> socketPtr = shared_from_this();
+#ifdef HAVE_NOSIGNAL
+    const int sendFlags = MSG_NOSIGNAL;
+#else
+    const int sendFlags = 0;
+#endif
+    int sent = 0;
+    uint64_t bytes = 0;
+#ifdef HAVE_SENDMMSG
+    enum { BatchSize = 64 };
+    mmsghdr headers[BatchSize];
+    iovec iovecs[BatchSize];
+    while (sent < count) {
+        const int batch = std::min<int>(count - sent, BatchSize);
+        for (int i = 0; i < batch; ++i) {
+            const Datagram &datagram = datagrams[sent + i];
+            iovecs[i].iov_base = const_cast<unsigned char *>(datagram.data);
+            iovecs[i].iov_len = datagram.size;
+            memset(&headers[i], 0, sizeof(mmsghdr));
+            headers[i].msg_hdr.msg_name = const_cast<sockaddr *>(datagram.address());
+            headers[i].msg_hdr.msg_namelen = datagram.addressLength;
+            headers[i].msg_hdr.msg_iov = &iovecs[i];
+            headers[i].msg_hdr.msg_iovlen = 1;
+        }
+        int e;
+        eintrwrap(e, ::sendmmsg(mFd, headers, batch, sendFlags));
+        if (e == -1) {
+            recordWrite(e);
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (!sent) {
+                mSignalError(socketPtr, WriteError);
+                return -1;
+            }
+            break;
+        }
+        int batchBytes = 0;
+        for (int i = 0; i < e; ++i)
+            batchBytes += headers[i].msg_len;
+        recordWrite(batchBytes);
+        bytes += batchBytes;
+        sent += e;
+        if (e < batch)
+            break;
+    }
+#else
+    while (sent < count) {
+        const Datagram &datagram = datagrams[sent];
+        int e;
+        eintrwrap(e, ::sendto(mFd, reinterpret_cast<const char *>(datagram.data), datagram.size, sendFlags,
+                              datagram.address(), datagram.addressLength));
+        recordWrite(e);
+        if (e == -1) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            if (!sent) {
+                mSignalError(socketPtr, WriteError);
+                return -1;
+            }
+            break;
+        }
+        bytes += e;
+        ++sent;
+    }
+#endif
+    if (bytes)
+        mSignalBytesWritten(socketPtr, bytes);
+    return sent;
+}
+
 void SocketClient::socketCallback(int f, int mode)
 {
     assert(f == mFd);
@@ -589,11 +1403,24 @@ void SocketClient::socketCallback(int f, int mode)
         return;
     }
 
+    if (mode & EventLoop::SocketErrorQueue && mZeroCopy) {
+        readZeroCopyCompletions();
+        // a one-shot registration is disarmed by any event
+        if (mWriteWait && !(mode & EventLoop::SocketWrite)) {
+            if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop())
+                loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+        }
+    }
+
     if (mWriteWait && (mode & EventLoop::SocketWrite)) {
         if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
-            loop->updateSocket(mFd, EventLoop::SocketRead);
+            loop->updateSocket(mFd, readMode());
             mWriteWait = false;
         }
+        if (mWriteBlockedSince) {
+            mStats.writeBlockedTime += Rct::monoMs() - mWriteBlockedSince;
+            mWriteBlockedSince = 0;
+        }
     }
 
     union {
@@ -605,21 +1432,37 @@ void SocketClient::socketCallback(int f, int mode)
     socklen_t fromLen = 0;
     const bool isIPv6 = mSocketMode & IPv6;
 
-    if (mode & EventLoop::SocketRead) {
+    if (mode & EventLoop::SocketRead && !mReadPaused && !mReadThrottled && mUdpBatch) {
+        if (!readBatch(socketPtr))
+            return;
+        if (mWriteWait) {
+            if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+                loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+            }
+        }
+    } else if (mode & EventLoop::SocketRead && !mReadPaused && !mReadThrottled) {
 
-        enum { BlockSize = 1024, AllocateAt = 512 };
+        enum { AllocateAt = 512 };
         int e;
 
         unsigned int total = 0;
+        uint64_t budget = mReadLimiter ? mReadLimiter->available() : UINT64_MAX;
         for(;;) {
+            if (!budget) {
+                // the rest waits until the limiter has refilled
+                throttleRead();
+                break;
+            }
             unsigned int rem = mReadBuffer.capacity() - mReadBuffer.size();
-            // printf("reading, remaining size %u\n", rem);
             if (rem <= AllocateAt) {
-                // printf("allocating more\n");
-                mReadBuffer.reserve(mReadBuffer.size() + BlockSize);
+                // start out with what recent reads needed and double
+                // from there
+                mReadBuffer.reserve(mReadBuffer.capacity() ? mReadBuffer.capacity() * 2 : mReadSize);
                 rem = mReadBuffer.capacity() - mReadBuffer.size();
-                // printf("Rem is now %d\n", rem);
             }
+            // datagrams can't be read in pieces
+            if (!(mSocketMode & Udp) && rem > budget)
+                rem = static_cast<unsigned int>(budget);
             if (mSocketMode & Udp) {
                 if (isIPv6) {
                     fromLen = sizeof(fromAddr6);
@@ -628,9 +1471,16 @@ void SocketClient::socketCallback(int f, int mode)
                     fromLen = sizeof(fromAddr4);
                     eintrwrap(e, ::recvfrom(mFd, reinterpret_cast<char*>(mReadBuffer.end()), rem, 0, &fromAddr, &fromLen));
                 }
+#ifndef _WIN32
+            } else if (mSocketMode & Unix) {
+                e = readUnix(mReadBuffer.end(), rem);
+#endif
             } else {
                 eintrwrap(e, ::read(mFd, mReadBuffer.end(), rem));
             }
+            recordRead(e);
+            if (mReadLimiter && e > 0)
+                budget = mReadLimiter->available();
             DEBUG() << "RECEIVED(2)" << rem << "BYTES" << e << errno;
             if (e == -1) {
                 if (errno == EAGAIN || errno == EWOULDBLOCK) {
@@ -662,10 +1512,21 @@ void SocketClient::socketCallback(int f, int mode)
         assert(total <= mReadBuffer.capacity());
         if (!fromLen)
             mSignalReadyRead(socketPtr, std::move(mReadBuffer));
+        // idle sockets shouldn't hold on to memory
+        if (mReadBuffer.isEmpty())
+            mReadBuffer.reset();
+
+        // grow right away, shrink slowly
+        if (total > static_cast<unsigned int>(mReadSize)) {
+            while (mReadSize < BufferPool::MaxBlockSize && static_cast<unsigned int>(mReadSize) < total)
+                mReadSize *= 2;
+        } else if (total < static_cast<unsigned int>(mReadSize) / 4 && mReadSize > BufferPool::MinBlockSize) {
+            mReadSize /= 2;
+        }
 
         if (mWriteWait) {
             if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
-                loop->updateSocket(mFd, EventLoop::SocketRead|EventLoop::SocketWrite|EventLoop::SocketOneShot);
+                loop->updateSocket(mFd, readMode()|EventLoop::SocketWrite|EventLoop::SocketOneShot);
             }
         }
     }
@@ -765,42 +1626,116 @@ bool SocketClient::setFlags(int mFd, int flag, int getcmd, int setcmd, FlagMode
 #endif
 }
 
-#ifdef RCT_SOCKETCLIENT_TIMING_ENABLED
-double SocketClient::mbpsWritten() const
+SocketStats SocketClient::stats() const
 {
-    uint64_t bytes = 0, currentStart = 0, currentEnd = 0;
-    uint64_t elapsed = 0;
+    SocketStats ret = mStats;
+    const uint64_t now = Rct::monoMs();
+    ret.readRate = mReadRate.value(now);
+    ret.writeRate = mWriteRate.value(now);
+    if (mWriteBlockedSince)
+        ret.writeBlockedTime += now - mWriteBlockedSince;
+    return ret;
+}
 
-    for (const auto &t : mWrites) {
-        // assert(t.isCompleted());
-        bytes += t.bytes;
-        if (t.startTime > currentEnd) {
-            elapsed += currentEnd - currentStart;
-            currentStart = t.startTime;
-        }
-        assert(currentEnd >= currentStart);
-        currentEnd = t.endTime;
+void SocketClient::addToStatsGroup(const std::shared_ptr<SocketStatsGroup> &group)
+{
+    if (mStatsGroups.contains(group))
+        return;
+    mStatsGroups.append(group);
+    group->add(this);
+}
+
+void SocketClient::recordRead(int e)
+{
+    ++mStats.reads;
+    if (e > 0) {
+        mStats.bytesRead += e;
+        mReadRate.add(e, Rct::monoMs());
+        if (mReadLimiter)
+            mReadLimiter->consume(e);
     }
-    elapsed += currentEnd - currentStart;
-    return ((static_cast<double>(bytes) / (1024 * 1024)) / (static_cast<double>(elapsed) / 1000.0));
 }
-#endif
 
+void SocketClient::recordWrite(int e)
+{
+    ++mStats.writes;
+    if (e > 0) {
+        mStats.bytesWritten += e;
+        mWriteRate.add(e, Rct::monoMs());
+        if (mWriteLimiter)
+            mWriteLimiter->consume(e);
+    } else if (e == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        ++mStats.writesBlocked;
+    }
+}
 
-void SocketClient::bytesWritten(const std::shared_ptr<SocketClient> &socket, uint64_t bytes)
+void SocketClient::setReadLimiter(const std::shared_ptr<RateLimiter> &limiter)
 {
-    const uint64_t copy = bytes;
-#ifdef RCT_SOCKETCLIENT_TIMING_ENABLED
-    List<TimeData>::iterator it = mPendingWrites.begin();
-    while (bytes && it != mPendingWrites.end()) {
-        if (it->add(bytes)) {
-            mWrites.append(*it);
-            it = mPendingWrites.erase(it);
-        } else {
-            ++it;
+    mReadLimiter = limiter;
+    if (!limiter && mReadTimer != -1) {
+        // no reason to wait anymore
+        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+            loop->unregisterTimer(mReadTimer);
+            mReadTimer = -1;
+            mReadThrottled = false;
+            loop->updateSocket(mFd, readMode() | (mWriteWait ? EventLoop::SocketWrite|EventLoop::SocketOneShot : 0));
         }
     }
-    assert(!bytes);
-#endif
-    mSignalBytesWritten(socket, copy);
+}
+
+void SocketClient::setWriteLimiter(const std::shared_ptr<RateLimiter> &limiter)
+{
+    mWriteLimiter = limiter;
+    if (!limiter && mWriteTimer != -1) {
+        if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
+            loop->unregisterTimer(mWriteTimer);
+            mWriteTimer = -1;
+            write(nullptr, 0);
+        }
+    }
+}
+
+size_t SocketClient::writeBudget() const
+{
+    if (!mWriteLimiter || mBlocking || mSocketMode & Udp)
+        return SIZE_MAX;
+    return static_cast<size_t>(std::min<uint64_t>(mWriteLimiter->available(), SIZE_MAX));
+}
+
+void SocketClient::throttleRead()
+{
+    std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+    if (!loop || mReadThrottled || mFd == -1)
+        return;
+    mReadThrottled = true;
+    loop->updateSocket(mFd, readMode() | (mWriteWait ? EventLoop::SocketWrite|EventLoop::SocketOneShot : 0));
+    std::weak_ptr<SocketClient> weak = shared_from_this();
+    mReadTimer = loop->registerTimer([weak](int) {
+            std::shared_ptr<SocketClient> socket = weak.lock();
+            if (!socket)
+                return;
+            socket->mReadTimer = -1;
+            socket->mReadThrottled = false;
+            // re-arming the socket reports data that's been waiting
+            if (std::shared_ptr<EventLoop> l = EventLoop::eventLoop())
+                l->updateSocket(socket->mFd, socket->readMode() | (socket->mWriteWait ? EventLoop::SocketWrite|EventLoop::SocketOneShot : 0));
+        }, std::max(mReadLimiter->delay(mReadSize), 1), Timer::SingleShot);
+}
+
+void SocketClient::throttleWrite()
+{
+    // data left over while the socket can take more means the limiter ran
+    // out, pick up again once it has refilled
+    if (!mWriteLimiter || mBlocking || mSocketMode & Udp || mWriteWait || mWriteTimer != -1 || mFd == -1 || !pendingWrite())
+        return;
+    std::shared_ptr<EventLoop> loop = EventLoop::eventLoop();
+    if (!loop)
+        return;
+    std::weak_ptr<SocketClient> weak = shared_from_this();
+    mWriteTimer = loop->registerTimer([weak](int) {
+            if (std::shared_ptr<SocketClient> socket = weak.lock()) {
+                socket->mWriteTimer = -1;
+                socket->write(nullptr, 0);
+            }
+        }, std::max(mWriteLimiter->delay(pendingWrite()), 1), Timer::SingleShot);
 }
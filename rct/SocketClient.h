@@ -8,11 +8,15 @@
 #include <utility>
 
 #include "Buffer.h"
+#include "DnsResolver.h"
+#include "RateLimiter.h"
 #include "Rct.h"
 #include "SignalSlot.h"
+#include "SocketStats.h"
 #include "String.h"
 
-// #define RCT_SOCKETCLIENT_TIMING_ENABLED
+struct sockaddr;
+
 class SocketClient : public std::enable_shared_from_this<SocketClient>
 {
 public:
@@ -22,7 +26,10 @@ public:
         Udp = 0x2,
         Unix = 0x4,
         IPv6 = 0x8,
-        Blocking = 0x10
+        Blocking = 0x10,
+        // the descriptor is already non-blocking and close-on-exec, e.g.
+        // from accept4(2)
+        Prepared = 0x20
     };
 
     SocketClient(unsigned int mode = 0);
@@ -37,14 +44,23 @@ public:
 #ifndef _WIN32
     bool connect(const String &path); // UNIX
 #endif
-    bool connect(const String &host, uint16_t port); // TCP
+    /**
+     * TCP. Host names are resolved through DnsResolver::instance(), on a
+     * background thread unless the answer is cached or the socket is
+     * blocking. The addresses are tried happy eyeballs style (RFC 8305),
+     * each getting a 250ms head start before the next one is tried in
+     * parallel. DNS and connect errors are reported through error(), data
+     * written before connected() is buffered.
+     */
+    bool connect(const String &host, uint16_t port);
     bool bind(uint16_t port); // UDP
 
     String hostName() const { return (mSocketMode & Tcp ? mAddress : String()); }
     String path() const { return (mSocketMode & Unix ? mAddress : String()); }
     uint16_t port() const { return mSocketPort; }
 
-    bool isConnected() const { return mFd != -1; }
+    // also true while connecting
+    bool isConnected() const { return mFd != -1 || mConnect; }
     int socket() const { return mFd; }
 
     void close();
@@ -52,6 +68,44 @@ public:
     // TCP/UNIX
     bool write(const void *data, unsigned int num);
     bool write(const String &data) { return write(&data[0], data.size()); }
+    /**
+     * TCP. Like write() but takes over data, writes of at least
+     * zeroCopyThreshold() bytes are then sent with MSG_ZEROCOPY.
+     */
+    bool write(String &&data);
+    /**
+     * TCP. Like write(String &&) but shares data, e.g. to send the same
+     * payload to many sockets. Zero-copy writes hold on to it rather than
+     * copying it until they're done.
+     */
+    bool write(const BufferRef &data);
+
+    /**
+     * TCP (Linux). With a threshold set, write(String &&) hands large
+     * writes to the kernel with MSG_ZEROCOPY: the pages are sent from
+     * directly instead of being copied into the socket buffer, and the
+     * string is kept until the kernel reports on the error queue that it's
+     * done with them. Completions cost a syscall and pinning pages isn't
+     * free either so this only pays off for writes of 64K and more. If the
+     * kernel ends up copying anyway (loopback, devices without
+     * scatter-gather) the socket goes back to plain writes. Pass 0 to turn
+     * it off. Returns false if the platform or socket doesn't support it.
+     */
+    bool setZeroCopyThreshold(size_t threshold);
+    size_t zeroCopyThreshold() const;
+
+#ifndef _WIN32
+    // UNIX, the descriptors travel with the first byte of data. Fails if
+    // there's buffered data that hasn't been written yet.
+    bool writeFileDescriptors(const void *data, unsigned int num, const int *fds, int count);
+    // descriptors received so far, in the order they arrived
+    List<int> takeFileDescriptors() { List<int> ret; std::swap(ret, mFileDescriptors); return ret; }
+    // TCP/UNIX, sends up to size bytes of fd from offset with sendfile(2)
+    // while nothing else is waiting to be written, within the write
+    // limiter's budget and counted like write(). Returns how much went out,
+    // the rest has to be written normally, or -1 if the socket failed.
+    int sendFile(int fd, uint64_t offset, int size);
+#endif
 
     String peerName(uint16_t *port = nullptr) const;
     String peerString() const
@@ -74,13 +128,64 @@ public:
         return String();
     }
 
-    // UDP
+    // UDP, host names are resolved through DnsResolver::instance() and
+    // cached, a cache miss blocks
     bool writeTo(const String &host, uint16_t port, const unsigned char *data, unsigned int num);
     bool writeTo(const String &host, uint16_t port, const String &data)
     {
         return writeTo(host, port, reinterpret_cast<const unsigned char *>(&data[0]), data.size());
     }
 
+    /**
+     * UDP, a datagram with the raw address it came from or goes to. For
+     * received datagrams data points into the socket's batch buffer and is
+     * only valid while readyReadBatch() is being emitted.
+     */
+    struct Datagram
+    {
+        Datagram()
+            : addressLength(0), data(nullptr), size(0)
+        {}
+
+        const sockaddr *address() const { return reinterpret_cast<const sockaddr *>(addressData); }
+        void setAddress(const sockaddr *address, uint32_t length);
+        // numeric IPv4 or IPv6 addresses only, no DNS lookups
+        bool setAddress(const String &ip, uint16_t port);
+        String host(uint16_t *port = nullptr) const;
+
+        // big enough for a sockaddr_in6
+        alignas(8) unsigned char addressData[28];
+        uint32_t addressLength;
+        const unsigned char *data;
+        unsigned int size;
+    };
+
+    /**
+     * UDP. Reads up to count datagrams of at most datagramSize bytes at a
+     * time, with recvmmsg(2) where available, and delivers them through
+     * readyReadBatch() instead of readyReadFrom(). Larger datagrams are
+     * dropped and counted in SocketStats::datagramsTruncated. Pass 0 to
+     * turn it off.
+     */
+    void setUdpBatchSize(int count, int datagramSize = 2048);
+    int udpBatchSize() const;
+    /**
+     * UDP. Sends count datagrams, with sendmmsg(2) where available, and
+     * returns how many were sent or -1 on error. Datagrams that don't fit
+     * in the socket's send buffer are not queued, the caller has to retry
+     * the rest later.
+     */
+    int writeTo(const Datagram *datagrams, int count);
+    /**
+     * UDP generic segmentation and receive offload (Linux). With a
+     * segment size set each write is split into datagrams of that size by
+     * the kernel. With GRO on, the kernel may coalesce received datagrams,
+     * batched reads split them up again so datagramSize should be 64K.
+     * Both return false if the platform doesn't support them.
+     */
+    bool setUdpSegmentSize(int size);
+    bool setUdpGro(bool on);
+
     // UDP Multicast
     bool addMembership(const String &ip);
     bool dropMembership(const String &ip);
@@ -92,6 +197,7 @@ public:
 
     Signal<std::function<void(const std::shared_ptr<SocketClient>&, Buffer&&)>>& readyRead() { return mSignalReadyRead; }
     Signal<std::function<void(const std::shared_ptr<SocketClient>&, const String&, uint16_t, Buffer&&)>>& readyReadFrom() { return mSignalReadyReadFrom; }
+    Signal<std::function<void(const std::shared_ptr<SocketClient>&, const List<Datagram>&)>>& readyReadBatch() { return mSignalReadyReadBatch; }
     Signal<std::function<void(const std::shared_ptr<SocketClient>&)>>& connected() { return signalConnected; }
     Signal<std::function<void(const std::shared_ptr<SocketClient>&)>>& disconnected() { return signalDisconnected; }
     Signal<std::function<void(const std::shared_ptr<SocketClient>&, int)>>& bytesWritten() { return mSignalBytesWritten; }
@@ -113,13 +219,56 @@ public:
     size_t maxWriteBufferSize() const { return mMaxWriteBufferSize; }
     void setMaxWriteBufferSize(size_t maxWriteBufferSize) { mMaxWriteBufferSize = maxWriteBufferSize; }
 
-#ifdef RCT_SOCKETCLIENT_TIMING_ENABLED
-    double mbpsWritten() const;
-#endif
+    /**
+     * writeBlocked() is emitted when the amount of buffered, unwritten data
+     * reaches high and writeDrained() once it has gone back down to low.
+     * Pass 0 for high to turn it off.
+     */
+    void setWriteWatermarks(size_t high, size_t low);
+    size_t highWatermark() const { return mHighWatermark; }
+    size_t lowWatermark() const { return mLowWatermark; }
+    size_t pendingWrite() const;
+    bool isWriteBlocked() const { return mWriteBlocked; }
+
+    Signal<std::function<void(const std::shared_ptr<SocketClient>&)>>& writeBlocked() { return mSignalWriteBlocked; }
+    Signal<std::function<void(const std::shared_ptr<SocketClient>&)>>& writeDrained() { return mSignalWriteDrained; }
+
+    // Stops polling the socket for reading, e.g. while the socket data is
+    // forwarded to is blocked. Writing is not affected.
+    void setReadPaused(bool paused);
+    bool isReadPaused() const { return mReadPaused; }
+
+    /**
+     * Caps how fast the socket is read from or written to, pass nullptr to
+     * lift it. While the read limiter is out of bytes the socket stops
+     * polling for reading, as with setReadPaused(). Writes beyond what the
+     * write limiter allows are buffered and sent as it refills, paced by a
+     * timer. Only TCP/UNIX writes are held back, datagrams and blocking
+     * sockets count towards the limiters but don't wait for them. Datagrams
+     * are read whole and may overdraw the read limiter.
+     */
+    void setReadLimiter(const std::shared_ptr<RateLimiter> &limiter);
+    const std::shared_ptr<RateLimiter> &readLimiter() const { return mReadLimiter; }
+    void setWriteLimiter(const std::shared_ptr<RateLimiter> &limiter);
+    const std::shared_ptr<RateLimiter> &writeLimiter() const { return mWriteLimiter; }
+
+    SocketStats stats() const;
+    /**
+     * Sockets join their event loop's group, EventLoop::socketStats(), when
+     * they're created and SocketServer adds the ones it accepts to its own.
+     */
+    void addToStatsGroup(const std::shared_ptr<SocketStatsGroup> &group);
+
     bool logsEnabled() const { return mLogsEnabled; }
     void setLogsEnabled(bool on) { mLogsEnabled = on; }
 private:
     bool init(unsigned int mode);
+    bool connect(const List<DnsResolver::Address> &addresses, uint16_t port);
+    void startConnectAttempt();
+    void connectAttemptReady(int fd, bool ipv6);
+    void finishConnectAttempt(int fd, bool ipv6);
+    struct ConnectAttempts;
+    std::unique_ptr<ConnectAttempts> mConnect;
 
     int mFd { -1 };
     uint16_t mSocketPort { 0 };
@@ -130,58 +279,52 @@ private:
     bool mBlocking { false };
     bool mLogsEnabled { true };
     size_t mMaxWriteBufferSize { 0 };
+    size_t mHighWatermark { 0 }, mLowWatermark { 0 };
+    bool mWriteBlocked { false };
+    bool mReadPaused { false };
 
     Signal<std::function<void(const std::shared_ptr<SocketClient>&, Buffer&&)>> mSignalReadyRead;
     Signal<std::function<void(const std::shared_ptr<SocketClient>&, const String&, uint16_t, Buffer&&)>> mSignalReadyReadFrom;
+    Signal<std::function<void(const std::shared_ptr<SocketClient>&, const List<Datagram>&)>> mSignalReadyReadBatch;
     Signal<std::function<void(const std::shared_ptr<SocketClient>&)>>signalConnected, signalDisconnected;
     Signal<std::function<void(const std::shared_ptr<SocketClient>&, Error)>> mSignalError;
     Signal<std::function<void(const std::shared_ptr<SocketClient>&, int)>> mSignalBytesWritten;
-    void bytesWritten(const std::shared_ptr<SocketClient> &socket, uint64_t bytes);
+    Signal<std::function<void(const std::shared_ptr<SocketClient>&)>> mSignalWriteBlocked, mSignalWriteDrained;
     Buffer mReadBuffer, mWriteBuffer;
+    // what the next read starts out with, adapts to recent traffic
+    int mReadSize { BufferPool::MinBlockSize };
     size_t mWriteOffset;
 
     int writeData(const unsigned char *data, int size);
+    struct ZeroCopy;
+    std::unique_ptr<ZeroCopy> mZeroCopy;
+    bool flushZeroCopy(const std::shared_ptr<SocketClient> &socket, size_t &budget);
+    void readZeroCopyCompletions();
     void socketCallback(int, int);
-
-#ifdef RCT_SOCKETCLIENT_TIMING_ENABLED
-    struct TimeData {
-        TimeData(uint64_t b = 0)
-            : startTime(Rct::monoMs()), endTime(0), bytes(b), completed(0)
-        {}
-
-        bool add(uint64_t &available)
-        {
-            assert(completed < bytes);
-            const uint64_t needed = bytes - completed;
-            const uint64_t provided = std::min(needed, available);
-            completed += provided;
-            assert(available > provided);
-            available -= provided;
-            if (needed == provided) {
-                endTime = Rct::monoMs();
-                return true;
-            }
-            return false;
-        }
-
-        bool isCompleted() const
-        {
-            return bytes == completed;
-        }
-        uint64_t startTime, endTime, bytes, completed;
-    };
-
-    void compactWrites(size_t maxSize)
-    {
-        if (mWrites.size() > maxSize) {
-            mWrites.remove(0, mWrites.size() - maxSize);
-        }
-    }
-
-    List<TimeData> mWrites, mPendingWrites;
+    struct UdpBatch;
+    std::unique_ptr<UdpBatch> mUdpBatch;
+    bool mUdpGro { false };
+    bool readBatch(const std::shared_ptr<SocketClient> &socket);
+    unsigned int readMode() const;
+    void checkWatermarks();
+#ifndef _WIN32
+    int readUnix(void *data, unsigned int size);
+    List<int> mFileDescriptors;
 #endif
 
-    friend class Resolver;
+    SocketStats mStats;
+    SocketStats::Rate mReadRate, mWriteRate;
+    uint64_t mWriteBlockedSince { 0 };
+    List<std::shared_ptr<SocketStatsGroup> > mStatsGroups;
+    void recordRead(int e);
+    void recordWrite(int e);
+
+    std::shared_ptr<RateLimiter> mReadLimiter, mWriteLimiter;
+    int mReadTimer { -1 }, mWriteTimer { -1 };
+    bool mReadThrottled { false };
+    size_t writeBudget() const;
+    void throttleRead();
+    void throttleWrite();
 };
 
 #endif
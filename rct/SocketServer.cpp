@@ -10,6 +10,7 @@
 #  define PASSPTR(x) (reinterpret_cast<const char*>(x))
 #else
 #  include <netinet/in.h>
+#  include <netinet/tcp.h>
 #  include <sys/socket.h>
 #  include <sys/un.h>
 #  include <unistd.h>
@@ -28,7 +29,7 @@
 #include "rct/String.h"
 
 SocketServer::SocketServer()
-    : fd(-1), isIPv6(false)
+    : fd(-1), isIPv6(false), isUnix(false), statsGroup(std::make_shared<SocketStatsGroup>())
 {}
 
 SocketServer::~SocketServer()
@@ -55,6 +56,7 @@ bool SocketServer::listen(uint16_t port, Mode mode)
     close();
 
     isIPv6 = (mode & IPv6);
+    isUnix = false;
 
     fd = ::socket(isIPv6 ? AF_INET6 : AF_INET, SOCK_STREAM, 0);
     if (fd < 0) {
@@ -114,6 +116,7 @@ bool SocketServer::listen(const Path &p)
 {
     close();
 
+    isUnix = true;
     fd = ::socket(PF_UNIX, SOCK_STREAM, 0);
     if (fd < 0) {
         // bad
@@ -144,6 +147,9 @@ bool SocketServer::listenFD(int fdArg)
     close();
 
     fd = fdArg;
+    sockaddr_storage addr;
+    socklen_t size = sizeof(addr);
+    isUnix = !::getsockname(fd, reinterpret_cast<sockaddr *>(&addr), &size) && addr.ss_family == AF_UNIX;
 
     return commonListen();
 }
@@ -160,11 +166,68 @@ bool SocketServer::commonBindAndListen(sockaddr* addr, size_t size)
     return commonListen();
 }
 
+bool SocketServer::setSocketOptions(const SocketOptions &o)
+{
+    options = o;
+    if (fd == -1)
+        return true;
+    // listen() again updates the backlog
+    return applySocketOptions(fd, options, !isUnix, true) && !::listen(fd, options.backlog);
+}
+
+bool SocketServer::applySocketOptions(int fd, const SocketOptions &options, bool tcp, bool listening)
+{
+    bool ok = true;
+    auto set = [fd, &ok](int level, int name, int value) {
+        if (::setsockopt(fd, level, name, PASSPTR(&value), sizeof(value)) == -1)
+            ok = false;
+    };
+    if (options.sendBufferSize)
+        set(SOL_SOCKET, SO_SNDBUF, options.sendBufferSize);
+    if (options.receiveBufferSize)
+        set(SOL_SOCKET, SO_RCVBUF, options.receiveBufferSize);
+#ifdef SO_BUSY_POLL
+    if (options.busyPoll)
+        set(SOL_SOCKET, SO_BUSY_POLL, options.busyPoll);
+#endif
+    if (!tcp)
+        return ok;
+    if (options.noDelay)
+        set(IPPROTO_TCP, TCP_NODELAY, 1);
+    if (options.keepAlive) {
+        set(SOL_SOCKET, SO_KEEPALIVE, 1);
+#ifdef TCP_KEEPIDLE
+        if (options.keepAliveIdle)
+            set(IPPROTO_TCP, TCP_KEEPIDLE, options.keepAliveIdle);
+#endif
+#ifdef TCP_KEEPINTVL
+        if (options.keepAliveInterval)
+            set(IPPROTO_TCP, TCP_KEEPINTVL, options.keepAliveInterval);
+#endif
+#ifdef TCP_KEEPCNT
+        if (options.keepAliveCount)
+            set(IPPROTO_TCP, TCP_KEEPCNT, options.keepAliveCount);
+#endif
+    }
+#ifdef TCP_DEFER_ACCEPT
+    if (listening && options.deferAccept)
+        set(IPPROTO_TCP, TCP_DEFER_ACCEPT, options.deferAccept);
+#else
+    (void)listening;
+#endif
+    return ok;
+}
+
 bool SocketServer::commonListen()
 {
-    // ### should be able to customize the backlog
-    enum { Backlog = 128 };
-    if (::listen(fd, Backlog) < 0) {
+    // before listen(), the window scale is based on the receive buffer size
+    if (!applySocketOptions(fd, options, !isUnix, true)) {
+        serverError(this, InitializeError);
+        close();
+        return false;
+    }
+
+    if (::listen(fd, options.backlog) < 0) {
         fprintf(stderr, "::listen() failed with errno: %s\n",
                 Rct::strerror().c_str());
 
@@ -174,8 +237,9 @@ bool SocketServer::commonListen()
     }
 
     if (std::shared_ptr<EventLoop> loop = EventLoop::eventLoop()) {
-        loop->registerSocket(fd, EventLoop::SocketRead,
-                             //|EventLoop::SocketWrite,
+        // level triggered, connections left over after a batch of
+        // accepts wake us up again
+        loop->registerSocket(fd, EventLoop::SocketRead|EventLoop::SocketLevelTriggered,
                              std::bind(&SocketServer::socketCallback,
                                        this,
                                        std::placeholders::_1,
@@ -198,40 +262,47 @@ std::shared_ptr<SocketClient> SocketServer::nextConnection()
         return nullptr;
     const int sock = accepted.front();
     accepted.pop();
-    return std::shared_ptr<SocketClient>(new SocketClient(sock, path.empty() ? SocketClient::Tcp : SocketClient::Unix));
+    unsigned int mode = isUnix ? SocketClient::Unix : SocketClient::Tcp;
+#ifdef HAVE_ACCEPT4
+    mode |= SocketClient::Prepared;
+#endif
+#ifndef __linux__
+    applySocketOptions(sock, options, !isUnix, false);
+#endif
+    std::shared_ptr<SocketClient> client(new SocketClient(sock, mode));
+    client->addToStatsGroup(statsGroup);
+    return client;
 }
 
 void SocketServer::socketCallback(int /*fd*/, int mode)
 {
-    union {
-        sockaddr_in client4;
-        sockaddr_in6 client6;
-        sockaddr client;
-    };
-    socklen_t size = 0;
-    if (isIPv6) {
-        size = sizeof(client6);
-    } else {
-        size = sizeof(client4);
-    }
-    int e;
-
     if (!(mode & EventLoop::SocketRead))
         return;
 
-    for (;;) {
-        eintrwrap(e, ::accept(fd, &client, &size));
+    // bounded so a connection storm doesn't starve the other sockets
+    enum { MaxAcceptBatch = 64 };
+    for (int i = 0; i < MaxAcceptBatch; ++i) {
+        int e;
+#ifdef HAVE_ACCEPT4
+        eintrwrap(e, ::accept4(fd, nullptr, nullptr, SOCK_NONBLOCK|SOCK_CLOEXEC));
+#else
+        eintrwrap(e, ::accept(fd, nullptr, nullptr));
+#endif
         if (e == -1) {
             if (errno == EAGAIN || errno == EWOULDBLOCK) {
                 return;
+            } else if (errno == ECONNABORTED) {
+                // reset before we got to it
+                continue;
             }
             serverError(this, AcceptError);
             close();
             return;
         }
 
-        //EventLoop::eventLoop()->unregisterSocket( fd );
         accepted.push(e);
         serverNewConnection(this);
+        if (fd == -1)
+            return;
     }
 }
@@ -23,6 +23,35 @@ public:
 
     enum Mode { IPv4, IPv6 };
 
+    /**
+     * Options for the listening socket and the connections it accepts.
+     * They're set once on the listening socket, accepted sockets inherit
+     * them on Linux and are set up one by one elsewhere. TCP options are
+     * ignored for UNIX sockets. Zero leaves the system default.
+     */
+    struct SocketOptions
+    {
+        SocketOptions()
+            : backlog(128), noDelay(false), sendBufferSize(0), receiveBufferSize(0),
+              keepAlive(false), keepAliveIdle(0), keepAliveInterval(0), keepAliveCount(0),
+              deferAccept(0), busyPoll(0)
+        {}
+
+        int backlog;
+        bool noDelay;
+        int sendBufferSize, receiveBufferSize;
+        // seconds for idle and interval
+        bool keepAlive;
+        int keepAliveIdle, keepAliveInterval, keepAliveCount;
+        // seconds to wait for the first data before accepting (TCP_DEFER_ACCEPT, Linux)
+        int deferAccept;
+        // microseconds to busy poll for data on blocking reads (SO_BUSY_POLL, Linux)
+        int busyPoll;
+    };
+    // takes effect right away when listening
+    bool setSocketOptions(const SocketOptions &options);
+    const SocketOptions &socketOptions() const { return options; }
+
     void close();
     bool listen(uint16_t port, Mode mode = IPv4); // TCP
 #ifndef _WIN32
@@ -32,6 +61,8 @@ public:
     bool isListening() const { return fd != -1; }
 
     std::shared_ptr<SocketClient> nextConnection();
+    // the connections handed out by nextConnection()
+    std::shared_ptr<SocketStatsGroup> socketStats() const { return statsGroup; }
 
     Signal<std::function<void(SocketServer*)>>& newConnection() { return serverNewConnection; }
 
@@ -42,12 +73,17 @@ private:
     void socketCallback(int fd, int mode);
     bool commonBindAndListen(sockaddr* addr, size_t size);
     bool commonListen();
+    static bool applySocketOptions(int fd, const SocketOptions &options, bool tcp, bool listening);
 
 private:
     int fd;
     bool isIPv6;
+    // TCP options don't apply
+    bool isUnix;
     Path path;
+    SocketOptions options;
     std::queue<int> accepted;
+    std::shared_ptr<SocketStatsGroup> statsGroup;
     Signal<std::function<void(SocketServer*)>> serverNewConnection;
     Signal<std::function<void(SocketServer*, Error)>> serverError;
 };
@@ -0,0 +1,88 @@
+#include "SocketStats.h"
+
+#include <math.h>
+#include <algorithm>
+
+#include "SocketClient.h"
+
+SocketStats &SocketStats::operator+=(const SocketStats &other)
+{
+    bytesRead += other.bytesRead;
+    bytesWritten += other.bytesWritten;
+    reads += other.reads;
+    writes += other.writes;
+    writesBlocked += other.writesBlocked;
+    writeBlockedTime += other.writeBlockedTime;
+    peakWriteQueue = std::max(peakWriteQueue, other.peakWriteQueue);
+    datagramsTruncated += other.datagramsTruncated;
+    readRate += other.readRate;
+    writeRate += other.writeRate;
+    return *this;
+}
+
+String SocketStats::toString() const
+{
+    return String::format<256>("read %llu bytes in %llu reads (%.0f B/s), wrote %llu bytes in %llu writes (%.0f B/s), "
+                               "%llu blocked writes, %llums blocked, peak write queue %llu, %llu truncated datagrams",
+                               static_cast<unsigned long long>(bytesRead), static_cast<unsigned long long>(reads), readRate,
+                               static_cast<unsigned long long>(bytesWritten), static_cast<unsigned long long>(writes), writeRate,
+                               static_cast<unsigned long long>(writesBlocked), static_cast<unsigned long long>(writeBlockedTime),
+                               static_cast<unsigned long long>(peakWriteQueue), static_cast<unsigned long long>(datagramsTruncated));
+}
+
+void SocketStats::Rate::add(uint64_t bytes, uint64_t now)
+{
+    mRate = value(now) + bytes * 1000.0 / RateWindow;
+    mLast = now;
+}
+
+double SocketStats::Rate::value(uint64_t now) const
+{
+    if (now <= mLast)
+        return mRate;
+    return mRate * exp(-static_cast<double>(now - mLast) / RateWindow);
+}
+
+SocketStats SocketStatsGroup::totals() const
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    SocketStats ret = mClosed;
+    for (const SocketClient *socket : mSockets)
+        ret += socket->stats();
+    return ret;
+}
+
+List<std::shared_ptr<SocketClient> > SocketStatsGroup::sockets() const
+{
+    List<std::shared_ptr<SocketClient> > ret;
+    std::lock_guard<std::mutex> locker(mMutex);
+    ret.reserve(mSockets.size());
+    for (SocketClient *socket : mSockets) {
+        if (std::shared_ptr<SocketClient> shared = socket->weak_from_this().lock())
+            ret.append(shared);
+    }
+    return ret;
+}
+
+size_t SocketStatsGroup::count() const
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    return mSockets.size();
+}
+
+void SocketStatsGroup::add(SocketClient *socket)
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    mSockets.insert(socket);
+}
+
+void SocketStatsGroup::remove(SocketClient *socket, const SocketStats &stats)
+{
+    std::lock_guard<std::mutex> locker(mMutex);
+    if (mSockets.erase(socket)) {
+        SocketStats closed = stats;
+        // nothing flows through a socket that's gone
+        closed.readRate = closed.writeRate = 0;
+        mClosed += closed;
+    }
+}
@@ -0,0 +1,92 @@
+#ifndef SocketStats_h
+#define SocketStats_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <memory>
+#include <mutex>
+
+#include <rct/List.h>
+#include <rct/Set.h>
+#include <rct/String.h>
+
+class SocketClient;
+
+/**
+ * Counters every SocketClient keeps about its traffic. They cost a few
+ * additions per syscall so they're always on.
+ */
+struct SocketStats
+{
+    SocketStats()
+        : bytesRead(0), bytesWritten(0), reads(0), writes(0), writesBlocked(0),
+          writeBlockedTime(0), peakWriteQueue(0), datagramsTruncated(0), readRate(0), writeRate(0)
+    {}
+
+    uint64_t bytesRead, bytesWritten;
+    // syscalls
+    uint64_t reads, writes;
+    // writes that ran into EAGAIN
+    uint64_t writesBlocked;
+    // ms spent waiting for the socket to become writable again
+    uint64_t writeBlockedTime;
+    // the most that was buffered and waiting to be written at once
+    uint64_t peakWriteQueue;
+    // batched UDP reads that were larger than the datagram size and dropped
+    uint64_t datagramsTruncated;
+    // bytes per second, moving averages over the last few seconds
+    double readRate, writeRate;
+
+    // sums up, except for peakWriteQueue which is the highest of the two
+    SocketStats &operator+=(const SocketStats &other);
+    String toString() const;
+
+    /**
+     * Exponentially weighted moving average of bytes per second that
+     * decays with a time constant of RateWindow ms.
+     */
+    class Rate
+    {
+    public:
+        enum { RateWindow = 2000 };
+
+        Rate()
+            : mRate(0), mLast(0)
+        {}
+
+        void add(uint64_t bytes, uint64_t now);
+        double value(uint64_t now) const;
+
+    private:
+        double mRate;
+        uint64_t mLast;
+    };
+};
+
+/**
+ * A set of sockets to look at together, e.g. everything on an EventLoop
+ * or the connections accepted by a SocketServer. Sockets leave the group
+ * when they're destroyed, their counters still count towards totals().
+ * Use it from the thread the sockets belong to.
+ */
+class SocketStatsGroup
+{
+public:
+    SocketStatsGroup() {}
+
+    SocketStats totals() const;
+    // e.g. to find the connections that have the most queued up for writing
+    List<std::shared_ptr<SocketClient> > sockets() const;
+    size_t count() const;
+
+private:
+    friend class SocketClient;
+    void add(SocketClient *socket);
+    void remove(SocketClient *socket, const SocketStats &stats);
+
+    mutable std::mutex mMutex;
+    Set<SocketClient *> mSockets;
+    SocketStats mClosed;
+};
+
+#endif
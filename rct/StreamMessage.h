@@ -0,0 +1,52 @@
+#ifndef StreamMessage_h
+#define StreamMessage_h
+
+#include <stdint.h>
+
+#include <rct/Message.h>
+
+// One frame of a stream sent with Connection::sendStream()
+class StreamMessage : public Message
+{
+public:
+    enum { MessageId = StreamMessageId };
+    enum Type {
+        Invalid,
+        Begin, // data is the header passed to sendStream()
+        Data,
+        End,
+        Abort
+    };
+
+    StreamMessage(Type type = Invalid, uint32_t streamId = 0, int64_t size = -1, String &&data = String())
+        : Message(MessageId), mType(type), mStreamId(streamId), mSize(size), mData(std::move(data))
+    {
+    }
+
+    Type type() const { return static_cast<Type>(mType); }
+    uint32_t streamId() const { return mStreamId; }
+    // total size of the stream for Begin, -1 if not known up front
+    int64_t size() const { return mSize; }
+    const String &data() const { return mData; }
+
+    virtual size_t encodedSize() const override
+    {
+        return sizeof(mType) + sizeof(mStreamId) + sizeof(mSize) + sizeof(uint32_t) + mData.size();
+    }
+    virtual void encode(Serializer &s) const override
+    {
+        encodeDataHeader(s, mData.size());
+        if (!mData.empty())
+            s.write(mData);
+    }
+    // everything but the bytes of data, used to send data that isn't in memory
+    void encodeDataHeader(Serializer &s, uint32_t dataSize) const { s << mType << mStreamId << mSize << dataSize; }
+    virtual void decode(Deserializer &d) override { d >> mType >> mStreamId >> mSize >> mData; }
+private:
+    uint8_t mType;
+    uint32_t mStreamId;
+    int64_t mSize;
+    String mData;
+};
+
+#endif
@@ -0,0 +1,60 @@
+#ifndef ZeroCopyCompletions_h
+#define ZeroCopyCompletions_h
+
+#include <stdint.h>
+#include <utility>
+
+#include <rct/List.h>
+
+/**
+ * Keeps track of which MSG_ZEROCOPY sends the kernel is done with. Sends
+ * are numbered from 0 and the numbers wrap, the kernel reports ranges of
+ * them on the error queue. Ranges usually come in order, those that
+ * don't are held on to until the gap before them has been filled.
+ */
+class ZeroCopyCompletions
+{
+public:
+    // first is the number of the first send
+    ZeroCopyCompletions(uint32_t first = 0)
+        : mCompleted(first)
+    {
+    }
+
+    // sends first through last, inclusive, have completed
+    void complete(uint32_t first, uint32_t last)
+    {
+        if (static_cast<int32_t>(first - mCompleted) > 0) {
+            mAhead.append(std::make_pair(first, last));
+            return;
+        }
+        if (static_cast<int32_t>(last + 1 - mCompleted) > 0)
+            mCompleted = last + 1;
+        bool merged;
+        do {
+            merged = false;
+            for (size_t i = 0; i < mAhead.size(); ++i) {
+                if (static_cast<int32_t>(mAhead[i].first - mCompleted) <= 0) {
+                    if (static_cast<int32_t>(mAhead[i].second + 1 - mCompleted) > 0)
+                        mCompleted = mAhead[i].second + 1;
+                    mAhead.removeAt(i);
+                    merged = true;
+                    break;
+                }
+            }
+        } while (merged);
+    }
+
+    // true if send and every one before it have completed
+    bool isComplete(uint32_t send) const { return static_cast<int32_t>(mCompleted - send) > 0; }
+    // the first send that hasn't completed
+    uint32_t completed() const { return mCompleted; }
+    // ranges that came in before a gap that's still open
+    size_t pending() const { return mAhead.size(); }
+
+private:
+    uint32_t mCompleted;
+    List<std::pair<uint32_t, uint32_t> > mAhead;
+};
+
+#endif
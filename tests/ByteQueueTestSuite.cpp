@@ -0,0 +1,214 @@
+#include "ByteQueueTestSuite.h"
+
+#include <string.h>
+#include <algorithm>
+#ifndef _WIN32
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+#include <rct/Buffer.h>
+#include <rct/ByteQueue.h>
+#include <rct/String.h>
+
+// a different byte at every position for a while, so misplaced bytes show
+static String pattern(size_t size, size_t start = 0)
+{
+    String ret(size, '\0');
+    for (size_t i = 0; i < size; ++i)
+        ret[i] = static_cast<char>((start + i) % 251);
+    return ret;
+}
+
+void ByteQueueTestSuite::appendAndRead()
+{
+    ByteQueue queue;
+    CPPUNIT_ASSERT(queue.isEmpty());
+    const String data = pattern(ByteQueue::ChunkSize * 3 + 100);
+    // lots of small pieces and a few that span chunks
+    size_t pos = 0;
+    for (size_t size = 1; pos < data.size(); size = size * 3 % 7919 + 1) {
+        size = std::min(size, data.size() - pos);
+        queue.append(data.constData() + pos, size);
+        pos += size;
+        CPPUNIT_ASSERT_EQUAL(pos, queue.size());
+    }
+
+    String out(data.size(), '\0');
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(10), queue.read(out.data(), 10));
+    CPPUNIT_ASSERT_EQUAL(data.size() - 10, queue.size());
+    CPPUNIT_ASSERT_EQUAL(data.size() - 10, queue.read(out.data() + 10, out.size()));
+    CPPUNIT_ASSERT(out == data);
+    CPPUNIT_ASSERT(queue.isEmpty());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), queue.read(out.data(), 1));
+
+    // and again once it's been emptied
+    queue.append("abc", 3);
+    char buf[3];
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(3), queue.read(buf, sizeof(buf)));
+    CPPUNIT_ASSERT(!memcmp(buf, "abc", 3));
+}
+
+void ByteQueueTestSuite::peek()
+{
+    ByteQueue queue;
+    const String data = pattern(ByteQueue::ChunkSize * 2);
+    queue.append(data.constData(), data.size());
+
+    String out(100, '\0');
+    CPPUNIT_ASSERT_EQUAL(out.size(), queue.peek(out.data(), out.size()));
+    CPPUNIT_ASSERT(out == data.mid(0, 100));
+    // straddling the first chunk boundary
+    CPPUNIT_ASSERT_EQUAL(out.size(), queue.peek(out.data(), out.size(), ByteQueue::ChunkSize - 50));
+    CPPUNIT_ASSERT(out == data.mid(ByteQueue::ChunkSize - 50, 100));
+    // cut short at the end
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(20), queue.peek(out.data(), out.size(), data.size() - 20));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), queue.peek(out.data(), out.size(), data.size()));
+    CPPUNIT_ASSERT_EQUAL(data.size(), queue.size());
+}
+
+void ByteQueueTestSuite::discard()
+{
+    ByteQueue queue;
+    const String data = pattern(ByteQueue::ChunkSize + 1000);
+    queue.append(data.constData(), data.size());
+
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(ByteQueue::ChunkSize + 10), queue.discard(ByteQueue::ChunkSize + 10));
+    char buf[10];
+    CPPUNIT_ASSERT_EQUAL(sizeof(buf), queue.read(buf, sizeof(buf)));
+    CPPUNIT_ASSERT(!memcmp(buf, data.constData() + ByteQueue::ChunkSize + 10, sizeof(buf)));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(980), queue.discard(100000));
+    CPPUNIT_ASSERT(queue.isEmpty());
+}
+
+void ByteQueueTestSuite::contiguousView()
+{
+    ByteQueue queue;
+    const String data = pattern(ByteQueue::ChunkSize * 3);
+    queue.append(data.constData(), 1000);
+
+    const unsigned char *view = queue.contiguousView(500);
+    CPPUNIT_ASSERT(view == queue.contiguousView(1000));
+    CPPUNIT_ASSERT(!memcmp(view, data.constData(), 1000));
+
+    queue.append(data.constData() + 1000, data.size() - 1000);
+    queue.discard(10);
+    // spans all three chunks
+    const size_t size = ByteQueue::ChunkSize * 2 + 100;
+    view = queue.contiguousView(size);
+    CPPUNIT_ASSERT(!memcmp(view, data.constData() + 10, size));
+    CPPUNIT_ASSERT_EQUAL(data.size() - 10, queue.size());
+
+    // what was queued behind the view stays behind it
+    queue.append("tail", 4);
+    String out(data.size() - 10 + 4, '\0');
+    CPPUNIT_ASSERT_EQUAL(out.size(), queue.read(out.data(), out.size()));
+    CPPUNIT_ASSERT(out == data.mid(10) + "tail");
+}
+
+void ByteQueueTestSuite::readv()
+{
+#ifndef _WIN32
+    int fds[2];
+    CPPUNIT_ASSERT(!pipe(fds));
+    const String data = pattern(ByteQueue::ChunkSize + 500);
+    CPPUNIT_ASSERT_EQUAL(static_cast<ssize_t>(data.size()), write(fds[1], data.constData(), data.size()));
+
+    ByteQueue queue;
+    queue.append("head", 4);
+    iovec vecs[4];
+    const int count = queue.reserve(vecs, 4, data.size());
+    CPPUNIT_ASSERT(count == 2);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(ByteQueue::ChunkSize - 4), vecs[0].iov_len);
+    const ssize_t r = ::readv(fds[0], vecs, count);
+    CPPUNIT_ASSERT_EQUAL(static_cast<ssize_t>(data.size()), r);
+    queue.commit(r);
+    CPPUNIT_ASSERT_EQUAL(data.size() + 4, queue.size());
+
+    queue.append("end", 3);
+    String out(queue.size(), '\0');
+    CPPUNIT_ASSERT_EQUAL(out.size(), queue.read(out.data(), out.size()));
+    CPPUNIT_ASSERT(out == "head" + data + "end");
+    close(fds[0]);
+    close(fds[1]);
+#endif
+}
+
+static Buffer buffer(const String &data)
+{
+    Buffer ret;
+    ret.reserve(data.size());
+    memcpy(ret.data(), data.constData(), data.size());
+    ret.resize(data.size());
+    return ret;
+}
+
+void ByteQueueTestSuite::adoptBuffers()
+{
+    ByteQueue queue;
+    const String data = pattern(64 * 1024);
+    queue.append(data.constData(), 100);
+
+    // doesn't fit into the first chunk, so it's taken over
+    Buffer big = buffer(data.mid(100, 20000));
+    const unsigned char *memory = big.data();
+    queue.append(std::move(big));
+    CPPUNIT_ASSERT(big.isEmpty());
+    CPPUNIT_ASSERT(!big.data());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(20100), queue.size());
+
+    // small enough to be copied into the free space at the end
+    Buffer small = buffer(data.mid(20100, 1000));
+    const size_t capacity = small.capacity();
+    queue.append(std::move(small));
+    CPPUNIT_ASSERT_EQUAL(capacity, small.capacity());
+
+    // a frame that's entirely in the taken over memory is viewed in place
+    queue.discard(100);
+    CPPUNIT_ASSERT(queue.contiguousView(20000) == memory);
+    CPPUNIT_ASSERT(queue.contiguousView(21000) == memory);
+
+    queue.append(buffer(data.mid(21100, 30000)));
+    queue.append(data.constData() + 51100, data.size() - 51100);
+    CPPUNIT_ASSERT_EQUAL(data.size() - 100, queue.size());
+    String out(queue.size(), '\0');
+    CPPUNIT_ASSERT_EQUAL(out.size(), queue.read(out.data(), out.size()));
+    CPPUNIT_ASSERT(out == data.mid(100));
+    CPPUNIT_ASSERT(queue.isEmpty());
+}
+
+void ByteQueueTestSuite::buffers()
+{
+    Buffers buffers;
+    for (int i = 0; i < 3; ++i) {
+        Buffer buffer;
+        buffer.resize(100);
+        memset(buffer.data(), 'a' + i, 100);
+        buffers.push(std::move(buffer));
+    }
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(300), buffers.size());
+    char buf[150];
+    CPPUNIT_ASSERT_EQUAL(sizeof(buf), buffers.read(buf, sizeof(buf)));
+    CPPUNIT_ASSERT(buf[99] == 'a' && buf[100] == 'b');
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(150), buffers.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(150), buffers.read(buf, sizeof(buf) + 10));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), buffers.size());
+
+    const BufferRef ref = BufferRef::copy(pattern(300).constData(), 300);
+    buffers.push(ref.slice(0, 200));
+    buffers.push(ref.slice(200));
+    // from one buffer it's shared
+    BufferRef taken = buffers.take(150);
+    CPPUNIT_ASSERT(taken.data() == ref.data());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(150), taken.size());
+    // across two it's copied together
+    taken = buffers.take(100);
+    CPPUNIT_ASSERT(taken.data() != ref.data() + 150);
+    CPPUNIT_ASSERT(!memcmp(taken.data(), ref.data() + 150, 100));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(50), buffers.size());
+    taken = buffers.take(1000);
+    CPPUNIT_ASSERT(taken.data() == ref.data() + 250);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(50), taken.size());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), buffers.size());
+    CPPUNIT_ASSERT(buffers.take(1).isEmpty());
+}
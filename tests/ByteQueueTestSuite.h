@@ -0,0 +1,43 @@
+#ifndef BYTEQUEUETESTSUITE_H
+#define BYTEQUEUETESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class ByteQueueTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(ByteQueueTestSuite);
+    CPPUNIT_TEST(appendAndRead);
+    CPPUNIT_TEST(peek);
+    CPPUNIT_TEST(discard);
+    CPPUNIT_TEST(contiguousView);
+    CPPUNIT_TEST(readv);
+    CPPUNIT_TEST(adoptBuffers);
+    CPPUNIT_TEST(buffers);
+    CPPUNIT_TEST_SUITE_END();
+
+protected:
+    /// bytes come out in order and size() follows along, across chunks
+    void appendAndRead();
+
+    /// peeking at any offset doesn't consume
+    void peek();
+
+    /// discarding more than is queued empties the queue
+    void discard();
+
+    /// views into the first chunk are free, spanning ones are merged
+    void contiguousView();
+
+    /// reading from a pipe straight into the queue
+    void readv();
+
+    /// large buffers become chunks without being copied, small ones are copied
+    void adoptBuffers();
+
+    /// Buffers keeps its size as buffers go in and come out and shares them
+    void buffers();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ByteQueueTestSuite);
+
+#endif
@@ -0,0 +1,150 @@
+#include "ConnectionPoolTestSuite.h"
+
+#include <rct/Connection.h>
+#include <rct/ConnectionPool.h>
+#include <rct/SocketClient.h>
+
+void ConnectionPoolTestSuite::setUp()
+{
+    mDisconnected = 0;
+    SocketTestFixture::setUp();
+    mPool.reset(new ConnectionPool);
+}
+
+void ConnectionPoolTestSuite::tearDown()
+{
+    mPool.reset();
+    mAccepted.clear();
+    SocketTestFixture::tearDown();
+}
+
+void ConnectionPoolTestSuite::accepted(const std::shared_ptr<SocketClient> &client)
+{
+    client->disconnected().connect([this](const std::shared_ptr<SocketClient> &) { ++mDisconnected; });
+    mAccepted.append(client);
+}
+
+std::shared_ptr<Connection> ConnectionPoolTestSuite::acquire()
+{
+    bool called = false;
+    std::shared_ptr<Connection> ret;
+    mPool->acquire(mPath, [&](const std::shared_ptr<Connection> &connection) {
+            called = true;
+            ret = connection;
+        });
+    CPPUNIT_ASSERT(waitFor([&called]() { return called; }));
+    CPPUNIT_ASSERT(ret);
+    CPPUNIT_ASSERT(ret->isConnected());
+    return ret;
+}
+
+void ConnectionPoolTestSuite::idleReuse()
+{
+    const std::shared_ptr<Connection> first = acquire();
+    mPool->release(first);
+    CPPUNIT_ASSERT(mPool->idleCount() == 1);
+    CPPUNIT_ASSERT(acquire() == first);
+    CPPUNIT_ASSERT(mPool->idleCount() == 0);
+
+    const std::shared_ptr<Connection> second = acquire();
+    CPPUNIT_ASSERT(second != first);
+    CPPUNIT_ASSERT(mPool->connectionCount() == 2);
+    mPool->release(first);
+    mPool->release(second);
+    CPPUNIT_ASSERT(mPool->idleCount() == 2);
+    CPPUNIT_ASSERT(acquire() == second);
+    CPPUNIT_ASSERT(acquire() == first);
+
+    // not reused, closed instead
+    mPool->release(first, false);
+    CPPUNIT_ASSERT(mPool->connectionCount() == 1);
+    CPPUNIT_ASSERT(mPool->idleCount() == 0);
+    CPPUNIT_ASSERT(waitFor([this]() { return mDisconnected == 1; }));
+    CPPUNIT_ASSERT(waitFor([this]() { return mAccepted.size() == 2; }));
+}
+
+void ConnectionPoolTestSuite::waiters()
+{
+    mPool->setMaxConnections(1);
+    const std::shared_ptr<Connection> connection = acquire();
+
+    List<int> order;
+    List<std::shared_ptr<Connection> > got;
+    for (int i = 0; i < 2; ++i) {
+        mPool->acquire(mPath, [i, &order, &got](const std::shared_ptr<Connection> &conn) {
+                order.append(i);
+                got.append(conn);
+            });
+    }
+    CPPUNIT_ASSERT(mPool->pendingCount() == 2);
+    CPPUNIT_ASSERT(mPool->connectionCount() == 1);
+    CPPUNIT_ASSERT(order.isEmpty());
+
+    mPool->release(connection);
+    CPPUNIT_ASSERT(order.size() == 1);
+    CPPUNIT_ASSERT(order.first() == 0);
+    CPPUNIT_ASSERT(got.first() == connection);
+    CPPUNIT_ASSERT(mPool->pendingCount() == 1);
+
+    mPool->release(got.first());
+    CPPUNIT_ASSERT(order.size() == 2);
+    CPPUNIT_ASSERT(order.last() == 1);
+    CPPUNIT_ASSERT(got.last() == connection);
+    CPPUNIT_ASSERT(mPool->pendingCount() == 0);
+    CPPUNIT_ASSERT(mPool->connectionCount() == 1);
+}
+
+void ConnectionPoolTestSuite::connectFailure()
+{
+    const Path missing = mPath + ".missing";
+    int failed = 0;
+    for (int i = 0; i < 3; ++i) {
+        mPool->acquire(missing, [&failed](const std::shared_ptr<Connection> &connection) {
+                CPPUNIT_ASSERT(!connection);
+                ++failed;
+            });
+    }
+    CPPUNIT_ASSERT(waitFor([&failed]() { return failed == 3; }));
+    CPPUNIT_ASSERT(mPool->connectionCount() == 0);
+    CPPUNIT_ASSERT(mPool->pendingCount() == 0);
+
+    // the working endpoint isn't affected
+    mPool->release(acquire());
+    CPPUNIT_ASSERT(mPool->idleCount() == 1);
+}
+
+void ConnectionPoolTestSuite::idleExpiry()
+{
+    mPool->setIdleTimeout(50);
+    const std::shared_ptr<Connection> first = acquire(), second = acquire();
+    mPool->release(first);
+    mPool->release(second);
+    CPPUNIT_ASSERT(mPool->idleCount() == 2);
+    CPPUNIT_ASSERT(waitFor([this]() { return !mPool->idleCount(); }));
+    CPPUNIT_ASSERT(mPool->connectionCount() == 0);
+    CPPUNIT_ASSERT(!first->isConnected());
+    CPPUNIT_ASSERT(waitFor([this]() { return mDisconnected == 2; }));
+
+    // a fresh one next time
+    const std::shared_ptr<Connection> third = acquire();
+    CPPUNIT_ASSERT(third != first && third != second);
+    CPPUNIT_ASSERT(waitFor([this]() { return mAccepted.size() == 3; }));
+}
+
+void ConnectionPoolTestSuite::healthCheck()
+{
+    bool healthy = true;
+    int checks = 0;
+    mPool->setHealthCheck([&](const std::shared_ptr<Connection> &, std::function<void(bool)> &&done) {
+            ++checks;
+            done(healthy);
+        }, 20);
+    const std::shared_ptr<Connection> connection = acquire();
+    mPool->release(connection);
+    CPPUNIT_ASSERT(waitFor([&checks]() { return checks >= 2; }));
+    CPPUNIT_ASSERT(mPool->idleCount() == 1);
+
+    healthy = false;
+    CPPUNIT_ASSERT(waitFor([this]() { return !mPool->connectionCount(); }));
+    CPPUNIT_ASSERT(!connection->isConnected());
+}
@@ -0,0 +1,50 @@
+#include "SocketTestFixture.h"
+
+#include <memory>
+
+#include <rct/List.h>
+
+class Connection;
+class ConnectionPool;
+
+class ConnectionPoolTestSuite : public SocketTestFixture
+{
+    CPPUNIT_TEST_SUITE(ConnectionPoolTestSuite);
+    CPPUNIT_TEST(idleReuse);
+    CPPUNIT_TEST(waiters);
+    CPPUNIT_TEST(connectFailure);
+    CPPUNIT_TEST(idleExpiry);
+    CPPUNIT_TEST(healthCheck);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;
+    void tearDown() override;
+
+protected:
+    /// released connections are handed out again, the most recent one first
+    void idleReuse();
+
+    /// acquires over maxConnections wait and get released connections in order
+    void waiters();
+
+    /// acquires fail when the endpoint can't be connected to
+    void connectFailure();
+
+    /// idle connections are closed after the idle timeout
+    void idleExpiry();
+
+    /// idle connections that fail the health check are closed
+    void healthCheck();
+
+private:
+    void accepted(const std::shared_ptr<SocketClient> &client) override;
+    // acquires a connection and runs the loop until it's there
+    std::shared_ptr<Connection> acquire();
+
+    std::shared_ptr<ConnectionPool> mPool;
+    List<std::shared_ptr<SocketClient> > mAccepted;
+    int mDisconnected;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ConnectionPoolTestSuite);
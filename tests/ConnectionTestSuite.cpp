@@ -0,0 +1,667 @@
+#include "ConnectionTestSuite.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <rct/Connection.h>
+#include <rct/LazyMessage.h>
+#include <rct/RateLimiter.h>
+#include <rct/ResponseMessage.h>
+#include <rct/SocketClient.h>
+#include <rct/SocketServer.h>
+#include <rct/StopWatch.h>
+
+// never registered, only lazy connections take it
+class UnregisteredMessage : public Message
+{
+public:
+    enum { MessageId = 201 };
+
+    UnregisteredMessage(const String &data = String())
+        : Message(MessageId), mData(data)
+    {}
+
+    void encode(Serializer &serializer) const override { serializer << mData; }
+    void decode(Deserializer &deserializer) override { deserializer >> mData; }
+private:
+    String mData;
+};
+
+static String responseData(const std::shared_ptr<Message> &message)
+{
+    return std::static_pointer_cast<ResponseMessage>(message)->data();
+}
+
+void ConnectionTestSuite::setUp()
+{
+    mLazy = false;
+    mSharedMemoryAllowed = true;
+    SocketTestFixture::setUp();
+}
+
+void ConnectionTestSuite::tearDown()
+{
+    mHandler = nullptr;
+    mAccepted.clear();
+    SocketTestFixture::tearDown();
+}
+
+void ConnectionTestSuite::accepted(const std::shared_ptr<SocketClient> &client)
+{
+    std::shared_ptr<Connection> connection = Connection::create(client);
+    connection->setLazyMessages(mLazy);
+    connection->setSharedMemoryAllowed(mSharedMemoryAllowed);
+    connection->newMessage().connect([this](const std::shared_ptr<Message> &message,
+                                            const std::shared_ptr<Connection> &conn) {
+            if (mHandler)
+                mHandler(message, conn);
+        });
+    mAccepted.append(connection);
+}
+
+std::shared_ptr<Connection> ConnectionTestSuite::connect()
+{
+    std::shared_ptr<Connection> connection = Connection::create();
+    CPPUNIT_ASSERT(connection->connectUnix(mPath));
+    return connection;
+}
+
+void ConnectionTestSuite::request()
+{
+    // answered in reverse order
+    List<std::shared_ptr<Message> > requests;
+    mHandler = [&requests](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+        CPPUNIT_ASSERT(message->isRequest());
+        CPPUNIT_ASSERT(message->correlationId());
+        requests.append(message);
+        if (requests.size() < 3)
+            return;
+        while (!requests.isEmpty()) {
+            const std::shared_ptr<Message> request = requests.takeLast();
+            CPPUNIT_ASSERT(conn->reply(*request, ResponseMessage("re:" + responseData(request))));
+        }
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    int replies = 0;
+    for (int i = 0; i < 3; ++i) {
+        const String data = String::number(i);
+        const uint32_t id = client->request(ResponseMessage(data), [data, &replies](const std::shared_ptr<Message> &reply,
+                                                                                     Connection::RequestStatus status) {
+                CPPUNIT_ASSERT(status == Connection::RequestSuccess);
+                CPPUNIT_ASSERT(reply->isReply());
+                CPPUNIT_ASSERT(responseData(reply) == "re:" + data);
+                ++replies;
+            });
+        CPPUNIT_ASSERT(id);
+    }
+    CPPUNIT_ASSERT(client->pendingRequests() == 3);
+    CPPUNIT_ASSERT(waitFor([&replies]() { return replies == 3; }));
+    CPPUNIT_ASSERT(client->pendingRequests() == 0);
+}
+
+void ConnectionTestSuite::forward()
+{
+    for (const bool lazy : { false, true }) {
+        mLazy = lazy;
+        mHandler = [lazy](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+            CPPUNIT_ASSERT(message->isLazy() == lazy);
+            CPPUNIT_ASSERT(message->isRequest());
+            // send it back as it is, then answer it
+            CPPUNIT_ASSERT(conn->send(*message));
+            CPPUNIT_ASSERT(message->isRequest());
+            CPPUNIT_ASSERT(conn->reply(*message, ResponseMessage("reply")));
+        };
+
+        std::shared_ptr<Connection> client = connect();
+        List<std::shared_ptr<Message> > received;
+        client->newMessage().connect([&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+                received.append(message);
+            });
+        int replies = 0;
+        CPPUNIT_ASSERT(client->request(ResponseMessage("forward me"), [&replies](const std::shared_ptr<Message> &reply,
+                                                                                  Connection::RequestStatus status) {
+                    CPPUNIT_ASSERT(status == Connection::RequestSuccess);
+                    CPPUNIT_ASSERT(responseData(reply) == "reply");
+                    ++replies;
+                }));
+        CPPUNIT_ASSERT(waitFor([&]() { return replies && !received.isEmpty(); }));
+        CPPUNIT_ASSERT(replies == 1);
+        CPPUNIT_ASSERT(received.size() == 1);
+        const std::shared_ptr<Message> &echo = received.first();
+        CPPUNIT_ASSERT(!echo->isRequest());
+        CPPUNIT_ASSERT(!echo->isReply());
+        CPPUNIT_ASSERT(!echo->correlationId());
+        CPPUNIT_ASSERT(responseData(echo) == "forward me");
+    }
+}
+
+void ConnectionTestSuite::requestTimeout()
+{
+    int answered = 0;
+    mHandler = [&answered](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+        if (responseData(message) == "answer") {
+            ++answered;
+            conn->reply(*message, ResponseMessage());
+        }
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    int calls = 0;
+    Connection::RequestStatus result = Connection::RequestSuccess;
+    CPPUNIT_ASSERT(client->request(ResponseMessage("ignore"), [&](const std::shared_ptr<Message> &reply,
+                                                                  Connection::RequestStatus status) {
+                CPPUNIT_ASSERT(!reply);
+                result = status;
+                ++calls;
+            }, 50));
+    bool done = false;
+    CPPUNIT_ASSERT(client->request(ResponseMessage("answer"), [&done](const std::shared_ptr<Message> &reply,
+                                                                      Connection::RequestStatus status) {
+                CPPUNIT_ASSERT(reply);
+                CPPUNIT_ASSERT(status == Connection::RequestSuccess);
+                done = true;
+            }, 5000));
+    CPPUNIT_ASSERT(waitFor([&]() { return done && calls; }));
+    CPPUNIT_ASSERT(calls == 1);
+    CPPUNIT_ASSERT(result == Connection::RequestTimeout);
+    CPPUNIT_ASSERT(answered == 1);
+    CPPUNIT_ASSERT(client->pendingRequests() == 0);
+}
+
+void ConnectionTestSuite::cancelRequest()
+{
+    mHandler = [](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+        conn->reply(*message, ResponseMessage(responseData(message)));
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    int calls = 0;
+    Connection::RequestStatus result = Connection::RequestSuccess;
+    const uint32_t id = client->request(ResponseMessage("cancel"), [&](const std::shared_ptr<Message> &reply,
+                                                                       Connection::RequestStatus status) {
+            CPPUNIT_ASSERT(!reply);
+            result = status;
+            ++calls;
+        });
+    CPPUNIT_ASSERT(id);
+    CPPUNIT_ASSERT(client->cancelRequest(id));
+    CPPUNIT_ASSERT(calls == 1);
+    CPPUNIT_ASSERT(result == Connection::RequestCancelled);
+    CPPUNIT_ASSERT(!client->cancelRequest(id));
+    CPPUNIT_ASSERT(client->pendingRequests() == 0);
+
+    // replies come in order, once this one is back the other one has
+    // been dropped
+    bool done = false;
+    CPPUNIT_ASSERT(client->request(ResponseMessage("next"), [&done](const std::shared_ptr<Message> &reply,
+                                                                    Connection::RequestStatus) {
+                CPPUNIT_ASSERT(responseData(reply) == "next");
+                done = true;
+            }));
+    CPPUNIT_ASSERT(waitFor([&done]() { return done; }));
+    CPPUNIT_ASSERT(calls == 1);
+}
+
+void ConnectionTestSuite::requestDisconnected()
+{
+    mHandler = [](const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &conn) {
+        conn->close();
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    int calls = 0;
+    Connection::RequestStatus result = Connection::RequestSuccess;
+    for (int i = 0; i < 2; ++i) {
+        CPPUNIT_ASSERT(client->request(ResponseMessage("close"), [&](const std::shared_ptr<Message> &reply,
+                                                                     Connection::RequestStatus status) {
+                    CPPUNIT_ASSERT(!reply);
+                    result = status;
+                    ++calls;
+                }, 5000));
+    }
+    CPPUNIT_ASSERT(waitFor([&calls]() { return calls == 2; }));
+    CPPUNIT_ASSERT(result == Connection::RequestDisconnected);
+    CPPUNIT_ASSERT(client->pendingRequests() == 0);
+}
+
+void ConnectionTestSuite::sharedMemory()
+{
+    List<String> received;
+    mHandler = [&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+        received.append(responseData(message));
+        if (message->isRequest())
+            conn->reply(*message, ResponseMessage("re:" + responseData(message)));
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(client->send(ResponseMessage("before")));
+    CPPUNIT_ASSERT(client->enableSharedMemory(64 * 1024));
+    CPPUNIT_ASSERT(client->send(ResponseMessage("during")));
+    CPPUNIT_ASSERT(waitFor([&]() {
+                return client->isUsingSharedMemory() && mAccepted.size() == 1 && mAccepted.first()->isUsingSharedMemory();
+            }));
+
+    // larger than the ring, so it has to wait for the peer to make room
+    const String big(256 * 1024, 'b');
+    CPPUNIT_ASSERT(client->send(ResponseMessage(big)));
+    String reply;
+    CPPUNIT_ASSERT(client->request(ResponseMessage("after"), [&reply](const std::shared_ptr<Message> &message,
+                                                                      Connection::RequestStatus status) {
+                CPPUNIT_ASSERT(status == Connection::RequestSuccess);
+                reply = responseData(message);
+            }));
+    CPPUNIT_ASSERT(waitFor([&reply]() { return !reply.isEmpty(); }));
+    CPPUNIT_ASSERT(reply == "re:after");
+    CPPUNIT_ASSERT(received.size() == 4);
+    CPPUNIT_ASSERT(received.at(0) == "before");
+    CPPUNIT_ASSERT(received.at(1) == "during");
+    CPPUNIT_ASSERT(received.at(2) == big);
+    CPPUNIT_ASSERT(received.at(3) == "after");
+}
+
+void ConnectionTestSuite::sharedMemoryRejected()
+{
+    mSharedMemoryAllowed = false;
+    List<String> received;
+    mHandler = [&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+        received.append(responseData(message));
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(client->enableSharedMemory());
+    CPPUNIT_ASSERT(client->send(ResponseMessage("one")));
+    CPPUNIT_ASSERT(waitFor([&received]() { return received.size() == 1; }));
+    // the reject comes back before anything the server sends after it
+    mAccepted.first()->send(ResponseMessage("sync"));
+    bool synced = false;
+    client->newMessage().connect([&synced](const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &) {
+            synced = true;
+        });
+    CPPUNIT_ASSERT(waitFor([&synced]() { return synced; }));
+    CPPUNIT_ASSERT(!client->isUsingSharedMemory());
+    CPPUNIT_ASSERT(!mAccepted.first()->isUsingSharedMemory());
+
+    CPPUNIT_ASSERT(client->send(ResponseMessage("two")));
+    CPPUNIT_ASSERT(waitFor([&received]() { return received.size() == 2; }));
+    CPPUNIT_ASSERT(received.at(1) == "two");
+    // it can be asked again
+    CPPUNIT_ASSERT(client->enableSharedMemory());
+}
+
+void ConnectionTestSuite::sharedMemoryTeardown()
+{
+    mHandler = [](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &conn) {
+        if (responseData(message) == "bye") {
+            conn->send(ResponseMessage("last"));
+            conn->close();
+        }
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    List<String> received;
+    bool disconnected = false;
+    client->newMessage().connect([&](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            CPPUNIT_ASSERT(!disconnected);
+            received.append(responseData(message));
+        });
+    client->disconnected().connect([&](const std::shared_ptr<Connection> &conn) {
+            disconnected = true;
+            CPPUNIT_ASSERT(!conn->isUsingSharedMemory());
+        });
+    CPPUNIT_ASSERT(client->enableSharedMemory());
+    CPPUNIT_ASSERT(waitFor([&]() {
+                return client->isUsingSharedMemory() && mAccepted.first()->isUsingSharedMemory();
+            }));
+
+    CPPUNIT_ASSERT(client->send(ResponseMessage("bye")));
+    CPPUNIT_ASSERT(waitFor([&disconnected]() { return disconnected; }));
+    CPPUNIT_ASSERT(received.size() == 1);
+    CPPUNIT_ASSERT(received.first() == "last");
+    CPPUNIT_ASSERT(!mAccepted.first()->isUsingSharedMemory());
+}
+
+void ConnectionTestSuite::sharedMemoryLazy()
+{
+    mLazy = true;
+    List<std::shared_ptr<Message> > received;
+    mHandler = [&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+        received.append(message);
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(client->enableSharedMemory());
+    CPPUNIT_ASSERT(waitFor([&]() {
+                return client->isUsingSharedMemory() && mAccepted.size() == 1 && mAccepted.first()->isUsingSharedMemory();
+            }));
+
+    const UnregisteredMessage message("lazy");
+    CPPUNIT_ASSERT(client->send(message));
+    CPPUNIT_ASSERT(client->send(ResponseMessage("lazy too")));
+    CPPUNIT_ASSERT(waitFor([&received]() { return received.size() == 2; }));
+    CPPUNIT_ASSERT(received.at(0)->isLazy());
+    CPPUNIT_ASSERT(received.at(0)->messageId() == UnregisteredMessage::MessageId);
+    const std::shared_ptr<LazyMessage> lazy = std::static_pointer_cast<LazyMessage>(received.at(0));
+    CPPUNIT_ASSERT(static_cast<size_t>(lazy->payloadSize()) == message.encodedSize());
+    CPPUNIT_ASSERT(received.at(1)->isLazy());
+    CPPUNIT_ASSERT(responseData(std::static_pointer_cast<LazyMessage>(received.at(1))->message()) == "lazy too");
+}
+
+void ConnectionTestSuite::sharedMemoryWrap()
+{
+    List<String> received;
+    mHandler = [&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+        received.append(responseData(message));
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(client->enableSharedMemory(64 * 1024));
+    CPPUNIT_ASSERT(waitFor([&]() {
+                return client->isUsingSharedMemory() && mAccepted.size() == 1 && mAccepted.first()->isUsingSharedMemory();
+            }));
+
+    // sizes that don't divide the ring so frames keep landing across its end
+    List<String> sent;
+    for (int i = 0; i < 200; ++i) {
+        sent.append(String((i * 7919) % 20000 + 1, static_cast<char>('a' + i % 26)));
+        CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+        if (i % 50 == 49)
+            CPPUNIT_ASSERT(waitFor([&]() { return received.size() == sent.size(); }));
+    }
+    CPPUNIT_ASSERT(waitFor([&]() { return received.size() == sent.size(); }));
+    CPPUNIT_ASSERT(received == sent);
+    CPPUNIT_ASSERT(waitFor([&client]() { return !client->pendingWrite(); }));
+}
+
+void ConnectionTestSuite::streamWindow()
+{
+    enum {
+        Window = 64 * 1024,
+        ChunkSize = 16 * 1024,
+        Size = 1024 * 1024 + 123
+    };
+    // past what 32 bits can hold
+    const int64_t huge = 5ll * 1024 * 1024 * 1024;
+
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(waitFor([this]() { return mAccepted.size() == 1; }));
+    struct Received
+    {
+        String header, data;
+        int64_t size;
+        int chunks;
+        bool ended, aborted;
+    };
+    Hash<uint32_t, Received> streams;
+    mAccepted.first()->streamChunk().connect([&streams](std::shared_ptr<Connection>, const Connection::StreamChunk &chunk) {
+            Received &stream = streams[chunk.streamId];
+            switch (chunk.event) {
+            case Connection::StreamBegin:
+                stream = { chunk.data, String(), chunk.size, 0, false, false };
+                break;
+            case Connection::StreamData:
+                CPPUNIT_ASSERT(!stream.ended && !stream.aborted);
+                CPPUNIT_ASSERT(chunk.size == stream.size);
+                CPPUNIT_ASSERT(chunk.offset == static_cast<int64_t>(stream.data.size()));
+                stream.data += chunk.data;
+                ++stream.chunks;
+                break;
+            case Connection::StreamEnd:
+                CPPUNIT_ASSERT(chunk.offset == static_cast<int64_t>(stream.data.size()));
+                stream.ended = true;
+                break;
+            case Connection::StreamAborted:
+                CPPUNIT_ASSERT(chunk.offset == static_cast<int64_t>(stream.data.size()));
+                stream.aborted = true;
+                break;
+            }
+        });
+
+    client->setStreamWindow(Window);
+    client->setStreamChunkSize(ChunkSize);
+    String contents(Size, '\0');
+    for (size_t i = 0; i < contents.size(); ++i)
+        contents[i] = static_cast<char>((i * 13) % 251);
+    size_t generated = 0;
+    int callbacks = 0;
+    bool success = false;
+    const uint32_t id = client->sendStream([&](char *data, int max) -> int {
+            // only asked for more while the window has room
+            CPPUNIT_ASSERT(client->pendingWrite() < Window);
+            CPPUNIT_ASSERT(max <= ChunkSize);
+            const size_t count = std::min<size_t>(max, contents.size() - generated);
+            memcpy(data, contents.constData() + generated, count);
+            generated += count;
+            return count;
+        }, Size, "header", [&](const std::shared_ptr<Connection> &, uint32_t streamId, bool ok) {
+            CPPUNIT_ASSERT(streamId == id);
+            success = ok;
+            ++callbacks;
+        });
+    CPPUNIT_ASSERT(id);
+    // the window holds only the first few chunks back
+    CPPUNIT_ASSERT(generated < contents.size());
+    CPPUNIT_ASSERT(waitFor([&]() { return streams[id].ended; }));
+    CPPUNIT_ASSERT(callbacks == 1);
+    CPPUNIT_ASSERT(success);
+    CPPUNIT_ASSERT(streams[id].header == "header");
+    CPPUNIT_ASSERT(streams[id].size == Size);
+    CPPUNIT_ASSERT(streams[id].chunks == (Size + ChunkSize - 1) / ChunkSize);
+    CPPUNIT_ASSERT(streams[id].data == contents);
+    CPPUNIT_ASSERT(!client->pendingStreams());
+
+    // a size that needs 64 bits makes it across, the generator gives up
+    // early so the stream is aborted rather than sent in full
+    int produced = 0;
+    const uint32_t hugeId = client->sendStream([&produced](char *data, int max) -> int {
+            if (produced == 3)
+                return -1;
+            memset(data, 'h', max);
+            ++produced;
+            return max;
+        }, huge);
+    CPPUNIT_ASSERT(hugeId);
+    CPPUNIT_ASSERT(waitFor([&]() { return streams[hugeId].aborted; }));
+    CPPUNIT_ASSERT(streams[hugeId].size == huge);
+    CPPUNIT_ASSERT(streams[hugeId].chunks == 3);
+    CPPUNIT_ASSERT(streams[hugeId].data == String(3 * ChunkSize, 'h'));
+
+    // file offsets past 4G, in a sparse file so it doesn't take up the space
+    const Path file = mPath + ".sparse";
+    const int fd = ::open(file.constData(), O_CREAT | O_TRUNC | O_WRONLY, 0600);
+    CPPUNIT_ASSERT(fd != -1);
+    const bool written = ::pwrite(fd, contents.constData(), contents.size(), huge) == static_cast<ssize_t>(contents.size());
+    ::close(fd);
+    if (written) {
+        const uint32_t fileId = client->sendFile(file, huge + 100, Size - 100);
+        CPPUNIT_ASSERT(fileId);
+        CPPUNIT_ASSERT(waitFor([&]() { return streams[fileId].ended; }));
+        CPPUNIT_ASSERT(streams[fileId].size == Size - 100);
+        CPPUNIT_ASSERT(streams[fileId].data == contents.mid(100));
+    }
+    Path::rm(file);
+}
+
+void ConnectionTestSuite::streamFileLimited()
+{
+    const Path file = mPath + ".file";
+    String contents(512 * 1024, '\0');
+    for (size_t i = 0; i < contents.size(); ++i)
+        contents[i] = static_cast<char>(i * 7);
+    CPPUNIT_ASSERT(Rct::writeFile(file, contents));
+
+    String received;
+    bool done = false;
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(waitFor([this]() { return mAccepted.size() == 1; }));
+    mAccepted.first()->streamChunk().connect([&](std::shared_ptr<Connection>, const Connection::StreamChunk &chunk) {
+            if (chunk.event == Connection::StreamData) {
+                CPPUNIT_ASSERT(chunk.offset == static_cast<int64_t>(received.size()));
+                received += chunk.data;
+            } else if (chunk.event == Connection::StreamEnd) {
+                done = true;
+            }
+        });
+
+    // 2MB/s with a 64K burst, about a fifth of a second for all of it
+    client->client()->setWriteLimiter(std::make_shared<RateLimiter>(2 * 1024 * 1024, 64 * 1024));
+    StopWatch sw;
+    CPPUNIT_ASSERT(client->sendFile(file));
+    CPPUNIT_ASSERT(waitFor([&done]() { return done; }));
+    CPPUNIT_ASSERT(sw.elapsed() >= 150);
+    CPPUNIT_ASSERT(received == contents);
+    CPPUNIT_ASSERT(client->client()->stats().bytesWritten > contents.size());
+    Path::rm(file);
+}
+
+void ConnectionTestSuite::unixSocketOptions()
+{
+    SocketServer::SocketOptions options;
+    options.noDelay = true;
+    options.keepAlive = true;
+    options.keepAliveIdle = 30;
+    options.deferAccept = 5;
+    options.receiveBufferSize = 64 * 1024;
+
+    const Path path = mPath + ".options";
+    SocketServer server;
+    bool failed = false;
+    server.error().connect([&failed](SocketServer *, SocketServer::Error) { failed = true; });
+    CPPUNIT_ASSERT(server.setSocketOptions(options));
+    CPPUNIT_ASSERT(server.listen(path));
+    CPPUNIT_ASSERT(server.isListening());
+    CPPUNIT_ASSERT(server.setSocketOptions(options));
+
+    std::shared_ptr<Connection> accepted;
+    String received;
+    server.newConnection().connect([&accepted, &received](SocketServer *s) {
+            accepted = Connection::create(s->nextConnection());
+            accepted->newMessage().connect([&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+                    received = responseData(message);
+                });
+        });
+    std::shared_ptr<Connection> client = Connection::create();
+    CPPUNIT_ASSERT(client->connectUnix(path));
+    CPPUNIT_ASSERT(client->send(ResponseMessage("options")));
+    CPPUNIT_ASSERT(waitFor([&received]() { return !received.isEmpty(); }));
+    CPPUNIT_ASSERT(received == "options");
+    CPPUNIT_ASSERT(!failed);
+}
+
+void ConnectionTestSuite::writeWatermarks()
+{
+    List<String> received;
+    mHandler = [&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+        received.append(responseData(message));
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(waitFor([this]() { return mAccepted.size() == 1; }));
+    const std::shared_ptr<Connection> server = mAccepted.first();
+    int blocked = 0, drained = 0;
+    client->writeBlocked().connect([&blocked](std::shared_ptr<Connection>) { ++blocked; });
+    client->writeDrained().connect([&drained](std::shared_ptr<Connection>) { ++drained; });
+    List<String> fromServer;
+    client->newMessage().connect([&fromServer](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+            fromServer.append(responseData(message));
+        });
+    client->setWriteWatermarks(1024 * 1024, 256 * 1024, true);
+
+    List<String> sent;
+    for (int crossing = 1; crossing <= 2; ++crossing) {
+        // with the server not reading everything piles up on the client
+        server->client()->setReadPaused(true);
+        while (!client->isWriteBlocked() && sent.size() < 100) {
+            sent.append(String(64 * 1024, static_cast<char>('a' + sent.size() % 26)));
+            CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+        }
+        CPPUNIT_ASSERT(client->isWriteBlocked());
+        CPPUNIT_ASSERT(client->pendingWrite() >= client->highWatermark());
+        // staying above the high watermark doesn't signal again
+        for (int i = 0; i < 4; ++i) {
+            sent.append(String(64 * 1024, static_cast<char>('a' + sent.size() % 26)));
+            CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+        }
+        CPPUNIT_ASSERT_EQUAL(crossing, blocked);
+        CPPUNIT_ASSERT_EQUAL(crossing - 1, drained);
+
+        // the client doesn't read while it's blocked
+        CPPUNIT_ASSERT(client->client()->isReadPaused());
+        const String ping = "ping " + String::number(crossing);
+        CPPUNIT_ASSERT(server->send(ResponseMessage(ping)));
+        StopWatch sw;
+        waitFor([&sw]() { return sw.elapsed() >= 100; });
+        CPPUNIT_ASSERT_EQUAL(crossing - 1, static_cast<int>(fromServer.size()));
+
+        server->client()->setReadPaused(false);
+        CPPUNIT_ASSERT(waitFor([&drained, crossing]() { return drained == crossing; }));
+        CPPUNIT_ASSERT(!client->isWriteBlocked());
+        CPPUNIT_ASSERT(client->pendingWrite() <= client->lowWatermark());
+        CPPUNIT_ASSERT_EQUAL(crossing, blocked);
+        CPPUNIT_ASSERT(!client->client()->isReadPaused());
+        CPPUNIT_ASSERT(waitFor([&fromServer, crossing]() { return static_cast<int>(fromServer.size()) == crossing; }));
+        CPPUNIT_ASSERT(fromServer.last() == ping);
+    }
+    CPPUNIT_ASSERT(waitFor([&]() { return received.size() == sent.size(); }));
+    CPPUNIT_ASSERT(received == sent);
+}
+
+void ConnectionTestSuite::cork()
+{
+    List<String> received;
+    mHandler = [&received](const std::shared_ptr<Message> &message, const std::shared_ptr<Connection> &) {
+        received.append(responseData(message));
+    };
+
+    std::shared_ptr<Connection> client = connect();
+    CPPUNIT_ASSERT(waitFor([this]() { return mAccepted.size() == 1; }));
+    const std::shared_ptr<SocketClient> socket = client->client();
+    client->setCorked(true, 16 * 1024);
+    CPPUNIT_ASSERT(client->isCorked());
+
+    List<String> sent;
+    uint64_t writes = socket->stats().writes;
+    for (int i = 0; i < 10; ++i) {
+        sent.append("corked " + String::number(i));
+        CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+    }
+    CPPUNIT_ASSERT_EQUAL(writes, socket->stats().writes);
+    CPPUNIT_ASSERT(client->pendingWrite() > 0);
+    CPPUNIT_ASSERT(waitFor([&]() { return received.size() == sent.size(); }));
+    CPPUNIT_ASSERT_EQUAL(writes + 1, socket->stats().writes);
+    CPPUNIT_ASSERT(received == sent);
+
+    // past the threshold it's written without waiting for the loop
+    writes = socket->stats().writes;
+    for (int i = 0; i < 3; ++i) {
+        sent.append(String(4000, static_cast<char>('a' + i)));
+        CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+    }
+    CPPUNIT_ASSERT_EQUAL(writes, socket->stats().writes);
+    for (int i = 3; i < 5; ++i) {
+        sent.append(String(4000, static_cast<char>('a' + i)));
+        CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+    }
+    CPPUNIT_ASSERT_EQUAL(writes + 1, socket->stats().writes);
+    // what comes after that is collected again
+    sent.append("after the threshold");
+    CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+    CPPUNIT_ASSERT_EQUAL(writes + 1, socket->stats().writes);
+    CPPUNIT_ASSERT(waitFor([&]() { return received.size() == sent.size(); }));
+    CPPUNIT_ASSERT_EQUAL(writes + 2, socket->stats().writes);
+    CPPUNIT_ASSERT(received == sent);
+
+    // flush() and uncorking don't wait either
+    writes = socket->stats().writes;
+    sent.append("flushed");
+    CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+    CPPUNIT_ASSERT(client->flush());
+    CPPUNIT_ASSERT_EQUAL(writes + 1, socket->stats().writes);
+    sent.append("uncorked");
+    CPPUNIT_ASSERT(client->send(ResponseMessage(sent.last())));
+    client->setCorked(false);
+    CPPUNIT_ASSERT_EQUAL(writes + 2, socket->stats().writes);
+    CPPUNIT_ASSERT(waitFor([&]() { return received.size() == sent.size(); }));
+    CPPUNIT_ASSERT(received == sent);
+}
@@ -0,0 +1,92 @@
+#include "SocketTestFixture.h"
+
+#include <functional>
+#include <memory>
+
+#include <rct/List.h>
+
+class Connection;
+class Message;
+
+class ConnectionTestSuite : public SocketTestFixture
+{
+    CPPUNIT_TEST_SUITE(ConnectionTestSuite);
+    CPPUNIT_TEST(request);
+    CPPUNIT_TEST(forward);
+    CPPUNIT_TEST(requestTimeout);
+    CPPUNIT_TEST(cancelRequest);
+    CPPUNIT_TEST(requestDisconnected);
+    CPPUNIT_TEST(sharedMemory);
+    CPPUNIT_TEST(sharedMemoryRejected);
+    CPPUNIT_TEST(sharedMemoryTeardown);
+    CPPUNIT_TEST(sharedMemoryLazy);
+    CPPUNIT_TEST(sharedMemoryWrap);
+    CPPUNIT_TEST(streamWindow);
+    CPPUNIT_TEST(streamFileLimited);
+    CPPUNIT_TEST(unixSocketOptions);
+    CPPUNIT_TEST(writeWatermarks);
+    CPPUNIT_TEST(cork);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;
+    void tearDown() override;
+
+protected:
+    /// replies find their way back to the callback of their request
+    void request();
+
+    /// sending a received request or lazy message on doesn't send its correlation id
+    void forward();
+
+    /// requests without a reply fail once their timeout is up
+    void requestTimeout();
+
+    /// a cancelled request fails right away and ignores its reply
+    void cancelRequest();
+
+    /// outstanding requests fail when the connection goes away
+    void requestDisconnected();
+
+    /// both sides switch to the rings and messages keep their order
+    void sharedMemory();
+
+    /// a peer that doesn't allow shared memory keeps using the socket
+    void sharedMemoryRejected();
+
+    /// the rings are dropped once the peer is gone, after delivering what's in them
+    void sharedMemoryTeardown();
+
+    /// lazy connections stay lazy on shared memory
+    void sharedMemoryLazy();
+
+    /// frames serialized in place and ones copied around the end of the ring stay in order
+    void sharedMemoryWrap();
+
+    /// a stream much larger than its window arrives chunk by chunk and in order, 64-bit sizes and offsets included
+    void streamWindow();
+
+    /// files streamed with sendfile() stay within the write limiter and are counted
+    void streamFileLimited();
+
+    /// TCP socket options are left alone on UNIX servers rather than failing them
+    void unixSocketOptions();
+
+    /// writeBlocked() and writeDrained() fire once per crossing and reads pause in between
+    void writeWatermarks();
+
+    /// corked sends go out in one write once the loop comes around, or right away past the threshold
+    void cork();
+
+private:
+    void accepted(const std::shared_ptr<SocketClient> &client) override;
+    std::shared_ptr<Connection> connect();
+
+    List<std::shared_ptr<Connection> > mAccepted;
+    // called for messages the server side receives
+    std::function<void(const std::shared_ptr<Message> &, const std::shared_ptr<Connection> &)> mHandler;
+    // for accepted connections
+    bool mLazy, mSharedMemoryAllowed;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ConnectionTestSuite);
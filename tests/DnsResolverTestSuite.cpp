@@ -0,0 +1,296 @@
+#include "DnsResolverTestSuite.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <rct/DnsResolver.h>
+#include <rct/EventLoop.h>
+#include <rct/Path.h>
+#include <rct/SocketClient.h>
+
+// records served by the stub name server, everything else is NXDOMAIN
+static const struct {
+    const char *name;
+    int family;
+    const char *address;
+} records[] = {
+    { "stub.test", AF_INET, "10.1.2.3" },
+    { "stub.test", AF_INET6, "2001:db8::1" },
+    // 100::/64 is the discard prefix, connects there never succeed
+    { "eyeballs.test", AF_INET6, "100::1" },
+    { "eyeballs.test", AF_INET, "127.0.0.1" },
+    { nullptr, 0, nullptr }
+};
+
+void DnsResolverTestSuite::setUp()
+{
+    mServerFd = socket(AF_INET, SOCK_DGRAM, 0);
+    CPPUNIT_ASSERT(mServerFd != -1);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    CPPUNIT_ASSERT(bind(mServerFd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+    socklen_t len = sizeof(addr);
+    CPPUNIT_ASSERT(getsockname(mServerFd, reinterpret_cast<sockaddr *>(&addr), &len) == 0);
+    mServerPort = ntohs(addr.sin_port);
+    mServerStopped = false;
+    mQueries = 0;
+    mServerThread = std::thread(&DnsResolverTestSuite::serve, this);
+}
+
+void DnsResolverTestSuite::tearDown()
+{
+    mServerStopped = true;
+    mServerThread.join();
+    close(mServerFd);
+}
+
+void DnsResolverTestSuite::serve()
+{
+    while (!mServerStopped) {
+        pollfd pfd = { mServerFd, POLLIN, 0 };
+        if (poll(&pfd, 1, 50) <= 0)
+            continue;
+        unsigned char query[512];
+        sockaddr_storage from;
+        socklen_t fromLen = sizeof(from);
+        const ssize_t size = recvfrom(mServerFd, query, sizeof(query), 0, reinterpret_cast<sockaddr *>(&from), &fromLen);
+        if (size < 17)
+            continue;
+        ++mQueries;
+
+        String name;
+        size_t pos = 12;
+        while (pos < static_cast<size_t>(size) && query[pos]) {
+            if (!name.isEmpty())
+                name += '.';
+            name.append(reinterpret_cast<const char *>(query) + pos + 1, query[pos]);
+            pos += query[pos] + 1;
+        }
+        pos += 5; // terminator, type and class
+        const int type = query[pos - 3];
+
+        String response(reinterpret_cast<const char *>(query), pos);
+        response[2] = static_cast<char>(0x81);
+        response[3] = static_cast<char>(0x80);
+        int answers = 0;
+        bool known = false;
+        for (int i = 0; records[i].name; ++i) {
+            if (name != records[i].name)
+                continue;
+            known = true;
+            if ((type == 1) != (records[i].family == AF_INET))
+                continue;
+            unsigned char rdata[16];
+            inet_pton(records[i].family, records[i].address, rdata);
+            const int length = records[i].family == AF_INET ? 4 : 16;
+            const char answer[] = {
+                static_cast<char>(0xc0), 12, // name points to the question
+                0, static_cast<char>(type), 0, 1,
+                0, 0, 0, 30, // ttl
+                0, static_cast<char>(length)
+            };
+            response.append(answer, sizeof(answer));
+            response.append(reinterpret_cast<const char *>(rdata), length);
+            ++answers;
+        }
+        if (!known)
+            response[3] = static_cast<char>(0x83);
+        response[7] = static_cast<char>(answers);
+        sendto(mServerFd, response.constData(), response.size(), 0, reinterpret_cast<sockaddr *>(&from), fromLen);
+    }
+}
+
+static List<String> toStrings(const List<DnsResolver::Address> &addresses)
+{
+    List<String> ret;
+    for (const DnsResolver::Address &address : addresses)
+        ret.append(address.toString());
+    return ret;
+}
+
+void DnsResolverTestSuite::numeric()
+{
+    DnsResolver resolver;
+    resolver.setNameServers(List<String>() << String::format<32>("127.0.0.1:%d", mServerPort));
+    List<String> addresses = toStrings(resolver.lookup("192.168.1.1"));
+    CPPUNIT_ASSERT(addresses.size() == 1 && addresses.first() == "192.168.1.1");
+    addresses = toStrings(resolver.lookup("::1"));
+    CPPUNIT_ASSERT(addresses.size() == 1 && addresses.first() == "::1");
+    CPPUNIT_ASSERT(resolver.lookup("::1", Rct::IPv4).isEmpty());
+    CPPUNIT_ASSERT(mQueries == 0);
+    CPPUNIT_ASSERT(resolver.cacheSize() == 0);
+}
+
+void DnsResolverTestSuite::systemHosts()
+{
+    DnsResolver resolver;
+    const List<String> addresses = toStrings(resolver.lookup("localhost"));
+    CPPUNIT_ASSERT(!addresses.isEmpty());
+    CPPUNIT_ASSERT(addresses.contains("127.0.0.1") || addresses.contains("::1"));
+
+    bool ok;
+    CPPUNIT_ASSERT(Rct::nameLookup("localhost", Rct::IPv4, &ok) == "127.0.0.1");
+    CPPUNIT_ASSERT(ok);
+    Rct::addrLookup("127.0.0.1", Rct::Auto, &ok);
+    CPPUNIT_ASSERT(ok);
+    Rct::nameLookup("does-not-exist.invalid", Rct::IPv4, &ok);
+    CPPUNIT_ASSERT(!ok);
+}
+
+void DnsResolverTestSuite::hostsFile()
+{
+    const Path hosts = "dnsresolver_hosts";
+    CPPUNIT_ASSERT(Path::write(hosts, "# comment\n10.9.8.7\thosted.test alias.test # trailing\nfe80::2 hosted.test\n"));
+
+    DnsResolver resolver;
+    resolver.setHostsFile(hosts);
+    resolver.setNameServers(List<String>() << String::format<32>("127.0.0.1:%d", mServerPort));
+    List<String> addresses = toStrings(resolver.lookup("ALIAS.test"));
+    CPPUNIT_ASSERT(addresses.size() == 1 && addresses.first() == "10.9.8.7");
+    addresses = toStrings(resolver.lookup("hosted.test"));
+    CPPUNIT_ASSERT(addresses.size() == 2 && addresses.at(0) == "10.9.8.7" && addresses.at(1) == "fe80::2");
+    CPPUNIT_ASSERT(mQueries == 0);
+    Path::rm(hosts);
+}
+
+void DnsResolverTestSuite::nameServer()
+{
+    DnsResolver resolver;
+    resolver.setHostsFile(Path());
+    // the first server doesn't exist
+    resolver.setTimeout(200);
+    resolver.setNameServers(List<String>() << "127.0.0.1:1" << String::format<32>("127.0.0.1:%d", mServerPort));
+    const List<String> addresses = toStrings(resolver.lookup("stub.test."));
+    CPPUNIT_ASSERT(addresses.size() == 2);
+    CPPUNIT_ASSERT(addresses.at(0) == "2001:db8::1");
+    CPPUNIT_ASSERT(addresses.at(1) == "10.1.2.3");
+    CPPUNIT_ASSERT(toStrings(resolver.lookup("stub.test", Rct::IPv4)) == (List<String>() << "10.1.2.3"));
+    CPPUNIT_ASSERT(resolver.lookup("missing.test").isEmpty());
+}
+
+void DnsResolverTestSuite::cache()
+{
+    DnsResolver resolver;
+    resolver.setHostsFile(Path());
+    resolver.setNameServers(List<String>() << String::format<32>("127.0.0.1:%d", mServerPort));
+
+    List<DnsResolver::Address> addresses;
+    CPPUNIT_ASSERT(!resolver.cached("stub.test", Rct::Auto, &addresses));
+    CPPUNIT_ASSERT(resolver.lookup("stub.test").size() == 2);
+    const int queries = mQueries;
+    CPPUNIT_ASSERT(queries == 2);
+    CPPUNIT_ASSERT(resolver.cached("Stub.Test", Rct::IPv6, &addresses) && addresses.size() == 1);
+    CPPUNIT_ASSERT(resolver.lookup("stub.test").size() == 2);
+    CPPUNIT_ASSERT(mQueries == queries);
+
+    CPPUNIT_ASSERT(resolver.lookup("missing.test").isEmpty());
+    CPPUNIT_ASSERT(resolver.lookup("missing.test").isEmpty());
+    CPPUNIT_ASSERT(mQueries == queries + 2);
+    CPPUNIT_ASSERT(resolver.cached("missing.test", Rct::Auto, &addresses) && addresses.isEmpty());
+
+    resolver.clearCache();
+    resolver.setTtl(0);
+    resolver.lookup("stub.test");
+    resolver.lookup("stub.test");
+    CPPUNIT_ASSERT(mQueries == queries + 6);
+
+    resolver.setTtl(60 * 1000);
+    resolver.setMaxCacheSize(1);
+    resolver.lookup("stub.test");
+    resolver.lookup("eyeballs.test");
+    CPPUNIT_ASSERT(resolver.cacheSize() == 1);
+}
+
+void DnsResolverTestSuite::asyncLookup()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    DnsResolver resolver;
+    resolver.setHostsFile(Path());
+    resolver.setNameServers(List<String>() << String::format<32>("127.0.0.1:%d", mServerPort));
+
+    const std::thread::id thread = std::this_thread::get_id();
+    int callbacks = 0;
+    bool wrongThread = false;
+    List<String> results[3];
+    auto callback = [&](int idx, const String &host, const List<DnsResolver::Address> &addresses) {
+        wrongThread = wrongThread || std::this_thread::get_id() != thread || host.isEmpty();
+        results[idx] = toStrings(addresses);
+        if (++callbacks == 3)
+            loop->quit();
+    };
+    resolver.lookup("stub.test", Rct::Auto, std::bind(callback, 0, std::placeholders::_1, std::placeholders::_2));
+    resolver.lookup("stub.test", Rct::IPv4, std::bind(callback, 1, std::placeholders::_1, std::placeholders::_2));
+    resolver.lookup("missing.test", Rct::Auto, std::bind(callback, 2, std::placeholders::_1, std::placeholders::_2));
+    // nothing is called back right away
+    CPPUNIT_ASSERT(callbacks == 0);
+    loop->exec(2000);
+
+    CPPUNIT_ASSERT(callbacks == 3);
+    CPPUNIT_ASSERT(!wrongThread);
+    CPPUNIT_ASSERT(results[0].size() == 2);
+    CPPUNIT_ASSERT(results[1] == (List<String>() << "10.1.2.3"));
+    CPPUNIT_ASSERT(results[2].isEmpty());
+    // both stub.test lookups were answered by the same queries
+    CPPUNIT_ASSERT(mQueries == 4);
+}
+
+void DnsResolverTestSuite::happyEyeballs()
+{
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    const int listener = socket(AF_INET, SOCK_STREAM, 0);
+    CPPUNIT_ASSERT(listener != -1);
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    socklen_t len = sizeof(addr);
+    CPPUNIT_ASSERT(bind(listener, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0);
+    CPPUNIT_ASSERT(listen(listener, 4) == 0);
+    CPPUNIT_ASSERT(getsockname(listener, reinterpret_cast<sockaddr *>(&addr), &len) == 0);
+
+    DnsResolver &resolver = DnsResolver::instance();
+    const List<String> nameServers = resolver.nameServers();
+    const Path hostsFile = resolver.hostsFile();
+    resolver.setHostsFile(Path());
+    resolver.setNameServers(List<String>() << String::format<32>("127.0.0.1:%d", mServerPort));
+
+    bool connected = false, failed = false;
+    std::shared_ptr<SocketClient> client(new SocketClient);
+    client->connected().connect([&](const std::shared_ptr<SocketClient> &) {
+            connected = true;
+            loop->quit();
+        });
+    client->error().connect([&](const std::shared_ptr<SocketClient> &, SocketClient::Error) {
+            failed = true;
+            loop->quit();
+        });
+    CPPUNIT_ASSERT(client->connect("eyeballs.test", ntohs(addr.sin_port)));
+    CPPUNIT_ASSERT(client->state() == SocketClient::Connecting);
+    // buffered until connected
+    CPPUNIT_ASSERT(client->write("hello"));
+    loop->exec(3000);
+
+    resolver.setNameServers(nameServers);
+    resolver.setHostsFile(hostsFile);
+    resolver.clearCache();
+
+    CPPUNIT_ASSERT(connected && !failed);
+    CPPUNIT_ASSERT(client->peerName() == "127.0.0.1");
+    const int fd = accept(listener, nullptr, nullptr);
+    CPPUNIT_ASSERT(fd != -1);
+    char buf[16];
+    CPPUNIT_ASSERT(read(fd, buf, sizeof(buf)) == 5 && !memcmp(buf, "hello", 5));
+    close(fd);
+    close(listener);
+}
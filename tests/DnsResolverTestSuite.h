@@ -0,0 +1,54 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <atomic>
+#include <thread>
+
+class DnsResolverTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(DnsResolverTestSuite);
+    CPPUNIT_TEST(numeric);
+    CPPUNIT_TEST(systemHosts);
+    CPPUNIT_TEST(hostsFile);
+    CPPUNIT_TEST(nameServer);
+    CPPUNIT_TEST(cache);
+    CPPUNIT_TEST(asyncLookup);
+    CPPUNIT_TEST(happyEyeballs);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;     ///< Start the stub name server.
+    void tearDown() override;  ///< Stop it.
+
+protected:
+    /// numeric addresses are parsed without lookups
+    void numeric();
+
+    /// resolve localhost through the system resolver, which reads /etc/hosts
+    void systemHosts();
+
+    /// names in the hosts file don't reach the name servers
+    void hostsFile();
+
+    /// A and AAAA answers from the stub server, ordered for happy eyeballs
+    void nameServer();
+
+    /// positive and negative answers are cached, ttl 0 turns it off
+    void cache();
+
+    /// callbacks come from the event loop, concurrent lookups share a query
+    void asyncLookup();
+
+    /// SocketClient falls back to IPv4 when the IPv6 address doesn't answer
+    void happyEyeballs();
+
+private:
+    void serve();
+
+    int mServerFd;
+    uint16_t mServerPort;
+    std::thread mServerThread;
+    std::atomic<bool> mServerStopped;
+    std::atomic<int> mQueries;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(DnsResolverTestSuite);
@@ -0,0 +1,92 @@
+/**
+ * Decodes the same frame over and over through Message::create(), first
+ * with every message allocated by std::make_shared and then with a
+ * message pool (Message::setPoolSize()), printing the time per message.
+ *
+ * Usage: MessagePoolBenchmark [messages] [threads] [payload]
+ *
+ * Defaults to 4000000 messages spread over 4 threads, each decoding and
+ * dropping its own, with a 64 byte string and a list of 16 strings in
+ * the payload.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <algorithm>
+#include <thread>
+#include <vector>
+
+#include <rct/List.h>
+#include <rct/Message.h>
+#include <rct/StopWatch.h>
+#include <rct/String.h>
+
+class BenchmarkMessage : public Message
+{
+public:
+    enum { MessageId = 100 };
+
+    BenchmarkMessage()
+        : Message(MessageId)
+    {}
+
+    virtual void encode(Serializer &serializer) const override { serializer << mName << mValues; }
+    virtual void decode(Deserializer &deserializer) override { deserializer >> mName >> mValues; }
+
+    String mName;
+    List<String> mValues;
+};
+
+static uint64_t run(const String &frame, uint64_t count, int threadCount)
+{
+    StopWatch sw(StopWatch::Microsecond);
+    std::vector<std::thread> threads;
+    for (int i = 0; i < threadCount; ++i) {
+        threads.emplace_back([&frame, count, threadCount]() {
+                for (uint64_t j = 0; j < count / threadCount; ++j) {
+                    std::shared_ptr<Message> message = Message::create(0, frame.constData(), frame.size());
+                    if (!message)
+                        abort();
+                }
+            });
+    }
+    for (std::thread &thread : threads)
+        thread.join();
+    return sw.elapsed();
+}
+
+int main(int argc, char **argv)
+{
+    const uint64_t count = argc > 1 ? strtoull(argv[1], nullptr, 10) : 4000000;
+    const int threads = argc > 2 ? std::max(atoi(argv[2]), 1) : 4;
+    const int payload = argc > 3 ? atoi(argv[3]) : 64;
+
+    Message::registerMessage<BenchmarkMessage>();
+    BenchmarkMessage message;
+    message.mName = String(payload, 'n');
+    for (int i = 0; i < 16; ++i)
+        message.mValues.append(String(payload / 4, 'v'));
+
+    // the frame without its length, what Message::create() takes
+    String frame;
+    {
+        String value;
+        Serializer valueSerializer(value);
+        message.encode(valueSerializer);
+        Serializer serializer(frame);
+        serializer << 0 << static_cast<uint8_t>(BenchmarkMessage::MessageId) << static_cast<uint8_t>(Message::None);
+        serializer.write(value.constData(), value.size());
+    }
+
+    for (int pool : { 0, 16 }) {
+        Message::setPoolSize<BenchmarkMessage>(pool);
+        // once to warm up
+        run(frame, count / 10, threads);
+        const uint64_t us = run(frame, count, threads);
+        printf("%s: %llu messages in %llums (%.1f ns/message)\n", pool ? "pooled" : "make_shared",
+               static_cast<unsigned long long>(count), static_cast<unsigned long long>(us / 1000),
+               count ? us * 1000.0 / count : 0.0);
+    }
+    Message::setPoolSize<BenchmarkMessage>(0);
+    return 0;
+}
@@ -0,0 +1,133 @@
+#include "MessageTestSuite.h"
+
+#include <atomic>
+#include <thread>
+
+#include <rct/List.h>
+#include <rct/Message.h>
+#include <rct/String.h>
+
+static std::atomic<int> sLive(0), sRecycled(0);
+
+class PooledMessage : public Message
+{
+public:
+    enum { MessageId = 100 };
+
+    PooledMessage()
+        : Message(MessageId)
+    {
+        ++sLive;
+    }
+    ~PooledMessage() override { --sLive; }
+
+    void encode(Serializer &serializer) const override { serializer << name << values << numbers; }
+    void decode(Deserializer &deserializer) override { deserializer >> name >> values >> numbers; }
+    void recycle() override
+    {
+        Message::recycle();
+        ++sRecycled;
+    }
+
+    String name;
+    List<String> values;
+    List<int> numbers;
+};
+
+static String frame(const PooledMessage &message)
+{
+    String value, ret;
+    Serializer valueSerializer(value);
+    message.encode(valueSerializer);
+    Serializer serializer(ret);
+    serializer << 0 << static_cast<uint8_t>(PooledMessage::MessageId) << static_cast<uint8_t>(Message::None);
+    serializer.write(value.constData(), value.size());
+    return ret;
+}
+
+static std::shared_ptr<PooledMessage> create(const String &data)
+{
+    std::shared_ptr<Message> message = Message::create(0, data.constData(), data.size());
+    CPPUNIT_ASSERT(message);
+    CPPUNIT_ASSERT(message->messageId() == PooledMessage::MessageId);
+    return std::static_pointer_cast<PooledMessage>(message);
+}
+
+void MessageTestSuite::tearDown()
+{
+    Message::setPoolSize<PooledMessage>(0);
+    sRecycled = 0;
+}
+
+void MessageTestSuite::pool()
+{
+    Message::setPoolSize<PooledMessage>(2);
+    const int live = sLive;
+    PooledMessage message;
+    message.name = "pooled";
+    const String data = frame(message);
+
+    std::shared_ptr<PooledMessage> first = create(data);
+    const PooledMessage *firstPtr = first.get();
+    first.reset();
+    CPPUNIT_ASSERT(sRecycled == 1);
+    CPPUNIT_ASSERT(sLive == live + 2);
+    std::shared_ptr<PooledMessage> second = create(data);
+    CPPUNIT_ASSERT(second.get() == firstPtr);
+    CPPUNIT_ASSERT(second->name == "pooled");
+
+    // one more than fits
+    List<std::shared_ptr<PooledMessage> > messages;
+    for (int i = 0; i < 3; ++i)
+        messages.append(create(data));
+    second.reset();
+    messages.clear();
+    CPPUNIT_ASSERT(sRecycled == 5);
+    CPPUNIT_ASSERT(sLive == live + 3);
+
+    Message::setPoolSize<PooledMessage>(0);
+    CPPUNIT_ASSERT(sLive == live + 1);
+}
+
+void MessageTestSuite::poolReuse()
+{
+    Message::setPoolSize<PooledMessage>(1);
+    PooledMessage full;
+    full.name = "full";
+    full.values << "a" << "b" << "c";
+    full.numbers << 1 << 2 << 3 << 4;
+    const PooledMessage empty;
+
+    std::shared_ptr<PooledMessage> message = create(frame(full));
+    CPPUNIT_ASSERT(message->values.size() == 3);
+    CPPUNIT_ASSERT(message->numbers.size() == 4);
+    const PooledMessage *ptr = message.get();
+    message.reset();
+
+    message = create(frame(empty));
+    CPPUNIT_ASSERT(message.get() == ptr);
+    CPPUNIT_ASSERT(message->name.isEmpty());
+    CPPUNIT_ASSERT(message->values.isEmpty());
+    CPPUNIT_ASSERT(message->numbers.isEmpty());
+}
+
+void MessageTestSuite::poolThreads()
+{
+    Message::setPoolSize<PooledMessage>(4);
+    const int live = sLive;
+    const String data = frame(PooledMessage());
+    List<std::shared_ptr<PooledMessage> > messages;
+    for (int i = 0; i < 4; ++i)
+        messages.append(create(data));
+
+    std::thread thread([&messages, &data]() {
+            // the other thread's pool is empty so this one is new
+            const std::shared_ptr<PooledMessage> message = create(data);
+            CPPUNIT_ASSERT(!messages.contains(message));
+            messages.clear();
+        });
+    thread.join();
+    CPPUNIT_ASSERT(sRecycled == 5);
+    // all gone with the thread
+    CPPUNIT_ASSERT(sLive == live);
+}
@@ -0,0 +1,25 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+class MessageTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(MessageTestSuite);
+    CPPUNIT_TEST(pool);
+    CPPUNIT_TEST(poolReuse);
+    CPPUNIT_TEST(poolThreads);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void tearDown() override;  ///< Turn pooling off again.
+
+protected:
+    /// released messages are recycled and decoded into again, up to the pool size
+    void pool();
+
+    /// nothing of the message that was in a pool slot before shows through
+    void poolReuse();
+
+    /// messages go back to the releasing thread's pool, which is freed with the thread
+    void poolThreads();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(MessageTestSuite);
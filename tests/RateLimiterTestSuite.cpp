@@ -0,0 +1,159 @@
+#include "RateLimiterTestSuite.h"
+
+#include <stdint.h>
+#include <unistd.h>
+
+#include <rct/EventLoop.h>
+#include <rct/RateLimiter.h>
+#include <rct/SocketClient.h>
+#include <rct/SocketServer.h>
+#include <rct/StopWatch.h>
+#include <rct/Timer.h>
+
+enum {
+    Rate = 1024 * 1024,
+    Burst = 64 * 1024,
+    Size = 512 * 1024,
+    // (Size - Burst) / Rate is 437ms, leave some room for timer slack
+    MinPaced = 380
+};
+
+void RateLimiterTestSuite::setUp()
+{
+    mLoop.reset(new EventLoop);
+    mLoop->init(EventLoop::MainEventLoop);
+    mServer.reset(new SocketServer);
+    mPort = 0;
+    for (uint16_t port = 28471; port < 28491 && !mPort; ++port) {
+        if (mServer->listen(port))
+            mPort = port;
+    }
+    CPPUNIT_ASSERT(mPort);
+    mReceived = mExpected = 0;
+    mServer->newConnection().connect([this](SocketServer *server) {
+            while (std::shared_ptr<SocketClient> client = server->nextConnection()) {
+                client->setReadLimiter(mAcceptedReadLimiter);
+                client->readyRead().connect([this](const std::shared_ptr<SocketClient> &, Buffer &&buffer) {
+                        const Buffer data = std::move(buffer);
+                        mReceived += data.size();
+                        if (mExpected && mReceived >= mExpected)
+                            mLoop->quit();
+                    });
+                mAccepted.append(client);
+            }
+        });
+}
+
+void RateLimiterTestSuite::tearDown()
+{
+    mAccepted.clear();
+    mServer.reset();
+    mLoop.reset();
+}
+
+std::shared_ptr<SocketClient> RateLimiterTestSuite::connect()
+{
+    std::shared_ptr<SocketClient> client(new SocketClient);
+    CPPUNIT_ASSERT(client->connect("127.0.0.1", mPort));
+    return client;
+}
+
+uint64_t RateLimiterTestSuite::receive(size_t bytes)
+{
+    StopWatch sw;
+    mExpected = bytes;
+    if (mReceived < bytes)
+        mLoop->exec(10000);
+    CPPUNIT_ASSERT(mReceived == bytes);
+    return sw.elapsed();
+}
+
+void RateLimiterTestSuite::bucket()
+{
+    RateLimiter unlimited;
+    CPPUNIT_ASSERT(unlimited.available() == UINT64_MAX);
+    CPPUNIT_ASSERT(unlimited.delay(UINT64_MAX) == 0);
+
+    CPPUNIT_ASSERT(RateLimiter(Rate).burst() == Rate / 10);
+    CPPUNIT_ASSERT(RateLimiter(1000).burst() == 4096);
+
+    RateLimiter limiter(100000, 10000);
+    CPPUNIT_ASSERT(limiter.rate() == 100000);
+    CPPUNIT_ASSERT(limiter.available() == 10000);
+    CPPUNIT_ASSERT(limiter.delay(5000) == 0);
+
+    // overdraw by 5000, 100 bytes come back per ms
+    limiter.consume(15000);
+    CPPUNIT_ASSERT(limiter.available() < 1000);
+    const int delay = limiter.delay(10000);
+    CPPUNIT_ASSERT(delay > 100 && delay <= 150);
+    // never more than the burst
+    CPPUNIT_ASSERT(limiter.delay(UINT64_MAX) == delay);
+
+    usleep(200 * 1000);
+    CPPUNIT_ASSERT(limiter.available() >= 4900);
+    CPPUNIT_ASSERT(limiter.available() <= 10000);
+
+    limiter.setRate(0);
+    CPPUNIT_ASSERT(limiter.available() == UINT64_MAX);
+}
+
+void RateLimiterTestSuite::writeLimit()
+{
+    std::shared_ptr<SocketClient> client = connect();
+    client->setWriteLimiter(std::make_shared<RateLimiter>(Rate, Burst));
+    CPPUNIT_ASSERT(client->write(String(Size, 'w')));
+
+    const uint64_t ms = receive(Size);
+    CPPUNIT_ASSERT(ms >= MinPaced);
+    CPPUNIT_ASSERT(ms < 3000);
+    CPPUNIT_ASSERT(client->pendingWrite() == 0);
+    CPPUNIT_ASSERT(client->stats().bytesWritten == Size);
+    // the socket was never full, the limiter did the waiting
+    CPPUNIT_ASSERT(client->stats().writesBlocked == 0);
+}
+
+void RateLimiterTestSuite::readLimit()
+{
+    mAcceptedReadLimiter = std::make_shared<RateLimiter>(Rate, Burst);
+    std::shared_ptr<SocketClient> client = connect();
+    CPPUNIT_ASSERT(client->write(String(Size, 'r')));
+
+    const uint64_t ms = receive(Size);
+    CPPUNIT_ASSERT(ms >= MinPaced);
+    CPPUNIT_ASSERT(ms < 3000);
+    CPPUNIT_ASSERT(mAccepted.size() == 1);
+    // throttling doesn't touch what the user paused
+    CPPUNIT_ASSERT(!mAccepted.first()->isReadPaused());
+    CPPUNIT_ASSERT(mAccepted.first()->stats().bytesRead == Size);
+}
+
+void RateLimiterTestSuite::sharedLimit()
+{
+    std::shared_ptr<RateLimiter> limiter = std::make_shared<RateLimiter>(Rate, Burst);
+    std::shared_ptr<SocketClient> first = connect(), second = connect();
+    first->setWriteLimiter(limiter);
+    second->setWriteLimiter(limiter);
+    CPPUNIT_ASSERT(first->write(String(Size / 2, '1')));
+    CPPUNIT_ASSERT(second->write(String(Size / 2, '2')));
+
+    const uint64_t ms = receive(Size);
+    CPPUNIT_ASSERT(ms >= MinPaced);
+    CPPUNIT_ASSERT(ms < 3000);
+    CPPUNIT_ASSERT(first->stats().bytesWritten == Size / 2);
+    CPPUNIT_ASSERT(second->stats().bytesWritten == Size / 2);
+}
+
+void RateLimiterTestSuite::removeLimit()
+{
+    std::shared_ptr<SocketClient> client = connect();
+    // would take 8 seconds
+    client->setWriteLimiter(std::make_shared<RateLimiter>(Size / 8, 4096));
+    CPPUNIT_ASSERT(client->write(String(Size, 'x')));
+    mLoop->registerTimer([client](int) { client->setWriteLimiter(std::shared_ptr<RateLimiter>()); },
+                         100, Timer::SingleShot);
+
+    const uint64_t ms = receive(Size);
+    CPPUNIT_ASSERT(ms < 2000);
+    CPPUNIT_ASSERT(!client->writeLimiter());
+}
@@ -0,0 +1,56 @@
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <memory>
+
+#include <rct/List.h>
+
+class EventLoop;
+class RateLimiter;
+class SocketClient;
+class SocketServer;
+
+class RateLimiterTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(RateLimiterTestSuite);
+    CPPUNIT_TEST(bucket);
+    CPPUNIT_TEST(writeLimit);
+    CPPUNIT_TEST(readLimit);
+    CPPUNIT_TEST(sharedLimit);
+    CPPUNIT_TEST(removeLimit);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;     ///< Start an event loop and a loopback server.
+    void tearDown() override;  ///< Stop them.
+
+protected:
+    /// refill, burst, debt and delays of the token bucket itself
+    void bucket();
+
+    /// writes over the limit are buffered and paced out by a timer
+    void writeLimit();
+
+    /// the socket stops reading while it's over the limit
+    void readLimit();
+
+    /// sockets sharing a limiter get its rate between them
+    void sharedLimit();
+
+    /// taking the limiter away sends what's been held back right away
+    void removeLimit();
+
+private:
+    std::shared_ptr<SocketClient> connect();
+    // runs the loop until the server side has received bytes, returns ms
+    uint64_t receive(size_t bytes);
+
+    std::shared_ptr<EventLoop> mLoop;
+    std::shared_ptr<SocketServer> mServer;
+    uint16_t mPort;
+    List<std::shared_ptr<SocketClient> > mAccepted;
+    // given to accepted sockets
+    std::shared_ptr<RateLimiter> mAcceptedReadLimiter;
+    size_t mReceived, mExpected;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(RateLimiterTestSuite);
@@ -0,0 +1,109 @@
+/**
+ * Writes a state file through Serializer(FILE *) and reads it back through
+ * Deserializer(FILE *), printing the throughput of both.
+ *
+ * Usage: SerializerBenchmark [file] [megabytes]
+ *
+ * The file defaults to a temporary file in /tmp and the size to 1024MB.
+ * Records are written field by field, which is the access pattern of
+ * typical state files and the one that is dominated by per call overhead.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <rct/Path.h>
+#include <rct/Serializer.h>
+#include <rct/StopWatch.h>
+#include <rct/String.h>
+
+struct Record
+{
+    uint64_t id;
+    int line, column;
+    String name;
+};
+
+static inline Serializer &operator<<(Serializer &s, const Record &record)
+{
+    s << record.id << record.line << record.column << record.name;
+    return s;
+}
+
+static inline Deserializer &operator>>(Deserializer &s, Record &record)
+{
+    s >> record.id >> record.line >> record.column >> record.name;
+    return s;
+}
+
+static void report(const char *what, uint64_t bytes, uint64_t ms)
+{
+    printf("%s: %llu bytes in %llums (%.1f MB/s)\n", what, static_cast<unsigned long long>(bytes),
+           static_cast<unsigned long long>(ms), ms ? (bytes / (1024.0 * 1024.0)) / (ms / 1000.0) : 0.0);
+}
+
+int main(int argc, char **argv)
+{
+    const Path path = argc > 1 ? Path(argv[1]) : Path("/tmp/rct_serializer_benchmark");
+    const uint64_t megabytes = argc > 2 ? strtoull(argv[2], nullptr, 10) : 1024;
+    // a file position is an int
+    const uint64_t bytes = std::min<uint64_t>(megabytes * 1024 * 1024, 0x7fff0000);
+
+    Record record;
+    record.name = "SerializerBenchmark::record";
+    const uint64_t recordSize = (Serializer::sizeOf<uint64_t>() + Serializer::sizeOf<int>() * 2
+                                 + Serializer::sizeOf<int>() + record.name.size());
+    const uint64_t count = bytes / recordSize;
+
+    FILE *f = fopen(path.c_str(), "w");
+    if (!f) {
+        fprintf(stderr, "Can't open %s for writing\n", path.c_str());
+        return 1;
+    }
+
+    StopWatch sw;
+    {
+        Serializer serializer(f);
+        serializer << count;
+        for (uint64_t i = 0; i < count; ++i) {
+            record.id = i;
+            record.line = static_cast<int>(i);
+            record.column = static_cast<int>(i % 80);
+            serializer << record;
+        }
+        if (!serializer.flush()) {
+            fprintf(stderr, "Failed to write %s\n", path.c_str());
+            fclose(f);
+            return 1;
+        }
+    }
+    fclose(f);
+    const uint64_t size = path.fileSize();
+    report("write", size, sw.restart());
+
+    f = fopen(path.c_str(), "r");
+    if (!f) {
+        fprintf(stderr, "Can't open %s for reading\n", path.c_str());
+        return 1;
+    }
+    uint64_t read = 0, errors = 0;
+    {
+        Deserializer deserializer(f);
+        deserializer >> read;
+        for (uint64_t i = 0; i < read; ++i) {
+            deserializer >> record;
+            if (record.id != i)
+                ++errors;
+        }
+    }
+    fclose(f);
+    report("read", size, sw.elapsed());
+
+    Path::rm(path);
+    if (read != count || errors) {
+        fprintf(stderr, "Read back %llu/%llu records with %llu errors\n", static_cast<unsigned long long>(read),
+                static_cast<unsigned long long>(count), static_cast<unsigned long long>(errors));
+        return 1;
+    }
+    return 0;
+}
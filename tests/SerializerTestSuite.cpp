@@ -0,0 +1,410 @@
+#include "SerializerTestSuite.h"
+
+#include <string.h>
+#include <limits>
+
+#include <rct/Flags.h>
+#include <rct/MemoryMappedFile.h>
+#include <rct/Serializer.h>
+
+// native types that make for few or no elements per batch
+template <size_t Size>
+struct Blob
+{
+    int id;
+    char data[Size - sizeof(int)];
+
+    bool operator<(const Blob &other) const { return id < other.id; }
+    bool operator==(const Blob &other) const { return id == other.id && !memcmp(data, other.data, sizeof(data)); }
+};
+typedef Blob<4096> Page;
+typedef Blob<64 * 1024> LargePage;
+DECLARE_NATIVE_TYPE(Page);
+DECLARE_NATIVE_TYPE(LargePage);
+
+enum NarrowFlag {
+    NarrowA = 0x1,
+    NarrowB = 0x2,
+    NarrowC = 0x4,
+    NarrowTop = 0x80000000
+};
+RCT_FLAGS(NarrowFlag);
+
+enum WideFlag : uint64_t {
+    WideA = 0x2,
+    WideTop = 1ull << 40
+};
+RCT_FLAGS(WideFlag);
+
+void
+SerializerTestSuite::setUp()
+{
+}
+
+void
+SerializerTestSuite::tearDown()
+{
+}
+
+void
+SerializerTestSuite::fixedEncoding()
+{
+    // prepare
+    String out;
+    Serializer serializer(out);
+
+    // execute
+    serializer << static_cast<int>(1) << static_cast<uint64_t>(2);
+
+    // verify
+    CPPUNIT_ASSERT_EQUAL(Serializer::sizeOf<int>() + Serializer::sizeOf<uint64_t>(), out.size());
+}
+
+void
+SerializerTestSuite::compactEncodingRoundTrip()
+{
+    // prepare
+    const List<int64_t> signedValues = {
+        0, 1, -1, 63, -64, 64, -65, 300, -300,
+        std::numeric_limits<int>::max(), std::numeric_limits<int>::min(),
+        std::numeric_limits<int64_t>::max(), std::numeric_limits<int64_t>::min()
+    };
+    const List<uint64_t> unsignedValues = { 0, 127, 128, 16383, 16384, std::numeric_limits<uint64_t>::max() };
+    const String string = "compact";
+    const List<String> list = { "a", "bc", String() };
+    Hash<String, int> hash;
+    hash["one"] = 1;
+    hash["minus two"] = -2;
+
+    String out;
+    Serializer serializer(out);
+    serializer.setEncoding(Serializer::CompactEncoding);
+
+    // execute
+    const List<Flags<NarrowFlag> > narrowFlags = {
+        Flags<NarrowFlag>(), NarrowA, NarrowB, NarrowC, NarrowA | NarrowC, NarrowB | NarrowTop
+    };
+    const Flags<WideFlag> wideFlags = WideA | WideTop;
+    serializer << signedValues << unsignedValues << string << list << hash
+               << static_cast<short>(-7) << 'x' << true << 1.5 << narrowFlags << wideFlags;
+
+    Deserializer deserializer(out);
+    deserializer.setEncoding(Serializer::CompactEncoding);
+    List<int64_t> signedResult;
+    List<uint64_t> unsignedResult;
+    String stringResult;
+    List<String> listResult;
+    Hash<String, int> hashResult;
+    short shortResult;
+    char charResult;
+    bool boolResult;
+    double doubleResult;
+    List<Flags<NarrowFlag> > narrowFlagsResult;
+    Flags<WideFlag> wideFlagsResult;
+    deserializer >> signedResult >> unsignedResult >> stringResult >> listResult >> hashResult
+                 >> shortResult >> charResult >> boolResult >> doubleResult >> narrowFlagsResult >> wideFlagsResult;
+
+    // verify
+    CPPUNIT_ASSERT_EQUAL(signedValues.size(), signedResult.size());
+    for (size_t i = 0; i < signedValues.size(); ++i)
+        CPPUNIT_ASSERT_EQUAL(signedValues.at(i), signedResult.at(i));
+    CPPUNIT_ASSERT_EQUAL(unsignedValues.size(), unsignedResult.size());
+    for (size_t i = 0; i < unsignedValues.size(); ++i)
+        CPPUNIT_ASSERT_EQUAL(unsignedValues.at(i), unsignedResult.at(i));
+    CPPUNIT_ASSERT(stringResult == string);
+    CPPUNIT_ASSERT(listResult == list);
+    CPPUNIT_ASSERT(hashResult == hash);
+    CPPUNIT_ASSERT_EQUAL(static_cast<short>(-7), shortResult);
+    CPPUNIT_ASSERT_EQUAL('x', charResult);
+    CPPUNIT_ASSERT(boolResult);
+    CPPUNIT_ASSERT_EQUAL(1.5, doubleResult);
+    CPPUNIT_ASSERT_EQUAL(narrowFlags.size(), narrowFlagsResult.size());
+    for (size_t i = 0; i < narrowFlags.size(); ++i)
+        CPPUNIT_ASSERT_EQUAL(narrowFlags.at(i).value(), narrowFlagsResult.at(i).value());
+    CPPUNIT_ASSERT_EQUAL(wideFlags.value(), wideFlagsResult.value());
+    CPPUNIT_ASSERT(deserializer.atEnd());
+}
+
+void
+SerializerTestSuite::compactEncodingSize()
+{
+    // prepare
+    String out;
+    Serializer serializer(out);
+    serializer.setEncoding(Serializer::CompactEncoding);
+
+    // execute
+    serializer << static_cast<int>(5) << static_cast<int>(-5) << static_cast<uint32_t>(200) << String("ab");
+
+    // verify
+    // 1 + 1 + 2 bytes for the integers, 1 for the size and 2 for the string
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(7), out.size());
+}
+
+void
+SerializerTestSuite::blockContainers()
+{
+    // prepare
+    List<double> list;
+    Set<int> set;
+    Hash<int, double> hash;
+    for (int i = 0; i < 3000; ++i) {
+        list.append(i * 0.5);
+        set.insert(i * 7);
+        hash[i] = i * 0.25;
+    }
+
+    String expected;
+    Serializer elementWise(expected);
+    elementWise << static_cast<uint32_t>(list.size());
+    for (double d : list)
+        elementWise << d;
+    elementWise << static_cast<uint32_t>(set.size());
+    for (int i : set)
+        elementWise << i;
+    elementWise << static_cast<uint32_t>(hash.size());
+    for (const auto &it : hash)
+        elementWise << it.first << it.second;
+
+    // execute
+    String out;
+    Serializer serializer(out);
+    serializer << list << set << hash;
+
+    Deserializer deserializer(out);
+    List<double> listResult;
+    Set<int> setResult;
+    Hash<int, double> hashResult;
+    deserializer >> listResult >> setResult >> hashResult;
+
+    // verify
+    CPPUNIT_ASSERT(out == expected);
+    CPPUNIT_ASSERT_EQUAL(list.size(), listResult.size());
+    for (size_t i = 0; i < list.size(); ++i)
+        CPPUNIT_ASSERT_EQUAL(list.at(i), listResult.at(i));
+    CPPUNIT_ASSERT(static_cast<const std::set<int> &>(setResult) == set);
+    CPPUNIT_ASSERT(hashResult == hash);
+    CPPUNIT_ASSERT(deserializer.atEnd());
+}
+
+void
+SerializerTestSuite::largeBlockElements()
+{
+    // prepare
+    Set<Page> pages;
+    Hash<int, Page> pageHash;
+    Set<LargePage> largePages;
+    for (int i = 0; i < 10; ++i) {
+        Page page;
+        page.id = i;
+        memset(page.data, 'a' + i, sizeof(page.data));
+        pages.insert(page);
+        pageHash[i] = page;
+    }
+    for (int i = 0; i < 3; ++i) {
+        LargePage page;
+        page.id = i;
+        memset(page.data, 'A' + i, sizeof(page.data));
+        largePages.insert(page);
+    }
+
+    String expected;
+    Serializer elementWise(expected);
+    elementWise << static_cast<uint32_t>(pages.size());
+    for (const Page &page : pages)
+        elementWise << page;
+    elementWise << static_cast<uint32_t>(pageHash.size());
+    for (const auto &it : pageHash)
+        elementWise << it.first << it.second;
+    elementWise << static_cast<uint32_t>(largePages.size());
+    for (const LargePage &page : largePages)
+        elementWise << page;
+
+    // execute
+    String out;
+    Serializer serializer(out);
+    serializer << pages << pageHash << largePages;
+
+    Deserializer deserializer(out);
+    Set<Page> pagesResult;
+    Hash<int, Page> pageHashResult;
+    Set<LargePage> largePagesResult;
+    deserializer >> pagesResult >> pageHashResult >> largePagesResult;
+
+    // verify
+    CPPUNIT_ASSERT(out == expected);
+    CPPUNIT_ASSERT(static_cast<const std::set<Page> &>(pagesResult) == pages);
+    CPPUNIT_ASSERT(pageHashResult == pageHash);
+    CPPUNIT_ASSERT(static_cast<const std::set<LargePage> &>(largePagesResult) == largePages);
+    CPPUNIT_ASSERT(deserializer.atEnd());
+}
+
+void
+SerializerTestSuite::fileRoundTrip()
+{
+    // prepare
+    // enough to go through the file buffers a few times, with one value
+    // larger than the buffer
+    List<String> strings;
+    for (int i = 0; i < 100000; ++i)
+        strings.append(String::number(i));
+    const String big(Serializer::FileBufferSize + 17, 'x');
+
+    String expected;
+    {
+        Serializer serializer(expected);
+        serializer << strings << big << static_cast<int>(42);
+    }
+
+    FILE *f = tmpfile();
+    CPPUNIT_ASSERT(f);
+
+    // execute
+    {
+        Serializer serializer(f);
+        serializer << strings << big << static_cast<int>(42);
+        CPPUNIT_ASSERT_EQUAL(static_cast<int>(expected.size()), serializer.pos());
+    }
+    const int written = ftell(f);
+    rewind(f);
+    List<String> stringsResult;
+    String bigResult;
+    int intResult;
+    char peeked;
+    int pos, afterPeek;
+    {
+        Deserializer deserializer(f);
+        deserializer >> stringsResult >> bigResult;
+        pos = deserializer.pos();
+        deserializer.peek(&peeked, 1);
+        afterPeek = deserializer.pos();
+        deserializer >> intResult;
+        CPPUNIT_ASSERT(deserializer.atEnd());
+    }
+
+    // verify
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(expected.size()), written);
+    CPPUNIT_ASSERT(stringsResult == strings);
+    CPPUNIT_ASSERT(bigResult == big);
+    CPPUNIT_ASSERT_EQUAL(42, intResult);
+    CPPUNIT_ASSERT_EQUAL(pos, afterPeek);
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(expected.size() - Serializer::sizeOf<int>()), pos);
+    CPPUNIT_ASSERT_EQUAL(expected.at(pos), peeked);
+    CPPUNIT_ASSERT_EQUAL(written, static_cast<int>(ftell(f)));
+    fclose(f);
+}
+
+void
+SerializerTestSuite::views()
+{
+    // prepare
+    const List<String> strings = { "one", "two", "three" };
+    Hash<int, double> hash;
+    hash[1] = 1.5;
+    hash[2] = 2.5;
+    Hash<String, List<int> > nested;
+    nested["a"] = List<int>({ 1, 2, 3 });
+
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << String("name") << strings << hash << nested << static_cast<short>(3)
+                   << String() << static_cast<int>(42);
+    }
+    const Path path = "serializer_views.dat";
+    CPPUNIT_ASSERT(path.write(out));
+
+    MemoryMappedFile file;
+    CPPUNIT_ASSERT(file.open(path));
+
+    // execute
+    Deserializer stringDeserializer(out.constData(), out.size());
+    Deserializer fileDeserializer(file);
+    const std::pair<Deserializer *, const char *> deserializers[] = {
+        { &stringDeserializer, out.constData() },
+        { &fileDeserializer, file.filePtr<char>() }
+    };
+    for (const auto &pair : deserializers) {
+        Deserializer *deserializer = pair.first;
+        std::string_view name, empty;
+        int value;
+        (*deserializer) >> name;
+        CPPUNIT_ASSERT(deserializer->skip<List<String> >());
+        CPPUNIT_ASSERT((deserializer->skip<Hash<int, double> >()));
+        CPPUNIT_ASSERT((deserializer->skip<Hash<String, List<int> > >()));
+        CPPUNIT_ASSERT(deserializer->skip<short>());
+        (*deserializer) >> empty >> value;
+
+        // verify
+        CPPUNIT_ASSERT(name == "name");
+        // decoded in place
+        CPPUNIT_ASSERT(name.data() == pair.second + Serializer::sizeOf<uint32_t>());
+        CPPUNIT_ASSERT(empty.empty());
+        CPPUNIT_ASSERT_EQUAL(42, value);
+        CPPUNIT_ASSERT(deserializer->atEnd());
+    }
+
+    file.close();
+    Path::rm(path);
+}
+
+void
+SerializerTestSuite::countingBuffer()
+{
+    // prepare
+    const List<String> strings = { "one", "two", "three" };
+    Hash<String, int> hash;
+    hash["a"] = 1;
+
+    for (Serializer::Encoding encoding : { Serializer::FixedEncoding, Serializer::CompactEncoding }) {
+        String out;
+        Serializer serializer(out);
+        Serializer counter(std::unique_ptr<Serializer::Buffer>(new Serializer::CountingBuffer));
+        serializer.setEncoding(encoding);
+        counter.setEncoding(encoding);
+
+        // execute
+        serializer << strings << hash << static_cast<int64_t>(-300) << 2.5;
+        counter << strings << hash << static_cast<int64_t>(-300) << 2.5;
+
+        // verify
+        CPPUNIT_ASSERT_EQUAL(static_cast<int>(out.size()), counter.pos());
+    }
+}
+
+void
+SerializerTestSuite::bufferRefs()
+{
+    // prepare
+    String out;
+    {
+        Serializer serializer(out);
+        serializer << BufferRef::copy("payload", 7) << String("string") << BufferRef() << 7;
+    }
+    String copy = out;
+    const BufferRef frame(std::move(copy));
+
+    // execute
+    Deserializer deserializer(frame);
+    BufferRef payload, empty;
+    String string;
+    int value;
+    deserializer >> payload >> string >> empty >> value;
+
+    // verify
+    CPPUNIT_ASSERT(payload.toString() == "payload");
+    // a slice of the frame, not a copy
+    CPPUNIT_ASSERT(payload.data() == frame.data() + sizeof(uint32_t));
+    CPPUNIT_ASSERT_EQUAL(3L, frame.useCount());
+    CPPUNIT_ASSERT(string == "string");
+    CPPUNIT_ASSERT(empty.isEmpty());
+    CPPUNIT_ASSERT_EQUAL(7, value);
+    CPPUNIT_ASSERT(deserializer.atEnd());
+
+    // String and BufferRef encode the same
+    Deserializer fromString(out);
+    fromString >> string >> payload;
+    CPPUNIT_ASSERT(string == "payload");
+    CPPUNIT_ASSERT(payload.toString() == "string");
+    CPPUNIT_ASSERT_EQUAL(1L, payload.useCount());
+}
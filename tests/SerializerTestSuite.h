@@ -0,0 +1,40 @@
+#ifndef SERIALIZERTESTSUITE_H
+#define SERIALIZERTESTSUITE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+class SerializerTestSuite : public CPPUNIT_NS::TestFixture
+{
+    CPPUNIT_TEST_SUITE(SerializerTestSuite);
+
+    CPPUNIT_TEST(fixedEncoding);
+    CPPUNIT_TEST(compactEncodingRoundTrip);
+    CPPUNIT_TEST(compactEncodingSize);
+    CPPUNIT_TEST(blockContainers);
+    CPPUNIT_TEST(largeBlockElements);
+    CPPUNIT_TEST(fileRoundTrip);
+    CPPUNIT_TEST(views);
+    CPPUNIT_TEST(countingBuffer);
+    CPPUNIT_TEST(bufferRefs);
+
+    CPPUNIT_TEST_SUITE_END();
+
+    public:
+        void setUp();
+        void tearDown();
+
+    protected:
+        void fixedEncoding();
+        void compactEncodingRoundTrip();
+        void compactEncodingSize();
+        void blockContainers();
+        void largeBlockElements();
+        void fileRoundTrip();
+        void views();
+        void countingBuffer();
+        void bufferRefs();
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(SerializerTestSuite);
+
+#endif
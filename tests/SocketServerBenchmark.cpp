@@ -0,0 +1,102 @@
+/**
+ * Connection storm against a SocketServer: a number of threads connect to
+ * it over loopback as fast as they can while the server accepts and drops
+ * the connections, printing the accept rate and the CPU time the server
+ * thread spent per connection.
+ *
+ * Usage: SocketServerBenchmark [connections] [threads] [port]
+ *
+ * Defaults to 50000 connections from 8 threads on port 28311. The clients
+ * close with SO_LINGER 0 so that TIME_WAIT doesn't run out of ports.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <rct/EventLoop.h>
+#include <rct/SocketClient.h>
+#include <rct/SocketServer.h>
+#include <rct/StopWatch.h>
+
+static void connectLoop(uint16_t port, int count, std::atomic<int> *failed)
+{
+    sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+    const linger lin = { 1, 0 };
+    for (int i = 0; i < count; ++i) {
+        const int fd = ::socket(AF_INET, SOCK_STREAM, 0);
+        if (fd == -1 || ::connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == -1) {
+            ++*failed;
+        } else {
+            ::setsockopt(fd, SOL_SOCKET, SO_LINGER, &lin, sizeof(lin));
+        }
+        if (fd != -1)
+            ::close(fd);
+    }
+}
+
+static uint64_t threadCpuUs()
+{
+    timespec ts;
+    clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+    return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+int main(int argc, char **argv)
+{
+    const int connections = argc > 1 ? atoi(argv[1]) : 50000;
+    const int threads = argc > 2 ? std::max(atoi(argv[2]), 1) : 8;
+    const uint16_t port = argc > 3 ? static_cast<uint16_t>(atoi(argv[3])) : 28311;
+
+    std::shared_ptr<EventLoop> loop(new EventLoop);
+    loop->init(EventLoop::MainEventLoop);
+
+    SocketServer server;
+    SocketServer::SocketOptions options;
+    options.backlog = 4096;
+    options.noDelay = true;
+    server.setSocketOptions(options);
+    if (!server.listen(port)) {
+        fprintf(stderr, "Can't listen on port %u\n", port);
+        return 1;
+    }
+
+    const int total = (connections / threads) * threads;
+    int accepted = 0;
+    server.newConnection().connect([&](SocketServer *s) {
+            while (std::shared_ptr<SocketClient> client = s->nextConnection()) {
+                if (++accepted == total)
+                    loop->quit();
+            }
+        });
+
+    std::atomic<int> failed(0);
+    StopWatch sw;
+    const uint64_t cpu = threadCpuUs();
+    std::vector<std::thread> clients;
+    for (int i = 0; i < threads; ++i)
+        clients.emplace_back(connectLoop, port, total / threads, &failed);
+    // give up if connects fail and the count is never reached
+    loop->exec(120 * 1000);
+    const uint64_t ms = sw.elapsed();
+    const uint64_t cpuUs = threadCpuUs() - cpu;
+    for (std::thread &thread : clients)
+        thread.join();
+
+    printf("accepted %d/%d connections in %llums (%.0f/s), server cpu %.1fus per connection, %d failed connects\n",
+           accepted, total, static_cast<unsigned long long>(ms), ms ? accepted * 1000.0 / ms : 0.0,
+           accepted ? static_cast<double>(cpuUs) / accepted : 0.0, failed.load());
+    return accepted == total ? 0 : 1;
+}
@@ -0,0 +1,40 @@
+#include "SocketTestFixture.h"
+
+#include <unistd.h>
+
+#include <rct/EventLoop.h>
+#include <rct/SocketClient.h>
+#include <rct/SocketServer.h>
+
+void SocketTestFixture::setUp()
+{
+    mLoop.reset(new EventLoop);
+    mLoop->init(EventLoop::MainEventLoop);
+    mPath = String::format<64>("/tmp/rct-socket-test-%d", getpid());
+    Path::rm(mPath);
+    mServer.reset(new SocketServer);
+    CPPUNIT_ASSERT(mServer->listen(mPath));
+    mServer->newConnection().connect([this](SocketServer *server) {
+            while (std::shared_ptr<SocketClient> client = server->nextConnection())
+                accepted(client);
+        });
+}
+
+void SocketTestFixture::tearDown()
+{
+    mServer.reset();
+    mLoop.reset();
+    Path::rm(mPath);
+}
+
+bool SocketTestFixture::waitFor(const std::function<bool()> &done)
+{
+    const int timer = mLoop->registerTimer([this, &done](int) {
+            if (done())
+                mLoop->quit();
+        }, 5);
+    if (!done())
+        mLoop->exec(5000);
+    mLoop->unregisterTimer(timer);
+    return done();
+}
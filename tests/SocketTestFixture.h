@@ -0,0 +1,37 @@
+#ifndef SOCKETTESTFIXTURE_H
+#define SOCKETTESTFIXTURE_H
+
+#include <cppunit/extensions/HelperMacros.h>
+
+#include <functional>
+#include <memory>
+
+#include <rct/Path.h>
+
+class EventLoop;
+class SocketClient;
+class SocketServer;
+
+/**
+ * Base for suites that need an event loop and a Unix socket server to
+ * talk to. Every socket the server accepts is handed to accepted().
+ */
+class SocketTestFixture : public CPPUNIT_NS::TestFixture
+{
+public:
+    void setUp() override;     ///< Start an event loop and a Unix socket server.
+    void tearDown() override;  ///< Stop them.
+
+protected:
+    // drops them by default
+    virtual void accepted(const std::shared_ptr<SocketClient> &client) { (void)client; }
+    // runs the loop until done returns true or 5 seconds have passed
+    bool waitFor(const std::function<bool()> &done);
+
+    std::shared_ptr<EventLoop> mLoop;
+    std::shared_ptr<SocketServer> mServer;
+    // where the server listens, suites can put their own files next to it
+    Path mPath;
+};
+
+#endif
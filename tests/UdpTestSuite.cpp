@@ -0,0 +1,111 @@
+#include "UdpTestSuite.h"
+
+#include <rct/SocketClient.h>
+
+// a different byte at every position for a while and per datagram, so
+// misplaced or mixed up bytes show
+static String pattern(int size, int seed)
+{
+    String ret(size, '\0');
+    for (int i = 0; i < size; ++i)
+        ret[i] = static_cast<char>((seed * 31 + i) % 251);
+    return ret;
+}
+
+void UdpTestSuite::setUp()
+{
+    SocketTestFixture::setUp();
+    mSender.reset(new SocketClient(SocketClient::Udp));
+    CPPUNIT_ASSERT(mSender->bind(0));
+    mSender->sockName(&mSenderPort);
+    mReceiver.reset(new SocketClient(SocketClient::Udp));
+    CPPUNIT_ASSERT(mReceiver->bind(0));
+    mReceiver->sockName(&mReceiverPort);
+    CPPUNIT_ASSERT(mSenderPort && mReceiverPort);
+    mReceiver->readyReadBatch().connect([this](const std::shared_ptr<SocketClient> &,
+                                               const List<SocketClient::Datagram> &datagrams) {
+            for (const SocketClient::Datagram &datagram : datagrams) {
+                mReceived.append(String(reinterpret_cast<const char *>(datagram.data), datagram.size));
+                uint16_t port = 0;
+                CPPUNIT_ASSERT(datagram.host(&port) == "127.0.0.1");
+                mReceivedFrom.append(port);
+            }
+        });
+}
+
+void UdpTestSuite::tearDown()
+{
+    mSender.reset();
+    mReceiver.reset();
+    mReceived.clear();
+    mReceivedFrom.clear();
+    SocketTestFixture::tearDown();
+}
+
+void UdpTestSuite::send(const List<int> &sizes)
+{
+    List<String> payloads;
+    List<SocketClient::Datagram> datagrams;
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        payloads.append(pattern(sizes.at(i), i));
+        SocketClient::Datagram datagram;
+        CPPUNIT_ASSERT(datagram.setAddress("127.0.0.1", mReceiverPort));
+        datagrams.append(datagram);
+    }
+    for (size_t i = 0; i < sizes.size(); ++i) {
+        datagrams[i].data = reinterpret_cast<const unsigned char *>(payloads.at(i).constData());
+        datagrams[i].size = payloads.at(i).size();
+    }
+    CPPUNIT_ASSERT_EQUAL(static_cast<int>(sizes.size()), mSender->writeTo(datagrams.data(), datagrams.size()));
+}
+
+void UdpTestSuite::batch()
+{
+    mReceiver->setUdpBatchSize(8, 2048);
+    List<int> sizes;
+    for (int i = 0; i < 100; ++i)
+        sizes.append((i * 37) % 2048 + 1);
+    send(sizes);
+    CPPUNIT_ASSERT(waitFor([this]() { return mReceived.size() == 100; }));
+    for (int i = 0; i < 100; ++i) {
+        CPPUNIT_ASSERT(mReceived.at(i) == pattern(sizes.at(i), i));
+        CPPUNIT_ASSERT_EQUAL(mSenderPort, mReceivedFrom.at(i));
+    }
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint64_t>(0), mReceiver->stats().datagramsTruncated);
+}
+
+void UdpTestSuite::truncated()
+{
+    mReceiver->setUdpBatchSize(4, 1024);
+    send({ 100, 1024, 1025, 3000, 200 });
+    CPPUNIT_ASSERT(waitFor([this]() { return mReceived.size() == 3; }));
+    CPPUNIT_ASSERT(mReceived.at(0) == pattern(100, 0));
+    CPPUNIT_ASSERT(mReceived.at(1) == pattern(1024, 1));
+    CPPUNIT_ASSERT(mReceived.at(2) == pattern(200, 4));
+    CPPUNIT_ASSERT(waitFor([this]() { return mReceiver->stats().datagramsTruncated == 2; }));
+}
+
+void UdpTestSuite::segments()
+{
+    mReceiver->setUdpBatchSize(4, 64 * 1024);
+    if (!mSender->setUdpSegmentSize(500) || !mReceiver->setUdpGro(true))
+        return; // not supported here
+    // split into 10 datagrams by the sender's kernel, possibly coalesced
+    // again on the way in
+    const String data = pattern(5000, 0);
+    send({ 5000 });
+    CPPUNIT_ASSERT(waitFor([this]() { return mReceived.size() == 10; }));
+    for (int i = 0; i < 10; ++i)
+        CPPUNIT_ASSERT(mReceived.at(i) == data.mid(i * 500, 500));
+
+    // too small for a coalesced read, only the whole segments that fit
+    // make it through
+    mReceiver->setUdpBatchSize(4, 1200);
+    mReceived.clear();
+    send({ 5000 });
+    CPPUNIT_ASSERT(waitFor([this]() { return mReceived.size() == 10 || mReceiver->stats().datagramsTruncated; }));
+    if (mReceiver->stats().datagramsTruncated)
+        CPPUNIT_ASSERT(mReceived.size() == 2);
+    for (size_t i = 0; i < mReceived.size(); ++i)
+        CPPUNIT_ASSERT(mReceived.at(i) == data.mid(i * 500, 500));
+}
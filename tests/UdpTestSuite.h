@@ -0,0 +1,40 @@
+#include "SocketTestFixture.h"
+
+#include <memory>
+
+#include <rct/List.h>
+#include <rct/String.h>
+
+class UdpTestSuite : public SocketTestFixture
+{
+    CPPUNIT_TEST_SUITE(UdpTestSuite);
+    CPPUNIT_TEST(batch);
+    CPPUNIT_TEST(truncated);
+    CPPUNIT_TEST(segments);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;     ///< Bind a sending and a batch receiving socket on loopback.
+    void tearDown() override;  ///< Close them.
+
+protected:
+    /// datagrams sent with writeTo() in one go arrive intact, in order and with their sender
+    void batch();
+
+    /// datagrams larger than the batch's datagram size are dropped and counted
+    void truncated();
+
+    /// segmentation offload splits writes, GRO coalesced reads are split up again
+    void segments();
+
+private:
+    // sends datagrams of these sizes to the receiver, each with its own pattern
+    void send(const List<int> &sizes);
+
+    std::shared_ptr<SocketClient> mSender, mReceiver;
+    uint16_t mSenderPort, mReceiverPort;
+    List<String> mReceived;
+    List<uint16_t> mReceivedFrom;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(UdpTestSuite);
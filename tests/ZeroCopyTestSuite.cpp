@@ -0,0 +1,128 @@
+#include "ZeroCopyTestSuite.h"
+
+#include <stdint.h>
+
+#include <rct/Buffer.h>
+#include <rct/SocketClient.h>
+#include <rct/SocketServer.h>
+#include <rct/ZeroCopyCompletions.h>
+
+enum {
+    Threshold = 64 * 1024,
+    Chunks = 8
+};
+
+// a different byte at every position for a while and per write, so
+// misplaced or mixed up bytes show
+static String pattern(int size, int seed)
+{
+    String ret(size, '\0');
+    for (int i = 0; i < size; ++i)
+        ret[i] = static_cast<char>((seed * 31 + i) % 251);
+    return ret;
+}
+
+void ZeroCopyTestSuite::setUp()
+{
+    SocketTestFixture::setUp();
+    mTcpServer.reset(new SocketServer);
+    mPort = 0;
+    for (uint16_t port = 28511; port < 28531 && !mPort; ++port) {
+        if (mTcpServer->listen(port))
+            mPort = port;
+    }
+    CPPUNIT_ASSERT(mPort);
+    mTcpServer->newConnection().connect([this](SocketServer *server) {
+            while (std::shared_ptr<SocketClient> client = server->nextConnection()) {
+                client->readyRead().connect([this](const std::shared_ptr<SocketClient> &, Buffer &&buffer) {
+                        const Buffer data = std::move(buffer);
+                        mReceived.append(reinterpret_cast<const char *>(data.data()), data.size());
+                    });
+                mAccepted.append(client);
+            }
+        });
+}
+
+void ZeroCopyTestSuite::tearDown()
+{
+    mAccepted.clear();
+    mTcpServer.reset();
+    mReceived.clear();
+    SocketTestFixture::tearDown();
+}
+
+void ZeroCopyTestSuite::completions()
+{
+    ZeroCopyCompletions inOrder;
+    CPPUNIT_ASSERT(!inOrder.isComplete(0));
+    inOrder.complete(0, 0);
+    CPPUNIT_ASSERT(inOrder.isComplete(0));
+    CPPUNIT_ASSERT(!inOrder.isComplete(1));
+    inOrder.complete(1, 4);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint32_t>(5), inOrder.completed());
+    // the kernel may report a range again, that doesn't go back
+    inOrder.complete(2, 3);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint32_t>(5), inOrder.completed());
+
+    ZeroCopyCompletions outOfOrder;
+    outOfOrder.complete(6, 8);
+    outOfOrder.complete(3, 4);
+    CPPUNIT_ASSERT(!outOfOrder.isComplete(0));
+    CPPUNIT_ASSERT(!outOfOrder.isComplete(3));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), outOfOrder.pending());
+    // fills the first gap, 3-4 follows right away but 5 is still missing
+    outOfOrder.complete(0, 2);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint32_t>(5), outOfOrder.completed());
+    CPPUNIT_ASSERT(outOfOrder.isComplete(4));
+    CPPUNIT_ASSERT(!outOfOrder.isComplete(6));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(1), outOfOrder.pending());
+    outOfOrder.complete(5, 5);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint32_t>(9), outOfOrder.completed());
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), outOfOrder.pending());
+
+    // send numbers wrap after UINT32_MAX, ranges may span the wrap
+    ZeroCopyCompletions wrapping(UINT32_MAX - 3);
+    wrapping.complete(2, 3);
+    wrapping.complete(UINT32_MAX - 1, 1);
+    CPPUNIT_ASSERT(!wrapping.isComplete(UINT32_MAX - 3));
+    CPPUNIT_ASSERT(!wrapping.isComplete(0));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(2), wrapping.pending());
+    wrapping.complete(UINT32_MAX - 3, UINT32_MAX - 2);
+    CPPUNIT_ASSERT_EQUAL(static_cast<uint32_t>(4), wrapping.completed());
+    CPPUNIT_ASSERT(wrapping.isComplete(UINT32_MAX));
+    CPPUNIT_ASSERT(wrapping.isComplete(3));
+    CPPUNIT_ASSERT(!wrapping.isComplete(4));
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), wrapping.pending());
+}
+
+void ZeroCopyTestSuite::loopback()
+{
+    std::shared_ptr<SocketClient> client(new SocketClient);
+    CPPUNIT_ASSERT(client->connect("127.0.0.1", mPort));
+    CPPUNIT_ASSERT(waitFor([&client]() { return client->state() == SocketClient::Connected; }));
+    if (!client->setZeroCopyThreshold(Threshold))
+        return; // not supported here
+
+    String expected;
+    for (int i = 0; i < Chunks; ++i) {
+        const String small = pattern(100 + i, i * 2);
+        CPPUNIT_ASSERT(client->write(small));
+        expected += small;
+
+        String large = pattern(Threshold * 16 + i * 1000, i * 2 + 1);
+        expected += large;
+        if (i % 2) {
+            CPPUNIT_ASSERT(client->write(std::move(large)));
+        } else {
+            CPPUNIT_ASSERT(client->write(BufferRef(std::move(large))));
+        }
+    }
+    // more than the socket takes at once, some of it has to be queued
+    CPPUNIT_ASSERT(client->pendingWrite() > 0);
+
+    CPPUNIT_ASSERT(waitFor([this, &client, &expected]() {
+                return mReceived.size() == expected.size() && !client->pendingWrite();
+            }));
+    CPPUNIT_ASSERT(mReceived == expected);
+    CPPUNIT_ASSERT_EQUAL(static_cast<size_t>(0), client->pendingWrite());
+}
@@ -0,0 +1,33 @@
+#include "SocketTestFixture.h"
+
+#include <memory>
+
+#include <rct/List.h>
+#include <rct/String.h>
+
+class ZeroCopyTestSuite : public SocketTestFixture
+{
+    CPPUNIT_TEST_SUITE(ZeroCopyTestSuite);
+    CPPUNIT_TEST(completions);
+    CPPUNIT_TEST(loopback);
+    CPPUNIT_TEST_SUITE_END();
+
+public:
+    void setUp() override;     ///< Start a loopback TCP server next to the fixture's.
+    void tearDown() override;  ///< Stop it.
+
+protected:
+    /// completion ranges coming in out of order and across the wrap of the send numbers
+    void completions();
+
+    /// large zero-copy writes mixed with small plain ones arrive intact and in order
+    void loopback();
+
+private:
+    std::shared_ptr<SocketServer> mTcpServer;
+    uint16_t mPort;
+    List<std::shared_ptr<SocketClient> > mAccepted;
+    String mReceived;
+};
+
+CPPUNIT_TEST_SUITE_REGISTRATION(ZeroCopyTestSuite);